@@ -0,0 +1,404 @@
+/*
+*  Asset pack
+*/
+
+/* One file instead of thousands of loose ones: a header, a table of
+   contents sorted by the hash of each asset's name, and the payloads, each
+   starting on a 4K boundary. The app maps the whole pack at startup, a
+   lookup is a binary search over the table, and a payload is a pointer into
+   the mapping that goes straight to vkCreateShaderModule or a staging copy
+   without being read into a buffer first. The pages are only read from disk
+   when they are touched.
+   
+   Assets that shrink are compressed (compression.c) in independent chunks
+   of ASSET_CHUNK_SIZE bytes, so there is less to read from disk and the
+   chunks decode in parallel on the job system, straight into their
+   destination. Their payload starts with the end offset of every compressed
+   chunk, counted from after that table. A chunk that is as large as its raw
+   size is stored as is.
+   
+   asset_packer.c writes packs offline. It shares the format and the name
+   hash, and defines ASSET_PACKER to leave out the loading. */
+
+#define ASSET_PACK_MAGIC 0x4b434150 // "PACK"
+#define ASSET_PACK_VERSION 2
+#define ASSET_PACK_ALIGNMENT 4096
+#define ASSET_CHUNK_SIZE (64 * 1024)
+#define ASSET_PACK_FILE "assets.pack"
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u32 entryCount;
+    u32 reserved;
+    
+    // Followed by AssetPackEntry[entryCount]
+    
+} AssetPackHeader;
+
+typedef struct
+{
+    u64 nameHash; // asset_name_hash(), the entries are sorted by it
+    u64 offset; // from the start of the pack, ASSET_PACK_ALIGNMENT aligned
+    u64 size; // in the pack
+    u64 rawSize;
+    u32 chunkCount; // 0 when the asset is stored uncompressed
+    u32 reserved;
+    
+} AssetPackEntry;
+
+// FNV-1a of the name with forward slashes and in lower case, so
+// "Shaders\Mesh.spv" and "shaders/mesh.spv" are the same asset
+u64
+asset_name_hash(char *name)
+{
+    u64 hash = HASH_SEED;
+    for (char *at = name; ; at++)
+    {
+        u8 c = (u8)*at;
+        c = c == '\\' ? '/' : c;
+        c = (c >= 'A' && c <= 'Z') ? (u8)(c - 'A' + 'a') : c;
+        
+        hash = hash_bytes(hash, &c, 1);
+        if (c == 0)
+        {
+            break;
+        }
+    }
+    
+    return hash;
+}
+
+#ifndef ASSET_PACKER
+
+/*
+*  Loading
+*/
+
+typedef struct
+{
+    HANDLE file;
+    HANDLE mapping;
+    u8 *base; // NULL when there is no pack
+    u64 size;
+    
+    AssetPackEntry *entries;
+    u32 entryCount;
+    
+    // What was read so far, for report_asset_loading()
+    volatile LONG assetCount;
+    volatile LONG64 packedBytes;
+    volatile LONG64 rawBytes;
+    volatile LONG64 decodedBytes;
+    volatile LONG64 decodeTicks;
+    
+} AssetPack;
+
+static AssetPack globalAssetPack;
+
+// Maps the pack read only, returns false if it doesn't exist or isn't a
+// pack of this version. The mapping stays for the life of the process.
+bool
+open_asset_pack(AssetPack *pack, char *path)
+{
+    pack->file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pack->file == INVALID_HANDLE_VALUE)
+    {
+        pack->file = NULL;
+        return false;
+    }
+    
+    LARGE_INTEGER size;
+    GetFileSizeEx(pack->file, &size);
+    pack->size = (u64)size.QuadPart;
+    
+    if (pack->size >= sizeof(AssetPackHeader))
+    {
+        pack->mapping = CreateFileMapping(pack->file, NULL, PAGE_READONLY, 0,
+                                          0, NULL);
+    }
+    
+    if (pack->mapping)
+    {
+        pack->base = (u8 *)MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0,
+                                         0);
+    }
+    
+    AssetPackHeader *header = (AssetPackHeader *)pack->base;
+    if (!header ||
+        header->magic != ASSET_PACK_MAGIC ||
+        header->version != ASSET_PACK_VERSION ||
+        sizeof(AssetPackHeader) +
+        (u64)header->entryCount * sizeof(AssetPackEntry) > pack->size)
+    {
+        if (pack->base)
+        {
+            UnmapViewOfFile(pack->base);
+        }
+        if (pack->mapping)
+        {
+            CloseHandle(pack->mapping);
+        }
+        CloseHandle(pack->file);
+        
+        memset(pack, 0, sizeof(*pack));
+        return false;
+    }
+    
+    pack->entries = (AssetPackEntry *)(header + 1);
+    pack->entryCount = header->entryCount;
+    
+    return true;
+}
+
+// Whether the entry's payload lies within the mapping, without overflowing
+bool
+asset_entry_in_pack(AssetPack *pack, AssetPackEntry *entry)
+{
+    return entry->offset <= pack->size &&
+        entry->size <= pack->size - entry->offset &&
+        entry->offset % ASSET_PACK_ALIGNMENT == 0;
+}
+
+// The asset's entry, NULL if the pack doesn't have it, there is no pack or
+// the entry points outside of it
+AssetPackEntry *
+find_asset(AssetPack *pack, char *name)
+{
+    u64 hash = asset_name_hash(name);
+    
+    u32 low = 0;
+    u32 high = pack->entryCount;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        if (pack->entries[middle].nameHash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    if (low < pack->entryCount && pack->entries[low].nameHash == hash)
+    {
+        AssetPackEntry *entry = &pack->entries[low];
+        if (!asset_entry_in_pack(pack, entry))
+        {
+            debug_printf("Assets: %s is outside of the pack\n", name);
+            return NULL;
+        }
+        
+        return entry;
+    }
+    
+    return NULL;
+}
+
+void
+count_asset_read(AssetPack *pack, AssetPackEntry *entry)
+{
+    InterlockedIncrement(&pack->assetCount);
+    InterlockedExchangeAdd64(&pack->packedBytes, (LONG64)entry->size);
+    InterlockedExchangeAdd64(&pack->rawBytes, (LONG64)entry->rawSize);
+}
+
+typedef struct
+{
+    u32 *chunkEnds;
+    u8 *chunks;
+    u8 *destination;
+    u64 rawSize;
+    volatile LONG failed; // a chunk didn't decompress
+    
+} AssetDecodeJob;
+
+/* Whether the entry's payload can be decoded without reading or writing out
+   of bounds: a payload within the pack, a chunk for every ASSET_CHUNK_SIZE
+   raw bytes, and a chunk table of ends that never decrease, stay within the
+   payload and are no larger than the chunk's raw size. */
+bool
+validate_asset_chunks(AssetPack *pack, AssetPackEntry *entry)
+{
+    if (!asset_entry_in_pack(pack, entry))
+    {
+        return false;
+    }
+    
+    if (entry->chunkCount == 0)
+    {
+        return entry->rawSize <= entry->size;
+    }
+    
+    u64 expectedChunks = (entry->rawSize + ASSET_CHUNK_SIZE - 1) /
+        ASSET_CHUNK_SIZE;
+    u64 tableSize = (u64)entry->chunkCount * sizeof(u32);
+    if (entry->chunkCount != expectedChunks || tableSize > entry->size)
+    {
+        return false;
+    }
+    
+    u32 *chunkEnds = (u32 *)(pack->base + entry->offset);
+    u64 chunksSize = entry->size - tableSize;
+    u32 chunkBegin = 0;
+    
+    for (u32 i = 0; i < entry->chunkCount; i++)
+    {
+        u64 rawOffset = (u64)i * ASSET_CHUNK_SIZE;
+        u64 rawSize = entry->rawSize - rawOffset;
+        rawSize = rawSize < ASSET_CHUNK_SIZE ? rawSize : ASSET_CHUNK_SIZE;
+        
+        if (chunkEnds[i] < chunkBegin || chunkEnds[i] > chunksSize ||
+            chunkEnds[i] - chunkBegin > rawSize)
+        {
+            return false;
+        }
+        
+        chunkBegin = chunkEnds[i];
+    }
+    
+    return true;
+}
+
+void
+decode_asset_chunks_job(void *data, u32 first, u32 end)
+{
+    AssetDecodeJob *job = (AssetDecodeJob *)data;
+    
+    for (u32 i = first; i < end; i++)
+    {
+        u32 chunkBegin = i > 0 ? job->chunkEnds[i - 1] : 0;
+        u32 chunkSize = job->chunkEnds[i] - chunkBegin;
+        
+        u64 rawOffset = (u64)i * ASSET_CHUNK_SIZE;
+        u64 rawSize = job->rawSize - rawOffset;
+        rawSize = rawSize < ASSET_CHUNK_SIZE ? rawSize : ASSET_CHUNK_SIZE;
+        
+        if (chunkSize == rawSize)
+        {
+            memcpy(job->destination + rawOffset, job->chunks + chunkBegin,
+                   (size_t)rawSize);
+        }
+        else if (!lz_decompress(job->chunks + chunkBegin, chunkSize,
+                                job->destination + rawOffset,
+                                (size_t)rawSize))
+        {
+            InterlockedExchange(&job->failed, 1);
+        }
+    }
+}
+
+/* Copies or decompresses the asset into destination, which has room for
+   entry->rawSize bytes and can be mapped staging memory. The chunks are
+   split over the job threads, so this must be called from one of them.
+   Returns false for a malformed or truncated entry, destination is then
+   partially written at most. */
+bool
+read_asset(AssetPack *pack, AssetPackEntry *entry, void *destination)
+{
+    if (!validate_asset_chunks(pack, entry))
+    {
+        return false;
+    }
+    
+    u8 *payload = pack->base + entry->offset;
+    count_asset_read(pack, entry);
+    
+    if (entry->chunkCount == 0)
+    {
+        memcpy(destination, payload, (size_t)entry->rawSize);
+        return true;
+    }
+    
+    u64 begin = get_ticks();
+    
+    AssetDecodeJob job;
+    job.chunkEnds = (u32 *)payload;
+    job.chunks = payload + entry->chunkCount * sizeof(u32);
+    job.destination = (u8 *)destination;
+    job.rawSize = entry->rawSize;
+    job.failed = 0;
+    
+    parallel_for(decode_asset_chunks_job, &job, entry->chunkCount, 1);
+    
+    InterlockedExchangeAdd64(&pack->decodedBytes, (LONG64)entry->rawSize);
+    InterlockedExchangeAdd64(&pack->decodeTicks,
+                             (LONG64)(get_ticks() - begin));
+    
+    return !job.failed;
+}
+
+/* The asset's bytes, empty if the pack doesn't have it or its entry is
+   corrupt, so the caller falls back as if it weren't packed. Uncompressed
+   assets are used in place, never to be freed or written, the others are
+   decompressed onto arena (or the heap when it's NULL, see
+   load_entire_file()). */
+LoadedFile
+load_asset(AssetPack *pack, char *name, Arena *arena)
+{
+    LoadedFile result = {NULL};
+    
+    AssetPackEntry *entry = find_asset(pack, name);
+    if (!entry)
+    {
+        return result;
+    }
+    
+    if (!validate_asset_chunks(pack, entry))
+    {
+        debug_printf("Assets: %s is corrupt in the pack\n", name);
+        return result;
+    }
+    
+    u8 *payload = pack->base + entry->offset;
+    result.size = (size_t)entry->rawSize;
+    if (entry->chunkCount == 0)
+    {
+        result.data = payload;
+        count_asset_read(pack, entry);
+    }
+    else
+    {
+        result.data = arena_push_or_heap(arena, result.size);
+        if (!read_asset(pack, entry, result.data))
+        {
+            // A chunk didn't decompress. What was pushed on the arena stays.
+            debug_printf("Assets: %s is corrupt in the pack\n", name);
+            if (!arena)
+            {
+                heap_free(result.data);
+            }
+            result.data = NULL;
+            result.size = 0;
+        }
+    }
+    
+    return result;
+}
+
+// Compressed and raw bytes read from the pack so far, and how fast the
+// compressed ones decoded
+void
+report_asset_loading(AssetPack *pack)
+{
+    if (!pack->base)
+    {
+        return;
+    }
+    
+    f32 decodeMs = ticks_to_ms((u64)pack->decodeTicks);
+    f32 decodeRate = decodeMs > 0.0f ?
+        (f32)pack->decodedBytes / (decodeMs * 1000.0f) : 0.0f;
+    
+    debug_printf("Assets: %d from the pack, %.1f KB read for %.1f KB, "
+                 "%.1f KB decoded in %.2f ms (%.0f MB/s)\n",
+                 pack->assetCount, (f32)pack->packedBytes / 1024.0f,
+                 (f32)pack->rawBytes / 1024.0f,
+                 (f32)pack->decodedBytes / 1024.0f, decodeMs, decodeRate);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,334 @@
+/*
+*  Asset packer
+*/
+
+/* Offline tool that writes the pack the app maps at startup, see
+   asset_pack.c for the format. Usage:
+   
+       asset_packer <output> <directory> [.extension ...]
+   
+   Packs every file under directory, recursively, or only the files with one
+   of the extensions. An asset is named by its path relative to directory,
+   so "asset_packer assets.pack ..\shaders .spv" packs the SPIR-V that
+   load_shader_binary() asks for by file name. Every asset is compressed in
+   chunks, and stored as is when that doesn't make it smaller. */
+
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef struct
+{
+    void *data;
+    size_t size;
+    
+} LoadedFile;
+
+// The app's 64-bit FNV-1a, see main.c
+#define HASH_SEED 0xcbf29ce484222325ull
+
+u64
+hash_bytes(u64 hash, void *data, size_t size)
+{
+    u8 *bytes = (u8 *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    
+    return hash;
+}
+
+#include "compression.c"
+
+#define ASSET_PACKER
+#include "asset_pack.c"
+
+#define MAX_PACK_INPUTS 65536
+
+typedef struct
+{
+    char name[MAX_PATH]; // relative to the packed directory
+    char path[MAX_PATH];
+    u64 nameHash;
+    
+} PackInput;
+
+static PackInput inputs[MAX_PACK_INPUTS];
+static u32 inputCount;
+
+bool
+has_extension_in(char *name, char **extensions, u32 extensionCount)
+{
+    if (extensionCount == 0)
+    {
+        return true;
+    }
+    
+    char *extension = strrchr(name, '.');
+    for (u32 i = 0; extension && i < extensionCount; i++)
+    {
+        if (_stricmp(extension, extensions[i]) == 0)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Adds the files under root\relative, relative is "" at the top
+void
+collect_files(char *root, char *relative, char **extensions,
+              u32 extensionCount)
+{
+    char pattern[MAX_PATH];
+    sprintf_s(pattern, sizeof(pattern), "%s\\%s*", root, relative);
+    
+    WIN32_FIND_DATA found;
+    HANDLE search = FindFirstFile(pattern, &found);
+    if (search == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    
+    do
+    {
+        if (strcmp(found.cFileName, ".") == 0 ||
+            strcmp(found.cFileName, "..") == 0)
+        {
+            continue;
+        }
+        
+        char name[MAX_PATH];
+        sprintf_s(name, sizeof(name), "%s%s", relative, found.cFileName);
+        
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            char directory[MAX_PATH];
+            sprintf_s(directory, sizeof(directory), "%s/", name);
+            collect_files(root, directory, extensions, extensionCount);
+        }
+        else if (has_extension_in(found.cFileName, extensions,
+                                  extensionCount))
+        {
+            if (inputCount == MAX_PACK_INPUTS)
+            {
+                fprintf(stderr, "More than %u files, skipping %s\n",
+                        MAX_PACK_INPUTS, name);
+                continue;
+            }
+            
+            PackInput *input = &inputs[inputCount++];
+            strcpy_s(input->name, sizeof(input->name), name);
+            sprintf_s(input->path, sizeof(input->path), "%s\\%s", root, name);
+            input->nameHash = asset_name_hash(name);
+        }
+    }
+    while (FindNextFile(search, &found));
+    
+    FindClose(search);
+}
+
+int
+compare_inputs(const void *a, const void *b)
+{
+    u64 hashA = ((PackInput *)a)->nameHash;
+    u64 hashB = ((PackInput *)b)->nameHash;
+    
+    return hashA < hashB ? -1 : hashA > hashB ? 1 : 0;
+}
+
+u64
+align_pack_offset(u64 offset)
+{
+    return (offset + ASSET_PACK_ALIGNMENT - 1) &
+        ~(u64)(ASSET_PACK_ALIGNMENT - 1);
+}
+
+// Zeros up to offset
+void
+pad_pack(FILE *pack, u64 offset)
+{
+    static u8 zeros[ASSET_PACK_ALIGNMENT];
+    
+    u64 position = (u64)_ftelli64(pack);
+    assert(offset - position <= sizeof(zeros));
+    fwrite(zeros, 1, (size_t)(offset - position), pack);
+}
+
+LoadedFile
+read_input(char *path)
+{
+    LoadedFile result = {NULL};
+    
+    FILE *file;
+    if (fopen_s(&file, path, "rb") != 0)
+    {
+        return result;
+    }
+    
+    _fseeki64(file, 0, SEEK_END);
+    result.size = (size_t)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+    
+    // Not NULL for empty files either
+    result.data = malloc(result.size + 1);
+    assert(result.data);
+    if (fread(result.data, 1, result.size, file) != result.size)
+    {
+        free(result.data);
+        result.data = NULL;
+    }
+    fclose(file);
+    
+    return result;
+}
+
+/* Compresses raw into payload as the chunk table followed by the chunks,
+   returns the payload's size or 0 if compressing doesn't save anything.
+   payload has room for raw.size bytes. */
+size_t
+compress_asset(LoadedFile raw, u8 *payload, u32 chunkCount)
+{
+    static u32 hashTable[LZ_HASH_SIZE];
+    static u8 compressed[ASSET_CHUNK_SIZE];
+    
+    u32 *chunkEnds = (u32 *)payload;
+    size_t tableSize = chunkCount * sizeof(u32);
+    size_t size = tableSize;
+    
+    for (u32 i = 0; i < chunkCount; i++)
+    {
+        u8 *chunk = (u8 *)raw.data + (size_t)i * ASSET_CHUNK_SIZE;
+        size_t chunkSize = raw.size - (size_t)i * ASSET_CHUNK_SIZE;
+        chunkSize = chunkSize < ASSET_CHUNK_SIZE ? chunkSize : ASSET_CHUNK_SIZE;
+        
+        // Chunks that don't shrink are stored, the loader tells them apart
+        // by their size
+        size_t compressedSize = lz_compress(chunk, chunkSize, compressed,
+                                            chunkSize - 1, hashTable);
+        u8 *source = compressedSize ? compressed : chunk;
+        compressedSize = compressedSize ? compressedSize : chunkSize;
+        
+        if (size + compressedSize >= raw.size)
+        {
+            return 0;
+        }
+        
+        memcpy(payload + size, source, compressedSize);
+        size += compressedSize;
+        chunkEnds[i] = (u32)(size - tableSize);
+    }
+    
+    return size;
+}
+
+int
+main(int argumentCount, char **arguments)
+{
+    if (argumentCount < 3)
+    {
+        fprintf(stderr, "Usage: asset_packer <output> <directory> "
+                "[.extension ...]\n");
+        return 1;
+    }
+    
+    char *outputPath = arguments[1];
+    char *root = arguments[2];
+    collect_files(root, "", arguments + 3, (u32)(argumentCount - 3));
+    
+    qsort(inputs, inputCount, sizeof(PackInput), compare_inputs);
+    for (u32 i = 1; i < inputCount; i++)
+    {
+        if (inputs[i].nameHash == inputs[i - 1].nameHash)
+        {
+            fprintf(stderr, "%s and %s have the same name hash, rename one\n",
+                    inputs[i - 1].name, inputs[i].name);
+            return 1;
+        }
+    }
+    
+    FILE *pack;
+    if (fopen_s(&pack, outputPath, "wb") != 0)
+    {
+        fprintf(stderr, "Can't write %s\n", outputPath);
+        return 1;
+    }
+    
+    AssetPackHeader header = {0};
+    header.magic = ASSET_PACK_MAGIC;
+    header.version = ASSET_PACK_VERSION;
+    header.entryCount = inputCount;
+    
+    // The table is written again once the payloads' sizes are known
+    AssetPackEntry *entries = calloc(inputCount + 1, sizeof(AssetPackEntry));
+    assert(entries);
+    
+    fwrite(&header, sizeof(header), 1, pack);
+    fwrite(entries, sizeof(AssetPackEntry), inputCount, pack);
+    
+    u64 offset = sizeof(header) + inputCount * sizeof(AssetPackEntry);
+    u64 rawTotal = 0;
+    for (u32 i = 0; i < inputCount; i++)
+    {
+        LoadedFile raw = read_input(inputs[i].path);
+        if (!raw.data)
+        {
+            fprintf(stderr, "Can't read %s\n", inputs[i].path);
+            fclose(pack);
+            return 1;
+        }
+        
+        u32 chunkCount = (u32)((raw.size + ASSET_CHUNK_SIZE - 1) /
+                               ASSET_CHUNK_SIZE);
+        u8 *payload = malloc(raw.size + 1);
+        assert(payload);
+        
+        AssetPackEntry *entry = &entries[i];
+        entry->nameHash = inputs[i].nameHash;
+        entry->offset = align_pack_offset(offset);
+        entry->rawSize = raw.size;
+        entry->size = compress_asset(raw, payload, chunkCount);
+        entry->chunkCount = entry->size ? chunkCount : 0;
+        
+        if (!entry->chunkCount)
+        {
+            entry->size = raw.size;
+            memcpy(payload, raw.data, raw.size);
+        }
+        
+        pad_pack(pack, entry->offset);
+        fwrite(payload, 1, (size_t)entry->size, pack);
+        offset = entry->offset + entry->size;
+        rawTotal += raw.size;
+        
+        printf("%016llx %10llu %10llu %s\n", entry->nameHash, entry->rawSize,
+               entry->size, inputs[i].name);
+        
+        free(payload);
+        free(raw.data);
+    }
+    
+    pad_pack(pack, align_pack_offset(offset));
+    
+    _fseeki64(pack, sizeof(header), SEEK_SET);
+    fwrite(entries, sizeof(AssetPackEntry), inputCount, pack);
+    fclose(pack);
+    
+    printf("Packed %u files, %llu bytes, into %s, %llu bytes\n", inputCount,
+           rawTotal, outputPath, align_pack_offset(offset));
+    
+    free(entries);
+    return 0;
+}
\ No newline at end of file
@@ -7,7 +7,17 @@ set vkl=-LIBPATH:"C:\VulkanSDK\1.3.290.0\Lib"
 REM compiler flags
 set cf=-nologo -FC -Z7 -W4 -WX -wd4189 -wd4100 -wd4101
 
+REM "build release" optimizes and compiles out asserts, validation and
+REM debug utils
+IF "%1"=="release" set cf=%cf% -O2 -DNDEBUG
+
+REM runtime GLSL compilation with shaderc, clear both to rely on glslc only
+set sc=-DRUNTIME_SHADER_COMPILE
+set scl=shaderc_shared.lib
+
 IF NOT EXIST bin mkdir bin
 pushd bin
-cl %cf% ..\main.c %vki% -link %vkl% user32.lib vulkan-1.lib
+cl %cf% %sc% ..\main.c %vki% -link %vkl% user32.lib gdi32.lib dwmapi.lib vulkan-1.lib %scl%
+cl %cf% ..\asset_packer.c -link user32.lib
+cl %cf% ..\obj_optimizer.c
 popd
\ No newline at end of file
@@ -0,0 +1,394 @@
+/*
+*  Clustered forward lighting
+*/
+
+/* The view frustum is divided into a CLUSTER_X * CLUSTER_Y * CLUSTER_Z grid
+   of froxels, screen tiles split into depth slices that get exponentially
+   thicker with distance. Every frame a compute pass tests every light's
+   bounding sphere against every froxel and writes the indices of the lights
+   that touch it, and the fragment shader only loops over the lights of the
+   froxel it falls in. Shading cost follows the local light density, the
+   total light count only shows up in the binning pass.
+   
+   The constants and the GPU structs below have to match
+   shaders/clustered_common.glsl. */
+
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+#define MAX_LIGHTS 16384
+
+#define LIGHT_BINNING_GROUP_SIZE 64
+
+typedef enum
+{
+    LightType_Point,
+    LightType_Spot,
+    
+} LightType;
+
+// std430, 48 bytes
+typedef struct
+{
+    Vec4 positionRange; // xyz world position, w range
+    Vec4 color; // rgb color times intensity, w LightType
+    Vec4 direction; // xyz spot direction, w cosine of the cone's half angle
+    
+} GpuLight;
+
+// std140
+typedef struct
+{
+    Mat4 view;
+    Mat4 projection;
+    Mat4 viewProjection;
+    Vec4 cameraPosition; // w time in seconds
+    Vec4 viewport; // width, height, 1 / width, 1 / height
+    Vec4 clusterDepth; // near, far, slice scale, slice bias
+    Vec4 ndcToView; // 1 / projection[0][0], 1 / projection[1][1]
+    u32 lightCount;
+    u32 padding[3];
+    
+} FrameUniforms;
+
+// Each light orbits its anchor, the GPU copy is rewritten every frame
+typedef struct
+{
+    Vec3 anchor;
+    f32 orbitRadius;
+    f32 orbitSpeed;
+    f32 phase;
+    f32 range;
+    LightType type;
+    Vec3 color;
+    
+} LightAnimation;
+
+typedef struct
+{
+    GpuBuffer uniforms;
+    GpuBuffer lights;
+    GpuBuffer clusters; // light counts, then the light indices per cluster
+    VkDescriptorSet descriptorSet;
+    
+} ClusteredFrame;
+
+typedef struct
+{
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    ClusteredFrame frames[FRAMES_IN_FLIGHT];
+    
+    LightAnimation *lights;
+    u32 lightCount;
+    
+} ClusteredLighting;
+
+// Shared by the light binning compute pass and the scene pipelines
+VkDescriptorSetLayout
+create_clustered_set_layout(VulkanContext *vk)
+{
+    VkDescriptorSetLayout result;
+    
+    VkDescriptorSetLayoutBinding bindings[] =
+    {
+        {
+            0, // binding
+            VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            1, // descriptorCount
+            VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT |
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            NULL // pImmutableSamplers
+        },
+        {
+            1, // binding
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1, // descriptorCount
+            VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+            NULL // pImmutableSamplers
+        },
+        {
+            2, // binding
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1, // descriptorCount
+            VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+            NULL // pImmutableSamplers
+        },
+    };
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        array_count(bindings),
+        bindings
+    };
+    
+    if (vkCreateDescriptorSetLayout(vk->device, &layoutInfo, NULL,
+                                    &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the clustered lighting set layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    handle_to_u64(result), "Clustered lighting set layout");
+    
+    return result;
+}
+
+f32
+random_unit(u32 *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return (f32)(*state >> 8) / 16777216.0f;
+}
+
+// Lights of random colors spread over the ground, a quarter of them spots
+// pointing down
+void
+spawn_lights(ClusteredLighting *lighting, u32 lightCount, f32 extent)
+{
+    lighting->lightCount = lightCount < MAX_LIGHTS ? lightCount : MAX_LIGHTS;
+    lighting->lights = push_array(&globalPermanentArena, LightAnimation,
+                                  lighting->lightCount);
+    
+    u32 random = 0x9e3779b9;
+    for (u32 i = 0; i < lighting->lightCount; i++)
+    {
+        LightAnimation *light = &lighting->lights[i];
+        light->anchor = vec3((random_unit(&random) * 2 - 1) * extent,
+                             0.5f + random_unit(&random) * 4.0f,
+                             (random_unit(&random) * 2 - 1) * extent);
+        light->orbitRadius = 0.5f + random_unit(&random) * 3.0f;
+        light->orbitSpeed = 0.2f + random_unit(&random);
+        light->phase = random_unit(&random) * 6.28318531f;
+        light->range = 2.0f + random_unit(&random) * 4.0f;
+        light->type = (i % 4 == 3) ? LightType_Spot : LightType_Point;
+        
+        // Fully saturated hues, so overlapping lights are easy to tell apart
+        f32 hue = random_unit(&random) * 6.0f;
+        f32 r = fabsf(hue - 3.0f) - 1.0f;
+        f32 g = 2.0f - fabsf(hue - 2.0f);
+        f32 b = 2.0f - fabsf(hue - 4.0f);
+        light->color = vec3(r < 0 ? 0 : r > 1 ? 1 : r,
+                            g < 0 ? 0 : g > 1 ? 1 : g,
+                            b < 0 ? 0 : b > 1 ? 1 : b);
+    }
+}
+
+void
+clustered_lighting_init(ClusteredLighting *lighting, VulkanContext *vk,
+                        u32 lightCount, f32 extent)
+{
+    lighting->setLayout = create_clustered_set_layout(vk);
+    spawn_lights(lighting, lightCount, extent);
+    
+    VkDescriptorPoolSize poolSizes[] =
+    {
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, FRAMES_IN_FLIGHT },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * FRAMES_IN_FLIGHT },
+    };
+    
+    VkDescriptorPoolCreateInfo poolInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        NULL,
+        0,
+        FRAMES_IN_FLIGHT, // maxSets
+        array_count(poolSizes),
+        poolSizes
+    };
+    
+    if (vkCreateDescriptorPool(vk->device, &poolInfo, NULL,
+                               &lighting->descriptorPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the clustered lighting descriptor pool");
+    }
+    
+    VkDeviceSize clusterSize = (VkDeviceSize)CLUSTER_COUNT *
+        (1 + MAX_LIGHTS_PER_CLUSTER) * sizeof(u32);
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        ClusteredFrame *frame = &lighting->frames[i];
+        
+        frame->uniforms =
+            create_host_buffer(vk, sizeof(FrameUniforms),
+                               VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                               "Frame uniforms");
+        frame->lights =
+            create_host_buffer(vk, MAX_LIGHTS * sizeof(GpuLight),
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, "Lights");
+        frame->clusters =
+            create_buffer(vk, clusterSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          "Cluster light lists");
+        
+        VkDescriptorSetAllocateInfo allocInfo =
+        {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            NULL,
+            lighting->descriptorPool,
+            1, // descriptorSetCount
+            &lighting->setLayout
+        };
+        
+        if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                     &frame->descriptorSet) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate descriptor set");
+        }
+        
+        VkDescriptorBufferInfo bufferInfos[] =
+        {
+            { frame->uniforms.buffer, 0, VK_WHOLE_SIZE },
+            { frame->lights.buffer, 0, VK_WHOLE_SIZE },
+            { frame->clusters.buffer, 0, VK_WHOLE_SIZE },
+        };
+        
+        VkWriteDescriptorSet writes[array_count(bufferInfos)];
+        for (u32 j = 0; j < array_count(bufferInfos); j++)
+        {
+            VkWriteDescriptorSet write =
+            {
+                VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                NULL,
+                frame->descriptorSet,
+                j, // dstBinding
+                0, // dstArrayElement
+                1, // descriptorCount
+                j == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER :
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                NULL, // pImageInfo
+                &bufferInfos[j],
+                NULL // pTexelBufferView
+            };
+            writes[j] = write;
+        }
+        
+        vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0,
+                               NULL);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                        handle_to_u64(frame->descriptorSet),
+                        "Clustered lighting set %u", i);
+    }
+    
+    debug_printf("Clustered lighting: %u lights, %u x %u x %u clusters\n",
+                 lighting->lightCount, CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+}
+
+typedef struct
+{
+    ClusteredLighting *lighting;
+    GpuLight *gpuLights;
+    f32 seconds;
+    
+} LightAnimationJob;
+
+// Writes the lights first to end into the frame's mapped buffer
+void
+animate_lights(void *data, u32 first, u32 end)
+{
+    LightAnimationJob *job = (LightAnimationJob *)data;
+    f32 seconds = job->seconds;
+    
+    for (u32 i = first; i < end; i++)
+    {
+        LightAnimation *light = &job->lighting->lights[i];
+        f32 angle = light->phase + seconds * light->orbitSpeed;
+        
+        GpuLight *gpuLight = &job->gpuLights[i];
+        gpuLight->positionRange =
+            vec4(light->anchor.x + cosf(angle) * light->orbitRadius,
+                 light->anchor.y,
+                 light->anchor.z + sinf(angle) * light->orbitRadius,
+                 light->range);
+        gpuLight->color = vec4(light->color.x * 2, light->color.y * 2,
+                               light->color.z * 2, (f32)light->type);
+        
+        // Spots look down and sweep around as they orbit
+        Vec3 direction = vec3_normalize(vec3(cosf(angle * 3) * 0.5f, -1,
+                                             sinf(angle * 3) * 0.5f));
+        gpuLight->direction = vec4(direction.x, direction.y, direction.z,
+                                   0.85f);
+    }
+}
+
+/* Writes this frame's uniforms and animated lights. The buffers belong to the
+   frame slot, which the timeline says the GPU is done with. */
+ClusteredFrame *
+clustered_lighting_update(ClusteredLighting *lighting, FrameTimeline *frames,
+                          Camera *camera, VkExtent2D extent, f32 seconds)
+{
+    ClusteredFrame *frame =
+        &lighting->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+    
+    FrameUniforms *uniforms = (FrameUniforms *)frame->uniforms.mapped;
+    uniforms->view = camera->view;
+    uniforms->projection = camera->projection;
+    uniforms->viewProjection = mat4_multiply(camera->projection, camera->view);
+    uniforms->cameraPosition = vec4(camera->position.x, camera->position.y,
+                                    camera->position.z, seconds);
+    uniforms->viewport = vec4((f32)extent.width, (f32)extent.height,
+                              1.0f / (f32)extent.width,
+                              1.0f / (f32)extent.height);
+    
+    // slice = log(depth) * scale - bias puts near at 0 and far at CLUSTER_Z
+    f32 logDepthRange = logf(camera->farPlane / camera->nearPlane);
+    f32 sliceScale = (f32)CLUSTER_Z / logDepthRange;
+    uniforms->clusterDepth = vec4(camera->nearPlane, camera->farPlane,
+                                  sliceScale,
+                                  sliceScale * logf(camera->nearPlane));
+    uniforms->ndcToView = vec4(1.0f / camera->projection.m[0],
+                               1.0f / camera->projection.m[5], 0, 0);
+    uniforms->lightCount = lighting->lightCount;
+    
+    // Thousands of lights are worth spreading over the cores
+    LightAnimationJob job =
+    {
+        lighting,
+        (GpuLight *)frame->lights.mapped,
+        seconds
+    };
+    parallel_for(animate_lights, &job, lighting->lightCount, 1024);
+    
+    return frame;
+}
+
+// Records the binning pass, its results are visible to fragment shaders
+// after this
+void
+bin_lights(ClusteredFrame *frame, VkCommandBuffer commandBuffer,
+           VkPipeline binningPipeline, VkPipelineLayout layout)
+{
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      binningPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            layout, 0, 1, &frame->descriptorSet, 0, NULL);
+    
+    // One invocation per cluster
+    u32 groupCount = (CLUSTER_COUNT + LIGHT_BINNING_GROUP_SIZE - 1) /
+        LIGHT_BINNING_GROUP_SIZE;
+    vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+    
+    VkBufferMemoryBarrier barrier =
+    {
+        VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        NULL,
+        VK_ACCESS_SHADER_WRITE_BIT, // srcAccessMask
+        VK_ACCESS_SHADER_READ_BIT, // dstAccessMask
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        frame->clusters.buffer,
+        0,
+        VK_WHOLE_SIZE
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                         0, NULL, 1, &barrier, 0, NULL);
+}
\ No newline at end of file
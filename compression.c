@@ -0,0 +1,282 @@
+/*
+*  Compression
+*/
+
+/* LZ4's block format: a stream of sequences, each a token byte, the
+   literals, a 16-bit offset back into the output and the length of the
+   match to copy from there. Lengths of 15 and more continue in extra bytes.
+   Decoding is just copies, which is fast enough that loading compressed
+   assets is limited by the disk, not the CPU.
+   
+   The asset packer compresses, greedily with a hash table of the last
+   position of every 4 bytes, and the app decompresses. Blocks don't
+   reference each other, so the chunks of an asset decode in parallel. */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the block ends with at least this many
+#define LZ_MATCH_LIMIT 12 // no match starts this close to the end
+#define LZ_HASH_BITS 16
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+u32
+lz_read32(u8 *at)
+{
+    u32 result;
+    memcpy(&result, at, sizeof(result));
+    
+    return result;
+}
+
+u32
+lz_hash(u32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Room for size bytes that don't compress
+size_t
+lz_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+u8 *
+lz_write_length(u8 *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = (u8)length;
+    
+    return out;
+}
+
+/* Compresses size bytes into destination, returns the compressed size or 0
+   if it doesn't fit in capacity. hashTable has LZ_HASH_SIZE entries. */
+size_t
+lz_compress(void *source, size_t size, void *destination, size_t capacity,
+            u32 *hashTable)
+{
+    u8 *in = (u8 *)source;
+    u8 *inEnd = in + size;
+    u8 *out = (u8 *)destination;
+    u8 *outEnd = out + capacity;
+    
+    u8 *anchor = in;
+    u8 *at = in;
+    
+    // Positions plus one, zero is empty
+    memset(hashTable, 0, LZ_HASH_SIZE * sizeof(u32));
+    
+    while (at + LZ_MATCH_LIMIT <= inEnd)
+    {
+        u32 sequence = lz_read32(at);
+        u32 *slot = &hashTable[lz_hash(sequence)];
+        u8 *match = *slot ? in + *slot - 1 : NULL;
+        *slot = (u32)(at - in) + 1;
+        
+        if (!match || at - match > LZ_MAX_OFFSET ||
+            lz_read32(match) != sequence)
+        {
+            at++;
+            continue;
+        }
+        
+        size_t matchLength = LZ_MIN_MATCH;
+        while (at + matchLength < inEnd - LZ_LAST_LITERALS &&
+               match[matchLength] == at[matchLength])
+        {
+            matchLength++;
+        }
+        
+        size_t literalCount = at - anchor;
+        size_t worstCase = 1 + literalCount / 255 + 1 + literalCount + 2 +
+            matchLength / 255 + 1;
+        if ((size_t)(outEnd - out) < worstCase)
+        {
+            return 0;
+        }
+        
+        size_t matchCode = matchLength - LZ_MIN_MATCH;
+        u8 *token = out++;
+        *token = (u8)(((literalCount < 15 ? literalCount : 15) << 4) |
+                      (matchCode < 15 ? matchCode : 15));
+        
+        if (literalCount >= 15)
+        {
+            out = lz_write_length(out, literalCount - 15);
+        }
+        memcpy(out, anchor, literalCount);
+        out += literalCount;
+        
+        size_t offset = at - match;
+        *out++ = (u8)offset;
+        *out++ = (u8)(offset >> 8);
+        
+        if (matchCode >= 15)
+        {
+            out = lz_write_length(out, matchCode - 15);
+        }
+        
+        at += matchLength;
+        anchor = at;
+    }
+    
+    // The rest as literals
+    size_t literalCount = inEnd - anchor;
+    if ((size_t)(outEnd - out) < 1 + literalCount / 255 + 1 + literalCount)
+    {
+        return 0;
+    }
+    
+    *out++ = (u8)((literalCount < 15 ? literalCount : 15) << 4);
+    if (literalCount >= 15)
+    {
+        out = lz_write_length(out, literalCount - 15);
+    }
+    memcpy(out, anchor, literalCount);
+    out += literalCount;
+    
+    return out - (u8 *)destination;
+}
+
+// Reads an extended length, false if it runs past the end of the block
+bool
+lz_read_length(u8 **at, u8 *end, size_t *length)
+{
+    u8 byte;
+    do
+    {
+        if (*at >= end)
+        {
+            return false;
+        }
+        byte = *(*at)++;
+        *length += byte;
+    }
+    while (byte == 255);
+    
+    return true;
+}
+
+/* Decompresses a block that must expand to exactly size bytes, returns false
+   if it's corrupt. Never reads or writes outside the two buffers.
+   
+   Away from the end of the output, copies are 8 or 16 bytes at a time and
+   round their length up. Whatever they write past it is overwritten by the
+   next sequence. */
+bool
+lz_decompress(void *source, size_t sourceSize, void *destination,
+              size_t size)
+{
+    u8 *in = (u8 *)source;
+    u8 *inEnd = in + sourceSize;
+    u8 *out = (u8 *)destination;
+    u8 *outEnd = out + size;
+    
+    for (;;)
+    {
+        if (in >= inEnd)
+        {
+            return false;
+        }
+        u8 token = *in++;
+        
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !lz_read_length(&in, inEnd, &literalCount))
+        {
+            return false;
+        }
+        
+        if (literalCount > (size_t)(inEnd - in) ||
+            literalCount > (size_t)(outEnd - out))
+        {
+            return false;
+        }
+        
+        if (literalCount <= 16 && inEnd - in >= 16 && outEnd - out >= 16)
+        {
+            memcpy(out, in, 16);
+        }
+        else
+        {
+            memcpy(out, in, literalCount);
+        }
+        in += literalCount;
+        out += literalCount;
+        
+        // The last sequence has no match
+        if (in == inEnd)
+        {
+            return out == outEnd;
+        }
+        
+        if (inEnd - in < 2)
+        {
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !lz_read_length(&in, inEnd, &matchLength))
+        {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        
+        if (offset == 0 || offset > (size_t)(out - (u8 *)destination) ||
+            matchLength > (size_t)(outEnd - out))
+        {
+            return false;
+        }
+        
+        // Room for the wide copies to overrun, the rest goes a byte at a time
+        u8 *match = out - offset;
+        size_t wideLength = matchLength;
+        if ((size_t)(outEnd - out) < matchLength + 16)
+        {
+            wideLength = matchLength > 16 ? matchLength - 16 : 0;
+        }
+        
+        size_t copied = 0;
+        if (offset >= 16)
+        {
+            // 16 bytes at a time never read what the same copy writes
+            for (; copied < wideLength; copied += 16)
+            {
+                memcpy(out + copied, match + copied, 16);
+            }
+        }
+        else if (wideLength >= 8)
+        {
+            /* A short offset repeats a pattern, which also repeats at any
+               multiple of the offset. The first 8 bytes go one at a time,
+               then the pattern is copied 8 bytes at a time from a multiple
+               of at least 8 back. */
+            for (; copied < 8; copied++)
+            {
+                out[copied] = match[copied];
+            }
+            
+            size_t period = offset;
+            while (period < 8)
+            {
+                period += offset;
+            }
+            
+            for (; copied < wideLength; copied += 8)
+            {
+                memcpy(out + copied, out + copied - period, 8);
+            }
+        }
+        
+        for (; copied < matchLength; copied++)
+        {
+            out[copied] = match[copied];
+        }
+        out += matchLength;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,255 @@
+/*
+*  Debug drawing
+*/
+
+/* Immediate mode lines for looking at bounds, frusta and rays: any code can
+   call debug_line(), debug_box(), debug_sphere(), debug_arrow() or
+   debug_frustum() during the frame, between begin_debug_draw() and the
+   flush at the end of the scene in the main subpass. The vertices go
+   straight into the frame slot's persistently mapped buffer, written front
+   to back and never read, and everything is one line list draw. A frame
+   without debug drawing records nothing at all. */
+
+#define MAX_DEBUG_VERTICES 131072 // per frame
+
+// VertexFormat_DebugLine, 16 bytes
+typedef struct
+{
+    Vec3 position;
+    u32 color; // RGBA8, see pack_color()
+    
+} DebugVertex;
+
+typedef struct
+{
+    GpuBuffer buffers[FRAMES_IN_FLIGHT]; // DebugVertex[MAX_DEBUG_VERTICES]
+    
+    GpuBuffer *buffer; // the frame's
+    DebugVertex *vertices; // mapped buffer, NULL outside of a frame
+    u32 vertexCount;
+    u32 capacity; // 0 outside of a frame, so calls are dropped
+    u32 droppedCount;
+    
+} DebugDraw;
+
+static DebugDraw globalDebugDraw;
+
+void
+debug_draw_init(DebugDraw *debug, VulkanContext *vk)
+{
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        debug->buffers[i] =
+            create_host_buffer(vk, MAX_DEBUG_VERTICES * sizeof(DebugVertex),
+                               VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                               "Debug lines");
+    }
+}
+
+void
+begin_debug_draw(DebugDraw *debug, FrameTimeline *frames)
+{
+    debug->buffer = &debug->buffers[frames->frameNumber % FRAMES_IN_FLIGHT];
+    debug->vertices = (DebugVertex *)debug->buffer->mapped;
+    debug->vertexCount = 0;
+    debug->capacity = MAX_DEBUG_VERTICES;
+    debug->droppedCount = 0;
+}
+
+void
+debug_line(Vec3 a, Vec3 b, u32 color)
+{
+    DebugDraw *debug = &globalDebugDraw;
+    if (debug->vertexCount + 2 > debug->capacity)
+    {
+        debug->droppedCount++;
+        return;
+    }
+    
+    DebugVertex *vertex = &debug->vertices[debug->vertexCount];
+    vertex[0].position = a;
+    vertex[0].color = color;
+    vertex[1].position = b;
+    vertex[1].color = color;
+    debug->vertexCount += 2;
+}
+
+// The corners of a box are the bit patterns of their index, x in bit 0
+static u8 boxEdges[12][2] =
+{
+    {0, 1}, {2, 3}, {4, 5}, {6, 7}, // along x
+    {0, 2}, {1, 3}, {4, 6}, {5, 7}, // along y
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}, // along z
+};
+
+void
+debug_box_corners(Vec3 *corners, u32 color)
+{
+    for (u32 i = 0; i < array_count(boxEdges); i++)
+    {
+        debug_line(corners[boxEdges[i][0]], corners[boxEdges[i][1]], color);
+    }
+}
+
+// The box from min to max in the space of transform, mat4_identity() for
+// an axis aligned box
+void
+debug_box(Mat4 transform, Vec3 min, Vec3 max, u32 color)
+{
+    Vec3 corners[8];
+    for (u32 i = 0; i < 8; i++)
+    {
+        Vec3 corner = vec3((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y,
+                           (i & 4) ? max.z : min.z);
+        corners[i] = mat4_transform_point(transform, corner);
+    }
+    
+    debug_box_corners(corners, color);
+}
+
+// Two unit vectors perpendicular to n and to each other
+void
+debug_basis(Vec3 n, Vec3 *u, Vec3 *v)
+{
+    Vec3 helper = fabsf(n.y) < 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    *u = vec3_normalize(vec3_cross(n, helper));
+    *v = vec3_cross(n, *u);
+}
+
+void
+debug_circle(Vec3 center, Vec3 u, Vec3 v, f32 radius, u32 color)
+{
+    u32 segments = 32;
+    Vec3 previous = vec3_add(center, vec3_scale(u, radius));
+    
+    for (u32 i = 1; i <= segments; i++)
+    {
+        f32 angle = 6.28318531f * (f32)i / (f32)segments;
+        Vec3 point = vec3_add(center,
+                              vec3_add(vec3_scale(u, cosf(angle) * radius),
+                                       vec3_scale(v, sinf(angle) * radius)));
+        debug_line(previous, point, color);
+        previous = point;
+    }
+}
+
+// Three great circles, one per axis
+void
+debug_sphere(Vec3 center, f32 radius, u32 color)
+{
+    Vec3 x = vec3(1, 0, 0);
+    Vec3 y = vec3(0, 1, 0);
+    Vec3 z = vec3(0, 0, 1);
+    
+    debug_circle(center, x, y, radius, color);
+    debug_circle(center, y, z, radius, color);
+    debug_circle(center, z, x, radius, color);
+}
+
+// A line with a four-sided head, a fifth of the length long
+void
+debug_arrow(Vec3 from, Vec3 to, u32 color)
+{
+    Vec3 direction = vec3_sub(to, from);
+    f32 length = vec3_length(direction);
+    if (length <= 0)
+    {
+        return;
+    }
+    
+    Vec3 n = vec3_scale(direction, 1.0f / length);
+    Vec3 u;
+    Vec3 v;
+    debug_basis(n, &u, &v);
+    
+    f32 headLength = length * 0.2f;
+    Vec3 headBase = vec3_sub(to, vec3_scale(n, headLength));
+    u = vec3_scale(u, headLength * 0.4f);
+    v = vec3_scale(v, headLength * 0.4f);
+    
+    debug_line(from, to, color);
+    debug_line(to, vec3_add(headBase, u), color);
+    debug_line(to, vec3_sub(headBase, u), color);
+    debug_line(to, vec3_add(headBase, v), color);
+    debug_line(to, vec3_sub(headBase, v), color);
+}
+
+// The view volume of camera between its near and far plane
+void
+debug_frustum(Camera *camera, f32 aspect, u32 color)
+{
+    Vec3 forward = vec3_normalize(vec3_sub(camera->target,
+                                           camera->position));
+    Vec3 right = vec3_normalize(vec3_cross(forward, vec3(0, 1, 0)));
+    Vec3 up = vec3_cross(right, forward);
+    f32 tanHalfFov = tanf(camera->fovY * 0.5f);
+    
+    Vec3 corners[8];
+    for (u32 i = 0; i < 8; i++)
+    {
+        f32 distance = (i & 4) ? camera->farPlane : camera->nearPlane;
+        f32 halfHeight = tanHalfFov * distance;
+        f32 halfWidth = halfHeight * aspect;
+        
+        Vec3 center = vec3_add(camera->position,
+                               vec3_scale(forward, distance));
+        Vec3 x = vec3_scale(right, (i & 1) ? halfWidth : -halfWidth);
+        Vec3 y = vec3_scale(up, (i & 2) ? halfHeight : -halfHeight);
+        corners[i] = vec3_add(center, vec3_add(x, y));
+    }
+    
+    debug_box_corners(corners, color);
+}
+
+/* Records the frame's lines as one draw, depth tested against the scene but
+   not written. Nothing is recorded when there are no lines. */
+void
+flush_debug_draw(DebugDraw *debug, VkCommandBuffer commandBuffer,
+                 VkPipeline pipeline, VkPipelineLayout layout,
+                 Mat4 *viewProjection)
+{
+    u32 count = debug->vertexCount;
+    debug->vertices = NULL;
+    debug->capacity = 0;
+    
+    if (count == 0)
+    {
+        return;
+    }
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline);
+    vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       sizeof(Mat4), viewProjection);
+    
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &debug->buffer->buffer,
+                           &offset);
+    
+    vkCmdDraw(commandBuffer, count, 1, 0, 0);
+}
+
+// Boxes around the cubes and spheres around the spheres, not the ground
+void
+debug_scene_bounds(Scene *scene, u32 color)
+{
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        SceneObject *object = &scene->objects[i];
+        Mat4 *transform = &object->transform;
+        
+        if (object->mesh == MeshId_Cube)
+        {
+            debug_box(*transform, vec3(-0.5f, -0.5f, -0.5f),
+                      vec3(0.5f, 0.5f, 0.5f), color);
+        }
+        else if (object->mesh == MeshId_Sphere)
+        {
+            // Uniformly scaled
+            Vec3 center = vec3(transform->m[12], transform->m[13],
+                               transform->m[14]);
+            debug_sphere(center, scene->meshes[MeshId_Sphere].radius *
+                         transform->m[0], color);
+        }
+    }
+}
\ No newline at end of file
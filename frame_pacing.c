@@ -0,0 +1,422 @@
+/*
+*  Frame pacing
+*/
+
+#include <dwmapi.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+#define PACING_HISTORY 64
+
+/* Starts each frame as late as possible before the vblank it is meant for,
+   instead of as soon as FIFO lets us, so the input and simulation state a frame
+   shows is as fresh as possible without dropping frames.
+   
+   With VK_KHR_present_wait the pacer waits until the previous frame is on
+   screen, which gives the exact vblank phase, and the next frame's work is
+   started one refresh later minus the predicted work. Without it the vblank
+   phase comes from DWM and the display time of a frame is estimated as the
+   first vblank after its GPU work completed.
+   
+   The predicted work is the longer of the CPU time to submit and the time
+   until the GPU completed the frame, both timed from the frame's start. A
+   thread waits for every frame's timeline value to time the completions, the
+   main thread only notices one when it waits for the frame's slot, about a
+   frame too late. The prediction adapts: a frame that misses its vblank
+   widens the safety margin, on-time frames slowly shrink it again. */
+typedef struct
+{
+    bool enabled; // latency is measured even with pacing disabled
+    bool usePresentWait;
+    bool logEveryFrame;
+    
+    PFN_vkWaitForPresentKHR vkWaitForPresentKHR;
+    HANDLE timer;
+    
+    // GPU completion times from the completion thread
+    VkDevice device;
+    VkSemaphore timeline;
+    HANDLE completionThread;
+    volatile LONG stopCompletionThread;
+    u64 completedTicks[PACING_HISTORY]; // indexed like frameStart
+    volatile LONG64 timedFrame; // completedTicks is written up to this frame
+    u64 recordedFrame; // completions recorded up to this frame
+    
+    u64 refreshPeriod; // in ticks
+    
+    // Exponential moving averages of the time from frame start to submit and
+    // to GPU completion
+    f32 submitEstimateMs;
+    f32 completionEstimateMs;
+    f32 marginMs;
+    
+    // Indexed by frame number % PACING_HISTORY
+    u64 frameStart[PACING_HISTORY];
+    u64 targetVblank[PACING_HISTORY];
+    
+    // Stats since the last report
+    u64 lastReport;
+    u32 latencyCount;
+    u32 missedCount;
+    f32 latencySumMs;
+    f32 latencyMinMs;
+    f32 latencyMaxMs;
+    
+} FramePacer;
+
+u64
+ms_to_ticks(f32 ms)
+{
+    return (u64)((f64)ms * (f64)globalStartup.frequency / 1000.0);
+}
+
+// Times the completion of every frame as it happens. It runs at most
+// FRAMES_IN_FLIGHT frames ahead of the main thread, well within the history.
+DWORD WINAPI
+frame_completion_thread(LPVOID param)
+{
+    FramePacer *pacer = (FramePacer *)param;
+    
+    for (u64 frameNumber = 1;; frameNumber++)
+    {
+        // Waiting for a value that isn't submitted yet is fine on a timeline
+        VkSemaphoreWaitInfo waitInfo =
+        {
+            VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            NULL,
+            0,
+            1, // semaphoreCount
+            &pacer->timeline,
+            &frameNumber
+        };
+        
+        if (vkWaitSemaphores(pacer->device, &waitInfo,
+                             UINT64_MAX) != VK_SUCCESS ||
+            pacer->stopCompletionThread)
+        {
+            break;
+        }
+        
+        pacer->completedTicks[frameNumber % PACING_HISTORY] = get_ticks();
+        InterlockedExchange64(&pacer->timedFrame, (LONG64)frameNumber);
+    }
+    
+    return 0;
+}
+
+void
+frame_pacer_init(FramePacer *pacer, VulkanContext *vk, VulkanConfig *config,
+                 FrameTimeline *frames)
+{
+    pacer->enabled = config->pacing;
+    pacer->logEveryFrame = config->logLatency;
+    pacer->usePresentWait = vk->hasPresentWait;
+    pacer->marginMs = 1.0f;
+    
+    if (pacer->usePresentWait)
+    {
+        pacer->vkWaitForPresentKHR = (PFN_vkWaitForPresentKHR)
+            vkGetDeviceProcAddr(vk->device, "vkWaitForPresentKHR");
+        pacer->usePresentWait = pacer->vkWaitForPresentKHR != NULL;
+    }
+    
+    pacer->device = vk->device;
+    pacer->timeline = frames->timeline;
+    pacer->completionThread = CreateThread(NULL, 0, frame_completion_thread,
+                                           pacer, 0, NULL);
+    assert(pacer->completionThread);
+    
+    // A plain waitable timer has the scheduler's granularity (up to 15.6 ms),
+    // the high resolution one is available from Windows 10 1803
+    pacer->timer = CreateWaitableTimerEx(NULL, NULL,
+                                         CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                         TIMER_ALL_ACCESS);
+    if (!pacer->timer)
+    {
+        pacer->timer = CreateWaitableTimer(NULL, TRUE, NULL);
+    }
+    
+    // 60 Hz until DWM tells us otherwise
+    pacer->refreshPeriod = ms_to_ticks(1000.0f / 60.0f);
+    
+    DWM_TIMING_INFO timingInfo = { sizeof(DWM_TIMING_INFO) };
+    if (SUCCEEDED(DwmGetCompositionTimingInfo(NULL, &timingInfo)) &&
+        timingInfo.qpcRefreshPeriod > 0)
+    {
+        pacer->refreshPeriod = timingInfo.qpcRefreshPeriod;
+    }
+    
+    pacer->lastReport = get_ticks();
+    pacer->latencyMinMs = FLT_MAX;
+    
+    debug_printf("Frame pacing: %s, latency measured with %s, %.2f Hz\n",
+                 pacer->enabled ? "on" : "off",
+                 pacer->usePresentWait ? "present wait" : "DWM vblank estimate",
+                 1000.0f / ticks_to_ms(pacer->refreshPeriod));
+}
+
+// Called once the device is idle. The completion thread waits for a frame
+// that will never be submitted, signaling it from the host lets it exit.
+void
+frame_pacer_shutdown(FramePacer *pacer)
+{
+    if (!pacer->completionThread)
+    {
+        return;
+    }
+    
+    InterlockedExchange(&pacer->stopCompletionThread, 1);
+    
+    u64 value = 0;
+    vkGetSemaphoreCounterValue(pacer->device, pacer->timeline, &value);
+    
+    VkSemaphoreSignalInfo signalInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+        NULL,
+        pacer->timeline,
+        value + 1
+    };
+    vkSignalSemaphore(pacer->device, &signalInfo);
+    
+    WaitForSingleObject(pacer->completionThread, INFINITE);
+    CloseHandle(pacer->completionThread);
+    pacer->completionThread = NULL;
+}
+
+// First vblank at or after ticks, from DWM's last vblank and refresh period.
+// ticks may be before that vblank, for a completion timed a moment ago.
+u64
+next_dwm_vblank(FramePacer *pacer, u64 ticks)
+{
+    DWM_TIMING_INFO timingInfo = { sizeof(DWM_TIMING_INFO) };
+    if (FAILED(DwmGetCompositionTimingInfo(NULL, &timingInfo)) ||
+        timingInfo.qpcVBlank == 0)
+    {
+        return ticks;
+    }
+    
+    u64 vblank = timingInfo.qpcVBlank;
+    if (vblank < ticks)
+    {
+        u64 periods = (ticks - vblank + pacer->refreshPeriod - 1) /
+            pacer->refreshPeriod;
+        vblank += periods * pacer->refreshPeriod;
+    }
+    else
+    {
+        vblank -= ((vblank - ticks) / pacer->refreshPeriod) *
+            pacer->refreshPeriod;
+    }
+    
+    return vblank;
+}
+
+void
+sleep_until(FramePacer *pacer, u64 wakeTicks)
+{
+    u64 now = get_ticks();
+    if (wakeTicks <= now)
+    {
+        return;
+    }
+    
+    // The timer gets within a fraction of a millisecond, spin for the rest
+    f32 sleepMs = ticks_to_ms(wakeTicks - now) - 0.5f;
+    if (sleepMs > 0 && pacer->timer)
+    {
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -(LONGLONG)(sleepMs * 10000.0f); // relative, 100ns
+        SetWaitableTimer(pacer->timer, &dueTime, 0, NULL, NULL, FALSE);
+        WaitForSingleObject(pacer->timer, INFINITE);
+    }
+    
+    while (get_ticks() < wakeTicks)
+    {
+        YieldProcessor();
+    }
+}
+
+void
+record_frame_latency(FramePacer *pacer, u64 frameNumber, u64 displayTicks)
+{
+    u32 slot = (u32)(frameNumber % PACING_HISTORY);
+    f32 latencyMs = ticks_to_ms(displayTicks - pacer->frameStart[slot]);
+    
+    // Shown later than planned, give the next frames more time
+    bool missed = pacer->targetVblank[slot] &&
+        displayTicks > pacer->targetVblank[slot] + pacer->refreshPeriod / 2;
+    
+    if (missed)
+    {
+        f32 periodMs = ticks_to_ms(pacer->refreshPeriod);
+        pacer->marginMs += 0.5f;
+        if (pacer->marginMs > periodMs)
+        {
+            pacer->marginMs = periodMs;
+        }
+        pacer->missedCount++;
+    }
+    else
+    {
+        pacer->marginMs -= 0.01f;
+        if (pacer->marginMs < 0.5f)
+        {
+            pacer->marginMs = 0.5f;
+        }
+    }
+    
+    pacer->latencyCount++;
+    pacer->latencySumMs += latencyMs;
+    if (latencyMs < pacer->latencyMinMs)
+    {
+        pacer->latencyMinMs = latencyMs;
+    }
+    if (latencyMs > pacer->latencyMaxMs)
+    {
+        pacer->latencyMaxMs = latencyMs;
+    }
+    
+    if (pacer->logEveryFrame)
+    {
+        debug_printf("Frame %llu: acquire to present %.2f ms%s\n", frameNumber,
+                     latencyMs, missed ? " (missed vblank)" : "");
+    }
+    
+    u64 now = get_ticks();
+    if (ticks_to_ms(now - pacer->lastReport) >= 1000.0f)
+    {
+        debug_printf("Latency: %u frames, acquire to present avg %.2f ms, "
+                     "min %.2f ms, max %.2f ms, %u missed, margin %.2f ms\n",
+                     pacer->latencyCount,
+                     pacer->latencySumMs / (f32)pacer->latencyCount,
+                     pacer->latencyMinMs, pacer->latencyMaxMs,
+                     pacer->missedCount, pacer->marginMs);
+        
+        pacer->lastReport = now;
+        pacer->latencyCount = 0;
+        pacer->missedCount = 0;
+        pacer->latencySumMs = 0;
+        pacer->latencyMinMs = FLT_MAX;
+        pacer->latencyMaxMs = 0;
+    }
+}
+
+/* Called before the frame's image is acquired. Waits for the previous frame to
+   be displayed, then sleeps until the latest point at which this frame can
+   start and still make the next vblank. */
+void
+frame_pacer_begin_frame(FramePacer *pacer, VulkanContext *vk, u64 frameNumber)
+{
+    u64 targetVblank = 0;
+    
+    if (pacer->usePresentWait && frameNumber > 1)
+    {
+        // Present ids are the frame numbers
+        VkResult result = pacer->vkWaitForPresentKHR(vk->device, vk->swapchain,
+                                                     frameNumber - 1,
+                                                     100 * 1000 * 1000);
+        if (result == VK_SUCCESS)
+        {
+            u64 displayed = get_ticks();
+            record_frame_latency(pacer, frameNumber - 1, displayed);
+            targetVblank = displayed + pacer->refreshPeriod;
+        }
+    }
+    else if (!pacer->usePresentWait)
+    {
+        targetVblank = next_dwm_vblank(pacer, get_ticks());
+    }
+    
+    if (pacer->enabled && targetVblank)
+    {
+        f32 workMs = pacer->submitEstimateMs > pacer->completionEstimateMs ?
+            pacer->submitEstimateMs : pacer->completionEstimateMs;
+        u64 wake = targetVblank - ms_to_ticks(workMs + pacer->marginMs);
+        
+        // Already too late for that vblank, aim for the one after it
+        u64 now = get_ticks();
+        if (wake < now && !pacer->usePresentWait)
+        {
+            targetVblank += pacer->refreshPeriod;
+            wake += pacer->refreshPeriod;
+        }
+        
+        if (wake > now)
+        {
+            sleep_until(pacer, wake);
+        }
+    }
+    
+    u32 slot = (u32)(frameNumber % PACING_HISTORY);
+    pacer->frameStart[slot] = get_ticks();
+    pacer->targetVblank[slot] = targetVblank;
+}
+
+void
+update_work_estimate(f32 *estimateMs, f32 workMs)
+{
+    *estimateMs = *estimateMs * 0.9f + workMs * 0.1f;
+    
+    // Spikes matter more than the average, react to them right away
+    if (workMs > *estimateMs)
+    {
+        *estimateMs = workMs;
+    }
+}
+
+// Called after the frame's command buffer is submitted
+void
+frame_pacer_end_cpu_work(FramePacer *pacer, u64 frameNumber)
+{
+    u32 slot = (u32)(frameNumber % PACING_HISTORY);
+    update_work_estimate(&pacer->submitEstimateMs,
+                         ticks_to_ms(get_ticks() - pacer->frameStart[slot]));
+}
+
+/* Called once per frame. Every frame the completion thread has timed since
+   goes into the completion estimate. Without present wait, it's also assumed
+   to be displayed at the first vblank after its GPU work completed. */
+void
+frame_pacer_record_completed(FramePacer *pacer)
+{
+    u64 timedFrame = (u64)InterlockedCompareExchange64(&pacer->timedFrame,
+                                                       0, 0);
+    while (pacer->recordedFrame < timedFrame)
+    {
+        u64 frameNumber = ++pacer->recordedFrame;
+        u32 slot = (u32)(frameNumber % PACING_HISTORY);
+        u64 completedTicks = pacer->completedTicks[slot];
+        
+        update_work_estimate(&pacer->completionEstimateMs,
+                             ticks_to_ms(completedTicks -
+                                         pacer->frameStart[slot]));
+        
+        if (!pacer->usePresentWait)
+        {
+            record_frame_latency(pacer, frameNumber,
+                                 next_dwm_vblank(pacer, completedTicks));
+        }
+    }
+}
+
+// Chained into VkPresentInfoKHR so present wait can refer to this frame
+void *
+frame_pacer_present_id(FramePacer *pacer, VkPresentIdKHR *presentId,
+                       u64 *presentIdValue, u64 frameNumber)
+{
+    if (!pacer->usePresentWait)
+    {
+        return NULL;
+    }
+    
+    *presentIdValue = frameNumber;
+    presentId->sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+    presentId->pNext = NULL;
+    presentId->swapchainCount = 1;
+    presentId->pPresentIds = presentIdValue;
+    
+    return presentId;
+}
\ No newline at end of file
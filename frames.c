@@ -0,0 +1,257 @@
+/*
+*  Frame timeline
+*/
+
+/* All CPU/GPU frame synchronization goes through one timeline semaphore. The
+   submit of frame N signals the value N, so "has frame N finished?" is a
+   single counter comparison anywhere in the engine, the CPU waits for a frame
+   slot by waiting for the value FRAMES_IN_FLIGHT frames back, and another
+   queue can depend on a frame by waiting on the same semaphore and value.
+   Binary semaphores remain only where the swapchain requires them. */
+
+#define FRAMES_IN_FLIGHT 2
+
+typedef enum
+{
+    DeferredDestroy_Pipeline,
+    DeferredDestroy_Buffer,
+    DeferredDestroy_Image,
+    DeferredDestroy_ImageView,
+    DeferredDestroy_Memory,
+    
+} DeferredDestroyType;
+
+typedef struct
+{
+    DeferredDestroyType type;
+    u64 handle;
+    u64 lastUsedFrame;
+    
+} DeferredDestroy;
+
+typedef struct
+{
+    VkCommandBuffer commandBuffer;
+    VkSemaphore imageAvailable; // binary, signaled by the acquire
+    
+    // CPU data that lives as long as the frame, reset by begin_frame()
+    Arena arena;
+    
+} FrameSlot;
+
+typedef struct
+{
+    VkSemaphore timeline;
+    u64 frameNumber; // frame being recorded, the first frame is 1
+    u64 completedFrame; // highest value the GPU is known to have signaled
+    
+    FrameSlot slots[FRAMES_IN_FLIGHT];
+    
+    // Binary, signaled by the submit and waited on by the present. One per
+    // swapchain image, since the presentation engine may still hold the one
+    // of an image while a later frame renders to another.
+    VkSemaphore renderFinished[MAX_SWAPCHAIN_IMAGES];
+    
+    DeferredDestroy deferred[256];
+    u32 deferredCount;
+    
+} FrameTimeline;
+
+void
+frame_timeline_init(FrameTimeline *frames, VulkanContext *vk,
+                    VkCommandPool commandPool)
+{
+    VkSemaphoreTypeCreateInfo timelineInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        NULL,
+        VK_SEMAPHORE_TYPE_TIMELINE,
+        0 // initialValue, frame 0 is complete by definition
+    };
+    
+    VkSemaphoreCreateInfo timelineCreateInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        &timelineInfo,
+        0
+    };
+    
+    if (vkCreateSemaphore(vk->device, &timelineCreateInfo, NULL,
+                          &frames->timeline) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the frame timeline semaphore");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_SEMAPHORE,
+                    handle_to_u64(frames->timeline), "Frame timeline");
+    
+    VkSemaphoreCreateInfo semaphoreInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        NULL,
+        0
+    };
+    
+    VkCommandBuffer commandBuffers[FRAMES_IN_FLIGHT];
+    
+    VkCommandBufferAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        NULL,
+        commandPool,
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        FRAMES_IN_FLIGHT // commandBufferCount
+    };
+    
+    vkAllocateCommandBuffers(vk->device, &allocInfo, commandBuffers);
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        frames->slots[i].commandBuffer = commandBuffers[i];
+        vkCreateSemaphore(vk->device, &semaphoreInfo, NULL,
+                          &frames->slots[i].imageAvailable);
+        arena_init(&frames->slots[i].arena, FRAME_ARENA_SIZE);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_COMMAND_BUFFER,
+                        handle_to_u64(commandBuffers[i]),
+                        "Frame command buffer %u", i);
+        set_object_name(vk, VK_OBJECT_TYPE_SEMAPHORE,
+                        handle_to_u64(frames->slots[i].imageAvailable),
+                        "Image available %u", i);
+    }
+    
+    for (u32 i = 0; i < vk->swapchainImageCount; i++)
+    {
+        vkCreateSemaphore(vk->device, &semaphoreInfo, NULL,
+                          &frames->renderFinished[i]);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_SEMAPHORE,
+                        handle_to_u64(frames->renderFinished[i]),
+                        "Render finished %u", i);
+    }
+}
+
+// Cheap enough to call anywhere, it only asks the driver when the cached
+// value doesn't already answer the question
+bool
+is_frame_complete(FrameTimeline *frames, VulkanContext *vk, u64 frameNumber)
+{
+    if (frameNumber > frames->completedFrame)
+    {
+        vkGetSemaphoreCounterValue(vk->device, frames->timeline,
+                                   &frames->completedFrame);
+    }
+    
+    return frameNumber <= frames->completedFrame;
+}
+
+void
+wait_for_frame(FrameTimeline *frames, VulkanContext *vk, u64 frameNumber)
+{
+    if (is_frame_complete(frames, vk, frameNumber))
+    {
+        return;
+    }
+    
+    VkSemaphoreWaitInfo waitInfo =
+    {
+        VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        NULL,
+        0,
+        1, // semaphoreCount
+        &frames->timeline,
+        &frameNumber
+    };
+    
+    vkWaitSemaphores(vk->device, &waitInfo, UINT64_MAX);
+    frames->completedFrame = frameNumber;
+}
+
+/* Destroys the object once every frame up to lastUsedFrame has completed.
+   Pass the current frame number for objects the current frame still uses. */
+void
+defer_destroy(FrameTimeline *frames, DeferredDestroyType type, u64 handle,
+              u64 lastUsedFrame)
+{
+    assert(frames->deferredCount < array_count(frames->deferred));
+    
+    DeferredDestroy *deferred = &frames->deferred[frames->deferredCount++];
+    deferred->type = type;
+    deferred->handle = handle;
+    deferred->lastUsedFrame = lastUsedFrame;
+}
+
+void
+destroy_completed_objects(FrameTimeline *frames, VulkanContext *vk)
+{
+    for (u32 i = 0; i < frames->deferredCount;)
+    {
+        DeferredDestroy *deferred = &frames->deferred[i];
+        u64 handle = deferred->handle;
+        
+        if (deferred->lastUsedFrame > frames->completedFrame)
+        {
+            i++;
+        }
+        else
+        {
+            switch (deferred->type)
+            {
+                case DeferredDestroy_Pipeline:
+                {
+                    vkDestroyPipeline(vk->device,
+                                      u64_to_handle(VkPipeline, handle), NULL);
+                } break;
+                
+                case DeferredDestroy_Buffer:
+                {
+                    vkDestroyBuffer(vk->device,
+                                    u64_to_handle(VkBuffer, handle), NULL);
+                } break;
+                
+                case DeferredDestroy_Image:
+                {
+                    vkDestroyImage(vk->device,
+                                   u64_to_handle(VkImage, handle), NULL);
+                } break;
+                
+                case DeferredDestroy_ImageView:
+                {
+                    vkDestroyImageView(vk->device,
+                                       u64_to_handle(VkImageView, handle),
+                                       NULL);
+                } break;
+                
+                case DeferredDestroy_Memory:
+                {
+                    vkFreeMemory(vk->device,
+                                 u64_to_handle(VkDeviceMemory, handle), NULL);
+                } break;
+            }
+            
+            *deferred = frames->deferred[--frames->deferredCount];
+        }
+    }
+}
+
+/* Starts the next frame: waits until its slot's previous frame has completed
+   and destroys whatever is no longer referenced by any frame in flight. */
+FrameSlot *
+begin_frame(FrameTimeline *frames, VulkanContext *vk)
+{
+    frames->frameNumber++;
+    
+    // Frame N reuses the command buffer and semaphore of frame N - 2
+    if (frames->frameNumber > FRAMES_IN_FLIGHT)
+    {
+        wait_for_frame(frames, vk, frames->frameNumber - FRAMES_IN_FLIGHT);
+    }
+    
+    is_frame_complete(frames, vk, frames->frameNumber - 1);
+    destroy_completed_objects(frames, vk);
+    
+    FrameSlot *slot = &frames->slots[frames->frameNumber % FRAMES_IN_FLIGHT];
+    arena_reset(&slot->arena);
+    
+    return slot;
+}
\ No newline at end of file
@@ -0,0 +1,538 @@
+/*
+*  Buffers and device memory
+*/
+
+/* One allocation per buffer, which is plenty for the handful of buffers the
+   app has. Host visible buffers stay mapped for their whole lifetime. */
+typedef struct
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    void *mapped; // NULL unless host visible
+    
+} GpuBuffer;
+
+// Index of the first memory type allowed by typeBits with all the property
+// flags, UINT32_MAX if there is none
+u32
+find_memory_type(VulkanContext *vk, u32 typeBits,
+                 VkMemoryPropertyFlags properties)
+{
+    for (u32 i = 0; i < vk->memoryProperties.memoryTypeCount; i++)
+    {
+        VkMemoryPropertyFlags flags =
+            vk->memoryProperties.memoryTypes[i].propertyFlags;
+        
+        if ((typeBits & (1u << i)) && (flags & properties) == properties)
+        {
+            return i;
+        }
+    }
+    
+    return UINT32_MAX;
+}
+
+GpuBuffer
+create_buffer(VulkanContext *vk, VkDeviceSize size, VkBufferUsageFlags usage,
+              VkMemoryPropertyFlags properties, char *name)
+{
+    GpuBuffer result = {0};
+    result.size = size;
+    
+    VkBufferCreateInfo bufferInfo =
+    {
+        VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        NULL,
+        0,
+        size,
+        usage,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL // (no queue family indices)
+    };
+    
+    if (vkCreateBuffer(vk->device, &bufferInfo, NULL,
+                       &result.buffer) != VK_SUCCESS)
+    {
+        assert(!"Failed to create buffer");
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(vk->device, result.buffer, &requirements);
+    
+    u32 memoryType = find_memory_type(vk, requirements.memoryTypeBits,
+                                      properties);
+    assert(memoryType != UINT32_MAX && "No memory type for the buffer");
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        requirements.size,
+        memoryType
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &result.memory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate buffer memory");
+    }
+    
+    vkBindBufferMemory(vk->device, result.buffer, result.memory, 0);
+    
+    if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        vkMapMemory(vk->device, result.memory, 0, VK_WHOLE_SIZE, 0,
+                    &result.mapped);
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_BUFFER, handle_to_u64(result.buffer),
+                    "%s", name);
+    set_object_name(vk, VK_OBJECT_TYPE_DEVICE_MEMORY,
+                    handle_to_u64(result.memory), "%s memory", name);
+    
+    return result;
+}
+
+// Host visible and coherent, written by the CPU every frame
+GpuBuffer
+create_host_buffer(VulkanContext *vk, VkDeviceSize size,
+                   VkBufferUsageFlags usage, char *name)
+{
+    return create_buffer(vk, size, usage,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, name);
+}
+
+// Immediately, use defer_destroy() for buffers frames in flight may use
+void
+destroy_buffer(VulkanContext *vk, GpuBuffer *buffer)
+{
+    vkDestroyBuffer(vk->device, buffer->buffer, NULL);
+    vkFreeMemory(vk->device, buffer->memory, NULL);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+/* A command buffer for load time uploads, end_one_time_commands() submits it
+   and waits for it to finish */
+VkCommandBuffer
+begin_one_time_commands(VulkanContext *vk, VkCommandPool commandPool)
+{
+    VkCommandBufferAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        NULL,
+        commandPool,
+        VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        1 // commandBufferCount
+    };
+    
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(vk->device, &allocInfo, &commandBuffer);
+    
+    VkCommandBufferBeginInfo beginInfo =
+    {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        NULL,
+        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        NULL // pInheritanceInfo
+    };
+    
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    
+    return commandBuffer;
+}
+
+void
+end_one_time_commands(VulkanContext *vk, VkCommandPool commandPool,
+                      VkCommandBuffer commandBuffer)
+{
+    vkEndCommandBuffer(commandBuffer);
+    
+    VkSubmitInfo submitInfo =
+    {
+        VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        NULL,
+        0, NULL, NULL, // (no wait semaphores)
+        1, &commandBuffer,
+        0, NULL // (no signal semaphores)
+    };
+    
+    vkQueueSubmit(vk->graphicsAndPresentQueue, 1, &submitInfo,
+                  VK_NULL_HANDLE);
+    vkQueueWaitIdle(vk->graphicsAndPresentQueue);
+    
+    vkFreeCommandBuffers(vk->device, commandPool, 1, &commandBuffer);
+}
+
+/* Device local buffer with its initial contents copied through a staging
+   buffer. Waits for the copy, so this is for load time only. */
+GpuBuffer
+create_buffer_with_data(VulkanContext *vk, VkCommandPool commandPool,
+                        VkBufferUsageFlags usage, void *data,
+                        VkDeviceSize size, char *name)
+{
+    GpuBuffer result = create_buffer(vk, size,
+                                     usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, name);
+    
+    GpuBuffer staging = create_host_buffer(vk, size,
+                                           VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                           "Staging");
+    memcpy(staging.mapped, data, (size_t)size);
+    
+    VkCommandBuffer commandBuffer = begin_one_time_commands(vk, commandPool);
+    
+    VkBufferCopy region = { 0, 0, size };
+    vkCmdCopyBuffer(commandBuffer, staging.buffer, result.buffer, 1, &region);
+    
+    end_one_time_commands(vk, commandPool, commandBuffer);
+    destroy_buffer(vk, &staging);
+    
+    return result;
+}
+
+/*
+*  Render targets
+*/
+
+typedef struct
+{
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    bool lazilyAllocated; // backed by tile memory, see create_transient_target
+    
+} GpuImage;
+
+/* A screen sized attachment. Transient ones only live within a render
+   pass, like a multisampled color target that is resolved before the pass
+   ends. Transient usage lets tilers keep them in on-chip memory, and lazily
+   allocated memory means they never back them with real memory at all.
+   Other GPUs don't have lazily allocated memory types and get an ordinary
+   device local image, which the render pass still never loads or stores.
+   Targets that are stored, loaded by a later pass or sampled can't be
+   transient. */
+GpuImage
+create_render_target(VulkanContext *vk, VkFormat format,
+                     VkImageUsageFlags usage, VkImageAspectFlags aspect,
+                     VkSampleCountFlagBits samples, bool transient,
+                     char *name)
+{
+    GpuImage result = {0};
+    
+    if (transient)
+    {
+        usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+    }
+    
+    VkImageCreateInfo imageInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_IMAGE_TYPE_2D,
+        format,
+        { vk->swapchainExtents.width, vk->swapchainExtents.height, 1 },
+        1, // mipLevels
+        1, // arrayLayers
+        samples,
+        VK_IMAGE_TILING_OPTIMAL,
+        usage,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL, // (no queue family indices)
+        VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    if (vkCreateImage(vk->device, &imageInfo, NULL,
+                      &result.image) != VK_SUCCESS)
+    {
+        assert(!"Failed to create render target");
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk->device, result.image, &requirements);
+    
+    u32 memoryType = UINT32_MAX;
+    if (transient)
+    {
+        memoryType = find_memory_type(vk, requirements.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                      VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+    }
+    result.lazilyAllocated = memoryType != UINT32_MAX;
+    
+    if (!result.lazilyAllocated)
+    {
+        memoryType = find_memory_type(vk, requirements.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+    assert(memoryType != UINT32_MAX && "No memory type for the target");
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        requirements.size,
+        memoryType
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &result.memory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate render target memory");
+    }
+    
+    vkBindImageMemory(vk->device, result.image, result.memory, 0);
+    
+    VkImageViewCreateInfo viewInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        NULL,
+        0,
+        result.image,
+        VK_IMAGE_VIEW_TYPE_2D,
+        format,
+        {0}, // identity swizzle
+        { aspect, 0, 1, 0, 1 } // subresource range
+    };
+    
+    if (vkCreateImageView(vk->device, &viewInfo, NULL,
+                          &result.view) != VK_SUCCESS)
+    {
+        assert(!"Failed to create render target view");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_IMAGE, handle_to_u64(result.image),
+                    "%s", name);
+    set_object_name(vk, VK_OBJECT_TYPE_IMAGE_VIEW, handle_to_u64(result.view),
+                    "%s view", name);
+    set_object_name(vk, VK_OBJECT_TYPE_DEVICE_MEMORY,
+                    handle_to_u64(result.memory), "%s memory", name);
+    
+    debug_printf("Render target %s: %u samples, %llu KB%s\n", name,
+                 (u32)samples, requirements.size / 1024,
+                 result.lazilyAllocated ? " lazily allocated" : "");
+    
+    return result;
+}
+
+GpuImage
+create_transient_target(VulkanContext *vk, VkFormat format,
+                        VkImageUsageFlags usage, VkImageAspectFlags aspect,
+                        VkSampleCountFlagBits samples, char *name)
+{
+    return create_render_target(vk, format, usage, aspect, samples, true,
+                                name);
+}
+
+/* The highest sample count up to requested that color attachments (and
+   depth attachments, which are multisampled along with them) support */
+VkSampleCountFlagBits
+choose_sample_count(VulkanContext *vk, u32 requested)
+{
+    VkPhysicalDeviceLimits *limits = &vk->physicalDeviceProperties.limits;
+    VkSampleCountFlags supported = limits->framebufferColorSampleCounts &
+        limits->framebufferDepthSampleCounts;
+    
+    VkSampleCountFlagBits result = VK_SAMPLE_COUNT_1_BIT;
+    for (u32 samples = 2; samples <= requested && samples <= 64; samples *= 2)
+    {
+        if (supported & samples)
+        {
+            result = (VkSampleCountFlagBits)samples;
+        }
+    }
+    
+    return result;
+}
+
+// Float formats first, reversed-Z depends on their precision near 0. D16 is
+// the only format every device has to support as a depth attachment. With
+// sampled the format has to be sampled in shaders too, VK_FORMAT_UNDEFINED
+// if none can be.
+VkFormat
+choose_depth_format(VulkanContext *vk, bool sampled)
+{
+    VkFormatFeatureFlags required =
+        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    if (sampled)
+    {
+        required |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+    }
+    
+    VkFormat candidates[] =
+    {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_X8_D24_UNORM_PACK32,
+        VK_FORMAT_D24_UNORM_S8_UINT,
+        VK_FORMAT_D16_UNORM,
+    };
+    
+    for (u32 i = 0; i < array_count(candidates); i++)
+    {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(vk->physicalDevice,
+                                            candidates[i], &properties);
+        
+        if ((properties.optimalTilingFeatures & required) == required)
+        {
+            return candidates[i];
+        }
+    }
+    
+    assert(sampled && "No depth format");
+    return VK_FORMAT_UNDEFINED;
+}
+
+VkImageAspectFlags
+get_depth_aspect(VkFormat format)
+{
+    bool hasStencil = format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
+        format == VK_FORMAT_D24_UNORM_S8_UINT ||
+        format == VK_FORMAT_D16_UNORM_S8_UINT;
+    
+    return VK_IMAGE_ASPECT_DEPTH_BIT |
+        (hasStencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0);
+}
+
+/*
+*  Textures
+*/
+
+/* Sampled 2D image without mipmaps, uploaded through a staging buffer and
+   left in SHADER_READ_ONLY_OPTIMAL. pixels are tightly packed rows of
+   bytesPerPixel. Waits for the upload, so this is for load time only. */
+GpuImage
+create_texture(VulkanContext *vk, VkCommandPool commandPool, u32 width,
+               u32 height, VkFormat format, u32 bytesPerPixel, void *pixels,
+               char *name)
+{
+    GpuImage result = {0};
+    
+    VkImageCreateInfo imageInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_IMAGE_TYPE_2D,
+        format,
+        { width, height, 1 },
+        1, // mipLevels
+        1, // arrayLayers
+        VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL, // (no queue family indices)
+        VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    if (vkCreateImage(vk->device, &imageInfo, NULL,
+                      &result.image) != VK_SUCCESS)
+    {
+        assert(!"Failed to create texture");
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk->device, result.image, &requirements);
+    
+    u32 memoryType = find_memory_type(vk, requirements.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    assert(memoryType != UINT32_MAX && "No memory type for the texture");
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        requirements.size,
+        memoryType
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &result.memory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate texture memory");
+    }
+    
+    vkBindImageMemory(vk->device, result.image, result.memory, 0);
+    
+    VkDeviceSize size = (VkDeviceSize)width * height * bytesPerPixel;
+    GpuBuffer staging = create_host_buffer(vk, size,
+                                           VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                           "Staging");
+    memcpy(staging.mapped, pixels, (size_t)size);
+    
+    VkCommandBuffer commandBuffer = begin_one_time_commands(vk, commandPool);
+    
+    VkImageMemoryBarrier toTransfer =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        NULL,
+        0, // srcAccessMask
+        VK_ACCESS_TRANSFER_WRITE_BIT, // dstAccessMask
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        result.image,
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                         1, &toTransfer);
+    
+    VkBufferImageCopy region =
+    {
+        0, // bufferOffset
+        0, 0, // (tightly packed rows)
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 }, // imageSubresource
+        { 0, 0, 0 }, // imageOffset
+        { width, height, 1 } // imageExtent
+    };
+    
+    vkCmdCopyBufferToImage(commandBuffer, staging.buffer, result.image,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    
+    VkImageMemoryBarrier toShaderRead = toTransfer;
+    toShaderRead.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    toShaderRead.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    toShaderRead.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    toShaderRead.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL,
+                         0, NULL, 1, &toShaderRead);
+    
+    end_one_time_commands(vk, commandPool, commandBuffer);
+    destroy_buffer(vk, &staging);
+    
+    VkImageViewCreateInfo viewInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        NULL,
+        0,
+        result.image,
+        VK_IMAGE_VIEW_TYPE_2D,
+        format,
+        {0}, // identity swizzle
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 } // subresource range
+    };
+    
+    if (vkCreateImageView(vk->device, &viewInfo, NULL,
+                          &result.view) != VK_SUCCESS)
+    {
+        assert(!"Failed to create texture view");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_IMAGE, handle_to_u64(result.image),
+                    "%s", name);
+    set_object_name(vk, VK_OBJECT_TYPE_IMAGE_VIEW, handle_to_u64(result.view),
+                    "%s view", name);
+    set_object_name(vk, VK_OBJECT_TYPE_DEVICE_MEMORY,
+                    handle_to_u64(result.memory), "%s memory", name);
+    
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,391 @@
+/*
+*  Job system
+*/
+
+/* A worker thread per core besides the main thread, each with its own
+   Chase-Lev deque: the owner pushes and pops jobs at the bottom without
+   locking, and threads that run out of work steal from the top of the
+   others' deques with a compare and swap. There is no shared queue.
+   
+   Jobs are a function over a range of indices, so a parallel for is one job
+   per chunk. Every job can decrement a JobCounter when it's done, and
+   wait_for_counter() runs other jobs until the counter drops to zero
+   instead of blocking, which is what keeps the cores busy while a job
+   waits on the jobs it spawned. Idle workers spin for a little while, then
+   sleep on a semaphore until more jobs are pushed.
+   
+   Jobs can only be pushed by the main thread and the workers. Each of them
+   takes jobs from its own ring of MAX_JOBS_PER_THREAD, which must not wrap
+   around onto jobs still in flight. */
+
+#define MAX_JOB_THREADS 64
+#define MAX_JOBS_PER_THREAD 4096 // a power of two, also the deque's size
+#define JOB_SPIN_COUNT 256 // failed attempts to get a job before sleeping
+
+typedef void JobFunction(void *data, u32 first, u32 end);
+
+typedef struct
+{
+    volatile LONG count;
+    
+} JobCounter;
+
+typedef struct
+{
+    JobFunction *function;
+    void *data;
+    u32 first;
+    u32 end;
+    JobCounter *counter; // may be NULL
+    
+} Job;
+
+typedef struct
+{
+    // Thieves and the owner hammer top and bottom, keep them on their own
+    // cache lines
+    volatile LONG64 top;
+    u8 topPadding[56];
+    volatile LONG64 bottom;
+    u8 bottomPadding[56];
+    
+    Job *volatile entries[MAX_JOBS_PER_THREAD];
+    
+} JobDeque;
+
+typedef struct
+{
+    JobDeque deque;
+    Job jobs[MAX_JOBS_PER_THREAD];
+    u32 jobCount; // jobs taken from the ring, wraps
+    u32 random; // picks the first thread to steal from
+    HANDLE thread;
+    
+} JobThread;
+
+typedef struct
+{
+    JobThread *threads; // the main thread is threads[0]
+    u32 threadCount;
+    
+    HANDLE wake; // semaphore, released when jobs are pushed
+    volatile LONG sleepingCount;
+    
+} JobSystem;
+
+static JobSystem globalJobs;
+
+// Index of the calling thread plus one, 0 on threads outside the job system
+static __declspec(thread) u32 globalJobThread;
+
+/*
+*  Chase-Lev deque
+*/
+
+// Owner only
+void
+job_deque_push(JobDeque *deque, Job *job)
+{
+    LONG64 bottom = deque->bottom;
+    assert(bottom - deque->top < MAX_JOBS_PER_THREAD);
+    
+    deque->entries[bottom & (MAX_JOBS_PER_THREAD - 1)] = job;
+    
+    // The entry has to be visible before the new bottom
+    MemoryBarrier();
+    deque->bottom = bottom + 1;
+}
+
+// Owner only, newest first
+Job *
+job_deque_pop(JobDeque *deque)
+{
+    LONG64 bottom = deque->bottom - 1;
+    
+    // Full barrier: thieves must see the lower bottom before top is read
+    InterlockedExchange64(&deque->bottom, bottom);
+    LONG64 top = deque->top;
+    
+    if (top > bottom)
+    {
+        // Empty
+        deque->bottom = top;
+        return NULL;
+    }
+    
+    Job *job = deque->entries[bottom & (MAX_JOBS_PER_THREAD - 1)];
+    if (top != bottom)
+    {
+        return job;
+    }
+    
+    // The last job, race the thieves for it
+    if (InterlockedCompareExchange64(&deque->top, top + 1, top) != top)
+    {
+        job = NULL;
+    }
+    deque->bottom = top + 1;
+    
+    return job;
+}
+
+// Any thread, oldest first. NULL when empty or when another thread won.
+Job *
+job_deque_steal(JobDeque *deque)
+{
+    LONG64 top = deque->top;
+    MemoryBarrier();
+    LONG64 bottom = deque->bottom;
+    
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+    
+    Job *job = deque->entries[top & (MAX_JOBS_PER_THREAD - 1)];
+    if (InterlockedCompareExchange64(&deque->top, top + 1, top) != top)
+    {
+        return NULL;
+    }
+    
+    return job;
+}
+
+/*
+*  Scheduling
+*/
+
+JobThread *
+get_job_thread(void)
+{
+    // Only the main thread and the workers have a deque to push to
+    assert(globalJobThread);
+    return &globalJobs.threads[globalJobThread - 1];
+}
+
+// The calling thread's own jobs first, then the others'
+Job *
+get_job(void)
+{
+    JobThread *self = get_job_thread();
+    
+    Job *job = job_deque_pop(&self->deque);
+    if (job)
+    {
+        return job;
+    }
+    
+    // Xorshift, so the thieves spread over the threads
+    self->random ^= self->random << 13;
+    self->random ^= self->random >> 17;
+    self->random ^= self->random << 5;
+    
+    u32 start = self->random % globalJobs.threadCount;
+    for (u32 i = 0; i < globalJobs.threadCount; i++)
+    {
+        JobThread *victim =
+            &globalJobs.threads[(start + i) % globalJobs.threadCount];
+        if (victim != self)
+        {
+            job = job_deque_steal(&victim->deque);
+            if (job)
+            {
+                return job;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+void
+execute_job(Job *job)
+{
+    job->function(job->data, job->first, job->end);
+    
+    if (job->counter)
+    {
+        InterlockedDecrement(&job->counter->count);
+    }
+}
+
+DWORD WINAPI
+job_worker(LPVOID param)
+{
+    globalJobThread = (u32)(uintptr_t)param + 1;
+    
+    u32 idleCount = 0;
+    for (;;)
+    {
+        Job *job = get_job();
+        if (job)
+        {
+            execute_job(job);
+            idleCount = 0;
+            continue;
+        }
+        
+        if (++idleCount < JOB_SPIN_COUNT)
+        {
+            YieldProcessor();
+            continue;
+        }
+        idleCount = 0;
+        
+        /* Announce the sleep before looking one last time, a push either
+           happened before and its job is found now or it sees the sleeping
+           count and releases the semaphore */
+        InterlockedIncrement(&globalJobs.sleepingCount);
+        job = get_job();
+        if (!job)
+        {
+            WaitForSingleObject(globalJobs.wake, INFINITE);
+        }
+        InterlockedDecrement(&globalJobs.sleepingCount);
+        
+        if (job)
+        {
+            execute_job(job);
+        }
+    }
+}
+
+// Starts a worker per logical processor besides the calling thread, which
+// becomes the main job thread
+void
+job_system_init(void)
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    
+    u32 threadCount = systemInfo.dwNumberOfProcessors;
+    threadCount = threadCount < MAX_JOB_THREADS ? threadCount : MAX_JOB_THREADS;
+    threadCount = threadCount ? threadCount : 1;
+    
+    globalJobs.threads = (JobThread *)arena_push_zero(&globalPermanentArena,
+                                                      threadCount *
+                                                      sizeof(JobThread), 64);
+    globalJobs.threadCount = threadCount;
+    
+    globalJobs.wake = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    assert(globalJobs.wake);
+    
+    globalJobThread = 1;
+    
+    for (u32 i = 0; i < threadCount; i++)
+    {
+        JobThread *thread = &globalJobs.threads[i];
+        thread->random = 0x9e3779b9u * (i + 1);
+        
+        if (i > 0)
+        {
+            thread->thread = CreateThread(NULL, 0, job_worker,
+                                          (LPVOID)(uintptr_t)i, 0, NULL);
+            assert(thread->thread);
+        }
+    }
+}
+
+void
+wake_job_workers(u32 jobCount)
+{
+    // Orders the pushes before the read of the sleeping count, see
+    // job_worker()
+    MemoryBarrier();
+    
+    u32 sleepingCount = (u32)globalJobs.sleepingCount;
+    u32 wakeCount = jobCount < sleepingCount ? jobCount : sleepingCount;
+    if (wakeCount)
+    {
+        ReleaseSemaphore(globalJobs.wake, (LONG)wakeCount, NULL);
+    }
+}
+
+void
+push_job(JobThread *self, JobFunction *function, void *data, u32 first,
+         u32 end, JobCounter *counter)
+{
+    Job *job = &self->jobs[self->jobCount++ & (MAX_JOBS_PER_THREAD - 1)];
+    job->function = function;
+    job->data = data;
+    job->first = first;
+    job->end = end;
+    job->counter = counter;
+    
+    job_deque_push(&self->deque, job);
+}
+
+// function(data, 0, 1) on whichever thread gets to it first. counter, if not
+// NULL, is incremented now and decremented when the job is done.
+void
+run_job(JobFunction *function, void *data, JobCounter *counter)
+{
+    if (counter)
+    {
+        InterlockedIncrement(&counter->count);
+    }
+    
+    push_job(get_job_thread(), function, data, 0, 1, counter);
+    wake_job_workers(1);
+}
+
+// function(data, first, end) over 0 to count in chunks of chunkSize indices,
+// each chunk a job that counts once on counter
+void
+run_parallel_for(JobFunction *function, void *data, u32 count,
+                 u32 chunkSize, JobCounter *counter)
+{
+    JobThread *self = get_job_thread();
+    u32 jobCount = (count + chunkSize - 1) / chunkSize;
+    
+    if (counter)
+    {
+        InterlockedExchangeAdd(&counter->count, (LONG)jobCount);
+    }
+    
+    for (u32 i = 0; i < jobCount; i++)
+    {
+        u32 first = i * chunkSize;
+        u32 end = count - first < chunkSize ? count : first + chunkSize;
+        push_job(self, function, data, first, end, counter);
+    }
+    
+    wake_job_workers(jobCount);
+}
+
+// Runs jobs, any jobs, until counter reaches zero
+void
+wait_for_counter(JobCounter *counter)
+{
+    while (counter->count > 0)
+    {
+        Job *job = get_job();
+        if (job)
+        {
+            execute_job(job);
+        }
+        else
+        {
+            YieldProcessor();
+        }
+    }
+    
+    // The jobs' writes are visible from here on
+    MemoryBarrier();
+}
+
+// Splits function over the job threads and waits for it, or runs it right
+// here when count is too small to be worth it
+void
+parallel_for(JobFunction *function, void *data, u32 count, u32 chunkSize)
+{
+    if (count <= chunkSize || globalJobs.threadCount < 2)
+    {
+        function(data, 0, count);
+        return;
+    }
+    
+    JobCounter counter = {0};
+    run_parallel_for(function, data, count, chunkSize, &counter);
+    wait_for_counter(&counter);
+}
\ No newline at end of file
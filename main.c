@@ -7,39 +7,506 @@
 #include <vulkan\vulkan_win32.h>
 
 #include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 4-wide SIMD for the transform hierarchy, see transforms.c
+#if defined(_M_ARM64) || defined(__aarch64__)
+#include <arm_neon.h>
+#else
+#include <immintrin.h>
+#endif
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
 typedef int32_t s32;
 
 typedef float f32;
+typedef double f64;
 
 #define array_count(array) (sizeof(array) / sizeof((array)[0]))
 
+// Compiles the validation layer and debug utils support in or out. On unless
+// building with -DNDEBUG or -DVULKAN_VALIDATION=0 (build.bat release)
+#ifndef VULKAN_VALIDATION
+#ifdef NDEBUG
+#define VULKAN_VALIDATION 0
+#else
+#define VULKAN_VALIDATION 1
+#endif
+#endif
+
+// CPU and GPU profiling scopes, see profiler.c. -DPROFILER=0 compiles them
+// out, debug labels included
+#ifndef PROFILER
+#define PROFILER 1
+#endif
+
+// Vulkan handles are 64-bit integers or pointers depending on the platform
+#define handle_to_u64(handle) ((u64)(uintptr_t)(handle))
+#define u64_to_handle(type, value) ((type)(uintptr_t)(value))
+
+// 64-bit FNV-1a, pass the previous result as seed to hash several buffers
+#define HASH_SEED 0xcbf29ce484222325ull
+
+u64
+hash_bytes(u64 hash, void *data, size_t size)
+{
+    u8 *bytes = (u8 *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    
+    return hash;
+}
+
+u64
+hash_string(u64 hash, char *string)
+{
+    // Including the terminator keeps "ab" + "c" apart from "a" + "bc"
+    return hash_bytes(hash, string, strlen(string) + 1);
+}
+
+void
+debug_printf(char *format, ...)
+{
+    char buffer[1024];
+    
+    va_list args;
+    va_start(args, format);
+    vsprintf_s(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    
+    OutputDebugString(buffer);
+}
+
+#include "vector_math.c"
+#include "memory.c"
+
+/*
+*  Startup timing
+*/
+
+typedef struct
+{
+    char *name;
+    u64 begin;
+    u64 end;
+    u32 threadId;
+    
+} StartupStage;
+
+typedef struct
+{
+    u64 frequency;
+    u64 winMainStart;
+    f32 processStartToWinMainMs;
+    
+    volatile LONG stageCount;
+    StartupStage stages[32];
+    
+} StartupTimings;
+
+static StartupTimings globalStartup;
+
+u64
+get_ticks(void)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+f32
+ticks_to_ms(u64 ticks)
+{
+    return (f32)((f64)ticks * 1000.0 / (f64)globalStartup.frequency);
+}
+
+void
+startup_timing_init(void)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    globalStartup.frequency = frequency.QuadPart;
+    globalStartup.winMainStart = get_ticks();
+    
+    // Time spent in the loader and CRT before WinMain, from the process
+    // creation time the kernel recorded (100ns units)
+    FILETIME creationTime, exitTime, kernelTime, userTime, now;
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime,
+                    &kernelTime, &userTime);
+    GetSystemTimePreciseAsFileTime(&now);
+    
+    ULARGE_INTEGER created = { creationTime.dwLowDateTime,
+                               creationTime.dwHighDateTime };
+    ULARGE_INTEGER current = { now.dwLowDateTime, now.dwHighDateTime };
+    globalStartup.processStartToWinMainMs =
+        (f32)(current.QuadPart - created.QuadPart) / 10000.0f;
+}
+
+// Thread safe, stages can be timed from the loader threads as well
+u32
+startup_begin(char *name)
+{
+    u32 index = (u32)InterlockedIncrement(&globalStartup.stageCount) - 1;
+    assert(index < array_count(globalStartup.stages));
+    
+    StartupStage *stage = &globalStartup.stages[index];
+    stage->name = name;
+    stage->threadId = GetCurrentThreadId();
+    stage->begin = get_ticks();
+    
+    return index;
+}
+
+void
+startup_end(u32 index)
+{
+    globalStartup.stages[index].end = get_ticks();
+}
+
+void
+report_startup_timings(void)
+{
+    u64 firstFrame = get_ticks();
+    u32 mainThreadId = GetCurrentThreadId();
+    
+    debug_printf("Startup: %.2f ms from process start to WinMain\n",
+                 globalStartup.processStartToWinMainMs);
+    
+    u32 stageCount = (u32)globalStartup.stageCount;
+    for (u32 i = 0; i < stageCount; i++)
+    {
+        StartupStage *stage = &globalStartup.stages[i];
+        debug_printf("Startup: %-24s +%8.2f ms %8.2f ms %s\n", stage->name,
+                     ticks_to_ms(stage->begin - globalStartup.winMainStart),
+                     ticks_to_ms(stage->end - stage->begin),
+                     stage->threadId == mainThreadId ? "" : "(worker)");
+    }
+    
+    f32 winMainToFirstFrame =
+        ticks_to_ms(firstFrame - globalStartup.winMainStart);
+    
+    debug_printf("Startup: time to first frame %.2f ms (%.2f ms in WinMain)\n",
+                 globalStartup.processStartToWinMainMs + winMainToFirstFrame,
+                 winMainToFirstFrame);
+}
+
+/*
+*  Command line and environment configuration
+*/
+
+typedef enum
+{
+    ValidationLevel_Off,
+    ValidationLevel_On,
+    ValidationLevel_Verbose,
+    
+} ValidationLevel;
+
+typedef enum
+{
+    VertexQuantization_Off, // 24 bytes, f32 positions and normals
+    VertexQuantization_Normal8, // 8 bytes, 2x8-bit octahedral normals
+    VertexQuantization_Normal16, // 12 bytes, 2x16-bit octahedral normals
+    
+} VertexQuantization;
+
+typedef struct
+{
+    // Pins the physical device by index, name substring or UUID, e.g.
+    // --device=1, --device=llvmpipe or --device=6a1f...e0
+    char device[256];
+    
+    // --pacing=off runs frames as fast as FIFO allows
+    bool pacing;
+    
+    // --latency-log prints the latency of every frame
+    bool logLatency;
+    
+    // --validation=off|on|verbose, on reports warnings and errors
+    ValidationLevel validation;
+    
+    // --debug-utils enables VK_EXT_debug_utils without the validation layer,
+    // e.g. for captures in RenderDoc. Always on with validation.
+    bool debugUtils;
+    
+    // --lights=N point and spot lights in the scene, up to MAX_LIGHTS
+    u32 lightCount;
+    
+    // --msaa=1|2|4|8 samples per pixel, lowered to what the device supports
+    u32 msaaSamples;
+    
+    // --prepass=off draws the scene without the depth prepass
+    bool depthPrepass;
+    
+    // --occlusion=off draws every scene object in the frustum instead of
+    // culling the occluded ones against a Hi-Z pyramid. Needs the prepass.
+    bool occlusionCulling;
+    
+    // --mesh-shaders=off culls and draws meshlets with compute and indirect
+    // draws even where VK_EXT_mesh_shader is supported
+    bool meshShaders;
+    
+    // --sprites=N sprites bouncing over the scene, up to MAX_SPRITES
+    u32 spriteCount;
+    
+    // --transform-nodes=N updates a spinning hierarchy of N nodes every
+    // frame, as a benchmark of the transform update. Off by default.
+    u32 transformNodes;
+    
+    // --quantized-vertices=off|8|16 stores the scene's positions as 16-bit
+    // fractions of each mesh's bounds and its normals octahedral encoded in
+    // 2x8 or 2x16 bits. 8 by default.
+    VertexQuantization vertexQuantization;
+    
+} VulkanConfig;
+
+// Copies the value of "--name=value" from the command line, falling back to
+// the environment variable envName. Values may be quoted to contain spaces.
+bool
+get_config_value(char *cmdLine, char *name, char *envName,
+                 char *value, u32 valueSize)
+{
+    char prefix[64];
+    sprintf_s(prefix, sizeof(prefix), "--%s=", name);
+    
+    char *at = cmdLine ? strstr(cmdLine, prefix) : NULL;
+    if (at)
+    {
+        at += strlen(prefix);
+        
+        char terminator = ' ';
+        if (*at == '"')
+        {
+            terminator = '"';
+            at++;
+        }
+        
+        u32 length = 0;
+        while (at[length] && at[length] != terminator &&
+               length + 1 < valueSize)
+        {
+            value[length] = at[length];
+            length++;
+        }
+        value[length] = 0;
+        
+        return true;
+    }
+    
+    DWORD length = GetEnvironmentVariable(envName, value, valueSize);
+    return length > 0 && length < valueSize;
+}
+
+// True if "--name" is on the command line or the environment variable
+// envName is set to anything but 0
+bool
+get_config_flag(char *cmdLine, char *name, char *envName)
+{
+    char flag[64];
+    sprintf_s(flag, sizeof(flag), "--%s", name);
+    
+    char *at = cmdLine ? strstr(cmdLine, flag) : NULL;
+    if (at && (at[strlen(flag)] == ' ' || at[strlen(flag)] == 0))
+    {
+        return true;
+    }
+    
+    char value[16];
+    DWORD length = GetEnvironmentVariable(envName, value, sizeof(value));
+    return length > 0 && length < sizeof(value) && strcmp(value, "0") != 0;
+}
+
+VulkanConfig
+parse_config(char *cmdLine)
+{
+    VulkanConfig config = {0};
+    
+    get_config_value(cmdLine, "device", "VULKAN_APP_DEVICE",
+                     config.device, sizeof(config.device));
+    
+    char pacing[16] = {0};
+    get_config_value(cmdLine, "pacing", "VULKAN_APP_PACING",
+                     pacing, sizeof(pacing));
+    config.pacing = strcmp(pacing, "off") != 0;
+    
+    config.logLatency = get_config_flag(cmdLine, "latency-log",
+                                        "VULKAN_APP_LATENCY_LOG");
+    
+    char validation[16] = {0};
+    get_config_value(cmdLine, "validation", "VULKAN_APP_VALIDATION",
+                     validation, sizeof(validation));
+    
+    config.validation = ValidationLevel_On;
+    if (strcmp(validation, "off") == 0)
+    {
+        config.validation = ValidationLevel_Off;
+    }
+    else if (strcmp(validation, "verbose") == 0)
+    {
+        config.validation = ValidationLevel_Verbose;
+    }
+    
+    if (!VULKAN_VALIDATION)
+    {
+        config.validation = ValidationLevel_Off;
+    }
+    
+    config.debugUtils = config.validation != ValidationLevel_Off ||
+        get_config_flag(cmdLine, "debug-utils", "VULKAN_APP_DEBUG_UTILS");
+    
+    char lights[16] = {0};
+    config.lightCount = 2048;
+    if (get_config_value(cmdLine, "lights", "VULKAN_APP_LIGHTS",
+                         lights, sizeof(lights)))
+    {
+        config.lightCount = (u32)strtoul(lights, NULL, 10);
+    }
+    
+    char msaa[16] = {0};
+    config.msaaSamples = 4;
+    if (get_config_value(cmdLine, "msaa", "VULKAN_APP_MSAA",
+                         msaa, sizeof(msaa)))
+    {
+        config.msaaSamples = (u32)strtoul(msaa, NULL, 10);
+    }
+    
+    char prepass[16] = {0};
+    get_config_value(cmdLine, "prepass", "VULKAN_APP_PREPASS",
+                     prepass, sizeof(prepass));
+    config.depthPrepass = strcmp(prepass, "off") != 0;
+    
+    char occlusion[16] = {0};
+    get_config_value(cmdLine, "occlusion", "VULKAN_APP_OCCLUSION",
+                     occlusion, sizeof(occlusion));
+    config.occlusionCulling = strcmp(occlusion, "off") != 0 &&
+        config.depthPrepass;
+    
+    char meshShaders[16] = {0};
+    get_config_value(cmdLine, "mesh-shaders", "VULKAN_APP_MESH_SHADERS",
+                     meshShaders, sizeof(meshShaders));
+    config.meshShaders = strcmp(meshShaders, "off") != 0;
+    
+    char sprites[16] = {0};
+    config.spriteCount = 10000;
+    if (get_config_value(cmdLine, "sprites", "VULKAN_APP_SPRITES",
+                         sprites, sizeof(sprites)))
+    {
+        config.spriteCount = (u32)strtoul(sprites, NULL, 10);
+    }
+    
+    char transformNodes[16] = {0};
+    if (get_config_value(cmdLine, "transform-nodes",
+                         "VULKAN_APP_TRANSFORM_NODES", transformNodes,
+                         sizeof(transformNodes)))
+    {
+        config.transformNodes = (u32)strtoul(transformNodes, NULL, 10);
+    }
+    
+    char quantization[16] = {0};
+    get_config_value(cmdLine, "quantized-vertices",
+                     "VULKAN_APP_QUANTIZED_VERTICES", quantization,
+                     sizeof(quantization));
+    
+    config.vertexQuantization = VertexQuantization_Normal8;
+    if (strcmp(quantization, "off") == 0)
+    {
+        config.vertexQuantization = VertexQuantization_Off;
+    }
+    else if (strcmp(quantization, "16") == 0)
+    {
+        config.vertexQuantization = VertexQuantization_Normal16;
+    }
+    
+    return config;
+}
+
 /*
 *  VulkanContext struct
 */
 
+#define MAX_SWAPCHAIN_IMAGES 4
+
 typedef struct
 {
+    VulkanConfig *config;
     HWND window;
     VkInstance instance;
+    bool hasValidation; // VK_LAYER_KHRONOS_validation is enabled
+    bool hasDebugUtils; // VK_EXT_debug_utils is enabled
+    VkDebugUtilsMessengerEXT debugMessenger;
+    PFN_vkSetDebugUtilsObjectNameEXT vkSetDebugUtilsObjectNameEXT;
+    PFN_vkCmdBeginDebugUtilsLabelEXT vkCmdBeginDebugUtilsLabelEXT;
+    PFN_vkCmdEndDebugUtilsLabelEXT vkCmdEndDebugUtilsLabelEXT;
     VkSurfaceKHR surface;
     VkPhysicalDevice physicalDevice;
+    VkPhysicalDeviceProperties physicalDeviceProperties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkPhysicalDeviceFeatures enabledFeatures;
+    VkPhysicalDeviceVulkan12Features enabledFeatures12;
+    char *enabledDeviceExtensions[16];
+    u32 enabledDeviceExtensionCount;
+    bool hasPresentWait; // VK_KHR_present_id and VK_KHR_present_wait
+    bool hasMeshShader; // VK_EXT_mesh_shader with task and mesh shaders
+    PFN_vkCmdDrawMeshTasksEXT vkCmdDrawMeshTasksEXT;
     VkDevice device;
     u32 graphicsAndPresentQueueFamily;
     VkQueue graphicsAndPresentQueue;
     VkSwapchainKHR swapchain;
     VkFormat swapchainImageFormat;
-    VkImage swapchainImages[2];
-    VkImageView swapchainImageViews[2];
+    u32 swapchainImageCount;
+    VkImage swapchainImages[MAX_SWAPCHAIN_IMAGES];
+    VkImageView swapchainImageViews[MAX_SWAPCHAIN_IMAGES];
     VkExtent2D swapchainExtents;
     
 } VulkanContext;
 
+/* Names show up in validation messages and in capture tools like RenderDoc,
+   where they match the names in our own profiler output. Does nothing without
+   VK_EXT_debug_utils. */
+void
+set_object_name(VulkanContext *vk, VkObjectType type, u64 handle,
+                char *format, ...)
+{
+    if (!vk->vkSetDebugUtilsObjectNameEXT || !handle)
+    {
+        return;
+    }
+    
+    char name[256];
+    
+    va_list args;
+    va_start(args, format);
+    vsprintf_s(name, sizeof(name), format, args);
+    va_end(args);
+    
+    VkDebugUtilsObjectNameInfoEXT nameInfo =
+    {
+        VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT,
+        NULL,
+        type,
+        handle,
+        name
+    };
+    
+    vk->vkSetDebugUtilsObjectNameEXT(vk->device, &nameInfo);
+}
+
 /*
 *  File loading utility
 */
@@ -51,22 +518,31 @@ typedef struct
     
 } LoadedFile;
 
+// Returns an empty LoadedFile if the file doesn't exist, callers that need
+// the file assert on the size. The data is pushed on arena, or allocated on
+// the heap when arena is NULL.
 LoadedFile
-load_entire_file(char *fileName)
+load_entire_file(char *fileName, Arena *arena)
 {
     LoadedFile result = {NULL};
     
     FILE *handle;
-    fopen_s(&handle, fileName, "rb");
-    assert(handle);
+    if (fopen_s(&handle, fileName, "rb") != 0)
+    {
+        return result;
+    }
     
     fseek(handle, 0, SEEK_END);
     result.size = ftell(handle);
     fseek(handle, 0, SEEK_SET);
     
-    assert(result.size > 0);
+    if (result.size == 0)
+    {
+        fclose(handle);
+        return result;
+    }
     
-    result.data = malloc(result.size);
+    result.data = arena_push_or_heap(arena, result.size);
     assert(result.data);
     
     size_t bytesRead = fread(result.data, 1, result.size, handle);
@@ -77,12 +553,48 @@ load_entire_file(char *fileName)
     return result;
 }
 
+// Writes a temporary file next to fileName and moves it over fileName once
+// it's complete, so a crash or a full disk never leaves a truncated file.
+// The temporary file is the thread's own, two threads can write the same
+// file at once.
+bool
+write_entire_file(char *fileName, void *data, size_t size)
+{
+    char tempName[MAX_PATH];
+    sprintf_s(tempName, sizeof(tempName), "%s.%lu.tmp", fileName,
+              GetCurrentThreadId());
+    
+    FILE *handle;
+    if (fopen_s(&handle, tempName, "wb") != 0)
+    {
+        return false;
+    }
+    
+    size_t bytesWritten = fwrite(data, 1, size, handle);
+    bool written = fclose(handle) == 0 && bytesWritten == size;
+    
+    if (!written ||
+        !MoveFileEx(tempName, fileName, MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFile(tempName);
+        return false;
+    }
+    
+    return true;
+}
+
 /*
 *  globalRunning and WindowProc
 */
 
 static bool globalRunning;
 
+// Pressing V cycles through the scene's debug views
+static u32 globalVariantIndex;
+
+// Pressing B shows the scene's bounds and freezes the camera's frustum
+static bool globalShowBounds;
+
 LRESULT CALLBACK
 vulkan_window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
 {
@@ -93,42 +605,823 @@ vulkan_window_proc(HWND window, UINT message, WPARAM wparam, LPARAM lparam)
             OutputDebugString("Window created\n");
         } break;
         
-        case WM_SIZE: 
+        case WM_SIZE: 
+        {
+            OutputDebugString("Window resized\n");
+        } break;
+        
+        case WM_KEYDOWN:
+        {
+            if (wparam == 'V')
+            {
+                globalVariantIndex++;
+            }
+            else if (wparam == 'B')
+            {
+                globalShowBounds = !globalShowBounds;
+            }
+        } break;
+        
+        case WM_CLOSE:
+        case WM_DESTROY:
+        {
+            globalRunning = false;
+        } break;
+        
+        default:
+        {
+            return DefWindowProc(window, message, wparam, lparam);
+        } break;
+    }
+    
+    return 0;
+}
+
+#include "validation_log.c"
+
+/*
+*  Physical device scoring and selection
+*/
+
+// Device extensions the app cannot run without
+static char *requiredDeviceExtensions[] =
+{
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME
+};
+
+typedef struct
+{
+    char *name;
+    u32 score; // added when the extension is supported
+    
+} DeviceExtensionRequest;
+
+// Device extensions the app uses when they are available
+static DeviceExtensionRequest optionalDeviceExtensions[] =
+{
+    { VK_KHR_PRESENT_ID_EXTENSION_NAME, 250 },
+    { VK_KHR_PRESENT_WAIT_EXTENSION_NAME, 250 },
+    { VK_EXT_MESH_SHADER_EXTENSION_NAME, 500 },
+};
+
+typedef struct
+{
+    char *name;
+    size_t offset; // into VkPhysicalDeviceFeatures
+    bool required;
+    u32 score; // added when the feature is supported
+    
+} DeviceFeatureRequest;
+
+#define device_feature(name, required, score) \
+{ #name, offsetof(VkPhysicalDeviceFeatures, name), required, score }
+
+#define device_feature12(name, required, score) \
+{ #name, offsetof(VkPhysicalDeviceVulkan12Features, name), required, score }
+
+// Supported features in this table are enabled on the logical device
+static DeviceFeatureRequest deviceFeatureRequests[] =
+{
+    device_feature(samplerAnisotropy, false, 500),
+    device_feature(fillModeNonSolid, false, 250),
+    device_feature(multiDrawIndirect, false, 1000),
+    device_feature(drawIndirectFirstInstance, false, 500),
+    device_feature(pipelineStatisticsQuery, false, 500),
+};
+
+// The same for VkPhysicalDeviceVulkan12Features
+static DeviceFeatureRequest deviceFeature12Requests[] =
+{
+    device_feature12(timelineSemaphore, true, 0),
+    device_feature12(hostQueryReset, true, 0),
+    device_feature12(drawIndirectCount, false, 500),
+    device_feature12(runtimeDescriptorArray, false, 250),
+    device_feature12(shaderSampledImageArrayNonUniformIndexing, false, 250),
+    device_feature12(descriptorBindingPartiallyBound, false, 250),
+};
+
+typedef struct
+{
+    VkPhysicalDevice device;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    VkPhysicalDeviceFeatures features;
+    VkPhysicalDeviceVulkan12Features features12;
+    u8 uuid[VK_UUID_SIZE];
+    u32 graphicsAndPresentQueueFamily;
+    u64 deviceLocalBytes;
+    bool suitable;
+    char *unsuitableReason;
+    u64 score;
+    
+} PhysicalDeviceCandidate;
+
+bool
+has_extension(VkExtensionProperties *extensions, u32 extensionCount,
+              char *name)
+{
+    for (u32 i = 0; i < extensionCount; i++)
+    {
+        if (strcmp(extensions[i].extensionName, name) == 0)
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+void
+format_uuid(u8 *uuid, char *buffer, u32 bufferSize)
+{
+    // 8-4-4-4-12 hex digits, the same format vulkaninfo prints
+    u32 at = 0;
+    for (u32 i = 0; i < VK_UUID_SIZE && at + 3 < bufferSize; i++)
+    {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+        {
+            buffer[at++] = '-';
+        }
+        sprintf_s(buffer + at, bufferSize - at, "%02x", uuid[i]);
+        at += 2;
+    }
+    buffer[at] = 0;
+}
+
+void
+score_feature_requests(PhysicalDeviceCandidate *candidate,
+                       DeviceFeatureRequest *requests, u32 requestCount,
+                       void *features)
+{
+    for (u32 i = 0; i < requestCount; i++)
+    {
+        DeviceFeatureRequest *request = &requests[i];
+        VkBool32 supported = *(VkBool32 *)((u8 *)features + request->offset);
+        
+        if (supported)
+        {
+            candidate->score += request->score;
+        }
+        else if (request->required)
+        {
+            candidate->suitable = false;
+            candidate->unsuitableReason = request->name;
+        }
+    }
+}
+
+PhysicalDeviceCandidate
+score_physical_device(VkPhysicalDevice device, VkSurfaceKHR surface)
+{
+    PhysicalDeviceCandidate result = {0};
+    result.device = device;
+    result.suitable = true;
+    result.graphicsAndPresentQueueFamily = UINT32_MAX;
+    
+    vkGetPhysicalDeviceProperties(device, &result.properties);
+    vkGetPhysicalDeviceMemoryProperties(device, &result.memoryProperties);
+    vkGetPhysicalDeviceFeatures(device, &result.features);
+    
+    // The device UUID is stable across runs and machines with the same driver
+    if (result.properties.apiVersion >= VK_API_VERSION_1_1)
+    {
+        VkPhysicalDeviceIDProperties idProperties =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES
+        };
+        
+        VkPhysicalDeviceProperties2 properties2 =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            &idProperties
+        };
+        
+        vkGetPhysicalDeviceProperties2(device, &properties2);
+        memcpy(result.uuid, idProperties.deviceUUID, VK_UUID_SIZE);
+    }
+    
+    /*
+    *  Device type and memory
+    */
+    
+    switch (result.properties.deviceType)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        {
+            result.score += 1000000;
+        } break;
+        
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        {
+            result.score += 500000;
+        } break;
+        
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        {
+            result.score += 200000;
+        } break;
+        
+        case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        {
+            result.score += 100000;
+        } break;
+        
+        default: break;
+    }
+    
+    for (u32 i = 0; i < result.memoryProperties.memoryHeapCount; i++)
+    {
+        VkMemoryHeap heap = result.memoryProperties.memoryHeaps[i];
+        if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+        {
+            result.deviceLocalBytes += heap.size;
+        }
+    }
+    
+    // One point per MB of device local memory (capped so that memory never
+    // outweighs the device type)
+    u64 deviceLocalMB = result.deviceLocalBytes / (1024 * 1024);
+    result.score += deviceLocalMB < 64 * 1024 ? deviceLocalMB : 64 * 1024;
+    
+    /*
+    *  Features
+    */
+    
+    score_feature_requests(&result, deviceFeatureRequests,
+                           array_count(deviceFeatureRequests),
+                           &result.features);
+    
+    // Frame synchronization is built on timeline semaphores, core in 1.2
+    if (result.properties.apiVersion >= VK_API_VERSION_1_2)
+    {
+        result.features12.sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        
+        VkPhysicalDeviceFeatures2 features2 =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            &result.features12
+        };
+        
+        vkGetPhysicalDeviceFeatures2(device, &features2);
+        result.features12.pNext = NULL;
+        
+        score_feature_requests(&result, deviceFeature12Requests,
+                               array_count(deviceFeature12Requests),
+                               &result.features12);
+    }
+    else
+    {
+        result.suitable = false;
+        result.unsuitableReason = "Vulkan 1.2";
+    }
+    
+    if (result.properties.limits.timestampComputeAndGraphics)
+    {
+        result.score += 500;
+    }
+    
+    /*
+    *  Extensions
+    */
+    
+    u32 extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &extensionCount, NULL);
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    VkExtensionProperties *extensions =
+        push_array(scratch, VkExtensionProperties, extensionCount);
+    assert(extensions || extensionCount == 0);
+    vkEnumerateDeviceExtensionProperties(device, NULL, &extensionCount,
+                                         extensions);
+    
+    for (u32 i = 0; i < array_count(requiredDeviceExtensions); i++)
+    {
+        if (!has_extension(extensions, extensionCount,
+                           requiredDeviceExtensions[i]))
+        {
+            result.suitable = false;
+            result.unsuitableReason = requiredDeviceExtensions[i];
+        }
+    }
+    
+    for (u32 i = 0; i < array_count(optionalDeviceExtensions); i++)
+    {
+        if (has_extension(extensions, extensionCount,
+                          optionalDeviceExtensions[i].name))
+        {
+            result.score += optionalDeviceExtensions[i].score;
+        }
+    }
+    
+    arena_restore(scratch, scratchMark);
+    
+    /*
+    *  Queue topology
+    */
+    
+    u32 queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+    
+    VkQueueFamilyProperties *queueFamilies =
+        push_array(scratch, VkQueueFamilyProperties, queueFamilyCount);
+    assert(queueFamilies || queueFamilyCount == 0);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             queueFamilies);
+    
+    bool hasAsyncCompute = false;
+    bool hasDedicatedTransfer = false;
+    
+    for (u32 i = 0; i < queueFamilyCount; i++)
+    {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        
+        VkBool32 presentSupport = VK_FALSE;
+        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                             &presentSupport);
+        
+        // We render and present from a single queue, so take the first
+        // family that can do both
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) && presentSupport &&
+            result.graphicsAndPresentQueueFamily == UINT32_MAX)
+        {
+            result.graphicsAndPresentQueueFamily = i;
+        }
+        
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT))
+        {
+            hasAsyncCompute = true;
+        }
+        
+        if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+        {
+            hasDedicatedTransfer = true;
+        }
+    }
+    
+    arena_restore(scratch, scratchMark);
+    
+    if (result.graphicsAndPresentQueueFamily == UINT32_MAX)
+    {
+        result.suitable = false;
+        result.unsuitableReason = "no graphics and present queue family";
+    }
+    
+    result.score += hasAsyncCompute ? 2000 : 0;
+    result.score += hasDedicatedTransfer ? 1000 : 0;
+    
+    /*
+    *  Surface support
+    */
+    
+    u32 formatCount = 0;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, NULL);
+    
+    u32 presentModeCount = 0;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface,
+                                              &presentModeCount, NULL);
+    
+    if (formatCount == 0 || presentModeCount == 0)
+    {
+        result.suitable = false;
+        result.unsuitableReason = "no surface formats or present modes";
+    }
+    
+    return result;
+}
+
+bool
+device_matches_override(PhysicalDeviceCandidate *candidate, u32 index,
+                        char *override)
+{
+    // Index, e.g. --device=1
+    bool isNumber = override[0] != 0;
+    for (char *at = override; *at; at++)
+    {
+        if (*at < '0' || *at > '9')
+        {
+            isNumber = false;
+        }
+    }
+    
+    if (isNumber)
+    {
+        return (u32)atoi(override) == index;
+    }
+    
+    // UUID, dashes and case are ignored
+    char uuid[64];
+    format_uuid(candidate->uuid, uuid, sizeof(uuid));
+    
+    char *a = uuid;
+    char *b = override;
+    while (*a && *b)
+    {
+        if (*a == '-') { a++; continue; }
+        if (*b == '-') { b++; continue; }
+        
+        char lower = (*b >= 'A' && *b <= 'F') ? (char)(*b - 'A' + 'a') : *b;
+        if (*a != lower)
+        {
+            break;
+        }
+        
+        a++;
+        b++;
+    }
+    
+    if (*a == 0 && *b == 0)
+    {
+        return true;
+    }
+    
+    // Case insensitive device name substring, e.g. --device=llvmpipe
+    char name[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE];
+    char needle[256];
+    strcpy_s(name, sizeof(name), candidate->properties.deviceName);
+    strcpy_s(needle, sizeof(needle), override);
+    _strlwr_s(name, sizeof(name));
+    _strlwr_s(needle, sizeof(needle));
+    
+    return strstr(name, needle) != NULL;
+}
+
+void
+vulkan_pick_physical_device(VulkanContext *vk, VulkanConfig *config)
+{
+    u32 deviceCount = 0;
+    vkEnumeratePhysicalDevices(vk->instance, &deviceCount, NULL);
+    assert(deviceCount > 0 && "No Vulkan devices found");
+    
+    // Rating the devices uses the scratch arena as well, above these
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    VkPhysicalDevice *devices = push_array(scratch, VkPhysicalDevice,
+                                           deviceCount);
+    PhysicalDeviceCandidate *candidates =
+        push_array(scratch, PhysicalDeviceCandidate, deviceCount);
+    assert(devices && candidates);
+    
+    vkEnumeratePhysicalDevices(vk->instance, &deviceCount, devices);
+    
+    PhysicalDeviceCandidate *chosen = NULL;
+    bool hasOverride = config->device[0] != 0;
+    
+    for (u32 i = 0; i < deviceCount; i++)
+    {
+        PhysicalDeviceCandidate *candidate = &candidates[i];
+        *candidate = score_physical_device(devices[i], vk->surface);
+        
+        char uuid[64];
+        format_uuid(candidate->uuid, uuid, sizeof(uuid));
+        
+        debug_printf("Vulkan device %u: %s [%s] score %llu%s%s\n", i,
+                     candidate->properties.deviceName, uuid, candidate->score,
+                     candidate->suitable ? "" : ", unsuitable: ",
+                     candidate->suitable ? "" : candidate->unsuitableReason);
+        
+        if (hasOverride)
+        {
+            // The first match wins so that benchmark runs are repeatable
+            if (!chosen &&
+                device_matches_override(candidate, i, config->device))
+            {
+                chosen = candidate;
+            }
+        }
+        else if (candidate->suitable &&
+                 (!chosen || candidate->score > chosen->score))
+        {
+            chosen = candidate;
+        }
+    }
+    
+    if (hasOverride)
+    {
+        assert(chosen && "No Vulkan device matches the --device override");
+        assert(chosen->suitable && "The overridden Vulkan device is unsuitable");
+    }
+    assert(chosen && "No suitable Vulkan device found");
+    
+    vk->physicalDevice = chosen->device;
+    vk->physicalDeviceProperties = chosen->properties;
+    vk->memoryProperties = chosen->memoryProperties;
+    vk->graphicsAndPresentQueueFamily = chosen->graphicsAndPresentQueueFamily;
+    
+    // Enable every requested feature the device supports
+    for (u32 i = 0; i < array_count(deviceFeatureRequests); i++)
+    {
+        size_t offset = deviceFeatureRequests[i].offset;
+        *(VkBool32 *)((u8 *)&vk->enabledFeatures + offset) =
+            *(VkBool32 *)((u8 *)&chosen->features + offset);
+    }
+    
+    vk->enabledFeatures12.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    for (u32 i = 0; i < array_count(deviceFeature12Requests); i++)
+    {
+        size_t offset = deviceFeature12Requests[i].offset;
+        *(VkBool32 *)((u8 *)&vk->enabledFeatures12 + offset) =
+            *(VkBool32 *)((u8 *)&chosen->features12 + offset);
+    }
+    
+    /*
+    *  Optional extensions
+    */
+    
+    u32 extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(vk->physicalDevice, NULL,
+                                         &extensionCount, NULL);
+    
+    VkExtensionProperties *extensions =
+        push_array(scratch, VkExtensionProperties, extensionCount);
+    assert(extensions || extensionCount == 0);
+    vkEnumerateDeviceExtensionProperties(vk->physicalDevice, NULL,
+                                         &extensionCount, extensions);
+    
+    for (u32 i = 0; i < array_count(requiredDeviceExtensions); i++)
+    {
+        vk->enabledDeviceExtensions[vk->enabledDeviceExtensionCount++] =
+            requiredDeviceExtensions[i];
+    }
+    
+    // Present wait needs both extensions and both features
+    if (has_extension(extensions, extensionCount,
+                      VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+        has_extension(extensions, extensionCount,
+                      VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+    {
+        VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR
+        };
+        
+        VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+            &presentWaitFeatures
+        };
+        
+        VkPhysicalDeviceFeatures2 features2 =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            &presentIdFeatures
+        };
+        
+        vkGetPhysicalDeviceFeatures2(vk->physicalDevice, &features2);
+        
+        if (presentIdFeatures.presentId && presentWaitFeatures.presentWait)
+        {
+            vk->hasPresentWait = true;
+            vk->enabledDeviceExtensions[vk->enabledDeviceExtensionCount++] =
+                VK_KHR_PRESENT_ID_EXTENSION_NAME;
+            vk->enabledDeviceExtensions[vk->enabledDeviceExtensionCount++] =
+                VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+        }
+    }
+    
+    // Mesh shading needs task shaders as well, the meshlet culling runs in
+    // them
+    if (config->meshShaders &&
+        has_extension(extensions, extensionCount,
+                      VK_EXT_MESH_SHADER_EXTENSION_NAME))
+    {
+        VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT
+        };
+        
+        VkPhysicalDeviceFeatures2 features2 =
+        {
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            &meshShaderFeatures
+        };
+        
+        vkGetPhysicalDeviceFeatures2(vk->physicalDevice, &features2);
+        
+        if (meshShaderFeatures.taskShader && meshShaderFeatures.meshShader)
+        {
+            vk->hasMeshShader = true;
+            vk->enabledDeviceExtensions[vk->enabledDeviceExtensionCount++] =
+                VK_EXT_MESH_SHADER_EXTENSION_NAME;
+        }
+    }
+    
+    assert(vk->enabledDeviceExtensionCount <=
+           array_count(vk->enabledDeviceExtensions));
+    
+    u32 driverVersion = chosen->properties.driverVersion;
+    debug_printf("Using Vulkan device %u: %s (driver 0x%08x, %llu MB local)\n",
+                 (u32)(chosen - candidates), chosen->properties.deviceName,
+                 driverVersion, chosen->deviceLocalBytes / (1024 * 1024));
+    
+    arena_restore(scratch, scratchMark);
+}
+
+/*
+*  Vulkan Instance creation
+*/
+
+/* Creating the instance loads the Vulkan loader, the layers and every ICD's
+   manifest, which is the slowest part of startup and doesn't depend on the
+   window. win32_init_vulkan runs this on a worker thread while it creates the
+   window on the main thread. */
+DWORD WINAPI
+vulkan_create_instance(LPVOID param)
+{
+    VulkanContext *vk = (VulkanContext *)param;
+    u32 stage = startup_begin("Create instance");
+    
+    /*
+    *  Set up enabled layers and extensions
+    */
+    
+    VulkanConfig *config = vk->config;
+    
+    char *enabledLayers[1];
+    u32 enabledLayerCount = 0;
+    
+    char *extensions[3] =
+    {
+        // These defines are used instead of raw strings for future compatibility
+        VK_KHR_SURFACE_EXTENSION_NAME, // "VK_KHR_surface"
+        VK_KHR_WIN32_SURFACE_EXTENSION_NAME, // "VK_KHR_win32_surface"
+    };
+    u32 extensionCount = 2;
+
+#if VULKAN_VALIDATION
+    if (config->validation != ValidationLevel_Off)
+    {
+        // Query available instance layers
+        u32 propertyCount = 0;
+        vkEnumerateInstanceLayerProperties(&propertyCount, NULL);
+        
+        Arena *scratch = get_scratch_arena();
+        u64 scratchMark = arena_mark(scratch);
+        
+        VkLayerProperties *layerProperties =
+            push_array(scratch, VkLayerProperties, propertyCount);
+        assert(layerProperties || propertyCount == 0);
+        vkEnumerateInstanceLayerProperties(&propertyCount, layerProperties);
+        
+        char *validationLayerName = "VK_LAYER_KHRONOS_validation";
+        
+        // Check if the requested validation layer is available
+        for (u32 i = 0; i < propertyCount; i++)
+        {
+            if (strcmp(validationLayerName, layerProperties[i].layerName) == 0)
+            {
+                enabledLayers[enabledLayerCount++] = validationLayerName;
+                vk->hasValidation = true;
+                break;
+            }
+        }
+        
+        arena_restore(scratch, scratchMark);
+        
+        // Running without validation beats not running at all
+        if (!vk->hasValidation)
+        {
+            debug_printf("Validation layer not found, running without it\n");
+        }
+    }
+    
+    if (config->debugUtils)
+    {
+        u32 propertyCount = 0;
+        vkEnumerateInstanceExtensionProperties(NULL, &propertyCount, NULL);
+        
+        Arena *scratch = get_scratch_arena();
+        u64 scratchMark = arena_mark(scratch);
+        
+        VkExtensionProperties *extensionProperties =
+            push_array(scratch, VkExtensionProperties, propertyCount);
+        assert(extensionProperties || propertyCount == 0);
+        vkEnumerateInstanceExtensionProperties(NULL, &propertyCount,
+                                               extensionProperties);
+        
+        // The validation layer provides debug utils itself
+        if (vk->hasValidation ||
+            has_extension(extensionProperties, propertyCount,
+                          VK_EXT_DEBUG_UTILS_EXTENSION_NAME))
+        {
+            // "VK_EXT_debug_utils"
+            extensions[extensionCount++] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
+            vk->hasDebugUtils = true;
+        }
+        
+        arena_restore(scratch, scratchMark);
+    }
+#endif
+
+    /*
+    *  Create Vulkan Instance
+    */
+    
+    /* This struct is technically optional, but it's worth adding for a nicer
+       display when inspecting the app with tools like RenderDoc. */
+    VkApplicationInfo appInfo =
+    {
+        VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        NULL,
+        "My Clever App Name",
+        1, // application Version
+        "My Even Cleverer Engine Name",
+        1, // engine Version
+        VK_API_VERSION_1_3
+    };
+    
+    /* This struct is necessary. The main purpose of this is to inform the
+       Vulkan driver about which layers and extensions to load when calling
+       vkCreateInstance. */
+    VkInstanceCreateInfo createInfo =
+    {
+        VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        NULL,
+        0, // flags (this is the only time I'm commenting on this)
+        &appInfo,
+        enabledLayerCount, // layer count
+        enabledLayers, // layers to enable
+        extensionCount, // extension count
+        extensions // extension names
+    };
+    
+    if (vkCreateInstance(&createInfo, NULL,
+                         &vk->instance) != VK_SUCCESS)
+    {
+        assert(!"Failed to create vulkan instance");
+    }
+    
+    /*
+    *  Set up debug callback
+    */
+    
+    // Messages only go to the callback when the validation layer is loaded,
+    // debug utils alone is just for object names and labels
+    if (vk->hasValidation)
+    {
+        VkDebugUtilsMessageSeverityFlagsEXT messageSeverity =
+            VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+            VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+        
+        if (config->validation == ValidationLevel_Verbose)
+        {
+            messageSeverity |= VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
+                VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT;
+        }
+        
+        VkDebugUtilsMessageTypeFlagsEXT messageType =
+            VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+            VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+            VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+        
+        VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo =
         {
-            OutputDebugString("Window resized\n");
-        } break;
+            VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
+            NULL,
+            0,
+            messageSeverity,
+            messageType,
+            vulkan_debug_callback,
+            &globalValidationLog // user data
+        };
         
-        case WM_CLOSE:
-        case WM_DESTROY:
-        {
-            globalRunning = false;
-        } break;
+        // The logger thread has to be running before the first message
+        validation_log_init(&globalValidationLog);
         
-        default:
+        // Load the debug utils extension function
+        PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT =
+        (PFN_vkCreateDebugUtilsMessengerEXT)
+            vkGetInstanceProcAddr(vk->instance,
+                                  "vkCreateDebugUtilsMessengerEXT");
+        
+        if (vkCreateDebugUtilsMessengerEXT(vk->instance, &debugCreateInfo, NULL,
+                                           &vk->debugMessenger) != VK_SUCCESS)
         {
-            return DefWindowProc(window, message, wparam, lparam);
-        } break;
+            assert(!"Failed to create debug messenger!");
+        }
     }
     
-    return 0;
-}
-
-/*
-*  Vulkan Validation layer's Debug Callback
-*/
-
-static VKAPI_ATTR VkBool32 VKAPI_CALL
-vulkan_debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
-                      VkDebugUtilsMessageTypeFlagsEXT messageType,
-                      const VkDebugUtilsMessengerCallbackDataEXT *callbackData,
-                      void *userData)
-{
-    char buffer[4096] = {0};
-    sprintf_s(buffer, sizeof(buffer), "Vulkan Validation layer: %s\n",
-              callbackData->pMessage);
-    OutputDebugString(buffer);
+    // Object names and command buffer labels
+    if (vk->hasDebugUtils)
+    {
+        vk->vkSetDebugUtilsObjectNameEXT = (PFN_vkSetDebugUtilsObjectNameEXT)
+            vkGetInstanceProcAddr(vk->instance,
+                                  "vkSetDebugUtilsObjectNameEXT");
+        vk->vkCmdBeginDebugUtilsLabelEXT = (PFN_vkCmdBeginDebugUtilsLabelEXT)
+            vkGetInstanceProcAddr(vk->instance,
+                                  "vkCmdBeginDebugUtilsLabelEXT");
+        vk->vkCmdEndDebugUtilsLabelEXT = (PFN_vkCmdEndDebugUtilsLabelEXT)
+            vkGetInstanceProcAddr(vk->instance, "vkCmdEndDebugUtilsLabelEXT");
+    }
     
-    return VK_FALSE;
+    startup_end(stage);
+    
+    return 0;
 }
 
 /*
@@ -136,15 +1429,23 @@ vulkan_debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 */
 
 VulkanContext
-win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
-                  u32 windowHeight, char *windowTitle)
+win32_init_vulkan(HINSTANCE instance, VulkanConfig *config, s32 windowX,
+                  s32 windowY, u32 windowWidth, u32 windowHeight,
+                  char *windowTitle)
 {
     VulkanContext vk = {NULL};
+    vk.config = config;
+    
+    HANDLE instanceThread = CreateThread(NULL, 0, vulkan_create_instance, &vk,
+                                         0, NULL);
+    assert(instanceThread);
     
     /*
     *  Create window
     */
     
+    u32 windowStage = startup_begin("Create window");
+    
     // Register window class
     WNDCLASSEX winClass =
     {
@@ -200,121 +1501,18 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
     
     ShowWindow(vk.window, SW_SHOW);
     
-    /*
-    *  Set up enabled layers and extensions
-    */
-    
-    // Query available instance layers
-    u32 propertyCount = 0;
-    vkEnumerateInstanceLayerProperties(&propertyCount, NULL);
-    assert(propertyCount <= 32); // Ensure we don't exceed our fixed-size array
-    
-    VkLayerProperties layerProperties[32];
-    vkEnumerateInstanceLayerProperties(&propertyCount, layerProperties);
-    
-    char *validationLayerName = "VK_LAYER_KHRONOS_validation";
-    
-    // Check if the requested validation layer is available
-    bool validationLayerFound = false;
-    for (u32 i = 0; i < propertyCount; i++)
-    {
-        if (strcmp(validationLayerName, layerProperties[i].layerName) == 0)
-        {
-            validationLayerFound = true;
-            break;
-        }
-    }
-    
-    assert(validationLayerFound && "Validation layer not found!");
-    char *enabledLayers[] = { validationLayerName };
-    
-    char *extensions[] =
-    {
-        // These defines are used instead of raw strings for future compatibility
-        VK_KHR_SURFACE_EXTENSION_NAME, // "VK_KHR_surface"
-        VK_KHR_WIN32_SURFACE_EXTENSION_NAME, // "VK_KHR_win32_surface"
-        VK_EXT_DEBUG_UTILS_EXTENSION_NAME // "VK_EXT_debug_utils"
-    };
-    
-    /*
-    *  Create Vulkan Instance
-    */
-    
-    /* This struct is technically optional, but it's worth adding for a nicer
-       display when inspecting the app with tools like RenderDoc. */
-    VkApplicationInfo appInfo =
-    {
-        VK_STRUCTURE_TYPE_APPLICATION_INFO,
-        NULL,
-        "My Clever App Name",
-        1, // application Version
-        "My Even Cleverer Engine Name",
-        1, // engine Version
-        VK_API_VERSION_1_3
-    };
-    
-    /* This struct is necessary. The main purpose of this is to inform the
-       Vulkan driver about which layers and extensions to load when calling
-       vkCreateInstance. */
-    VkInstanceCreateInfo createInfo =
-    {
-        VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-        NULL,
-        0, // flags (this is the only time I'm commenting on this)
-        &appInfo,
-        array_count(enabledLayers), // layer count
-        enabledLayers, // layers to enable
-        array_count(extensions), // extension count
-        extensions // extension names
-    };
-    
-    if (vkCreateInstance(&createInfo, NULL,
-                         &vk.instance) != VK_SUCCESS)
-    {
-        assert(!"Failed to create vulkan instance");
-    }
-    
-    /*
-    *  Set up debug callback
-    */
-    
-    VkDebugUtilsMessageSeverityFlagsEXT messageSeverity = 
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-    
-    VkDebugUtilsMessageTypeFlagsEXT messageType =
-        VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
-        VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-    
-    VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo =
-    {
-        VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
-        NULL,
-        0,
-        messageSeverity,
-        messageType,
-        vulkan_debug_callback,
-        NULL // user data
-    };
-    
-    // Load the debug utils extension function
-    PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT =
-    (PFN_vkCreateDebugUtilsMessengerEXT)
-        vkGetInstanceProcAddr(vk.instance, "vkCreateDebugUtilsMessengerEXT");
+    startup_end(windowStage);
     
-    VkDebugUtilsMessengerEXT debugMessenger;
-    if (vkCreateDebugUtilsMessengerEXT(vk.instance, &debugCreateInfo, NULL,
-                                       &debugMessenger) != VK_SUCCESS)
-    {
-        assert(!"Failed to create debug messenger!");
-    }
+    // The surface needs both the window and the instance
+    WaitForSingleObject(instanceThread, INFINITE);
+    CloseHandle(instanceThread);
     
     /* 
     *  Create surface
     */
     
+    u32 surfaceStage = startup_begin("Create surface");
+    
     VkWin32SurfaceCreateInfoKHR surfaceCreateInfo =
     {
         VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR,
@@ -330,68 +1528,24 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
         assert(!"Failed to create surface");
     }
     
+    startup_end(surfaceStage);
+    
     /*
     *  Pick a physical device and the graphicsAndPresent queue family
     */
     
-    u32 deviceCount = 0;
-    vkEnumeratePhysicalDevices(vk.instance, &deviceCount, NULL);
-    assert(deviceCount <= 8); // Ensure there are no more than 8 devices
-    
-    VkPhysicalDevice devices[8] = {NULL};
-    vkEnumeratePhysicalDevices(vk.instance, &deviceCount, devices);
-    
-    // Choose the first available device as a fallback
-    vk.physicalDevice = devices[0];
-    
-    // Search for a dedicated GPU (discrete GPU)
-    for (u32 i = 0; i < deviceCount; i++)
-    {
-        VkPhysicalDeviceProperties props;
-        vkGetPhysicalDeviceProperties(devices[i], &props);
-        
-        // If the device is a dedicated (discrete) GPU, prefer it
-        if (props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
-        {
-            // Choose it as the physical device and break the loop
-            vk.physicalDevice = devices[i];
-            break;
-        }
-    }
-    assert(vk.physicalDevice); // Ensure a physical device has been selected
-    
-    // Query the queue family properties for the chosen physical device
-    u32 queueFamilyPropertyCount = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(vk.physicalDevice,
-                                             &queueFamilyPropertyCount, NULL);
-    // Ensure there are no more than 3 queue families
-    assert(queueFamilyPropertyCount <= 3); 
-    
-    VkQueueFamilyProperties queueFamilyProperties[3] = {0};
-    vkGetPhysicalDeviceQueueFamilyProperties(vk.physicalDevice,
-                                             &queueFamilyPropertyCount,
-                                             queueFamilyProperties);
-    
-    // Assume first queue family supports Graphics and Present capabilities
-    u32 queueFamilyIndex = 0;
-    
-    // Ensure the queue family supports graphics
-    assert(queueFamilyProperties[queueFamilyIndex].queueFlags
-           & VK_QUEUE_GRAPHICS_BIT);
+    u32 pickStage = startup_begin("Pick physical device");
     
-    VkBool32 presentSupport = VK_FALSE;
-    vkGetPhysicalDeviceSurfaceSupportKHR(vk.physicalDevice, queueFamilyIndex,
-                                         vk.surface,
-                                         &presentSupport);
-    assert(presentSupport); // Ensure present support is available
+    vulkan_pick_physical_device(&vk, config);
     
-    // Store the queue family index that supports both graphics and present
-    vk.graphicsAndPresentQueueFamily = queueFamilyIndex;
+    startup_end(pickStage);
     
     /*
     *  Create logical device
     */
     
+    u32 deviceStage = startup_begin("Create device");
+    
     f32 queuePriorities[] = { 1.0f };
     VkDeviceQueueCreateInfo queueCreateInfo =
     {
@@ -405,21 +1559,56 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
     
     VkDeviceQueueCreateInfo queueCreateInfos[] = {queueCreateInfo};
     
-    // Enable required device extensions (swapchain)
-    char *deviceExtensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+    // Features of optional extensions are enabled through the pNext chain
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures =
+    {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        NULL,
+        VK_TRUE // presentWait
+    };
+    
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures =
+    {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        &presentWaitFeatures,
+        VK_TRUE // presentId
+    };
+    
+    VkPhysicalDeviceMeshShaderFeaturesEXT meshShaderFeatures =
+    {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MESH_SHADER_FEATURES_EXT,
+        NULL,
+        VK_TRUE, // taskShader
+        VK_TRUE // meshShader
+    };
+    
+    // Core 1.2 features (timeline semaphores) are always chained
+    void *deviceFeatureChain = &vk.enabledFeatures12;
+    if (vk.hasPresentWait)
+    {
+        presentWaitFeatures.pNext = deviceFeatureChain;
+        deviceFeatureChain = &presentIdFeatures;
+    }
+    
+    if (vk.hasMeshShader)
+    {
+        meshShaderFeatures.pNext = deviceFeatureChain;
+        deviceFeatureChain = &meshShaderFeatures;
+    }
     
+    // Required extensions (swapchain) plus the supported optional ones
     VkDeviceCreateInfo deviceCreateInfo =
     {
         VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        NULL,
+        deviceFeatureChain,
         0,
         array_count(queueCreateInfos),
         queueCreateInfos,
         0, // enabledLayerCount deprecated
         NULL, // ppEnabledLayerNames deprecated
-        array_count(deviceExtensions),
-        deviceExtensions,
-        NULL // pEnabledFeatures
+        vk.enabledDeviceExtensionCount,
+        vk.enabledDeviceExtensions,
+        &vk.enabledFeatures
     };
     
     // Create the actual logical device finally
@@ -437,15 +1626,50 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
                      &vk.graphicsAndPresentQueue);
     assert(vk.graphicsAndPresentQueue);
     
+    if (vk.hasMeshShader)
+    {
+        vk.vkCmdDrawMeshTasksEXT = (PFN_vkCmdDrawMeshTasksEXT)
+            vkGetDeviceProcAddr(vk.device, "vkCmdDrawMeshTasksEXT");
+        assert(vk.vkCmdDrawMeshTasksEXT);
+    }
+    
+    // The device exists now, so everything created so far can be named
+    set_object_name(&vk, VK_OBJECT_TYPE_INSTANCE, handle_to_u64(vk.instance),
+                    "Instance");
+    set_object_name(&vk, VK_OBJECT_TYPE_SURFACE_KHR,
+                    handle_to_u64(vk.surface), "Window surface");
+    set_object_name(&vk, VK_OBJECT_TYPE_DEVICE, handle_to_u64(vk.device),
+                    "Device (%s)", vk.physicalDeviceProperties.deviceName);
+    set_object_name(&vk, VK_OBJECT_TYPE_QUEUE,
+                    handle_to_u64(vk.graphicsAndPresentQueue),
+                    "Graphics and present queue");
+    
+    startup_end(deviceStage);
+    
     /*
     *  Create swapchain 
     */
     
+    u32 swapchainStage = startup_begin("Create swapchain");
+    
     // Query surface capabilities
     VkSurfaceCapabilitiesKHR surfaceCapabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk.physicalDevice, vk.surface,
                                               &surfaceCapabilities);
     
+    // Double buffered, unless the surface needs more (maxImageCount 0 means
+    // there is no limit)
+    u32 minImageCount = 2;
+    if (minImageCount < surfaceCapabilities.minImageCount)
+    {
+        minImageCount = surfaceCapabilities.minImageCount;
+    }
+    if (surfaceCapabilities.maxImageCount &&
+        minImageCount > surfaceCapabilities.maxImageCount)
+    {
+        minImageCount = surfaceCapabilities.maxImageCount;
+    }
+    
     // Save the swapchain image format and extents
     vk.swapchainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
     vk.swapchainExtents = surfaceCapabilities.currentExtent;
@@ -456,7 +1680,7 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
         NULL,
         0,
         vk.surface,
-        array_count(vk.swapchainImages), // minImageCount (2)
+        minImageCount,
         vk.swapchainImageFormat,
         VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, // imageColorSpace
         vk.swapchainExtents, // imageExtent
@@ -478,19 +1702,22 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
         assert(!"Failed to create the swapchain");
     }
     
+    set_object_name(&vk, VK_OBJECT_TYPE_SWAPCHAIN_KHR,
+                    handle_to_u64(vk.swapchain), "Swapchain");
+    
     /*
     *  Get swapchain images and create their views
     */
     
-    u32 imageCount = 0;
-    vkGetSwapchainImagesKHR(vk.device, vk.swapchain, &imageCount, NULL);
-    assert(imageCount == array_count(vk.swapchainImages));
+    vkGetSwapchainImagesKHR(vk.device, vk.swapchain, &vk.swapchainImageCount,
+                            NULL);
+    assert(vk.swapchainImageCount <= array_count(vk.swapchainImages));
     
-    vkGetSwapchainImagesKHR(vk.device, vk.swapchain, &imageCount,
+    vkGetSwapchainImagesKHR(vk.device, vk.swapchain, &vk.swapchainImageCount,
                             vk.swapchainImages);
     
     // For each swapchain image
-    for (u32 i = 0; i < imageCount; i++)
+    for (u32 i = 0; i < vk.swapchainImageCount; i++)
     {
         assert(vk.swapchainImages[i]);
         
@@ -528,8 +1755,17 @@ win32_init_vulkan(HINSTANCE instance, s32 windowX, s32 windowY, u32 windowWidth,
                           &vk.swapchainImageViews[i]);
         
         assert(vk.swapchainImageViews[i]);
+        
+        set_object_name(&vk, VK_OBJECT_TYPE_IMAGE,
+                        handle_to_u64(vk.swapchainImages[i]),
+                        "Swapchain image %u", i);
+        set_object_name(&vk, VK_OBJECT_TYPE_IMAGE_VIEW,
+                        handle_to_u64(vk.swapchainImageViews[i]),
+                        "Swapchain image view %u", i);
     }
     
+    startup_end(swapchainStage);
+    
     return vk;
 }
 
@@ -560,6 +1796,139 @@ create_shader_module(VulkanContext *vk, void *code, size_t size)
     return result;
 }
 
+#include "jobs.c"
+#include "compression.c"
+#include "asset_pack.c"
+#include "shaders.c"
+#include "frames.c"
+#include "gpu_memory.c"
+#include "profiler.c"
+#include "transforms.c"
+#include "mesh_optimizer.c"
+#include "scene.c"
+#include "clustered.c"
+#include "sprites.c"
+#include "text.c"
+#include "debug_draw.c"
+#include "pipelines.c"
+#include "meshlets.c"
+#include "occlusion.c"
+#include "frame_pacing.c"
+
+/*
+*  Startup asset loading and pipeline cache
+*/
+
+typedef struct
+{
+    LoadedFile shaderBinaries[ShaderId_Count];
+    LoadedFile pipelineCache;
+    FontAtlas fontAtlas;
+    
+} StartupAssets;
+
+/* Jobs that run on the workers while win32_init_vulkan creates the device,
+   every shader is its own job so a cold shader cache compiles them in
+   parallel */
+void
+load_shaders_job(void *data, u32 first, u32 end)
+{
+    StartupAssets *assets = (StartupAssets *)data;
+    
+    for (u32 i = first; i < end; i++)
+    {
+        assets->shaderBinaries[i] = get_shader_spirv((ShaderId)i,
+                                                     &globalPermanentArena);
+    }
+}
+
+void
+load_pipeline_cache_job(void *data, u32 first, u32 end)
+{
+    (void)first;
+    (void)end;
+    
+    StartupAssets *assets = (StartupAssets *)data;
+    
+    u32 cacheStage = startup_begin("Load pipeline cache");
+    assets->pipelineCache = load_entire_file("pipeline_cache.bin",
+                                             &globalPermanentArena);
+    startup_end(cacheStage);
+}
+
+void
+load_font_atlas_job(void *data, u32 first, u32 end)
+{
+    (void)first;
+    (void)end;
+    
+    StartupAssets *assets = (StartupAssets *)data;
+    
+    u32 fontStage = startup_begin("Load font atlas");
+    load_font_atlas(&assets->fontAtlas, &globalPermanentArena);
+    startup_end(fontStage);
+}
+
+VkPipelineCache
+create_pipeline_cache(VulkanContext *vk, LoadedFile *cacheFile)
+{
+    VkPipelineCache result;
+    
+    size_t initialDataSize = 0;
+    void *initialData = NULL;
+    
+    // Only hand the driver data that was written by this exact device and
+    // driver, a cache from another GPU is useless and some drivers choke on it
+    VkPipelineCacheHeaderVersionOne *header = cacheFile->data;
+    if (cacheFile->size >= sizeof(*header) &&
+        header->headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header->vendorID == vk->physicalDeviceProperties.vendorID &&
+        header->deviceID == vk->physicalDeviceProperties.deviceID &&
+        memcmp(header->pipelineCacheUUID,
+               vk->physicalDeviceProperties.pipelineCacheUUID,
+               VK_UUID_SIZE) == 0)
+    {
+        initialDataSize = cacheFile->size;
+        initialData = cacheFile->data;
+    }
+    
+    VkPipelineCacheCreateInfo createInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        NULL,
+        0,
+        initialDataSize,
+        initialData
+    };
+    
+    if (vkCreatePipelineCache(vk->device, &createInfo, NULL,
+                              &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create pipeline cache");
+    }
+    
+    return result;
+}
+
+void
+save_pipeline_cache(VulkanContext *vk, VkPipelineCache pipelineCache)
+{
+    size_t size = 0;
+    vkGetPipelineCacheData(vk->device, pipelineCache, &size, NULL);
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    void *data = arena_push(scratch, size, 16);
+    if (vkGetPipelineCacheData(vk->device, pipelineCache, &size,
+                               data) == VK_SUCCESS)
+    {
+        write_entire_file("pipeline_cache.bin", data, size);
+    }
+    
+    arena_restore(scratch, scratchMark);
+}
+
 /*
 *  WinMain application entry point
 */
@@ -567,7 +1936,30 @@ create_shader_module(VulkanContext *vk, void *code, size_t size)
 int CALLBACK
 WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
 {
-    VulkanContext vk = win32_init_vulkan(instance, 100, 100, 800, 600,
+    startup_timing_init();
+    arena_init(&globalPermanentArena, PERMANENT_ARENA_SIZE);
+    job_system_init();
+    
+    u32 packStage = startup_begin("Open asset pack");
+    if (!open_asset_pack(&globalAssetPack, ASSET_PACK_FILE))
+    {
+        debug_printf("No " ASSET_PACK_FILE ", loading loose files\n");
+    }
+    startup_end(packStage);
+    
+    // Shader binaries, the pipeline cache and the font atlas are read from
+    // disk by the job threads while the instance, device and swapchain are
+    // being created
+    StartupAssets assets = {0};
+    JobCounter assetsLoaded = {0};
+    run_parallel_for(load_shaders_job, &assets, ShaderId_Count, 1,
+                     &assetsLoaded);
+    run_job(load_pipeline_cache_job, &assets, &assetsLoaded);
+    run_job(load_font_atlas_job, &assets, &assetsLoaded);
+    
+    VulkanConfig config = parse_config(cmdLine);
+    
+    VulkanContext vk = win32_init_vulkan(instance, &config, 100, 100, 800, 600,
                                          "My Shiny Vulkan Window");
     
     /*
@@ -575,26 +1967,77 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
     */
     
     VkRenderPass renderPass;
-    VkFramebuffer swapchainFramebuffers[2];
-    VkSemaphore imageAvailableSemaphore;
-    VkSemaphore renderFinishedSemaphore;
+    VkFramebuffer swapchainFramebuffers[MAX_SWAPCHAIN_IMAGES];
+    GpuImage msaaColor = {0};
+    GpuImage depth;
     VkCommandPool commandPool;
-    VkCommandBuffer commandBuffer;
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
-    VkFence frameFence;
+    VkPipelineLayout sceneLayout;
+    VkPipelineLayout spriteLayout;
+    VkPipelineLayout textLayout;
+    VkPipelineLayout debugLayout;
+    VkPipelineCache pipelineCache;
     
     /*
     *  Create the Render Pass
     */
     
-    // Describe the color attachment (the swapchain image)
+    u32 renderPassStage = startup_begin("Create render pass");
+    
+    VkSampleCountFlagBits samples = choose_sample_count(&vk,
+                                                        config.msaaSamples);
+    bool multisampled = samples != VK_SAMPLE_COUNT_1_BIT;
+    VkFormat depthFormat = choose_depth_format(&vk, config.occlusionCulling);
+    
+    // The Hi-Z pass of the occlusion culling samples the depth, at the MSAA
+    // sample count. Rather than lower the MSAA the culling is turned off
+    // when the device can't do that.
+    VkSampleCountFlags sampledDepthCounts =
+        vk.physicalDeviceProperties.limits.sampledImageDepthSampleCounts;
+    if (config.occlusionCulling &&
+        (depthFormat == VK_FORMAT_UNDEFINED ||
+         !(sampledDepthCounts & samples)))
+    {
+        debug_printf("Occlusion culling: off, the device can't sample a "
+                     "depth format at %u samples\n", (u32)samples);
+        config.occlusionCulling = false;
+        depthFormat = choose_depth_format(&vk, false);
+    }
+    
+    // With MSAA the scene is drawn into a transient multisampled target that
+    // is resolved into the swapchain image at the end of the subpass, so the
+    // samples are never written to memory
+    if (multisampled)
+    {
+        msaaColor =
+            create_transient_target(&vk, vk.swapchainImageFormat,
+                                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                                    VK_IMAGE_ASPECT_COLOR_BIT, samples,
+                                    "MSAA color");
+    }
+    
+    // Depth is only needed within the render pass (the prepass is a subpass
+    // of it) so it is transient as well. Unless the occlusion culling draws
+    // into it first and samples it for the Hi-Z pyramid.
+    VkImageUsageFlags depthUsage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+    if (config.occlusionCulling)
+    {
+        depthUsage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+    }
+    depth = create_render_target(&vk, depthFormat, depthUsage,
+                                 get_depth_aspect(depthFormat), samples,
+                                 !config.occlusionCulling, "Depth");
+    
+    // Describe the color attachment (the swapchain image), rendered to
+    // directly without MSAA and the resolve target with it
     VkAttachmentDescription colorAttachment =
     {
         0, // flags
         vk.swapchainImageFormat,
         VK_SAMPLE_COUNT_1_BIT, // no multisampling
-        VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation (clear the screen)
+        // load operation (clear the screen, or fully overwritten by the
+        // resolve)
+        multisampled ? VK_ATTACHMENT_LOAD_OP_DONT_CARE :
+            VK_ATTACHMENT_LOAD_OP_CLEAR,
         VK_ATTACHMENT_STORE_OP_STORE, // store op (save the result)
         VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
         VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
@@ -602,19 +2045,88 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         VK_IMAGE_LAYOUT_PRESENT_SRC_KHR // final layout (optimal to present)
     };
     
-    VkAttachmentDescription colorAttachments[] = { colorAttachment };
+    // Describe the depth attachment (cleared to 0, the far plane with
+    // reversed-Z, and discarded). With occlusion culling it already holds
+    // the depth of the objects drawn in the occlusion pass.
+    VkAttachmentDescription depthAttachment =
+    {
+        0, // flags
+        depthFormat,
+        samples,
+        config.occlusionCulling ? VK_ATTACHMENT_LOAD_OP_LOAD :
+            VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // store op (not needed afterwards)
+        VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
+        config.occlusionCulling ?
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL :
+            VK_IMAGE_LAYOUT_UNDEFINED, // initial image layout
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL // final layout
+    };
+    
+    // Describe the multisampled color attachment (cleared, then resolved
+    // and discarded)
+    VkAttachmentDescription msaaColorAttachment =
+    {
+        0, // flags
+        vk.swapchainImageFormat,
+        samples,
+        VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation (clear the screen)
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // store op (only the resolve is)
+        VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
+        VK_IMAGE_LAYOUT_UNDEFINED, // initial image layout
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL // final layout
+    };
+    
+    // The swapchain image and depth are attachments 0 and 1 either way so
+    // the clear values line up, the multisampled target is attachment 2
+    VkAttachmentDescription attachments[] =
+    {
+        colorAttachment,
+        depthAttachment,
+        msaaColorAttachment
+    };
     
     VkAttachmentReference colorAttachmentRef =
     {
-        0, // index of the attachment in the render pass
+        multisampled ? 2 : 0, // index of the attachment in the render pass
         // layout during rendering (optimal for rendering color data)
         VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
     };
     
+    VkAttachmentReference resolveAttachmentRef =
+    {
+        0, // the swapchain image
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+    };
+    
+    VkAttachmentReference depthAttachmentRef =
+    {
+        1,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+    };
+    
     VkAttachmentReference colorAttachmentRefs[] = { colorAttachmentRef };
+    VkAttachmentReference resolveAttachmentRefs[] = { resolveAttachmentRef };
+    
+    // Describe the depth prepass subpass, depth only
+    VkSubpassDescription prepassSubpass =
+    {
+        0, // flags
+        VK_PIPELINE_BIND_POINT_GRAPHICS, // pipeline bind point
+        0, // input attachment count (ignored)
+        NULL, // input attachments (ignored)
+        0, // color attachment count (none)
+        NULL, // color attachments (none)
+        NULL, // resolve attachments (ignored)
+        &depthAttachmentRef,
+        0, // preserve attachment count (ignored)
+        NULL // preserve attachments (ignored)
+    };
     
-    // Describe the render subpass
-    VkSubpassDescription subpass =
+    // Describe the main subpass
+    VkSubpassDescription mainSubpass =
     {
         0, // flags
         VK_PIPELINE_BIND_POINT_GRAPHICS, // pipeline bind point
@@ -622,25 +2134,74 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         NULL, // input attachments (ignored)
         array_count(colorAttachmentRefs),
         colorAttachmentRefs,
-        NULL, // resolve attachments (ignored)
-        NULL, // depth stencil attachment (ignored)
+        multisampled ? resolveAttachmentRefs : NULL, // resolve attachments
+        &depthAttachmentRef,
         0, // preserve attachment count (ignored)
         NULL // preserve attachments (ignored)
     };
     
-    VkSubpassDescription subpasses[] = { subpass };
+    // Without the prepass the main subpass is the only one
+    u32 mainSubpassIndex = config.depthPrepass ? 1 : 0;
+    VkSubpassDescription subpasses[] = { prepassSubpass, mainSubpass };
+    
+    // Both frames in flight render into the same color and depth targets, so
+    // the next frame's clears have to wait for the previous frame's writes.
+    // This also orders the layout transitions after the acquire semaphore
+    // wait. With the prepass the main subpass tests against its depth. With
+    // occlusion culling the depth's transition also waits for the Hi-Z pass
+    // to be done sampling it.
+    VkPipelineStageFlags fragmentTests =
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    VkPipelineStageFlags depthSources = fragmentTests;
+    if (config.occlusionCulling)
+    {
+        depthSources |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    }
+    
+    VkSubpassDependency dependencies[] =
+    {
+        {
+            VK_SUBPASS_EXTERNAL, // srcSubpass
+            0, // dstSubpass
+            depthSources, // srcStageMask
+            fragmentTests, // dstStageMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // dstAccessMask
+            0 // dependencyFlags
+        },
+        {
+            VK_SUBPASS_EXTERNAL, // srcSubpass
+            mainSubpassIndex, // dstSubpass
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, // srcStageMask
+            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, // dstStageMask
+            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, // dstAccessMask
+            0 // dependencyFlags
+        },
+        {
+            0, // srcSubpass (the prepass)
+            1, // dstSubpass
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, // srcStageMask
+            VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, // dstStageMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, // dstAccessMask
+            VK_DEPENDENCY_BY_REGION_BIT
+        },
+    };
     
     VkRenderPassCreateInfo renderPassInfo =
     {
         VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
         NULL,
         0,
-        array_count(colorAttachments),
-        colorAttachments,
-        array_count(subpasses),
-        subpasses,
-        0, // dependency count (ignored)
-        NULL  // dependencies (ignored)
+        multisampled ? 3 : 2, // attachmentCount
+        attachments,
+        config.depthPrepass ? 2 : 1, // subpassCount
+        subpasses + 1 - mainSubpassIndex,
+        config.depthPrepass ? 3 : 2, // dependencyCount
+        dependencies
     };
     
     if (vkCreateRenderPass(vk.device, &renderPassInfo, NULL,
@@ -649,13 +2210,21 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         assert(!"Failed to create render pass");
     }
     
+    set_object_name(&vk, VK_OBJECT_TYPE_RENDER_PASS, handle_to_u64(renderPass),
+                    "Main pass");
+    
     /*
     *  Create Swapchain image's Framebuffers
     */
     
-    for (u32 i = 0; i < array_count(vk.swapchainImageViews); i++)
+    for (u32 i = 0; i < vk.swapchainImageCount; i++)
     {
-        VkImageView frameBufferAttachments[] = { vk.swapchainImageViews[i] };
+        VkImageView frameBufferAttachments[] =
+        {
+            vk.swapchainImageViews[i],
+            depth.view,
+            msaaColor.view
+        };
         
         // Fill framebuffer create info
         VkFramebufferCreateInfo framebufferInfo =
@@ -664,7 +2233,7 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
             NULL,
             0,
             renderPass,
-            array_count(frameBufferAttachments),
+            multisampled ? 3 : 2, // attachmentCount
             frameBufferAttachments,
             vk.swapchainExtents.width,
             vk.swapchainExtents.height,
@@ -677,27 +2246,16 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         {
             assert(!"Failed to create framebuffer");
         }
+        
+        set_object_name(&vk, VK_OBJECT_TYPE_FRAMEBUFFER,
+                        handle_to_u64(swapchainFramebuffers[i]),
+                        "Swapchain framebuffer %u", i);
     }
     
-    /*
-    *  Create Semaphores
-    */
-    
-    VkSemaphoreCreateInfo semaphoreInfo =
-    {
-        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-        NULL,
-        0
-    };
-    
-    vkCreateSemaphore(vk.device, &semaphoreInfo, NULL,
-                      &imageAvailableSemaphore);
-    
-    vkCreateSemaphore(vk.device, &semaphoreInfo, NULL,
-                      &renderFinishedSemaphore);
+    startup_end(renderPassStage);
     
     /*
-    *  Create Command Pool and Command Buffer
+    *  Create Command Pool and the Frame Timeline
     */
     
     VkCommandPoolCreateInfo commandPoolCreateInfo =
@@ -714,297 +2272,587 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         assert(!"Failed to create a command pool");
     }
     
-    VkCommandBufferAllocateInfo allocInfo =
-    {
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        NULL,
-        commandPool,
-        VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        1 // commandBufferCount
-    };
+    set_object_name(&vk, VK_OBJECT_TYPE_COMMAND_POOL,
+                    handle_to_u64(commandPool), "Frame command pool");
     
-    vkAllocateCommandBuffers(vk.device, &allocInfo,
-                             &commandBuffer);
+    // The timeline semaphore plus a command buffer and semaphores for each
+    // of the FRAMES_IN_FLIGHT frames the CPU may record ahead of the GPU
+    FrameTimeline frames = {0};
+    frame_timeline_init(&frames, &vk, commandPool);
     
     /*
-    *  Load SPIR-V and Create Shader Modules
+    *  Upload the Scene and Spawn the Lights
     */
     
-    LoadedFile vertexShader = load_entire_file("../shaders/vert.spv");
-    assert(vertexShader.size > 0);
+    u32 sceneStage = startup_begin("Create scene");
+    
+    Scene scene = {0};
+    scene_init(&scene, &vk, commandPool, config.vertexQuantization);
+    
+    ClusteredLighting lighting = {0};
+    clustered_lighting_init(&lighting, &vk, config.lightCount, scene.extent);
+    
+    MeshletRenderer meshlets = {0};
+    meshlet_renderer_init(&meshlets, &vk, commandPool, scene.extent);
     
-    LoadedFile fragmentShader = load_entire_file("../shaders/frag.spv");
-    assert(fragmentShader.size > 0);
+    OcclusionCuller occlusion = {0};
+    if (config.occlusionCulling)
+    {
+        occlusion_culler_init(&occlusion, &vk, commandPool, &depth,
+                              depthFormat, samples, lighting.setLayout);
+    }
+    
+    SpriteBatcher sprites = {0};
+    sprite_batcher_init(&sprites, &vk, commandPool);
+    
+    SpriteDemo spriteDemo = {0};
+    sprite_demo_init(&spriteDemo, &sprites, &vk, commandPool,
+                     config.spriteCount);
     
-    // Create shader modules from loaded binaries
-    VkShaderModule vertShaderModule =
-        create_shader_module(&vk, vertexShader.data, vertexShader.size);
+    TransformHierarchy transformStress = {0};
+    if (config.transformNodes)
+    {
+        transform_stress_init(&transformStress, config.transformNodes);
+    }
     
-    VkShaderModule fragShaderModule =
-        create_shader_module(&vk, fragmentShader.data, fragmentShader.size);
+    Camera camera = {0};
+    
+    startup_end(sceneStage);
     
     /*
-    *  Define Shader Stage Create Info
+    *  Wait for the SPIR-V and the Pipeline Cache
     */
     
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        NULL,
-        0,
-        VK_SHADER_STAGE_VERTEX_BIT,
-        vertShaderModule,
-        "main", // entry point
-        NULL // specialization info
-    };
+    // Whatever is left of the asset loading shows up as this stage, the main
+    // thread helps with it
+    u32 waitStage = startup_begin("Wait for asset jobs");
+    wait_for_counter(&assetsLoaded);
+    startup_end(waitStage);
+    report_asset_loading(&globalAssetPack);
     
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo =
-    {
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        NULL,
-        0,
-        VK_SHADER_STAGE_FRAGMENT_BIT,
-        fragShaderModule,
-        "main", // entry point
-        NULL, // specialization info
-    };
+    TextRenderer text = {0};
+    text_renderer_init(&text, &vk, commandPool, &assets.fontAtlas);
     
-    VkPipelineShaderStageCreateInfo shaderStageInfo[] =
+    debug_draw_init(&globalDebugDraw, &vk);
+    
+    u32 pipelineStage = startup_begin("Create pipeline");
+    
+    for (u32 i = 0; i < ShaderId_Count; i++)
     {
-        vertShaderStageInfo,
-        fragShaderStageInfo
-    };
+        assert(assets.shaderBinaries[i].size > 0 &&
+               "Missing SPIR-V, see the debugger output");
+    }
+    
+    pipelineCache = create_pipeline_cache(&vk, &assets.pipelineCache);
+    set_object_name(&vk, VK_OBJECT_TYPE_PIPELINE_CACHE,
+                    handle_to_u64(pipelineCache), "Pipeline cache");
     
     /*
-    *  Define Vertex Input Create Info
+    *  Create Pipeline Layout
     */
     
-    VkPipelineVertexInputStateCreateInfo vertexInputStateInfo =
+    // The frame's uniforms, lights and clusters in set 0, the meshlet
+    // buffers in set 1, the object's transform and color in push constants.
+    // The compute passes use the same layout, so set 0 stays bound.
+    VkPushConstantRange pushConstantRange =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        NULL,
-        0,
-        0, NULL, 0, NULL // No vertex buffers
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+        0, // offset
+        sizeof(ObjectConstants)
     };
     
-    VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateInfo =
+    VkDescriptorSetLayout setLayouts[] =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
-        VK_FALSE // primitiveRestartEnable
+        lighting.setLayout,
+        meshlets.setLayout
     };
     
-    /*
-    *  Define Dynamic State Crate Info
-    */
-    
-    VkPipelineDynamicStateCreateInfo dynamicStateInfo =
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         NULL,
         0,
-        0, NULL // No dynamic states
+        array_count(setLayouts), setLayouts,
+        1, &pushConstantRange
     };
     
-    /*
-    *  Define Viewport State Create Info
-    */
-    
-    VkViewport viewport =
+    if (vkCreatePipelineLayout(vk.device, &pipelineLayoutInfo, NULL,
+                               &sceneLayout) != VK_SUCCESS)
     {
-        0, 0, // x, y
-        (f32)vk.swapchainExtents.width,
-        (f32)vk.swapchainExtents.height,
-        0, 0 // min, max depth
-    };
+        assert(!"Failed to create pipeline layout!");
+    }
     
-    VkViewport viewports[] = { viewport };
+    set_object_name(&vk, VK_OBJECT_TYPE_PIPELINE_LAYOUT,
+                    handle_to_u64(sceneLayout), "Scene layout");
     
-    VkRect2D scissor =
+    // The sprite textures in set 0, the pixel to NDC scale in push constants
+    VkPushConstantRange spriteConstantRange =
     {
-        {0, 0}, // offset
-        vk.swapchainExtents
+        VK_SHADER_STAGE_VERTEX_BIT,
+        0, // offset
+        2 * sizeof(f32)
     };
     
-    VkRect2D scissors[] = { scissor };
-    
-    VkPipelineViewportStateCreateInfo viewportStateInfo =
+    VkPipelineLayoutCreateInfo spriteLayoutInfo =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         NULL,
         0,
-        array_count(viewports),
-        viewports,
-        array_count(scissors),
-        scissors
+        1, &sprites.setLayout,
+        1, &spriteConstantRange
     };
     
-    /*
-    *  Define Rasterization State Create Info
-    */
-    
-    VkPipelineRasterizationStateCreateInfo rasterizationStateInfo =
+    if (vkCreatePipelineLayout(vk.device, &spriteLayoutInfo, NULL,
+                               &spriteLayout) != VK_SUCCESS)
     {
-        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_FALSE, // depthClampEnable
-        VK_FALSE, // rasterizerDiscardEnable
-        VK_POLYGON_MODE_FILL, // polygonMode (solid triangles)
-        VK_CULL_MODE_BACK_BIT, // cullMode
-        VK_FRONT_FACE_CLOCKWISE, // frontFace
-        VK_FALSE, 0, 0, 0, // no depth bias
-        1.0f // lineWidth
-    };
+        assert(!"Failed to create pipeline layout!");
+    }
     
-    /*
-    *  Define Multisample State Create Info
-    */
+    set_object_name(&vk, VK_OBJECT_TYPE_PIPELINE_LAYOUT,
+                    handle_to_u64(spriteLayout), "Sprite layout");
     
-    VkPipelineMultisampleStateCreateInfo multisampleStateInfo =
+    // The font atlas in set 0, the same push constants as sprites
+    VkPipelineLayoutCreateInfo textLayoutInfo =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         NULL,
         0,
-        VK_SAMPLE_COUNT_1_BIT, // rasterizationSamples
-        VK_FALSE, // sampleShadingEnable
-        0, // minSampleShading
-        NULL, // pSampleMask
-        VK_FALSE, // alphaToCoverageEnable
-        VK_FALSE, // alphaToOneEnable
+        1, &text.setLayout,
+        1, &spriteConstantRange
     };
     
-    /*
-    *  Define Color Blend State Create Info
-    */
-    
-    VkFlags colorWriteMask =
-        VK_COLOR_COMPONENT_R_BIT |
-        VK_COLOR_COMPONENT_G_BIT |
-        VK_COLOR_COMPONENT_B_BIT |
-        VK_COLOR_COMPONENT_A_BIT;
-    
-    VkPipelineColorBlendAttachmentState colorBlendAttachment =
-    {
-        VK_FALSE, // blendEnable
-        VK_BLEND_FACTOR_ZERO,
-        VK_BLEND_FACTOR_ZERO,
-        VK_BLEND_OP_ADD,
-        VK_BLEND_FACTOR_ZERO,
-        VK_BLEND_FACTOR_ZERO,
-        VK_BLEND_OP_ADD,
-        colorWriteMask,
-    };
+    if (vkCreatePipelineLayout(vk.device, &textLayoutInfo, NULL,
+                               &textLayout) != VK_SUCCESS)
+    {
+        assert(!"Failed to create pipeline layout!");
+    }
     
-    VkPipelineColorBlendAttachmentState
-        colorBlendAttachments[] = { colorBlendAttachment };
+    set_object_name(&vk, VK_OBJECT_TYPE_PIPELINE_LAYOUT,
+                    handle_to_u64(textLayout), "Text layout");
     
-    VkPipelineColorBlendStateCreateInfo colorBlendStateInfo =
+    // Only the view projection matrix, in push constants
+    VkPushConstantRange debugConstantRange =
     {
-        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        NULL,
-        0,
-        VK_FALSE,
-        VK_LOGIC_OP_CLEAR,
-        array_count(colorBlendAttachments),
-        colorBlendAttachments,
-        {0, 0, 0, 0}
+        VK_SHADER_STAGE_VERTEX_BIT,
+        0, // offset
+        sizeof(Mat4)
     };
     
-    /*
-    *  Create Pipeline Layout
-    */
-    
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo =
+    VkPipelineLayoutCreateInfo debugLayoutInfo =
     {
         VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
         NULL,
         0,
         0, NULL, // (no descriptor sets)
-        0, NULL // (no push constant ranges)
+        1, &debugConstantRange
     };
     
-    if (vkCreatePipelineLayout(vk.device, &pipelineLayoutInfo, NULL,
-                               &pipelineLayout) != VK_SUCCESS)
+    if (vkCreatePipelineLayout(vk.device, &debugLayoutInfo, NULL,
+                               &debugLayout) != VK_SUCCESS)
     {
         assert(!"Failed to create pipeline layout!");
     }
     
+    set_object_name(&vk, VK_OBJECT_TYPE_PIPELINE_LAYOUT,
+                    handle_to_u64(debugLayout), "Debug line layout");
+    
     /*
-    *  Create Graphics Pipeline
+    *  Create Graphics and Compute Pipelines
     */
     
-    VkGraphicsPipelineCreateInfo pipelineInfo =
+    PipelineLibrary pipelines = {0};
+    pipeline_library_init(&pipelines, &vk, pipelineCache,
+                          assets.shaderBinaries);
+    
+    // The scene's vertex format and the vertex shader that decodes it
+    ShaderId meshVertexShader = ShaderId_MeshVertexQuantized;
+    VertexFormat meshVertexFormat = VertexFormat_MeshQuantized8;
+    if (config.vertexQuantization == VertexQuantization_Off)
     {
-        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        NULL,
-        0,
-        array_count(shaderStageInfo),
-        shaderStageInfo,
-        &vertexInputStateInfo,
-        &inputAssemblyStateInfo,
-        NULL, // pTessellationState
-        &viewportStateInfo,
-        &rasterizationStateInfo,
-        &multisampleStateInfo,
-        NULL, // pDepthStencilState
-        &colorBlendStateInfo,
-        &dynamicStateInfo,
-        pipelineLayout,
+        meshVertexShader = ShaderId_MeshVertex;
+        meshVertexFormat = VertexFormat_Mesh;
+    }
+    else if (config.vertexQuantization == VertexQuantization_Normal16)
+    {
+        meshVertexFormat = VertexFormat_MeshQuantized16;
+    }
+    
+    // The prepass lays down the depth of the closest surfaces, so the main
+    // pass only shades fragments that pass an EQUAL test and never writes
+    // depth. Without it the main pass tests and writes depth itself.
+    // Reversed-Z, closer is greater.
+    if (config.depthPrepass)
+    {
+        GraphicsPipelineDesc prepassDesc =
+        {
+            "Depth prepass",
+            meshVertexShader,
+            SHADER_NONE,
+            SHADER_NONE, SHADER_NONE, // (no task and mesh shaders)
+            meshVertexFormat,
+            VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+            VK_CULL_MODE_BACK_BIT,
+            VK_COMPARE_OP_GREATER,
+            true, // depthWrite
+            sceneLayout,
+            renderPass,
+            0, // subpass
+            samples
+        };
+        
+        pipeline_library_add(&pipelines, PipelineId_DepthPrepass,
+                             &prepassDesc);
+        
+        // The same depth only drawing for the early occlusion phase
+        if (config.occlusionCulling)
+        {
+            GraphicsPipelineDesc occlusionDesc = prepassDesc;
+            occlusionDesc.name = "Occlusion depth";
+            occlusionDesc.renderPass = occlusion.renderPass;
+            occlusionDesc.subpass = 0;
+            
+            pipeline_library_add(&pipelines, PipelineId_OcclusionDepth,
+                                 &occlusionDesc);
+        }
+    }
+    
+    if (config.occlusionCulling)
+    {
+        ComputePipelineDesc hizDepthDesc =
+        {
+            "Hi-Z depth",
+            multisampled ? ShaderId_HiZDepthMultisampled : ShaderId_HiZDepth,
+            occlusion.hizLayout
+        };
+        
+        ComputePipelineDesc hizDownsampleDesc =
+        {
+            "Hi-Z downsample",
+            ShaderId_HiZDownsample,
+            occlusion.hizLayout
+        };
+        
+        ComputePipelineDesc occlusionCullDesc =
+        {
+            "Occlusion culling",
+            ShaderId_OcclusionCull,
+            occlusion.cullLayout
+        };
+        
+        pipeline_library_add_compute(&pipelines, PipelineId_HiZDepth,
+                                     &hizDepthDesc);
+        pipeline_library_add_compute(&pipelines, PipelineId_HiZDownsample,
+                                     &hizDownsampleDesc);
+        pipeline_library_add_compute(&pipelines, PipelineId_OcclusionCull,
+                                     &occlusionCullDesc);
+    }
+    
+    GraphicsPipelineDesc sceneDesc =
+    {
+        "Scene",
+        meshVertexShader,
+        ShaderId_ClusteredFragment,
+        SHADER_NONE, SHADER_NONE, // (no task and mesh shaders)
+        meshVertexFormat,
+        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        VK_CULL_MODE_BACK_BIT,
+        config.depthPrepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_GREATER,
+        !config.depthPrepass, // depthWrite
+        sceneLayout,
         renderPass,
-        0, // subpass index
-        NULL, 0 // (no base pipeline)
+        mainSubpassIndex,
+        samples
+    };
+    
+    pipeline_library_add(&pipelines, PipelineId_Scene, &sceneDesc);
+    
+    ComputePipelineDesc binningDesc =
+    {
+        "Light binning",
+        ShaderId_LightBinning,
+        sceneLayout
     };
     
-    // Create the graphics pipeline
-    if (vkCreateGraphicsPipelines(vk.device, VK_NULL_HANDLE, 1,
-                                  &pipelineInfo, NULL,
-                                  &graphicsPipeline) != VK_SUCCESS)
+    pipeline_library_add_compute(&pipelines, PipelineId_LightBinning,
+                                 &binningDesc);
+    
+    // Meshlets are culled by the task shader with mesh shading, otherwise by
+    // a compute pass and drawn with the vertex shader pulling the vertices
+    ShaderId meshletTask = SHADER_NONE;
+    ShaderId meshletMesh = SHADER_NONE;
+    ShaderId meshletVertex = ShaderId_MeshletVertex;
+    
+    if (meshlets.meshShading)
+    {
+        meshletTask = ShaderId_MeshletTask;
+        meshletMesh = ShaderId_MeshletMesh;
+        meshletVertex = SHADER_NONE;
+    }
+    else
+    {
+        ComputePipelineDesc cullDesc =
+        {
+            "Meshlet culling",
+            ShaderId_MeshletCull,
+            sceneLayout
+        };
+        
+        pipeline_library_add_compute(&pipelines, PipelineId_MeshletCull,
+                                     &cullDesc);
+    }
+    
+    if (config.depthPrepass)
     {
-        assert(!"Failed to create graphics pipeline!");
+        GraphicsPipelineDesc meshletPrepassDesc =
+        {
+            "Meshlet depth prepass",
+            meshletVertex,
+            SHADER_NONE,
+            meshletTask, meshletMesh,
+            VertexFormat_None,
+            VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+            VK_CULL_MODE_BACK_BIT,
+            VK_COMPARE_OP_GREATER,
+            true, // depthWrite
+            sceneLayout,
+            renderPass,
+            0, // subpass
+            samples
+        };
+        
+        pipeline_library_add(&pipelines, PipelineId_MeshletPrepass,
+                             &meshletPrepassDesc);
     }
     
-    /*
-    *  Destroy Shader Modules and Create Frame Fence
-    */
+    GraphicsPipelineDesc meshletDesc =
+    {
+        "Meshlets",
+        meshletVertex,
+        ShaderId_ClusteredFragment,
+        meshletTask, meshletMesh,
+        VertexFormat_None,
+        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        VK_CULL_MODE_BACK_BIT,
+        config.depthPrepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_GREATER,
+        !config.depthPrepass, // depthWrite
+        sceneLayout,
+        renderPass,
+        mainSubpassIndex,
+        samples
+    };
     
-    vkDestroyShaderModule(vk.device, vertShaderModule, NULL);
-    vkDestroyShaderModule(vk.device, fragShaderModule, NULL);
+    pipeline_library_add(&pipelines, PipelineId_Meshlets, &meshletDesc);
     
-    VkFenceCreateInfo fenceInfo =
+    // Over everything drawn before in the main subpass, without depth
+    GraphicsPipelineDesc spriteDesc =
     {
-        VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        NULL,
-        0
+        "Sprites",
+        ShaderId_SpriteVertex,
+        sprites.bindless ? ShaderId_SpriteFragment :
+        ShaderId_SpriteFragmentUniform,
+        SHADER_NONE, SHADER_NONE,
+        VertexFormat_Sprite,
+        VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+        VK_CULL_MODE_NONE,
+        VK_COMPARE_OP_NEVER,
+        false, // depthWrite
+        spriteLayout,
+        renderPass,
+        mainSubpassIndex,
+        samples,
+        true // alphaBlend
+    };
+    
+    pipeline_library_add(&pipelines, PipelineId_Sprites, &spriteDesc);
+    
+    // Glyph quads are sprite instances, only the shading differs
+    GraphicsPipelineDesc textDesc = spriteDesc;
+    textDesc.name = "Text";
+    textDesc.fragmentShader = ShaderId_TextFragment;
+    textDesc.layout = textLayout;
+    
+    pipeline_library_add(&pipelines, PipelineId_Text, &textDesc);
+    
+    // Depth tested against the scene, but lines don't write depth
+    GraphicsPipelineDesc debugLineDesc =
+    {
+        "Debug lines",
+        ShaderId_DebugLineVertex,
+        ShaderId_DebugLineFragment,
+        SHADER_NONE, SHADER_NONE,
+        VertexFormat_DebugLine,
+        VK_PRIMITIVE_TOPOLOGY_LINE_LIST,
+        VK_CULL_MODE_NONE,
+        VK_COMPARE_OP_GREATER_OR_EQUAL,
+        false, // depthWrite
+        debugLayout,
+        renderPass,
+        mainSubpassIndex,
+        samples
+    };
+    
+    pipeline_library_add(&pipelines, PipelineId_DebugLines, &debugLineDesc);
+    
+    // Specialization constant of clustered.frag: DEBUG_VIEW
+    ShaderVariantKey sceneVariants[] =
+    {
+        { {0}, 1 }, // lit
+        { {1}, 1 }, // heatmap of the lights per cluster
+        { {2}, 1 }, // depth slices
     };
     
-    vkCreateFence(vk.device, &fenceInfo, NULL,
-                  &frameFence);
+    // Build every variant now so switching never stalls a frame
+    for (u32 i = 0; i < array_count(sceneVariants); i++)
+    {
+        get_pipeline_variant(&pipelines, PipelineId_Scene, &sceneVariants[i]);
+        get_pipeline_variant(&pipelines, PipelineId_Meshlets,
+                             &sceneVariants[i]);
+    }
+    
+    // Saving a shader in ../shaders recompiles it and swaps in new pipelines
+    start_shader_hot_reload(&pipelines);
+    
+    startup_end(pipelineStage);
     
     /*
     *  Main Loop
     */
     
+    FramePacer pacer = {0};
+    frame_pacer_init(&pacer, &vk, &config, &frames);
+
+#if PROFILER
+    profiler_init(&globalProfiler, &vk);
+#endif
+
+    bool firstFramePresented = false;
+    
+    // The camera as it was when B was pressed
+    Camera boundsCamera = {0};
+    bool boundsCameraFrozen = false;
+    
+    // Once it's running, a frame allocates from arenas only. Shown on screen
+    // and reported when it doesn't, hot reloads allocate on their thread.
+    u64 frameHeapAllocations = 0;
+    
     globalRunning = true;
     while (globalRunning)
     {
+        u64 heapAllocationsBefore = (u64)globalHeapAllocationCount;
+        
+        /*
+        *  Wait for the Frame's Slot on the Timeline
+        */
+        
+        // Waits until frame N - FRAMES_IN_FLIGHT has completed, then destroys
+        // objects no frame in flight references anymore
+        FrameSlot *frame = begin_frame(&frames, &vk);
+        u64 frameNumber = frames.frameNumber;
+        VkCommandBuffer commandBuffer = frame->commandBuffer;
+        
+        u64 now = get_ticks();
+        frame_pacer_record_completed(&pacer);
+        
+        pipeline_library_begin_frame(&pipelines, &frames);
+        
+        f32 seconds = (f32)(now - globalStartup.winMainStart) /
+            (f32)globalStartup.frequency;
+        update_camera(&camera, &scene, seconds, vk.swapchainExtents);
+        update_scene_transforms(&scene, seconds);
+        
+        // Writes this slot's uniforms and lights, its previous frame is done
+        ClusteredFrame *lightingFrame =
+            clustered_lighting_update(&lighting, &frames, &camera,
+                                      vk.swapchainExtents, seconds);
+        MeshletFrame *meshletFrame = get_meshlet_frame(&meshlets, &frames);
+        
+        // Also reads back the culling stats of this slot's previous frame
+        OcclusionFrame *occlusionFrame = NULL;
+        if (config.occlusionCulling)
+        {
+            occlusionFrame = occlusion_begin_frame(&occlusion, &frames, &scene);
+        }
+        
+        begin_sprites(&sprites, &frames);
+        sprite_demo_update(&spriteDemo, &sprites, vk.swapchainExtents,
+                           seconds);
+        
+        begin_text(&text, &frames);
+        f32 textY = draw_diagnostics(&text, &globalProfiler, 16, 16, 18);
+        draw_textf(&text, 16, textY, 18, pack_color(1, 1, 1, 1),
+                   "%u sprites in %u draws", sprites.spriteCount,
+                   sprites.drawCount);
+        draw_textf(&text, 16, textY + 18, 18, pack_color(1, 1, 1, 1),
+                   "%llu heap allocations last frame", frameHeapAllocations);
+        if (config.occlusionCulling)
+        {
+            OcclusionStats *stats = &occlusion.stats;
+            draw_textf(&text, 16, textY + 36, 18, pack_color(1, 1, 1, 1),
+                       "Objects: %u early, %u late, %u occluded, "
+                       "%u outside the frustum", stats->drawnEarly,
+                       stats->drawnLate, stats->occluded,
+                       stats->outsideFrustum);
+        }
+        
+        begin_debug_draw(&globalDebugDraw, &frames);
+        if (globalShowBounds)
+        {
+            if (!boundsCameraFrozen)
+            {
+                boundsCamera = camera;
+                boundsCameraFrozen = true;
+            }
+            
+            f32 aspect = (f32)vk.swapchainExtents.width /
+                (f32)vk.swapchainExtents.height;
+            Vec3 forward = vec3_normalize(vec3_sub(boundsCamera.target,
+                                                   boundsCamera.position));
+            
+            debug_scene_bounds(&scene, pack_color(0.2f, 1, 0.2f, 1));
+            debug_frustum(&boundsCamera, aspect, pack_color(1, 1, 0.2f, 1));
+            debug_arrow(boundsCamera.position,
+                        vec3_add(boundsCamera.position,
+                                 vec3_scale(forward, 10.0f)),
+                        pack_color(1, 0.3f, 0.2f, 1));
+        }
+        else
+        {
+            boundsCameraFrozen = false;
+        }
+
+#if PROFILER
+        // Reads the timings of the frame that last used this slot
+        profiler_begin_frame(&globalProfiler, &frames);
+#endif
+
         /*
-        *  Wait for the Frame Fence, then Reset it
+        *  Pace the Frame
         */
         
-        vkWaitForFences(vk.device, 1, &frameFence, VK_TRUE, UINT64_MAX);
-        vkResetFences(vk.device, 1, &frameFence);
+        // Sleeps until the latest point this frame can start and still make
+        // its vblank, the frame's latency is measured from here
+        PROFILE_BEGIN(NULL, "Frame pacing");
+        frame_pacer_begin_frame(&pacer, &vk, frameNumber);
+        PROFILE_END(NULL);
+        
+        // Timed in the profiler's overlay, after the pacer's sleep
+        if (transformStress.count)
+        {
+            PROFILE_BEGIN(NULL, "Transforms");
+            transform_stress_update(&transformStress, seconds);
+            PROFILE_END(NULL);
+        }
         
         /*
         *  Acquire the "Next" Swap Chain Image
         */
         
+        PROFILE_BEGIN(NULL, "Acquire");
+        
         u32 imageIndex = UINT32_MAX;
         if (vkAcquireNextImageKHR(vk.device, vk.swapchain,
                                   UINT64_MAX, // timeout
-                                  imageAvailableSemaphore,
+                                  frame->imageAvailable,
                                   VK_NULL_HANDLE, // fence (ignored)
                                   &imageIndex) == VK_ERROR_OUT_OF_DATE_KHR)
         {
@@ -1013,6 +2861,8 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         
         assert(imageIndex != UINT32_MAX);
         
+        PROFILE_END(NULL);
+        
         /*
         *  Process Windows' messages
         */
@@ -1040,6 +2890,103 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         
         vkBeginCommandBuffer(commandBuffer, &beginInfo);
         
+        /*
+        *  Bin the Lights into Clusters
+        */
+        
+        PROFILE_PASS_BEGIN(commandBuffer, "Light binning");
+        bin_lights(lightingFrame, commandBuffer,
+                   get_pipeline(&pipelines, PipelineId_LightBinning),
+                   sceneLayout);
+        PROFILE_PASS_END(commandBuffer);
+        
+        if (!meshlets.meshShading)
+        {
+            PROFILE_PASS_BEGIN(commandBuffer, "Meshlet culling");
+            cull_meshlets(&meshlets, meshletFrame, commandBuffer,
+                          get_pipeline(&pipelines, PipelineId_MeshletCull),
+                          sceneLayout);
+            PROFILE_PASS_END(commandBuffer);
+        }
+        
+        VkViewport viewport =
+        {
+            0, 0, // x, y
+            (f32)vk.swapchainExtents.width,
+            (f32)vk.swapchainExtents.height,
+            0, 1 // min, max depth
+        };
+        
+        VkRect2D scissor =
+        {
+            {0, 0}, // offset
+            vk.swapchainExtents
+        };
+        
+        // Front to back, so occluded fragments fail the depth test early
+        u32 *drawOrder = push_array(&frame->arena, u32, scene.objectCount);
+        sort_objects_front_to_back(&scene, &camera, drawOrder, &frame->arena);
+        
+        /*
+        *  Occlusion Culling
+        */
+        
+        // Draws what was visible last frame, builds the Hi-Z pyramid from
+        // its depth and tests everything against it. The main pass draws
+        // from the lists this fills in.
+        VkBuffer occlusionDraws = VK_NULL_HANDLE;
+        if (config.occlusionCulling)
+        {
+            occlusionDraws = occlusionFrame->drawCommands.buffer;
+            VkPipeline cullPipeline = get_pipeline(&pipelines,
+                                                   PipelineId_OcclusionCull);
+            
+            PROFILE_PASS_BEGIN(commandBuffer, "Early culling");
+            cull_scene_objects(&occlusion, occlusionFrame, commandBuffer,
+                               cullPipeline, lightingFrame->descriptorSet,
+                               OcclusionPhase_Early);
+            PROFILE_PASS_END(commandBuffer);
+            
+            PROFILE_PASS_BEGIN(commandBuffer, "Occlusion depth");
+            begin_occlusion_pass(&occlusion, commandBuffer);
+            
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    sceneLayout, 0, 1,
+                                    &lightingFrame->descriptorSet, 0, NULL);
+            
+            VkDeviceSize vertexOffset = 0;
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+                                   &scene.vertices.buffer, &vertexOffset);
+            vkCmdBindIndexBuffer(commandBuffer, scene.indices.buffer, 0,
+                                 VK_INDEX_TYPE_UINT32);
+            
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              get_pipeline(&pipelines,
+                                           PipelineId_OcclusionDepth));
+            draw_scene_objects(&scene, commandBuffer, sceneLayout, drawOrder,
+                               occlusionDraws,
+                               get_occlusion_draws_offset(
+                                   OcclusionDraws_Early));
+            
+            vkCmdEndRenderPass(commandBuffer);
+            PROFILE_PASS_END(commandBuffer);
+            
+            PROFILE_PASS_BEGIN(commandBuffer, "Hi-Z");
+            build_hiz(&occlusion, commandBuffer,
+                      get_pipeline(&pipelines, PipelineId_HiZDepth),
+                      get_pipeline(&pipelines, PipelineId_HiZDownsample));
+            PROFILE_PASS_END(commandBuffer);
+            
+            PROFILE_PASS_BEGIN(commandBuffer, "Late culling");
+            cull_scene_objects(&occlusion, occlusionFrame, commandBuffer,
+                               cullPipeline, lightingFrame->descriptorSet,
+                               OcclusionPhase_Late);
+            PROFILE_PASS_END(commandBuffer);
+        }
+        
         /*
         *  Begin Render Pass
         */
@@ -1055,7 +3002,17 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         
         VkClearValue clearValue = { clearColor };
         
-        VkClearValue clearValues[] = { clearValue };
+        VkClearValue depthClearValue;
+        depthClearValue.depthStencil.depth = 0; // the far plane, reversed-Z
+        depthClearValue.depthStencil.stencil = 0;
+        
+        // Swapchain image, depth and the multisampled target
+        VkClearValue clearValues[] =
+        {
+            clearValue,
+            depthClearValue,
+            clearValue
+        };
         
         VkRenderPassBeginInfo renderPassBeginInfo =
         {
@@ -1068,6 +3025,10 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
             clearValues
         };
         
+        // A statistics query has to end in the subpass it began in, so each
+        // subpass is a profiler pass of its own. The shading subpass's
+        // fragment invocations then show what the prepass saves.
+        PROFILE_BEGIN(commandBuffer, "Main pass");
         vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo,
                              VK_SUBPASS_CONTENTS_INLINE);
         
@@ -1075,15 +3036,99 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         *  Finish the Command Buffer
         */
         
-        // Bind the pipeline
+        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        
+        // Descriptor sets and vertex buffers stay bound across subpasses
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                sceneLayout, 0, 1,
+                                &lightingFrame->descriptorSet, 0, NULL);
+        
+        VkDeviceSize vertexOffset = 0;
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, &scene.vertices.buffer,
+                               &vertexOffset);
+        vkCmdBindIndexBuffer(commandBuffer, scene.indices.buffer, 0,
+                             VK_INDEX_TYPE_UINT32);
+        
+        // With occlusion culling the prepass only adds what the late phase
+        // found, the early phase's depth is already there
+        if (config.depthPrepass)
+        {
+            PROFILE_PASS_BEGIN(commandBuffer, "Depth prepass");
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              get_pipeline(&pipelines,
+                                           PipelineId_DepthPrepass));
+            draw_scene_objects(&scene, commandBuffer, sceneLayout, drawOrder,
+                               occlusionDraws,
+                               get_occlusion_draws_offset(
+                                   OcclusionDraws_Late));
+            
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              get_pipeline(&pipelines,
+                                           PipelineId_MeshletPrepass));
+            draw_meshlets(&vk, &meshlets, meshletFrame, commandBuffer,
+                          sceneLayout);
+            PROFILE_PASS_END(commandBuffer);
+            
+            // The meshlet fallback path binds its own index buffer
+            vkCmdBindIndexBuffer(commandBuffer, scene.indices.buffer, 0,
+                                 VK_INDEX_TYPE_UINT32);
+            
+            vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+        }
+        
+        PROFILE_PASS_BEGIN(commandBuffer, "Shading");
+        PROFILE_BEGIN(commandBuffer, "Scene");
+        
+        // Bind the pipeline variant, a cache hit after the first frame
+        u32 variantIndex = globalVariantIndex % array_count(sceneVariants);
+        ShaderVariantKey *variant = &sceneVariants[variantIndex];
+        
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          get_pipeline_variant(&pipelines, PipelineId_Scene,
+                                               variant));
+        draw_scene_objects(&scene, commandBuffer, sceneLayout, drawOrder,
+                           occlusionDraws,
+                           get_occlusion_draws_offset(OcclusionDraws_All));
+        PROFILE_END(commandBuffer);
+        
+        PROFILE_BEGIN(commandBuffer, "Meshlets");
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          graphicsPipeline);
+                          get_pipeline_variant(&pipelines,
+                                               PipelineId_Meshlets, variant));
+        draw_meshlets(&vk, &meshlets, meshletFrame, commandBuffer,
+                      sceneLayout);
+        PROFILE_END(commandBuffer);
         
-        // Draw 3 vertices (triangle)
-        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+        // Nothing is recorded on frames without debug drawing
+        if (globalDebugDraw.vertexCount > 0)
+        {
+            Mat4 viewProjection = mat4_multiply(camera.projection,
+                                                camera.view);
+            
+            PROFILE_BEGIN(commandBuffer, "Debug lines");
+            flush_debug_draw(&globalDebugDraw, commandBuffer,
+                             get_pipeline(&pipelines, PipelineId_DebugLines),
+                             debugLayout, &viewProjection);
+            PROFILE_END(commandBuffer);
+        }
+        
+        PROFILE_BEGIN(commandBuffer, "Sprites");
+        flush_sprites(&sprites, commandBuffer,
+                      get_pipeline(&pipelines, PipelineId_Sprites),
+                      spriteLayout, vk.swapchainExtents);
+        PROFILE_END(commandBuffer);
+        
+        PROFILE_BEGIN(commandBuffer, "Text");
+        flush_text(&text, commandBuffer,
+                   get_pipeline(&pipelines, PipelineId_Text), textLayout,
+                   vk.swapchainExtents);
+        PROFILE_END(commandBuffer);
+        PROFILE_PASS_END(commandBuffer);
         
         // End the render pass
         vkCmdEndRenderPass(commandBuffer);
+        PROFILE_END(commandBuffer);
         
         // End the command buffer
         vkEndCommandBuffer(commandBuffer);
@@ -1094,33 +3139,60 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         
         VkCommandBuffer commandBuffers[] = { commandBuffer };
         
-        VkSemaphore imageAvailableSemaphores[] = { imageAvailableSemaphore };
+        VkSemaphore imageAvailableSemaphores[] = { frame->imageAvailable };
         
         VkPipelineStageFlags waitStages[] =
         {
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
         };
         
-        VkSemaphore renderFinishedSemaphores[] = { renderFinishedSemaphore };
+        VkSemaphore renderFinishedSemaphores[] =
+        {
+            frames.renderFinished[imageIndex]
+        };
+        
+        // The timeline reaches frameNumber when this frame's work is done
+        VkSemaphore signalSemaphores[] =
+        {
+            frames.renderFinished[imageIndex],
+            frames.timeline
+        };
+        
+        u64 waitValues[] = { 0 }; // binary
+        u64 signalValues[] = { 0, frameNumber };
+        
+        VkTimelineSemaphoreSubmitInfo timelineSubmitInfo =
+        {
+            VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            NULL,
+            array_count(waitValues),
+            waitValues,
+            array_count(signalValues),
+            signalValues
+        };
         
         VkSubmitInfo submitInfo =
         {
             VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            NULL,
+            &timelineSubmitInfo,
             array_count(imageAvailableSemaphores),
             imageAvailableSemaphores,
             waitStages,
             array_count(commandBuffers),
             commandBuffers,
-            array_count(renderFinishedSemaphores),
-            renderFinishedSemaphores
+            array_count(signalSemaphores),
+            signalSemaphores
         };
         
+        PROFILE_BEGIN(NULL, "Submit");
         if (vkQueueSubmit(vk.graphicsAndPresentQueue, 1, &submitInfo,
-                          frameFence) != VK_SUCCESS)
+                          VK_NULL_HANDLE) != VK_SUCCESS)
         {
             assert(!"failed to submit draw command buffer!");
         }
+        PROFILE_END(NULL);
+        
+        frame_pacer_end_cpu_work(&pacer, frameNumber);
         
         /*
         *  Present the image
@@ -1129,10 +3201,14 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
         VkSwapchainKHR swapchains[] = { vk.swapchain };
         u32 imageIndices[] = { imageIndex };
         
+        VkPresentIdKHR presentId;
+        u64 presentIdValue;
+        
         VkPresentInfoKHR presentInfo =
         {
             VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            NULL,
+            frame_pacer_present_id(&pacer, &presentId, &presentIdValue,
+                                   frameNumber),
             array_count(renderFinishedSemaphores), // waitSemaphoreCount
             renderFinishedSemaphores, // pWaitSemaphores
             array_count(swapchains),
@@ -1141,12 +3217,44 @@ WinMain(HINSTANCE instance, HINSTANCE prevInstance, LPSTR cmdLine, int showCmd)
             NULL, // pResults
         };
         
+        PROFILE_BEGIN(NULL, "Present");
         if (vkQueuePresentKHR(vk.graphicsAndPresentQueue, &presentInfo) ==
             VK_ERROR_OUT_OF_DATE_KHR)
         {
             // TODO: Handle window resize - recreate swapchain
         }
+        PROFILE_END(NULL);
+        
+        if (!firstFramePresented)
+        {
+            report_startup_timings();
+            firstFramePresented = true;
+        }
+        
+        frameHeapAllocations = (u64)globalHeapAllocationCount -
+            heapAllocationsBefore;
+        if (frameHeapAllocations > 0 && frameNumber > FRAMES_IN_FLIGHT)
+        {
+            debug_printf("Frame %llu: %llu heap allocations\n", frameNumber,
+                         frameHeapAllocations);
+        }
     }
     
+    /*
+    *  Shutdown
+    */
+    
+    stop_shader_hot_reload(&pipelines);
+    
+    stop_shader_hot_reload(&pipelines);
+    
+    // Next launch creates the pipelines straight from the cache
+    vkDeviceWaitIdle(vk.device);
+    save_pipeline_cache(&vk, pipelineCache);
+    
+    frame_pacer_shutdown(&pacer);
+    
+    validation_log_shutdown(&globalValidationLog);
+    
     return 0;
 }
\ No newline at end of file
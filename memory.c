@@ -0,0 +1,230 @@
+/*
+*  Memory
+*/
+
+/* Three kinds of CPU memory, besides the stack:
+
+   - Arenas, for almost everything. An arena reserves a large range of
+     address space up front and commits it as it grows, so pointers into it
+     stay valid and pushing is a bump of an offset. globalPermanentArena
+     holds what startup creates and keeps until exit, every frame slot has
+     an arena that begin_frame() resets once the GPU is done with the slot,
+     and every thread has a scratch arena for temporary data, released with
+     a mark.
+   - Pools, for fixed-size objects that come and go in any order.
+   - The heap, only for memory that is freed on its own, like shaders that
+     get replaced by hot reload. Every heap allocation goes through
+     heap_alloc() and friends, which count them, and the frame loop checks
+     that the count doesn't move once it is running. */
+
+#define ARENA_COMMIT_SIZE (64 * 1024)
+#define PERMANENT_ARENA_SIZE (1024ull * 1024 * 1024)
+#define SCRATCH_ARENA_SIZE (256ull * 1024 * 1024)
+#define FRAME_ARENA_SIZE (64ull * 1024 * 1024)
+
+static volatile LONG64 globalHeapAllocationCount;
+
+void *
+heap_alloc(size_t size)
+{
+    InterlockedIncrement64(&globalHeapAllocationCount);
+    return malloc(size);
+}
+
+void *
+heap_calloc(size_t count, size_t size)
+{
+    InterlockedIncrement64(&globalHeapAllocationCount);
+    return calloc(count, size);
+}
+
+void *
+heap_realloc(void *memory, size_t size)
+{
+    InterlockedIncrement64(&globalHeapAllocationCount);
+    return realloc(memory, size);
+}
+
+void
+heap_free(void *memory)
+{
+    free(memory);
+}
+
+/*
+*  Arenas
+*/
+
+typedef struct
+{
+    u8 *base;
+    size_t reserved;
+    
+    // Pushes are lock free, the asset jobs share the permanent arena
+    volatile LONG64 used;
+    volatile LONG64 committed;
+    
+} Arena;
+
+static Arena globalPermanentArena;
+
+// Reserves size bytes of address space, nothing is committed yet
+void
+arena_init(Arena *arena, size_t size)
+{
+    arena->base = (u8 *)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+    assert(arena->base);
+    arena->reserved = size;
+    arena->used = 0;
+    arena->committed = 0;
+}
+
+// Uninitialized memory, alignment is a power of two
+void *
+arena_push(Arena *arena, size_t size, size_t alignment)
+{
+    LONG64 offset;
+    LONG64 aligned;
+    LONG64 end;
+    
+    do
+    {
+        offset = arena->used;
+        aligned = (offset + (LONG64)alignment - 1) & ~((LONG64)alignment - 1);
+        end = aligned + (LONG64)size;
+        assert((size_t)end <= arena->reserved);
+    }
+    while (InterlockedCompareExchange64(&arena->used, end, offset) != offset);
+    
+    LONG64 committed = arena->committed;
+    if (end > committed)
+    {
+        // Committing pages twice is harmless, so racing pushes can overlap
+        LONG64 commitEnd = (end + ARENA_COMMIT_SIZE - 1) &
+            ~(LONG64)(ARENA_COMMIT_SIZE - 1);
+        commitEnd = (size_t)commitEnd < arena->reserved ?
+            commitEnd : (LONG64)arena->reserved;
+        
+        void *pages = VirtualAlloc(arena->base + committed,
+                                   (size_t)(commitEnd - committed), MEM_COMMIT,
+                                   PAGE_READWRITE);
+        assert(pages);
+        
+        while (committed < commitEnd &&
+               InterlockedCompareExchange64(&arena->committed, commitEnd,
+                                            committed) != committed)
+        {
+            committed = arena->committed;
+        }
+    }
+    
+    return arena->base + aligned;
+}
+
+void *
+arena_push_zero(Arena *arena, size_t size, size_t alignment)
+{
+    void *result = arena_push(arena, size, alignment);
+    memset(result, 0, size);
+    
+    return result;
+}
+
+#define push_array(arena, type, count) \
+    ((type *)arena_push((arena), (count) * sizeof(type), 16))
+#define push_array_zero(arena, type, count) \
+    ((type *)arena_push_zero((arena), (count) * sizeof(type), 16))
+
+// From arena, or from the heap for the caller to heap_free() when arena is
+// NULL
+void *
+arena_push_or_heap(Arena *arena, size_t size)
+{
+    return arena ? arena_push(arena, size, 16) : heap_alloc(size);
+}
+
+/* Marks and resets are for one thread at a time: everything pushed after
+   the mark is released, the pages stay committed for the next time */
+u64
+arena_mark(Arena *arena)
+{
+    return (u64)arena->used;
+}
+
+void
+arena_restore(Arena *arena, u64 mark)
+{
+    assert(mark <= (u64)arena->used);
+    arena->used = (LONG64)mark;
+}
+
+void
+arena_reset(Arena *arena)
+{
+    arena->used = 0;
+}
+
+// The calling thread's scratch arena, reserved on first use. Callers mark
+// it and restore the mark before they return.
+static __declspec(thread) Arena globalScratchArena;
+
+Arena *
+get_scratch_arena(void)
+{
+    if (!globalScratchArena.base)
+    {
+        arena_init(&globalScratchArena, SCRATCH_ARENA_SIZE);
+    }
+    
+    return &globalScratchArena;
+}
+
+/*
+*  Pools
+*/
+
+/* Fixed-size objects carved out of an arena. Freed objects go on a lock free
+   list and are handed out again first, so a pool only grows to its peak
+   number of live objects. Any thread can allocate and free. */
+typedef struct
+{
+    SLIST_HEADER freeList; // 16 byte aligned
+    Arena *arena;
+    size_t size;
+    volatile LONG liveCount;
+    
+} Pool;
+
+void
+pool_init(Pool *pool, Arena *arena, size_t size)
+{
+    InitializeSListHead(&pool->freeList);
+    pool->arena = arena;
+    
+    // Free objects hold the list entry
+    size = size > sizeof(SLIST_ENTRY) ? size : sizeof(SLIST_ENTRY);
+    pool->size = (size + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+        ~(size_t)(MEMORY_ALLOCATION_ALIGNMENT - 1);
+}
+
+void *
+pool_alloc(Pool *pool)
+{
+    InterlockedIncrement(&pool->liveCount);
+    
+    void *result = InterlockedPopEntrySList(&pool->freeList);
+    if (!result)
+    {
+        result = arena_push(pool->arena, pool->size,
+                            MEMORY_ALLOCATION_ALIGNMENT);
+    }
+    
+    return result;
+}
+
+void
+pool_free(Pool *pool, void *object)
+{
+    InterlockedPushEntrySList(&pool->freeList, (SLIST_ENTRY *)object);
+    InterlockedDecrement(&pool->liveCount);
+}
\ No newline at end of file
@@ -0,0 +1,545 @@
+/*
+*  Mesh optimizer
+*/
+
+/* Reorders an indexed triangle list for the GPU in three passes, which only
+   make sense in this order:
+   
+   - Vertex cache: triangles are reordered so that their vertices are still
+     in the post-transform cache, with Tom Forsyth's linear-speed algorithm.
+     Every vertex scores by its place in a simulated LRU cache and by how
+     few triangles it has left, and the next triangle is the best scoring
+     one of the cached vertices.
+   - Overdraw: the cache-ordered triangles are split into clusters where the
+     cache is cold anyway, and the clusters facing away from the mesh's
+     center, which tend to hide the others, are drawn first (Sander, Nehab
+     and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+     Overdraw").
+   - Vertex fetch: vertices are renumbered in the order the indices first
+     use them, so the fetches walk the vertex buffer forward.
+   
+   analyze_vertex_cache() measures the result against a FIFO cache like the
+   hardware's: the average cache miss ratio (ACMR) is transformed vertices
+   per triangle, 0.5 at best for a large grid and 3 at worst, and the
+   average transform to vertex ratio (ATVR) is transformed vertices per
+   vertex, 1 at best. The vertex shader invocations in the profiler's
+   pipeline statistics drop by the same ratio.
+   
+   The app optimizes the meshes it generates, obj_optimizer.c does the same
+   offline for exported meshes. */
+
+#define VERTEX_CACHE_SIZE 16 // FIFO entries, roughly what GPUs reuse
+
+#define FORSYTH_CACHE_SIZE 32 // LRU entries the scoring simulates
+#define FORSYTH_MAX_VALENCE 32 // vertices with more triangles score the same
+#define FORSYTH_NO_TRIANGLE 0xffffffff
+
+#define OVERDRAW_THRESHOLD 1.05f // how much worse clusters may make the ACMR
+
+typedef struct
+{
+    f32 acmr;
+    f32 atvr;
+    
+} VertexCacheStats;
+
+VertexCacheStats
+analyze_vertex_cache(u32 *indices, u32 indexCount, u32 vertexCount,
+                     u32 cacheSize)
+{
+    VertexCacheStats result = {0};
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    // When each vertex was last transformed, a FIFO cache holds the last
+    // cacheSize of them
+    u32 *vertexTime = push_array_zero(scratchArena, u32, vertexCount);
+    u32 time = cacheSize + 1;
+    u32 transformCount = 0;
+    u32 usedCount = 0;
+    
+    for (u32 i = 0; i < indexCount; i++)
+    {
+        u32 vertex = indices[i];
+        assert(vertex < vertexCount);
+        
+        usedCount += vertexTime[vertex] == 0;
+        if (time - vertexTime[vertex] > cacheSize)
+        {
+            vertexTime[vertex] = time++;
+            transformCount++;
+        }
+    }
+    
+    u32 triangleCount = indexCount / 3;
+    result.acmr = triangleCount ? (f32)transformCount / (f32)triangleCount : 0;
+    result.atvr = usedCount ? (f32)transformCount / (f32)usedCount : 0;
+    
+    arena_restore(scratchArena, scratchMark);
+    
+    return result;
+}
+
+/*
+*  Vertex cache
+*/
+
+typedef struct
+{
+    f32 cache[FORSYTH_CACHE_SIZE];
+    f32 valence[FORSYTH_MAX_VALENCE];
+    
+} ForsythScores;
+
+void
+forsyth_scores_init(ForsythScores *scores)
+{
+    // The last triangle's vertices score a little lower than the next ones,
+    // so the order doesn't reuse them in a way that leaves the rest behind
+    for (u32 i = 0; i < FORSYTH_CACHE_SIZE; i++)
+    {
+        scores->cache[i] = i < 3 ? 0.75f :
+            powf(1.0f - (f32)(i - 3) / (f32)(FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
+    
+    // Vertices with few triangles left score higher, to finish them off
+    scores->valence[0] = 0.0f;
+    for (u32 i = 1; i < FORSYTH_MAX_VALENCE; i++)
+    {
+        scores->valence[i] = 2.0f / sqrtf((f32)i);
+    }
+}
+
+f32
+forsyth_vertex_score(ForsythScores *scores, s32 cachePosition,
+                     u32 triangleCount)
+{
+    if (triangleCount == 0)
+    {
+        return -1.0f;
+    }
+    
+    f32 result = cachePosition >= 0 ? scores->cache[cachePosition] : 0.0f;
+    result += scores->valence[triangleCount < FORSYTH_MAX_VALENCE ?
+                              triangleCount : FORSYTH_MAX_VALENCE - 1];
+    
+    return result;
+}
+
+// Reorders the triangles of indices in place
+void
+optimize_vertex_cache(u32 *indices, u32 indexCount, u32 vertexCount)
+{
+    u32 triangleCount = indexCount / 3;
+    if (triangleCount == 0)
+    {
+        return;
+    }
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    ForsythScores scores;
+    forsyth_scores_init(&scores);
+    
+    // Every vertex's triangles, the ones not yet emitted come first
+    u32 *firstTriangle = push_array_zero(scratchArena, u32, vertexCount + 1);
+    u32 *liveCount = push_array_zero(scratchArena, u32, vertexCount);
+    u32 *triangles = push_array(scratchArena, u32, indexCount);
+    
+    for (u32 i = 0; i < indexCount; i++)
+    {
+        assert(indices[i] < vertexCount);
+        firstTriangle[indices[i] + 1]++;
+    }
+    for (u32 i = 0; i < vertexCount; i++)
+    {
+        firstTriangle[i + 1] += firstTriangle[i];
+    }
+    for (u32 i = 0; i < indexCount; i++)
+    {
+        u32 vertex = indices[i];
+        triangles[firstTriangle[vertex] + liveCount[vertex]++] = i / 3;
+    }
+    
+    s32 *cachePosition = push_array(scratchArena, s32, vertexCount);
+    f32 *vertexScore = push_array(scratchArena, f32, vertexCount);
+    for (u32 i = 0; i < vertexCount; i++)
+    {
+        cachePosition[i] = -1;
+        vertexScore[i] = forsyth_vertex_score(&scores, -1, liveCount[i]);
+    }
+    
+    f32 *triangleScore = push_array(scratchArena, f32, triangleCount);
+    u8 *emitted = push_array_zero(scratchArena, u8, triangleCount);
+    u32 bestTriangle = 0;
+    for (u32 i = 0; i < triangleCount; i++)
+    {
+        triangleScore[i] = vertexScore[indices[i * 3]] +
+            vertexScore[indices[i * 3 + 1]] + vertexScore[indices[i * 3 + 2]];
+        if (triangleScore[i] > triangleScore[bestTriangle])
+        {
+            bestTriangle = i;
+        }
+    }
+    
+    u32 *ordered = push_array(scratchArena, u32, indexCount);
+    u32 cache[FORSYTH_CACHE_SIZE + 3];
+    u32 cacheCount = 0;
+    u32 nextUnemitted = 0;
+    
+    for (u32 output = 0; output < triangleCount; output++)
+    {
+        // None of the cached vertices has triangles left, take the next one
+        // in the original order
+        if (bestTriangle == FORSYTH_NO_TRIANGLE)
+        {
+            while (emitted[nextUnemitted])
+            {
+                nextUnemitted++;
+            }
+            bestTriangle = nextUnemitted;
+        }
+        
+        u32 *corners = indices + bestTriangle * 3;
+        memcpy(ordered + output * 3, corners, 3 * sizeof(u32));
+        emitted[bestTriangle] = 1;
+        
+        u32 newCache[FORSYTH_CACHE_SIZE + 3];
+        u32 newCacheCount = 0;
+        
+        for (u32 i = 0; i < 3; i++)
+        {
+            u32 vertex = corners[i];
+            
+            u32 *live = triangles + firstTriangle[vertex];
+            for (u32 j = 0; j < liveCount[vertex]; j++)
+            {
+                if (live[j] == bestTriangle)
+                {
+                    live[j] = live[--liveCount[vertex]];
+                    live[liveCount[vertex]] = bestTriangle;
+                    break;
+                }
+            }
+            
+            bool cached = false;
+            for (u32 j = 0; j < newCacheCount; j++)
+            {
+                cached |= newCache[j] == vertex;
+            }
+            if (!cached)
+            {
+                newCache[newCacheCount++] = vertex;
+            }
+        }
+        
+        // The triangle's vertices move to the front, the oldest fall out
+        u32 frontCount = newCacheCount;
+        for (u32 i = 0; i < cacheCount; i++)
+        {
+            u32 vertex = cache[i];
+            bool front = false;
+            for (u32 j = 0; j < frontCount; j++)
+            {
+                front |= newCache[j] == vertex;
+            }
+            if (!front)
+            {
+                newCache[newCacheCount++] = vertex;
+            }
+        }
+        
+        for (u32 i = 0; i < newCacheCount; i++)
+        {
+            u32 vertex = newCache[i];
+            cachePosition[vertex] = i < FORSYTH_CACHE_SIZE ? (s32)i : -1;
+            vertexScore[vertex] = forsyth_vertex_score(&scores,
+                                                       cachePosition[vertex],
+                                                       liveCount[vertex]);
+        }
+        
+        // Only the triangles of vertices whose score changed need a new
+        // score, the best of them is next
+        bestTriangle = FORSYTH_NO_TRIANGLE;
+        f32 bestScore = -1.0f;
+        for (u32 i = 0; i < newCacheCount; i++)
+        {
+            u32 vertex = newCache[i];
+            u32 *live = triangles + firstTriangle[vertex];
+            
+            for (u32 j = 0; j < liveCount[vertex]; j++)
+            {
+                u32 triangle = live[j];
+                u32 *triangleCorners = indices + triangle * 3;
+                triangleScore[triangle] = vertexScore[triangleCorners[0]] +
+                    vertexScore[triangleCorners[1]] +
+                    vertexScore[triangleCorners[2]];
+                
+                if (i < FORSYTH_CACHE_SIZE &&
+                    triangleScore[triangle] > bestScore)
+                {
+                    bestScore = triangleScore[triangle];
+                    bestTriangle = triangle;
+                }
+            }
+        }
+        
+        cacheCount = newCacheCount < FORSYTH_CACHE_SIZE ?
+            newCacheCount : FORSYTH_CACHE_SIZE;
+        memcpy(cache, newCache, cacheCount * sizeof(u32));
+    }
+    
+    memcpy(indices, ordered, triangleCount * 3 * sizeof(u32));
+    
+    arena_restore(scratchArena, scratchMark);
+}
+
+/*
+*  Overdraw
+*/
+
+typedef struct
+{
+    f32 key;
+    u32 first; // triangle
+    u32 count;
+    
+} TriangleCluster;
+
+int
+compare_clusters(const void *a, const void *b)
+{
+    TriangleCluster *clusterA = (TriangleCluster *)a;
+    TriangleCluster *clusterB = (TriangleCluster *)b;
+    
+    // Largest key first, in the original order when they're equal
+    if (clusterA->key != clusterB->key)
+    {
+        return clusterA->key > clusterB->key ? -1 : 1;
+    }
+    
+    return clusterA->first < clusterB->first ? -1 : 1;
+}
+
+// Transformed vertices of a triangle, in a FIFO cache of VERTEX_CACHE_SIZE
+u32
+simulate_triangle(u32 *corners, u32 *vertexTime, u32 *time)
+{
+    u32 result = 0;
+    for (u32 i = 0; i < 3; i++)
+    {
+        if (*time - vertexTime[corners[i]] > VERTEX_CACHE_SIZE)
+        {
+            vertexTime[corners[i]] = (*time)++;
+            result++;
+        }
+    }
+    
+    return result;
+}
+
+/* Reorders clusters of the triangles of indices in place, which must
+   already be in vertex cache order. Every vertex starts with its f32
+   position, vertexSize bytes apart. */
+void
+optimize_overdraw(u32 *indices, u32 indexCount, void *vertices,
+                  u32 vertexCount, u32 vertexSize)
+{
+    u32 triangleCount = indexCount / 3;
+    if (triangleCount == 0)
+    {
+        return;
+    }
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    u32 *vertexTime = push_array_zero(scratchArena, u32, vertexCount);
+    u32 time = VERTEX_CACHE_SIZE + 1;
+    
+    // Hard boundaries, where a triangle misses all three vertices
+    u32 *clusterStart = push_array(scratchArena, u32, triangleCount + 1);
+    u32 hardCount = 0;
+    for (u32 i = 0; i < triangleCount; i++)
+    {
+        u32 misses = simulate_triangle(indices + i * 3, vertexTime, &time);
+        if (i == 0 || misses == 3)
+        {
+            clusterStart[hardCount++] = i;
+        }
+    }
+    clusterStart[hardCount] = triangleCount;
+    
+    /* Soft boundaries split the hard clusters further, as soon as the
+       triangles so far, starting with a cold cache, miss about as often as
+       the whole hard cluster does. A cold cache at every cluster is what
+       the reordering costs. */
+    TriangleCluster *clusters = push_array(scratchArena, TriangleCluster,
+                                           triangleCount);
+    u32 clusterCount = 0;
+    
+    for (u32 hard = 0; hard < hardCount; hard++)
+    {
+        u32 first = clusterStart[hard];
+        u32 end = clusterStart[hard + 1];
+        
+        time += VERTEX_CACHE_SIZE + 1;
+        u32 hardMisses = 0;
+        for (u32 i = first; i < end; i++)
+        {
+            hardMisses += simulate_triangle(indices + i * 3, vertexTime, &time);
+        }
+        f32 hardAcmr = (f32)hardMisses / (f32)(end - first);
+        
+        time += VERTEX_CACHE_SIZE + 1;
+        u32 softFirst = first;
+        u32 softMisses = 0;
+        for (u32 i = first; i < end; i++)
+        {
+            softMisses += simulate_triangle(indices + i * 3, vertexTime, &time);
+            
+            u32 softCount = i + 1 - softFirst;
+            if (i + 1 == end ||
+                (f32)softMisses <= hardAcmr * OVERDRAW_THRESHOLD *
+                (f32)softCount)
+            {
+                TriangleCluster *cluster = &clusters[clusterCount++];
+                cluster->first = softFirst;
+                cluster->count = softCount;
+                
+                time += VERTEX_CACHE_SIZE + 1;
+                softFirst = i + 1;
+                softMisses = 0;
+            }
+        }
+    }
+    
+    u8 *vertexBytes = (u8 *)vertices;
+    
+    f32 meshCenter[3] = {0};
+    for (u32 i = 0; i < indexCount; i++)
+    {
+        f32 *position = (f32 *)(vertexBytes + indices[i] * vertexSize);
+        meshCenter[0] += position[0] / (f32)indexCount;
+        meshCenter[1] += position[1] / (f32)indexCount;
+        meshCenter[2] += position[2] / (f32)indexCount;
+    }
+    
+    // How far out the cluster is along its own normal, clusters on the
+    // outside and facing out come first
+    for (u32 i = 0; i < clusterCount; i++)
+    {
+        TriangleCluster *cluster = &clusters[i];
+        
+        f32 center[3] = {0};
+        f32 normal[3] = {0};
+        f32 area = 0;
+        
+        for (u32 j = cluster->first; j < cluster->first + cluster->count; j++)
+        {
+            f32 *a = (f32 *)(vertexBytes + indices[j * 3] * vertexSize);
+            f32 *b = (f32 *)(vertexBytes + indices[j * 3 + 1] * vertexSize);
+            f32 *c = (f32 *)(vertexBytes + indices[j * 3 + 2] * vertexSize);
+            
+            f32 ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+            f32 ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+            f32 cross[3] =
+            {
+                ab[1] * ac[2] - ab[2] * ac[1],
+                ab[2] * ac[0] - ab[0] * ac[2],
+                ab[0] * ac[1] - ab[1] * ac[0],
+            };
+            f32 triangleArea = sqrtf(cross[0] * cross[0] +
+                                     cross[1] * cross[1] +
+                                     cross[2] * cross[2]);
+            
+            for (u32 k = 0; k < 3; k++)
+            {
+                center[k] += (a[k] + b[k] + c[k]) / 3.0f * triangleArea;
+                normal[k] += cross[k];
+            }
+            area += triangleArea;
+        }
+        
+        f32 normalLength = sqrtf(normal[0] * normal[0] +
+                                 normal[1] * normal[1] +
+                                 normal[2] * normal[2]);
+        cluster->key = 0;
+        if (area > 0 && normalLength > 0)
+        {
+            for (u32 k = 0; k < 3; k++)
+            {
+                cluster->key += (center[k] / area - meshCenter[k]) *
+                    normal[k] / normalLength;
+            }
+        }
+    }
+    
+    qsort(clusters, clusterCount, sizeof(TriangleCluster), compare_clusters);
+    
+    u32 *ordered = push_array(scratchArena, u32, indexCount);
+    u32 *at = ordered;
+    for (u32 i = 0; i < clusterCount; i++)
+    {
+        memcpy(at, indices + clusters[i].first * 3,
+               clusters[i].count * 3 * sizeof(u32));
+        at += clusters[i].count * 3;
+    }
+    memcpy(indices, ordered, triangleCount * 3 * sizeof(u32));
+    
+    arena_restore(scratchArena, scratchMark);
+}
+
+/*
+*  Vertex fetch
+*/
+
+/* Renumbers the vertices in the order indices first use them and moves them
+   there. Returns the number of vertices left, the ones no index uses are
+   dropped from the end. */
+u32
+optimize_vertex_fetch(void *vertices, u32 vertexCount, u32 vertexSize,
+                      u32 *indices, u32 indexCount)
+{
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    u32 *newIndex = push_array(scratchArena, u32, vertexCount);
+    memset(newIndex, 0xff, vertexCount * sizeof(u32));
+    
+    u8 *original = (u8 *)arena_push(scratchArena,
+                                    (size_t)vertexCount * vertexSize, 16);
+    memcpy(original, vertices, (size_t)vertexCount * vertexSize);
+    
+    u32 usedCount = 0;
+    for (u32 i = 0; i < indexCount; i++)
+    {
+        u32 vertex = indices[i];
+        if (newIndex[vertex] == 0xffffffff)
+        {
+            newIndex[vertex] = usedCount++;
+            memcpy((u8 *)vertices + (size_t)newIndex[vertex] * vertexSize,
+                   original + (size_t)vertex * vertexSize, vertexSize);
+        }
+        indices[i] = newIndex[vertex];
+    }
+    
+    arena_restore(scratchArena, scratchMark);
+    
+    return usedCount;
+}
+
+// All three passes, see the top of the file. The vertices start with their
+// f32 position. Returns the number of vertices left.
+u32
+optimize_mesh(void *vertices, u32 vertexCount, u32 vertexSize, u32 *indices,
+              u32 indexCount)
+{
+    optimize_vertex_cache(indices, indexCount, vertexCount);
+    optimize_overdraw(indices, indexCount, vertices, vertexCount, vertexSize);
+    
+    return optimize_vertex_fetch(vertices, vertexCount, vertexSize, indices,
+                                 indexCount);
+}
\ No newline at end of file
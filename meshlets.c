@@ -0,0 +1,702 @@
+/*
+*  Meshlets
+*/
+
+/* Large meshes are split into meshlets, small clusters of triangles that are
+   culled on the GPU as a unit. Each meshlet has a bounding sphere for frustum
+   culling and a cone around its triangles' normals for backface culling. With
+   VK_EXT_mesh_shader a task shader culls them and mesh shaders emit the
+   survivors. Otherwise a compute pass culls them into indexed indirect
+   draws. */
+
+// 64 vertices and 124 triangles fit the output limits of every mesh shader
+// implementation, 124 rather than 128 leaves room for the triangle indices
+// in 128 bytes chunks on NVIDIA
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+#define MESHLET_CULL_GROUP_SIZE 64
+#define MESHLET_TASK_GROUP_SIZE 32
+
+#define MAX_MESHLET_INSTANCES 16
+
+// std430, the structs have to match meshlet_common.glsl
+typedef struct
+{
+    Vec4 sphere; // xyz center, w radius, in object space
+    Vec4 cone; // xyz axis, w cutoff, a cutoff of 1 is never culled
+    u32 vertexOffset; // into the meshlet vertices
+    u32 triangleOffset; // into the meshlet triangles, times 3 into the indices
+    u32 vertexCount;
+    u32 triangleCount;
+    
+} GpuMeshlet;
+
+typedef struct
+{
+    Mat4 model; // rotation, translation and uniform scale, for the cones
+    Vec4 color;
+    
+} MeshletInstance;
+
+typedef struct
+{
+    u32 meshletCount;
+    u32 vertexCount; // of the mesh
+    u32 instanceCount;
+    u32 padding;
+    MeshletInstance instances[MAX_MESHLET_INSTANCES];
+    
+} MeshletInstances;
+
+typedef struct
+{
+    GpuMeshlet *meshlets;
+    u32 meshletCount;
+    u32 meshletCapacity;
+    
+    u32 *vertices; // mesh vertex of each meshlet vertex
+    u32 vertexCount;
+    u32 vertexCapacity;
+    
+    u32 *triangles; // three 8-bit meshlet vertex indices each
+    u32 triangleCount;
+    u32 triangleCapacity;
+    
+} MeshletData;
+
+// Grows array to hold at least count elements of size bytes
+void *
+grow_array(void *array, u32 *capacity, u32 count, size_t size)
+{
+    if (count > *capacity)
+    {
+        while (count > *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 1024;
+        }
+        
+        array = heap_realloc(array, *capacity * size);
+        assert(array);
+    }
+    
+    return array;
+}
+
+// Bounding sphere and normal cone of the meshlet just filled in
+void
+compute_meshlet_bounds(MeshletData *data, GpuMeshlet *meshlet,
+                       MeshVertex *vertices)
+{
+    Vec3 boxMin = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vec3 boxMax = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    
+    for (u32 i = 0; i < meshlet->vertexCount; i++)
+    {
+        f32 *p = vertices[data->vertices[meshlet->vertexOffset + i]].position;
+        boxMin = vec3(fminf(boxMin.x, p[0]), fminf(boxMin.y, p[1]),
+                      fminf(boxMin.z, p[2]));
+        boxMax = vec3(fmaxf(boxMax.x, p[0]), fmaxf(boxMax.y, p[1]),
+                      fmaxf(boxMax.z, p[2]));
+    }
+    
+    Vec3 center = vec3_scale(vec3_add(boxMin, boxMax), 0.5f);
+    f32 radius = 0;
+    for (u32 i = 0; i < meshlet->vertexCount; i++)
+    {
+        f32 *p = vertices[data->vertices[meshlet->vertexOffset + i]].position;
+        f32 distance = vec3_length(vec3_sub(vec3(p[0], p[1], p[2]), center));
+        radius = fmaxf(radius, distance);
+    }
+    
+    // The axis is the average of the triangle normals, the cone has to
+    // contain every one of them
+    Vec3 normals[MESHLET_MAX_TRIANGLES];
+    Vec3 axis = vec3(0, 0, 0);
+    
+    for (u32 i = 0; i < meshlet->triangleCount; i++)
+    {
+        u32 triangle = data->triangles[meshlet->triangleOffset + i];
+        Vec3 corners[3];
+        for (u32 j = 0; j < 3; j++)
+        {
+            u32 local = (triangle >> (j * 8)) & 0xff;
+            f32 *p = vertices[data->vertices[meshlet->vertexOffset +
+                                             local]].position;
+            corners[j] = vec3(p[0], p[1], p[2]);
+        }
+        
+        Vec3 edge1 = vec3_sub(corners[1], corners[0]);
+        Vec3 edge2 = vec3_sub(corners[2], corners[0]);
+        normals[i] = vec3_normalize(vec3_cross(edge1, edge2));
+        axis = vec3_add(axis, normals[i]);
+    }
+    
+    axis = vec3_normalize(axis);
+    
+    f32 minDot = 1;
+    for (u32 i = 0; i < meshlet->triangleCount; i++)
+    {
+        minDot = fminf(minDot, vec3_dot(normals[i], axis));
+    }
+    
+    // Seen from a direction within 90 degrees minus the cone's spread of the
+    // axis every triangle faces away, so the cutoff is the sine of the
+    // spread. Cones close to a half sphere would hardly ever cull.
+    f32 cutoff = minDot > 0.1f ? sqrtf(1 - minDot * minDot) : 1;
+    
+    meshlet->sphere = vec4(center.x, center.y, center.z, radius);
+    meshlet->cone = vec4(axis.x, axis.y, axis.z, cutoff);
+}
+
+/* Greedily packs triangles into meshlets in index order, starting a new one
+   when a triangle would exceed the vertex or triangle limit. The meshlets are
+   only as compact as the triangle order, so meshes should be ordered for
+   locality first. */
+void
+build_meshlets(MeshletData *data, MeshVertex *vertices, u32 vertexCount,
+               u32 *indices, u32 indexCount)
+{
+    // Meshlet vertex index of each mesh vertex in the current meshlet
+    u8 *localIndex = heap_alloc(vertexCount);
+    assert(localIndex);
+    memset(localIndex, 0xff, vertexCount);
+    
+    GpuMeshlet meshlet = {0};
+    
+    for (u32 i = 0; i + 2 < indexCount; i += 3)
+    {
+        u32 a = indices[i];
+        u32 b = indices[i + 1];
+        u32 c = indices[i + 2];
+        
+        if (a == b || b == c || a == c)
+        {
+            continue;
+        }
+        
+        u32 newVertices = (localIndex[a] == 0xff) + (localIndex[b] == 0xff) +
+            (localIndex[c] == 0xff);
+        
+        if (meshlet.vertexCount + newVertices > MESHLET_MAX_VERTICES ||
+            meshlet.triangleCount + 1 > MESHLET_MAX_TRIANGLES)
+        {
+            for (u32 j = 0; j < meshlet.vertexCount; j++)
+            {
+                localIndex[data->vertices[meshlet.vertexOffset + j]] = 0xff;
+            }
+            
+            data->meshlets = grow_array(data->meshlets, &data->meshletCapacity,
+                                        data->meshletCount + 1,
+                                        sizeof(GpuMeshlet));
+            data->meshlets[data->meshletCount++] = meshlet;
+            
+            memset(&meshlet, 0, sizeof(meshlet));
+            meshlet.vertexOffset = data->vertexCount;
+            meshlet.triangleOffset = data->triangleCount;
+        }
+        
+        u32 corners[3] = { a, b, c };
+        u32 triangle = 0;
+        
+        for (u32 j = 0; j < 3; j++)
+        {
+            u32 vertex = corners[j];
+            if (localIndex[vertex] == 0xff)
+            {
+                data->vertices = grow_array(data->vertices,
+                                            &data->vertexCapacity,
+                                            data->vertexCount + 1,
+                                            sizeof(u32));
+                data->vertices[data->vertexCount++] = vertex;
+                localIndex[vertex] = (u8)meshlet.vertexCount++;
+            }
+            
+            triangle |= (u32)localIndex[vertex] << (j * 8);
+        }
+        
+        data->triangles = grow_array(data->triangles, &data->triangleCapacity,
+                                     data->triangleCount + 1, sizeof(u32));
+        data->triangles[data->triangleCount++] = triangle;
+        meshlet.triangleCount++;
+    }
+    
+    if (meshlet.triangleCount > 0)
+    {
+        data->meshlets = grow_array(data->meshlets, &data->meshletCapacity,
+                                    data->meshletCount + 1, sizeof(GpuMeshlet));
+        data->meshlets[data->meshletCount++] = meshlet;
+    }
+    
+    for (u32 i = 0; i < data->meshletCount; i++)
+    {
+        compute_meshlet_bounds(data, &data->meshlets[i], vertices);
+    }
+    
+    heap_free(localIndex);
+}
+
+/* A torus with over a million triangles. Its quads are emitted in 7x7 tiles,
+   8x8 vertices and 98 triangles each, which the greedy builder turns into
+   one compact meshlet per tile. */
+void
+build_dense_torus(MeshBuilder *builder, u32 majorSegments, u32 minorSegments,
+                  f32 majorRadius, f32 minorRadius)
+{
+    assert(majorSegments % 7 == 0 && minorSegments % 7 == 0);
+    
+    mesh_builder_reserve(builder, (majorSegments + 1) * (minorSegments + 1),
+                         majorSegments * minorSegments * 6);
+    u32 base = builder->vertexCount;
+    
+    for (u32 major = 0; major <= majorSegments; major++)
+    {
+        f32 u = 6.28318531f * (f32)major / (f32)majorSegments;
+        Vec3 ringCenter = vec3(cosf(u) * majorRadius, 0,
+                               -sinf(u) * majorRadius);
+        
+        for (u32 minor = 0; minor <= minorSegments; minor++)
+        {
+            f32 v = 6.28318531f * (f32)minor / (f32)minorSegments;
+            Vec3 normal = vec3(cosf(u) * cosf(v), sinf(v),
+                               -sinf(u) * cosf(v));
+            add_vertex(builder,
+                       vec3_add(ringCenter, vec3_scale(normal, minorRadius)),
+                       normal);
+        }
+    }
+    
+    u32 stride = minorSegments + 1;
+    for (u32 tileMajor = 0; tileMajor < majorSegments; tileMajor += 7)
+    {
+        for (u32 tileMinor = 0; tileMinor < minorSegments; tileMinor += 7)
+        {
+            for (u32 major = tileMajor; major < tileMajor + 7; major++)
+            {
+                for (u32 minor = tileMinor; minor < tileMinor + 7; minor++)
+                {
+                    u32 a = base + major * stride + minor;
+                    u32 b = a + stride;
+                    u32 quad[] = { a, b, a + 1, a + 1, b, b + 1 };
+                    
+                    for (u32 i = 0; i < array_count(quad); i++)
+                    {
+                        builder->indices[builder->indexCount++] = quad[i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+*  Meshlet renderer
+*/
+
+typedef struct
+{
+    GpuBuffer drawCommands; // VkDrawIndexedIndirectCommand
+    GpuBuffer drawCount;
+    VkDescriptorSet descriptorSet;
+    
+} MeshletFrame;
+
+typedef struct
+{
+    bool meshShading; // task and mesh shaders, or compute culling
+    bool drawIndirectCount;
+    
+    u32 meshletCount;
+    u32 instanceCount;
+    u32 triangleCount; // of the mesh
+    
+    GpuBuffer meshlets;
+    GpuBuffer meshletVertices;
+    GpuBuffer meshletTriangles;
+    GpuBuffer vertexData;
+    GpuBuffer instances;
+    GpuBuffer indices; // meshlet triangles as mesh vertex indices
+    
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    MeshletFrame frames[FRAMES_IN_FLIGHT];
+    
+} MeshletRenderer;
+
+VkDescriptorSetLayout
+create_meshlet_set_layout(VulkanContext *vk)
+{
+    VkDescriptorSetLayout result;
+    
+    VkShaderStageFlags stages = VK_SHADER_STAGE_VERTEX_BIT |
+        VK_SHADER_STAGE_COMPUTE_BIT;
+    if (vk->hasMeshShader)
+    {
+        stages |= VK_SHADER_STAGE_TASK_BIT_EXT | VK_SHADER_STAGE_MESH_BIT_EXT;
+    }
+    
+    // Meshlets, meshlet vertices, meshlet triangles, vertex data,
+    // instances, draw commands and the draw count
+    VkDescriptorSetLayoutBinding bindings[7];
+    for (u32 i = 0; i < array_count(bindings); i++)
+    {
+        VkDescriptorSetLayoutBinding binding =
+        {
+            i, // binding
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            1, // descriptorCount
+            stages,
+            NULL // pImmutableSamplers
+        };
+        
+        bindings[i] = binding;
+    }
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        array_count(bindings),
+        bindings
+    };
+    
+    if (vkCreateDescriptorSetLayout(vk->device, &layoutInfo, NULL,
+                                    &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create descriptor set layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    handle_to_u64(result), "Meshlet set layout");
+    
+    return result;
+}
+
+// Builds the dense torus's meshlets, uploads them and places a few instances
+// above the scene
+void
+meshlet_renderer_init(MeshletRenderer *renderer, VulkanContext *vk,
+                      VkCommandPool commandPool, f32 sceneExtent)
+{
+    renderer->meshShading = vk->hasMeshShader;
+    renderer->drawIndirectCount = vk->enabledFeatures12.drawIndirectCount;
+    renderer->setLayout = create_meshlet_set_layout(vk);
+    
+    u64 begin = get_ticks();
+    
+    MeshBuilder builder = {0};
+    build_dense_torus(&builder, 7 * 144, 7 * 72, 1.0f, 0.35f);
+    
+    MeshletData data = {0};
+    build_meshlets(&data, builder.vertices, builder.vertexCount,
+                   builder.indices, builder.indexCount);
+    
+    renderer->meshletCount = data.meshletCount;
+    renderer->triangleCount = data.triangleCount;
+    
+    debug_printf("Meshlets: %u triangles in %u meshlets (%.1f vertices, %.1f "
+                 "triangles on average) built in %.2f ms\n",
+                 data.triangleCount, data.meshletCount,
+                 (f32)data.vertexCount / (f32)data.meshletCount,
+                 (f32)data.triangleCount / (f32)data.meshletCount,
+                 ticks_to_ms(get_ticks() - begin));
+    
+    // The compute path draws the meshlets from a plain index buffer
+    u32 *indices = heap_alloc(data.triangleCount * 3 * sizeof(u32));
+    assert(indices);
+    
+    for (u32 i = 0; i < data.meshletCount; i++)
+    {
+        GpuMeshlet *meshlet = &data.meshlets[i];
+        for (u32 j = 0; j < meshlet->triangleCount; j++)
+        {
+            u32 triangle = data.triangles[meshlet->triangleOffset + j];
+            for (u32 k = 0; k < 3; k++)
+            {
+                u32 local = (triangle >> (k * 8)) & 0xff;
+                indices[(meshlet->triangleOffset + j) * 3 + k] =
+                    data.vertices[meshlet->vertexOffset + local];
+            }
+        }
+    }
+    
+    VkBufferUsageFlags storage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    
+    renderer->meshlets =
+        create_buffer_with_data(vk, commandPool, storage, data.meshlets,
+                                data.meshletCount * sizeof(GpuMeshlet),
+                                "Meshlets");
+    renderer->meshletVertices =
+        create_buffer_with_data(vk, commandPool, storage, data.vertices,
+                                data.vertexCount * sizeof(u32),
+                                "Meshlet vertices");
+    renderer->meshletTriangles =
+        create_buffer_with_data(vk, commandPool, storage, data.triangles,
+                                data.triangleCount * sizeof(u32),
+                                "Meshlet triangles");
+    renderer->vertexData =
+        create_buffer_with_data(vk, commandPool, storage, builder.vertices,
+                                builder.vertexCount * sizeof(MeshVertex),
+                                "Meshlet vertex data");
+    renderer->indices =
+        create_buffer_with_data(vk, commandPool,
+                                VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indices,
+                                data.triangleCount * 3 * sizeof(u32),
+                                "Meshlet indices");
+    
+    // Tori leaning at different angles above the middle of the scene
+    MeshletInstances instances = {0};
+    instances.meshletCount = data.meshletCount;
+    instances.vertexCount = builder.vertexCount;
+    instances.instanceCount = 3;
+    
+    for (u32 i = 0; i < instances.instanceCount; i++)
+    {
+        f32 angle = 2.0943951f * (f32)i; // a third of a turn apart
+        f32 scale = sceneExtent * 0.15f;
+        Vec3 position = vec3(cosf(angle) * sceneExtent * 0.35f,
+                             sceneExtent * 0.3f,
+                             sinf(angle) * sceneExtent * 0.35f);
+        
+        // Tilted about x by rotating y into z, then turned
+        Mat4 tilt = mat4_identity();
+        tilt.m[5] = cosf(0.6f);
+        tilt.m[6] = sinf(0.6f);
+        tilt.m[9] = -sinf(0.6f);
+        tilt.m[10] = cosf(0.6f);
+        
+        Mat4 model = mat4_multiply(tilt, mat4_scale(vec3(scale, scale, scale)));
+        model = mat4_multiply(mat4_rotation_y(angle), model);
+        model = mat4_multiply(mat4_translation(position), model);
+        
+        instances.instances[i].model = model;
+        instances.instances[i].color = vec4(0.9f, 0.75f - 0.2f * (f32)i,
+                                            0.4f + 0.2f * (f32)i, 1);
+    }
+    
+    renderer->instanceCount = instances.instanceCount;
+    renderer->instances =
+        create_buffer_with_data(vk, commandPool, storage, &instances,
+                                sizeof(instances), "Meshlet instances");
+    
+    heap_free(indices);
+    heap_free(data.meshlets);
+    heap_free(data.vertices);
+    heap_free(data.triangles);
+    heap_free(builder.vertices);
+    heap_free(builder.indices);
+    
+    /*
+    *  Per frame draw commands and descriptor sets
+    */
+    
+    VkDescriptorPoolSize poolSize =
+    {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        7 * FRAMES_IN_FLIGHT
+    };
+    
+    VkDescriptorPoolCreateInfo poolInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        NULL,
+        0,
+        FRAMES_IN_FLIGHT, // maxSets
+        1, &poolSize
+    };
+    
+    if (vkCreateDescriptorPool(vk->device, &poolInfo, NULL,
+                               &renderer->descriptorPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create descriptor pool");
+    }
+    
+    u32 maxDraws = renderer->meshletCount * renderer->instanceCount;
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        MeshletFrame *frame = &renderer->frames[i];
+        
+        VkBufferUsageFlags indirect = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        
+        frame->drawCommands =
+            create_buffer(vk, maxDraws * sizeof(VkDrawIndexedIndirectCommand),
+                          indirect, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          "Meshlet draws");
+        frame->drawCount =
+            create_buffer(vk, sizeof(u32), indirect,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          "Meshlet draw count");
+        
+        VkDescriptorSetAllocateInfo allocInfo =
+        {
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            NULL,
+            renderer->descriptorPool,
+            1, &renderer->setLayout
+        };
+        
+        if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                     &frame->descriptorSet) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate descriptor set");
+        }
+        
+        GpuBuffer *buffers[] =
+        {
+            &renderer->meshlets,
+            &renderer->meshletVertices,
+            &renderer->meshletTriangles,
+            &renderer->vertexData,
+            &renderer->instances,
+            &frame->drawCommands,
+            &frame->drawCount,
+        };
+        
+        VkDescriptorBufferInfo bufferInfos[array_count(buffers)];
+        VkWriteDescriptorSet writes[array_count(buffers)];
+        
+        for (u32 j = 0; j < array_count(buffers); j++)
+        {
+            VkDescriptorBufferInfo bufferInfo =
+            {
+                buffers[j]->buffer,
+                0,
+                VK_WHOLE_SIZE
+            };
+            bufferInfos[j] = bufferInfo;
+            
+            VkWriteDescriptorSet write =
+            {
+                VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                NULL,
+                frame->descriptorSet,
+                j, // dstBinding
+                0, // dstArrayElement
+                1, // descriptorCount
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                NULL, // pImageInfo
+                &bufferInfos[j],
+                NULL // pTexelBufferView
+            };
+            writes[j] = write;
+        }
+        
+        vkUpdateDescriptorSets(vk->device, array_count(writes), writes,
+                               0, NULL);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                        handle_to_u64(frame->descriptorSet),
+                        "Meshlet set %u", i);
+    }
+}
+
+MeshletFrame *
+get_meshlet_frame(MeshletRenderer *renderer, FrameTimeline *frames)
+{
+    return &renderer->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+}
+
+/* Compute path only, outside the render pass. Culls every meshlet of every
+   instance into the frame's draw commands. Without drawIndirectCount all
+   commands are drawn, so the ones past the count are cleared to empty
+   draws. */
+void
+cull_meshlets(MeshletRenderer *renderer, MeshletFrame *frame,
+              VkCommandBuffer commandBuffer, VkPipeline cullPipeline,
+              VkPipelineLayout layout)
+{
+    vkCmdFillBuffer(commandBuffer, frame->drawCount.buffer, 0, VK_WHOLE_SIZE,
+                    0);
+    if (!renderer->drawIndirectCount)
+    {
+        vkCmdFillBuffer(commandBuffer, frame->drawCommands.buffer, 0,
+                        VK_WHOLE_SIZE, 0);
+    }
+    
+    VkMemoryBarrier clearBarrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        NULL,
+        VK_ACCESS_TRANSFER_WRITE_BIT, // srcAccessMask
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &clearBarrier, 0, NULL, 0, NULL);
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            layout, 1, 1, &frame->descriptorSet, 0, NULL);
+    
+    u32 invocations = renderer->meshletCount * renderer->instanceCount;
+    vkCmdDispatch(commandBuffer,
+                  (invocations + MESHLET_CULL_GROUP_SIZE - 1) /
+                  MESHLET_CULL_GROUP_SIZE, 1, 1);
+    
+    VkMemoryBarrier drawBarrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        NULL,
+        VK_ACCESS_SHADER_WRITE_BIT, // srcAccessMask
+        VK_ACCESS_INDIRECT_COMMAND_READ_BIT // dstAccessMask
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+                         1, &drawBarrier, 0, NULL, 0, NULL);
+}
+
+/* Inside the render pass, with the pipeline and the set 0 descriptors
+   bound. Called once for the depth prepass and once for the main pass, the
+   compute path reuses the culled draws, the task shader culls again. */
+void
+draw_meshlets(VulkanContext *vk, MeshletRenderer *renderer,
+              MeshletFrame *frame, VkCommandBuffer commandBuffer,
+              VkPipelineLayout layout)
+{
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            layout, 1, 1, &frame->descriptorSet, 0, NULL);
+    
+    if (renderer->meshShading)
+    {
+        u32 groupCount =
+            (renderer->meshletCount + MESHLET_TASK_GROUP_SIZE - 1) /
+            MESHLET_TASK_GROUP_SIZE;
+        vk->vkCmdDrawMeshTasksEXT(commandBuffer, groupCount,
+                                  renderer->instanceCount, 1);
+        return;
+    }
+    
+    vkCmdBindIndexBuffer(commandBuffer, renderer->indices.buffer, 0,
+                         VK_INDEX_TYPE_UINT32);
+    
+    u32 maxDraws = renderer->meshletCount * renderer->instanceCount;
+    u32 stride = sizeof(VkDrawIndexedIndirectCommand);
+    
+    if (renderer->drawIndirectCount)
+    {
+        vkCmdDrawIndexedIndirectCount(commandBuffer,
+                                      frame->drawCommands.buffer, 0,
+                                      frame->drawCount.buffer, 0,
+                                      maxDraws, stride);
+    }
+    else if (vk->enabledFeatures.multiDrawIndirect)
+    {
+        vkCmdDrawIndexedIndirect(commandBuffer, frame->drawCommands.buffer, 0,
+                                 maxDraws, stride);
+    }
+    else
+    {
+        for (u32 i = 0; i < maxDraws; i++)
+        {
+            vkCmdDrawIndexedIndirect(commandBuffer, frame->drawCommands.buffer,
+                                     i * stride, 1, stride);
+        }
+    }
+}
\ No newline at end of file
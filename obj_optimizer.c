@@ -0,0 +1,429 @@
+/*
+*  OBJ optimizer
+*/
+
+/* Offline tool that runs mesh_optimizer.c over a Wavefront OBJ. Usage:
+
+       obj_optimizer <input.obj> <output.obj>
+   
+   Faces are triangulated as fans, and corners with the same position,
+   texture coordinate and normal become one vertex, in the order the
+   exporter emitted them. The output has a v, vt and vn line per vertex in
+   fetch order, followed by the faces in the optimized order, so importers
+   that keep the file's order get the optimized mesh. Groups, materials and
+   everything else are dropped. ACMR and ATVR before and after are printed,
+   see analyze_vertex_cache(). */
+
+#include <windows.h>
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+
+typedef float f32;
+typedef double f64;
+
+// The app's 64-bit FNV-1a, see main.c
+#define HASH_SEED 0xcbf29ce484222325ull
+
+u64
+hash_bytes(u64 hash, void *data, size_t size)
+{
+    u8 *bytes = (u8 *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    
+    return hash;
+}
+
+#include "memory.c"
+#include "mesh_optimizer.c"
+
+#define OBJ_NONE 0xffffffff
+
+typedef struct
+{
+    f32 position[3]; // first, for optimize_overdraw()
+    f32 texcoord[2];
+    f32 normal[3];
+    
+} ObjVertex;
+
+typedef struct
+{
+    f32 *positions;
+    f32 *texcoords;
+    f32 *normals;
+    u32 positionCount;
+    u32 texcoordCount;
+    u32 normalCount;
+    
+    ObjVertex *vertices;
+    u32 vertexCount;
+    u32 *indices;
+    u32 indexCount;
+    
+    // Welds corners, the key is a corner's three OBJ indices and the value
+    // its vertex plus one, zero when empty
+    u32 *weldKeys;
+    u32 *weldVertices;
+    u32 weldMask;
+    
+} ObjMesh;
+
+char *
+skip_spaces(char *at)
+{
+    while (*at == ' ' || *at == '\t')
+    {
+        at++;
+    }
+    
+    return at;
+}
+
+bool
+starts_with(char *line, char *prefix)
+{
+    size_t length = strlen(prefix);
+    return strncmp(line, prefix, length) == 0 &&
+        (line[length] == ' ' || line[length] == '\t');
+}
+
+// Parses "v", "v/t", "v//n" or "v/t/n" into 0-based indices, OBJ_NONE for
+// the ones that are missing. Negative indices count back from the end.
+char *
+parse_corner(ObjMesh *mesh, char *at, u32 corner[3])
+{
+    u32 counts[3] = { mesh->positionCount, mesh->texcoordCount,
+                      mesh->normalCount };
+    
+    for (u32 i = 0; i < 3; i++)
+    {
+        corner[i] = OBJ_NONE;
+        if (i > 0)
+        {
+            if (*at != '/')
+            {
+                continue;
+            }
+            at++;
+        }
+        
+        char *end;
+        long index = strtol(at, &end, 10);
+        if (end != at)
+        {
+            index = index < 0 ? (long)counts[i] + index : index - 1;
+            if (index < 0 || (u32)index >= counts[i])
+            {
+                fprintf(stderr, "Index out of range\n");
+                exit(1);
+            }
+            corner[i] = (u32)index;
+        }
+        at = end;
+    }
+    
+    return at;
+}
+
+u32
+weld_corner(ObjMesh *mesh, u32 corner[3])
+{
+    u64 hash = hash_bytes(HASH_SEED, corner, 3 * sizeof(u32));
+    for (u32 slot = (u32)hash & mesh->weldMask; ;
+         slot = (slot + 1) & mesh->weldMask)
+    {
+        u32 *key = mesh->weldKeys + slot * 3;
+        if (mesh->weldVertices[slot] == 0)
+        {
+            memcpy(key, corner, 3 * sizeof(u32));
+            
+            ObjVertex *vertex = &mesh->vertices[mesh->vertexCount++];
+            memset(vertex, 0, sizeof(*vertex));
+            memcpy(vertex->position, mesh->positions + corner[0] * 3,
+                   3 * sizeof(f32));
+            if (corner[1] != OBJ_NONE)
+            {
+                memcpy(vertex->texcoord, mesh->texcoords + corner[1] * 2,
+                       2 * sizeof(f32));
+            }
+            if (corner[2] != OBJ_NONE)
+            {
+                memcpy(vertex->normal, mesh->normals + corner[2] * 3,
+                       3 * sizeof(f32));
+            }
+            
+            mesh->weldVertices[slot] = mesh->vertexCount;
+        }
+        
+        if (memcmp(key, corner, 3 * sizeof(u32)) == 0)
+        {
+            return mesh->weldVertices[slot] - 1;
+        }
+    }
+}
+
+/* Two passes over the text, the first counts what the second fills in.
+   Lines are split in place. */
+void
+parse_obj(ObjMesh *mesh, char *text, size_t size)
+{
+    u32 positionCount = 0;
+    u32 texcoordCount = 0;
+    u32 normalCount = 0;
+    u32 cornerCount = 0;
+    u32 triangleCount = 0;
+    
+    for (size_t i = 0; i < size; i++)
+    {
+        text[i] = text[i] == '\r' ? '\n' : text[i];
+    }
+    
+    for (char *line = text; line < text + size; line += strlen(line) + 1)
+    {
+        char *end = strchr(line, '\n');
+        if (end)
+        {
+            *end = 0;
+        }
+        
+        line = skip_spaces(line);
+        positionCount += starts_with(line, "v");
+        texcoordCount += starts_with(line, "vt");
+        normalCount += starts_with(line, "vn");
+        
+        if (starts_with(line, "f"))
+        {
+            u32 faceCorners = 0;
+            for (char *at = skip_spaces(line + 1); *at;
+                 at = skip_spaces(at))
+            {
+                faceCorners++;
+                while (*at && *at != ' ' && *at != '\t')
+                {
+                    at++;
+                }
+            }
+            
+            cornerCount += faceCorners;
+            triangleCount += faceCorners > 2 ? faceCorners - 2 : 0;
+        }
+    }
+    
+    Arena *arena = &globalPermanentArena;
+    mesh->positions = push_array(arena, f32, positionCount * 3);
+    mesh->texcoords = push_array(arena, f32, texcoordCount * 2);
+    mesh->normals = push_array(arena, f32, normalCount * 3);
+    mesh->vertices = push_array(arena, ObjVertex, cornerCount);
+    mesh->indices = push_array(arena, u32, triangleCount * 3);
+    
+    u32 weldSize = 16;
+    while (weldSize < cornerCount * 2)
+    {
+        weldSize *= 2;
+    }
+    mesh->weldKeys = push_array(arena, u32, weldSize * 3);
+    mesh->weldVertices = push_array_zero(arena, u32, weldSize);
+    mesh->weldMask = weldSize - 1;
+    
+    for (char *line = text; line < text + size; line += strlen(line) + 1)
+    {
+        char *at = skip_spaces(line);
+        
+        if (starts_with(at, "v"))
+        {
+            f32 *position = mesh->positions + mesh->positionCount++ * 3;
+            char *next = at + 1;
+            for (u32 i = 0; i < 3; i++)
+            {
+                position[i] = strtof(next, &next);
+            }
+        }
+        else if (starts_with(at, "vt"))
+        {
+            f32 *texcoord = mesh->texcoords + mesh->texcoordCount++ * 2;
+            char *next = at + 2;
+            for (u32 i = 0; i < 2; i++)
+            {
+                texcoord[i] = strtof(next, &next);
+            }
+        }
+        else if (starts_with(at, "vn"))
+        {
+            f32 *normal = mesh->normals + mesh->normalCount++ * 3;
+            char *next = at + 2;
+            for (u32 i = 0; i < 3; i++)
+            {
+                normal[i] = strtof(next, &next);
+            }
+        }
+        else if (starts_with(at, "f"))
+        {
+            u32 first = 0;
+            u32 previous = 0;
+            u32 cornerIndex = 0;
+            
+            for (at = skip_spaces(at + 1); *at; at = skip_spaces(at))
+            {
+                u32 corner[3];
+                at = parse_corner(mesh, at, corner);
+                if (corner[0] == OBJ_NONE)
+                {
+                    fprintf(stderr, "Face corner without a position\n");
+                    exit(1);
+                }
+                
+                u32 vertex = weld_corner(mesh, corner);
+                if (cornerIndex == 0)
+                {
+                    first = vertex;
+                }
+                else if (cornerIndex >= 2)
+                {
+                    u32 *triangle = mesh->indices + mesh->indexCount;
+                    triangle[0] = first;
+                    triangle[1] = previous;
+                    triangle[2] = vertex;
+                    mesh->indexCount += 3;
+                }
+                previous = vertex;
+                cornerIndex++;
+            }
+        }
+    }
+}
+
+void
+write_obj(ObjMesh *mesh, FILE *file)
+{
+    bool hasTexcoords = mesh->texcoordCount > 0;
+    bool hasNormals = mesh->normalCount > 0;
+    
+    for (u32 i = 0; i < mesh->vertexCount; i++)
+    {
+        ObjVertex *vertex = &mesh->vertices[i];
+        fprintf(file, "v %g %g %g\n", vertex->position[0],
+                vertex->position[1], vertex->position[2]);
+        if (hasTexcoords)
+        {
+            fprintf(file, "vt %g %g\n", vertex->texcoord[0],
+                    vertex->texcoord[1]);
+        }
+        if (hasNormals)
+        {
+            fprintf(file, "vn %g %g %g\n", vertex->normal[0],
+                    vertex->normal[1], vertex->normal[2]);
+        }
+    }
+    
+    for (u32 i = 0; i < mesh->indexCount; i += 3)
+    {
+        fprintf(file, "f");
+        for (u32 j = 0; j < 3; j++)
+        {
+            u32 index = mesh->indices[i + j] + 1;
+            if (hasTexcoords && hasNormals)
+            {
+                fprintf(file, " %u/%u/%u", index, index, index);
+            }
+            else if (hasTexcoords)
+            {
+                fprintf(file, " %u/%u", index, index);
+            }
+            else if (hasNormals)
+            {
+                fprintf(file, " %u//%u", index, index);
+            }
+            else
+            {
+                fprintf(file, " %u", index);
+            }
+        }
+        fprintf(file, "\n");
+    }
+}
+
+int
+main(int argumentCount, char **arguments)
+{
+    if (argumentCount != 3)
+    {
+        fprintf(stderr, "Usage: obj_optimizer <input.obj> <output.obj>\n");
+        return 1;
+    }
+    
+    arena_init(&globalPermanentArena, PERMANENT_ARENA_SIZE);
+    
+    FILE *input;
+    if (fopen_s(&input, arguments[1], "rb") != 0)
+    {
+        fprintf(stderr, "Can't read %s\n", arguments[1]);
+        return 1;
+    }
+    
+    _fseeki64(input, 0, SEEK_END);
+    size_t size = (size_t)_ftelli64(input);
+    _fseeki64(input, 0, SEEK_SET);
+    
+    char *text = push_array(&globalPermanentArena, char, size + 1);
+    size = fread(text, 1, size, input);
+    text[size] = 0;
+    fclose(input);
+    
+    ObjMesh mesh = {0};
+    parse_obj(&mesh, text, size);
+    
+    VertexCacheStats before = analyze_vertex_cache(mesh.indices,
+                                                   mesh.indexCount,
+                                                   mesh.vertexCount,
+                                                   VERTEX_CACHE_SIZE);
+    
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+    
+    mesh.vertexCount = optimize_mesh(mesh.vertices, mesh.vertexCount,
+                                     sizeof(ObjVertex), mesh.indices,
+                                     mesh.indexCount);
+    
+    QueryPerformanceCounter(&end);
+    
+    VertexCacheStats after = analyze_vertex_cache(mesh.indices,
+                                                  mesh.indexCount,
+                                                  mesh.vertexCount,
+                                                  VERTEX_CACHE_SIZE);
+    
+    printf("%u vertices, %u triangles, optimized in %.1f ms\n",
+           mesh.vertexCount, mesh.indexCount / 3,
+           (f64)(end.QuadPart - begin.QuadPart) * 1000.0 /
+           (f64)frequency.QuadPart);
+    printf("ACMR %.3f -> %.3f\n", before.acmr, after.acmr);
+    printf("ATVR %.3f -> %.3f\n", before.atvr, after.atvr);
+    
+    FILE *output;
+    if (fopen_s(&output, arguments[2], "w") != 0)
+    {
+        fprintf(stderr, "Can't write %s\n", arguments[2]);
+        return 1;
+    }
+    write_obj(&mesh, output);
+    fclose(output);
+    
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,955 @@
+/*
+*  Occlusion culling
+*/
+
+/* Two phase occlusion culling of the scene objects against a hierarchical
+   depth (Hi-Z) pyramid, all on the GPU:
+   
+   1. The early phase culls the objects that were visible last frame against
+      the frustum, and a depth only pass draws the survivors.
+   2. A compute pass reduces that depth into the pyramid, each texel the
+      farthest depth of the area it covers.
+   3. The late phase tests every object's bounding sphere against the
+      pyramid, draws the ones that are visible now but weren't drawn early
+      in the depth prepass subpass, and remembers what is visible for the
+      next frame. The main subpass draws both sets.
+   
+   What was visible last frame is a good guess for what occludes this
+   frame, and the late phase catches whatever the guess got wrong, so
+   nothing visible is ever missing, only drawn a phase later. The main
+   render pass loads the depth of the early pass instead of clearing it.
+   
+   Each object has a fixed slot in each of three draw lists (early, late and
+   all) that the culling fills with an indexed draw, empty when the object
+   isn't drawn. The CPU still records one indirect draw per object, front to
+   back, so the per object push constants stay as they are. The meshlets
+   are culled on their own and aren't occluders. Requires the depth
+   prepass. The constants and structs have to match
+   shaders/occlusion_cull.comp and shaders/hiz_downsample.comp. */
+
+#define OCCLUSION_CULL_GROUP_SIZE 64
+#define HIZ_GROUP_SIZE 8
+#define MAX_HIZ_LEVELS 16
+
+typedef enum
+{
+    OcclusionPhase_Early,
+    OcclusionPhase_Late,
+    
+} OcclusionPhase;
+
+// Draw lists in the frame's draw commands, MAX_SCENE_OBJECTS each
+typedef enum
+{
+    OcclusionDraws_Early, // in the occlusion pass
+    OcclusionDraws_Late, // in the depth prepass subpass
+    OcclusionDraws_All, // early or late, in the main subpass
+    
+    OcclusionDraws_Count
+    
+} OcclusionDraws;
+
+// std430
+typedef struct
+{
+    Vec4 sphere; // world space center and radius
+    u32 indexCount;
+    u32 firstIndex;
+    s32 vertexOffset;
+    u32 padding;
+    
+} OcclusionObject;
+
+// Counted by the culling, read back once the frame has completed
+typedef struct
+{
+    u32 drawnEarly;
+    u32 drawnLate;
+    u32 occluded;
+    u32 outsideFrustum;
+    
+} OcclusionStats;
+
+typedef struct
+{
+    u32 phase;
+    u32 objectCount;
+    u32 listSize;
+    u32 hizLevels;
+    u32 hizWidth;
+    u32 hizHeight;
+    
+} OcclusionCullConstants;
+
+typedef struct
+{
+    u32 sourceWidth;
+    u32 sourceHeight;
+    u32 width;
+    u32 height;
+    
+} HiZConstants;
+
+typedef struct
+{
+    GpuBuffer objects; // host visible, written every frame
+    GpuBuffer drawCommands; // VkDrawIndexedIndirectCommand per list
+    GpuBuffer stats; // host visible OcclusionStats
+    VkDescriptorSet descriptorSet;
+    
+} OcclusionFrame;
+
+typedef struct
+{
+    // Depth only pass of the early phase, into the scene's depth target
+    VkRenderPass renderPass;
+    VkFramebuffer framebuffer;
+    VkImageView depthView; // the depth aspect alone, for sampling
+    VkExtent2D extent;
+    
+    // R32_SFLOAT, always in the GENERAL layout. Level 0 is the largest power
+    // of two no larger than the screen.
+    VkImage hiz;
+    VkDeviceMemory hizMemory;
+    VkImageView hizView; // every level, for the culling
+    VkImageView hizLevelViews[MAX_HIZ_LEVELS];
+    u32 hizWidth;
+    u32 hizHeight;
+    u32 hizLevels;
+    VkSampler sampler;
+    
+    // One u32 per object, kept from one frame's late phase to the next
+    // frame's early phase
+    GpuBuffer visibility;
+    
+    VkDescriptorSetLayout hizSetLayout;
+    VkDescriptorSetLayout cullSetLayout;
+    VkPipelineLayout hizLayout;
+    VkPipelineLayout cullLayout; // the frame's set 0, then the culling's
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSet hizSets[MAX_HIZ_LEVELS];
+    OcclusionFrame frames[FRAMES_IN_FLIGHT];
+    
+    u32 objectCount;
+    OcclusionStats stats; // FRAMES_IN_FLIGHT frames old
+    
+} OcclusionCuller;
+
+u32
+floor_power_of_two(u32 value)
+{
+    u32 result = 1;
+    while (result * 2 <= value)
+    {
+        result *= 2;
+    }
+    
+    return result;
+}
+
+VkImageView
+create_hiz_view(VulkanContext *vk, VkImage image, u32 firstLevel,
+                u32 levelCount)
+{
+    VkImageView result;
+    
+    VkImageViewCreateInfo viewInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        NULL,
+        0,
+        image,
+        VK_IMAGE_VIEW_TYPE_2D,
+        VK_FORMAT_R32_SFLOAT,
+        {0}, // identity swizzle
+        { VK_IMAGE_ASPECT_COLOR_BIT, firstLevel, levelCount, 0, 1 }
+    };
+    
+    if (vkCreateImageView(vk->device, &viewInfo, NULL,
+                          &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create Hi-Z view");
+    }
+    
+    return result;
+}
+
+void
+create_hiz_pyramid(OcclusionCuller *culler, VulkanContext *vk)
+{
+    culler->hizWidth = floor_power_of_two(culler->extent.width);
+    culler->hizHeight = floor_power_of_two(culler->extent.height);
+    
+    u32 largest = culler->hizWidth > culler->hizHeight ?
+        culler->hizWidth : culler->hizHeight;
+    culler->hizLevels = 1;
+    while ((largest >> culler->hizLevels) > 0)
+    {
+        culler->hizLevels++;
+    }
+    assert(culler->hizLevels <= MAX_HIZ_LEVELS);
+    
+    VkImageCreateInfo imageInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        NULL,
+        0,
+        VK_IMAGE_TYPE_2D,
+        VK_FORMAT_R32_SFLOAT,
+        { culler->hizWidth, culler->hizHeight, 1 },
+        culler->hizLevels, // mipLevels
+        1, // arrayLayers
+        VK_SAMPLE_COUNT_1_BIT,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_SHARING_MODE_EXCLUSIVE,
+        0, NULL, // (no queue family indices)
+        VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    
+    if (vkCreateImage(vk->device, &imageInfo, NULL,
+                      &culler->hiz) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the Hi-Z pyramid");
+    }
+    
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk->device, culler->hiz, &requirements);
+    
+    u32 memoryType = find_memory_type(vk, requirements.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    assert(memoryType != UINT32_MAX && "No memory type for the Hi-Z pyramid");
+    
+    VkMemoryAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        NULL,
+        requirements.size,
+        memoryType
+    };
+    
+    if (vkAllocateMemory(vk->device, &allocInfo, NULL,
+                         &culler->hizMemory) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate Hi-Z memory");
+    }
+    
+    vkBindImageMemory(vk->device, culler->hiz, culler->hizMemory, 0);
+    
+    culler->hizView = create_hiz_view(vk, culler->hiz, 0, culler->hizLevels);
+    for (u32 i = 0; i < culler->hizLevels; i++)
+    {
+        culler->hizLevelViews[i] = create_hiz_view(vk, culler->hiz, i, 1);
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_IMAGE, handle_to_u64(culler->hiz),
+                    "Hi-Z pyramid");
+    set_object_name(vk, VK_OBJECT_TYPE_DEVICE_MEMORY,
+                    handle_to_u64(culler->hizMemory), "Hi-Z pyramid memory");
+    
+    // texelFetch() only, the sampler is just what sampler2D needs
+    VkSamplerCreateInfo samplerInfo =
+    {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        NULL,
+        0,
+        VK_FILTER_NEAREST, // magFilter
+        VK_FILTER_NEAREST, // minFilter
+        VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        0, // mipLodBias
+        VK_FALSE, 1, // (no anisotropy)
+        VK_FALSE, VK_COMPARE_OP_ALWAYS, // (no comparison)
+        0, VK_LOD_CLAMP_NONE, // minLod, maxLod
+        VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+        VK_FALSE // unnormalizedCoordinates
+    };
+    
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL,
+                        &culler->sampler) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the Hi-Z sampler");
+    }
+    
+    debug_printf("Hi-Z pyramid: %u x %u, %u levels\n", culler->hizWidth,
+                 culler->hizHeight, culler->hizLevels);
+}
+
+/* Clears the depth target, draws the early phase into it and leaves it for
+   the Hi-Z pass to sample. The main render pass then loads it. */
+void
+create_occlusion_pass(OcclusionCuller *culler, VulkanContext *vk,
+                      GpuImage *depth, VkFormat depthFormat,
+                      VkSampleCountFlagBits samples)
+{
+    VkAttachmentDescription depthAttachment =
+    {
+        0, // flags
+        depthFormat,
+        samples,
+        VK_ATTACHMENT_LOAD_OP_CLEAR, // load operation
+        VK_ATTACHMENT_STORE_OP_STORE, // store op (for the Hi-Z and main pass)
+        VK_ATTACHMENT_LOAD_OP_DONT_CARE, // stencil load op (ignored)
+        VK_ATTACHMENT_STORE_OP_DONT_CARE, // stencil store op (ignored)
+        VK_IMAGE_LAYOUT_UNDEFINED, // initial image layout
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL // final layout
+    };
+    
+    VkAttachmentReference depthAttachmentRef =
+    {
+        0,
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+    };
+    
+    VkSubpassDescription subpass =
+    {
+        0, // flags
+        VK_PIPELINE_BIND_POINT_GRAPHICS, // pipeline bind point
+        0, // input attachment count (ignored)
+        NULL, // input attachments (ignored)
+        0, // color attachment count (none)
+        NULL, // color attachments (none)
+        NULL, // resolve attachments (ignored)
+        &depthAttachmentRef,
+        0, // preserve attachment count (ignored)
+        NULL // preserve attachments (ignored)
+    };
+    
+    // After the previous frame's main pass is done with the depth, and
+    // before the Hi-Z pass samples it
+    VkPipelineStageFlags fragmentTests =
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    
+    VkSubpassDependency dependencies[] =
+    {
+        {
+            VK_SUBPASS_EXTERNAL, // srcSubpass
+            0, // dstSubpass
+            fragmentTests, // srcStageMask
+            fragmentTests, // dstStageMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // dstAccessMask
+            0 // dependencyFlags
+        },
+        {
+            0, // srcSubpass
+            VK_SUBPASS_EXTERNAL, // dstSubpass
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, // srcStageMask
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, // dstStageMask
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_SHADER_READ_BIT, // dstAccessMask
+            0 // dependencyFlags
+        },
+    };
+    
+    VkRenderPassCreateInfo renderPassInfo =
+    {
+        VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+        NULL,
+        0,
+        1, &depthAttachment,
+        1, &subpass,
+        array_count(dependencies), dependencies
+    };
+    
+    if (vkCreateRenderPass(vk->device, &renderPassInfo, NULL,
+                           &culler->renderPass) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the occlusion pass");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_RENDER_PASS,
+                    handle_to_u64(culler->renderPass), "Occlusion pass");
+    
+    VkFramebufferCreateInfo framebufferInfo =
+    {
+        VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        NULL,
+        0,
+        culler->renderPass,
+        1, &depth->view,
+        culler->extent.width,
+        culler->extent.height,
+        1, // layers
+    };
+    
+    if (vkCreateFramebuffer(vk->device, &framebufferInfo, NULL,
+                            &culler->framebuffer) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the occlusion framebuffer");
+    }
+    
+    VkImageViewCreateInfo viewInfo =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        NULL,
+        0,
+        depth->image,
+        VK_IMAGE_VIEW_TYPE_2D,
+        depthFormat,
+        {0}, // identity swizzle
+        { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 } // subresource range
+    };
+    
+    if (vkCreateImageView(vk->device, &viewInfo, NULL,
+                          &culler->depthView) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the sampled depth view");
+    }
+}
+
+VkDescriptorSetLayout
+create_occlusion_set_layout(VulkanContext *vk, VkDescriptorType *types,
+                            u32 typeCount, char *name)
+{
+    VkDescriptorSetLayout result;
+    
+    VkDescriptorSetLayoutBinding bindings[8];
+    assert(typeCount <= array_count(bindings));
+    
+    for (u32 i = 0; i < typeCount; i++)
+    {
+        VkDescriptorSetLayoutBinding binding =
+        {
+            i, // binding
+            types[i],
+            1, // descriptorCount
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            NULL // pImmutableSamplers
+        };
+        
+        bindings[i] = binding;
+    }
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        typeCount,
+        bindings
+    };
+    
+    if (vkCreateDescriptorSetLayout(vk->device, &layoutInfo, NULL,
+                                    &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create descriptor set layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    handle_to_u64(result), "%s", name);
+    
+    return result;
+}
+
+VkPipelineLayout
+create_occlusion_pipeline_layout(VulkanContext *vk,
+                                 VkDescriptorSetLayout *setLayouts,
+                                 u32 setLayoutCount, u32 constantsSize,
+                                 char *name)
+{
+    VkPipelineLayout result;
+    
+    VkPushConstantRange pushConstantRange =
+    {
+        VK_SHADER_STAGE_COMPUTE_BIT,
+        0, // offset
+        constantsSize
+    };
+    
+    VkPipelineLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        setLayoutCount, setLayouts,
+        1, &pushConstantRange
+    };
+    
+    if (vkCreatePipelineLayout(vk->device, &layoutInfo, NULL,
+                               &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to create pipeline layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_PIPELINE_LAYOUT, handle_to_u64(result),
+                    "%s", name);
+    
+    return result;
+}
+
+VkDescriptorSet
+allocate_occlusion_set(OcclusionCuller *culler, VulkanContext *vk,
+                       VkDescriptorSetLayout setLayout)
+{
+    VkDescriptorSet result;
+    
+    VkDescriptorSetAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        NULL,
+        culler->descriptorPool,
+        1, &setLayout
+    };
+    
+    if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                 &result) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate descriptor set");
+    }
+    
+    return result;
+}
+
+VkWriteDescriptorSet
+write_occlusion_image(VkDescriptorSet set, u32 binding, VkDescriptorType type,
+                      VkDescriptorImageInfo *imageInfo)
+{
+    VkWriteDescriptorSet result =
+    {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        NULL,
+        set,
+        binding, // dstBinding
+        0, // dstArrayElement
+        1, // descriptorCount
+        type,
+        imageInfo,
+        NULL, // pBufferInfo
+        NULL // pTexelBufferView
+    };
+    
+    return result;
+}
+
+/* depth is the scene's depth target, created with sampled usage and not
+   transient. frameSetLayout is set 0 of the culling, the frame uniforms. */
+void
+occlusion_culler_init(OcclusionCuller *culler, VulkanContext *vk,
+                      VkCommandPool commandPool, GpuImage *depth,
+                      VkFormat depthFormat, VkSampleCountFlagBits samples,
+                      VkDescriptorSetLayout frameSetLayout)
+{
+    culler->extent = vk->swapchainExtents;
+    
+    create_hiz_pyramid(culler, vk);
+    create_occlusion_pass(culler, vk, depth, depthFormat, samples);
+    
+    VkDescriptorType hizTypes[] =
+    {
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, // source
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, // destination
+    };
+    
+    // Objects, visibility, draw commands, stats and the pyramid
+    VkDescriptorType cullTypes[] =
+    {
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    };
+    
+    culler->hizSetLayout =
+        create_occlusion_set_layout(vk, hizTypes, array_count(hizTypes),
+                                    "Hi-Z set layout");
+    culler->cullSetLayout =
+        create_occlusion_set_layout(vk, cullTypes, array_count(cullTypes),
+                                    "Occlusion culling set layout");
+    
+    VkDescriptorSetLayout cullSetLayouts[] =
+    {
+        frameSetLayout,
+        culler->cullSetLayout
+    };
+    
+    culler->hizLayout =
+        create_occlusion_pipeline_layout(vk, &culler->hizSetLayout, 1,
+                                         sizeof(HiZConstants), "Hi-Z layout");
+    culler->cullLayout =
+        create_occlusion_pipeline_layout(vk, cullSetLayouts,
+                                         array_count(cullSetLayouts),
+                                         sizeof(OcclusionCullConstants),
+                                         "Occlusion culling layout");
+    
+    VkDescriptorPoolSize poolSizes[] =
+    {
+        {
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            MAX_HIZ_LEVELS + FRAMES_IN_FLIGHT
+        },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, MAX_HIZ_LEVELS },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4 * FRAMES_IN_FLIGHT },
+    };
+    
+    VkDescriptorPoolCreateInfo poolInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        NULL,
+        0,
+        MAX_HIZ_LEVELS + FRAMES_IN_FLIGHT, // maxSets
+        array_count(poolSizes),
+        poolSizes
+    };
+    
+    if (vkCreateDescriptorPool(vk->device, &poolInfo, NULL,
+                               &culler->descriptorPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the occlusion culling descriptor pool");
+    }
+    
+    /*
+    *  Hi-Z levels, each reduces the one above or the depth
+    */
+    
+    for (u32 i = 0; i < culler->hizLevels; i++)
+    {
+        VkDescriptorSet set = allocate_occlusion_set(culler, vk,
+                                                     culler->hizSetLayout);
+        culler->hizSets[i] = set;
+        
+        VkDescriptorImageInfo source =
+        {
+            culler->sampler,
+            i > 0 ? culler->hizLevelViews[i - 1] : culler->depthView,
+            i > 0 ? VK_IMAGE_LAYOUT_GENERAL :
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+        };
+        
+        VkDescriptorImageInfo destination =
+        {
+            VK_NULL_HANDLE,
+            culler->hizLevelViews[i],
+            VK_IMAGE_LAYOUT_GENERAL
+        };
+        
+        VkWriteDescriptorSet writes[] =
+        {
+            write_occlusion_image(set, 0,
+                                  VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                  &source),
+            write_occlusion_image(set, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                  &destination),
+        };
+        
+        vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0,
+                               NULL);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET, handle_to_u64(set),
+                        "Hi-Z set %u", i);
+    }
+    
+    /*
+    *  Per frame objects, draw commands and stats
+    */
+    
+    culler->visibility =
+        create_buffer(vk, MAX_SCENE_OBJECTS * sizeof(u32),
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      "Object visibility");
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        OcclusionFrame *frame = &culler->frames[i];
+        
+        frame->objects =
+            create_host_buffer(vk, MAX_SCENE_OBJECTS * sizeof(OcclusionObject),
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                               "Occlusion objects");
+        frame->drawCommands =
+            create_buffer(vk, OcclusionDraws_Count * MAX_SCENE_OBJECTS *
+                          sizeof(VkDrawIndexedIndirectCommand),
+                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                          VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          "Occlusion draws");
+        frame->stats =
+            create_host_buffer(vk, sizeof(OcclusionStats),
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                               VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                               "Occlusion stats");
+        memset(frame->stats.mapped, 0, sizeof(OcclusionStats));
+        
+        frame->descriptorSet = allocate_occlusion_set(culler, vk,
+                                                      culler->cullSetLayout);
+        
+        GpuBuffer *buffers[] =
+        {
+            &frame->objects,
+            &culler->visibility,
+            &frame->drawCommands,
+            &frame->stats,
+        };
+        
+        VkDescriptorBufferInfo bufferInfos[array_count(buffers)];
+        VkWriteDescriptorSet writes[array_count(buffers) + 1];
+        
+        for (u32 j = 0; j < array_count(buffers); j++)
+        {
+            VkDescriptorBufferInfo bufferInfo =
+            {
+                buffers[j]->buffer,
+                0,
+                VK_WHOLE_SIZE
+            };
+            bufferInfos[j] = bufferInfo;
+            
+            VkWriteDescriptorSet write =
+            {
+                VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                NULL,
+                frame->descriptorSet,
+                j, // dstBinding
+                0, // dstArrayElement
+                1, // descriptorCount
+                VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                NULL, // pImageInfo
+                &bufferInfos[j],
+                NULL // pTexelBufferView
+            };
+            writes[j] = write;
+        }
+        
+        VkDescriptorImageInfo hizInfo =
+        {
+            culler->sampler,
+            culler->hizView,
+            VK_IMAGE_LAYOUT_GENERAL
+        };
+        writes[array_count(buffers)] =
+            write_occlusion_image(frame->descriptorSet, array_count(buffers),
+                                  VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                  &hizInfo);
+        
+        vkUpdateDescriptorSets(vk->device, array_count(writes), writes, 0,
+                               NULL);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                        handle_to_u64(frame->descriptorSet),
+                        "Occlusion culling set %u", i);
+    }
+    
+    // Nothing was visible before the first frame, so its early phase draws
+    // nothing and the late phase everything in view. The pyramid stays in
+    // the GENERAL layout from here on.
+    VkCommandBuffer commandBuffer = begin_one_time_commands(vk, commandPool);
+    
+    vkCmdFillBuffer(commandBuffer, culler->visibility.buffer, 0,
+                    VK_WHOLE_SIZE, 0);
+    
+    VkImageMemoryBarrier toGeneral =
+    {
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        NULL,
+        0, // srcAccessMask
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_IMAGE_LAYOUT_GENERAL,
+        VK_QUEUE_FAMILY_IGNORED,
+        VK_QUEUE_FAMILY_IGNORED,
+        culler->hiz,
+        { VK_IMAGE_ASPECT_COLOR_BIT, 0, culler->hizLevels, 0, 1 }
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         0, NULL, 0, NULL, 1, &toGeneral);
+    
+    end_one_time_commands(vk, commandPool, commandBuffer);
+}
+
+/* Reads the stats of the frame that last used this slot, which has
+   completed, and writes the objects' bounding spheres and draws */
+OcclusionFrame *
+occlusion_begin_frame(OcclusionCuller *culler, FrameTimeline *frames,
+                      Scene *scene)
+{
+    OcclusionFrame *frame =
+        &culler->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+    
+    culler->stats = *(OcclusionStats *)frame->stats.mapped;
+    culler->objectCount = scene->objectCount;
+    
+    OcclusionObject *objects = (OcclusionObject *)frame->objects.mapped;
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        SceneObject *object = &scene->objects[i];
+        Mesh *mesh = &scene->meshes[object->mesh];
+        f32 *m = object->transform.m;
+        
+        // The mesh's sphere around its origin, scaled by the longest axis
+        f32 scale = fmaxf(vec3_length(vec3(m[0], m[1], m[2])),
+                          fmaxf(vec3_length(vec3(m[4], m[5], m[6])),
+                                vec3_length(vec3(m[8], m[9], m[10]))));
+        
+        objects[i].sphere = vec4(m[12], m[13], m[14], mesh->radius * scale);
+        objects[i].indexCount = mesh->indexCount;
+        objects[i].firstIndex = mesh->firstIndex;
+        objects[i].vertexOffset = mesh->vertexOffset;
+        objects[i].padding = 0;
+    }
+    
+    return frame;
+}
+
+/* Outside of render passes. The early phase also resets the stats. After
+   either phase its draw lists can be drawn, and after the late phase the
+   stats are ready for the CPU once the frame completes. */
+void
+cull_scene_objects(OcclusionCuller *culler, OcclusionFrame *frame,
+                   VkCommandBuffer commandBuffer, VkPipeline cullPipeline,
+                   VkDescriptorSet frameSet, OcclusionPhase phase)
+{
+    if (phase == OcclusionPhase_Early)
+    {
+        vkCmdFillBuffer(commandBuffer, frame->stats.buffer, 0, VK_WHOLE_SIZE,
+                        0);
+    }
+    
+    // Also after the previous frame's late phase wrote the visibility and
+    // read the pyramid, and its draws read this slot's commands
+    VkMemoryBarrier beforeBarrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        NULL,
+        VK_ACCESS_TRANSFER_WRITE_BIT |
+        VK_ACCESS_SHADER_WRITE_BIT, // srcAccessMask
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &beforeBarrier, 0, NULL, 0, NULL);
+    
+    VkDescriptorSet sets[] = { frameSet, frame->descriptorSet };
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            culler->cullLayout, 0, array_count(sets), sets,
+                            0, NULL);
+    
+    OcclusionCullConstants constants =
+    {
+        (u32)phase,
+        culler->objectCount,
+        MAX_SCENE_OBJECTS, // listSize
+        culler->hizLevels,
+        culler->hizWidth,
+        culler->hizHeight
+    };
+    vkCmdPushConstants(commandBuffer, culler->cullLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                       &constants);
+    
+    vkCmdDispatch(commandBuffer,
+                  (culler->objectCount + OCCLUSION_CULL_GROUP_SIZE - 1) /
+                  OCCLUSION_CULL_GROUP_SIZE, 1, 1);
+    
+    VkMemoryBarrier afterBarrier =
+    {
+        VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        NULL,
+        VK_ACCESS_SHADER_WRITE_BIT, // srcAccessMask
+        VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT
+    };
+    
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                         VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &afterBarrier, 0, NULL, 0, NULL);
+}
+
+// The depth only pass of the early phase, the caller draws the early list
+// and ends it
+void
+begin_occlusion_pass(OcclusionCuller *culler, VkCommandBuffer commandBuffer)
+{
+    VkClearValue depthClearValue;
+    depthClearValue.depthStencil.depth = 0; // the far plane, reversed-Z
+    depthClearValue.depthStencil.stencil = 0;
+    
+    VkRenderPassBeginInfo renderPassBeginInfo =
+    {
+        VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        NULL,
+        culler->renderPass,
+        culler->framebuffer,
+        { {0, 0}, culler->extent }, // renderArea
+        1, &depthClearValue
+    };
+    
+    vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo,
+                         VK_SUBPASS_CONTENTS_INLINE);
+}
+
+/* After the occlusion pass, reduces its depth into level 0 and every level
+   into the next. The levels are small enough past the first few that a
+   dispatch per level costs more in barriers than in work, which is fine for
+   a dozen levels. */
+void
+build_hiz(OcclusionCuller *culler, VkCommandBuffer commandBuffer,
+          VkPipeline depthPipeline, VkPipeline downsamplePipeline)
+{
+    u32 sourceWidth = culler->extent.width;
+    u32 sourceHeight = culler->extent.height;
+    
+    for (u32 i = 0; i < culler->hizLevels; i++)
+    {
+        u32 width = culler->hizWidth >> i;
+        u32 height = culler->hizHeight >> i;
+        width = width ? width : 1;
+        height = height ? height : 1;
+        
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          i == 0 ? depthPipeline : downsamplePipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                culler->hizLayout, 0, 1, &culler->hizSets[i],
+                                0, NULL);
+        
+        HiZConstants constants = { sourceWidth, sourceHeight, width, height };
+        vkCmdPushConstants(commandBuffer, culler->hizLayout,
+                           VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                           &constants);
+        
+        vkCmdDispatch(commandBuffer,
+                      (width + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE,
+                      (height + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+        
+        // The next level, or the late phase, reads this one
+        VkMemoryBarrier barrier =
+        {
+            VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            NULL,
+            VK_ACCESS_SHADER_WRITE_BIT, // srcAccessMask
+            VK_ACCESS_SHADER_READ_BIT // dstAccessMask
+        };
+        
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                             1, &barrier, 0, NULL, 0, NULL);
+        
+        sourceWidth = width;
+        sourceHeight = height;
+    }
+}
+
+// Offset of a draw list in the frame's draw commands, for
+// draw_scene_objects()
+VkDeviceSize
+get_occlusion_draws_offset(OcclusionDraws list)
+{
+    return (VkDeviceSize)list * MAX_SCENE_OBJECTS *
+        sizeof(VkDrawIndexedIndirectCommand);
+}
\ No newline at end of file
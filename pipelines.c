@@ -0,0 +1,987 @@
+/*
+*  Graphics pipeline creation
+*/
+
+#define MAX_SPECIALIZATION_CONSTANTS 8
+
+/* Identifies a variant of a pipeline by the values of its specialization
+   constants. constants[i] is the value of the shader's constant_id = i (bools
+   are 0 or 1), both stages see the same values. Constants past constantCount
+   keep the default written in the shader. The driver folds the constants
+   into the pipeline, so branches and loops that depend on them cost nothing
+   at runtime, unlike the same toggles read from a uniform. */
+typedef struct
+{
+    u32 constants[MAX_SPECIALIZATION_CONSTANTS];
+    u32 constantCount;
+    
+} ShaderVariantKey;
+
+typedef enum
+{
+    VertexFormat_None, // vertices are generated or pulled by the shader
+    VertexFormat_Mesh, // MeshVertex
+    VertexFormat_MeshQuantized8, // QuantizedVertex8
+    VertexFormat_MeshQuantized16, // QuantizedVertex16
+    VertexFormat_Sprite, // SpriteInstance per instance, 4 vertex strip
+    VertexFormat_DebugLine, // DebugVertex
+    
+    VertexFormat_Count
+    
+} VertexFormat;
+
+typedef struct
+{
+    u32 stride;
+    VkVertexInputRate inputRate;
+    u32 attributeCount;
+    VkVertexInputAttributeDescription attributes[4];
+    
+} VertexLayout;
+
+// Single interleaved binding, attribute i is at location i
+static VertexLayout vertexLayouts[VertexFormat_Count] =
+{
+    { 0, VK_VERTEX_INPUT_RATE_VERTEX, 0 },
+    {
+        sizeof(MeshVertex), VK_VERTEX_INPUT_RATE_VERTEX, 2,
+        {
+            { 0, 0, VK_FORMAT_R32G32B32_SFLOAT,
+              offsetof(MeshVertex, position) },
+            { 1, 0, VK_FORMAT_R32G32B32_SFLOAT,
+              offsetof(MeshVertex, normal) },
+        }
+    },
+    {
+        sizeof(QuantizedVertex8), VK_VERTEX_INPUT_RATE_VERTEX, 2,
+        {
+            { 0, 0, VK_FORMAT_R16G16B16A16_UNORM,
+              offsetof(QuantizedVertex8, position) },
+            { 1, 0, VK_FORMAT_R8G8_SNORM,
+              offsetof(QuantizedVertex8, normal) },
+        }
+    },
+    {
+        sizeof(QuantizedVertex16), VK_VERTEX_INPUT_RATE_VERTEX, 2,
+        {
+            { 0, 0, VK_FORMAT_R16G16B16A16_UNORM,
+              offsetof(QuantizedVertex16, position) },
+            { 1, 0, VK_FORMAT_R16G16_SNORM,
+              offsetof(QuantizedVertex16, normal) },
+        }
+    },
+    {
+        sizeof(SpriteInstance), VK_VERTEX_INPUT_RATE_INSTANCE, 4,
+        {
+            { 0, 0, VK_FORMAT_R32G32B32A32_SFLOAT,
+              offsetof(SpriteInstance, rect) },
+            { 1, 0, VK_FORMAT_R32G32B32A32_SFLOAT,
+              offsetof(SpriteInstance, uvRect) },
+            { 2, 0, VK_FORMAT_R8G8B8A8_UNORM,
+              offsetof(SpriteInstance, color) },
+            { 3, 0, VK_FORMAT_R32_UINT,
+              offsetof(SpriteInstance, texture) },
+        }
+    },
+    {
+        sizeof(DebugVertex), VK_VERTEX_INPUT_RATE_VERTEX, 2,
+        {
+            { 0, 0, VK_FORMAT_R32G32B32_SFLOAT,
+              offsetof(DebugVertex, position) },
+            { 1, 0, VK_FORMAT_R8G8B8A8_UNORM,
+              offsetof(DebugVertex, color) },
+        }
+    },
+};
+
+/* For the stages a pipeline doesn't have. Depth only pipelines have no
+   fragment shader and no color outputs, mesh shading pipelines have a mesh
+   shader, optionally a task shader and no vertex shader. */
+#define SHADER_NONE ShaderId_Count
+
+typedef struct
+{
+    char *name; // for debug utils and logs
+    ShaderId vertexShader;
+    ShaderId fragmentShader;
+    ShaderId taskShader;
+    ShaderId meshShader;
+    VertexFormat vertexFormat;
+    VkPrimitiveTopology topology;
+    VkCullModeFlags cullMode;
+    VkCompareOp depthCompare; // VK_COMPARE_OP_NEVER disables the depth test
+    bool depthWrite;
+    VkPipelineLayout layout;
+    VkRenderPass renderPass;
+    u32 subpass;
+    VkSampleCountFlagBits samples; // of the render pass's attachments
+    bool alphaBlend; // straight alpha over the target, off when omitted
+    
+} GraphicsPipelineDesc;
+
+typedef struct
+{
+    char *name;
+    ShaderId shader;
+    VkPipelineLayout layout;
+    
+} ComputePipelineDesc;
+
+// Specialization info for key, constants[i] goes to constant_id = i
+VkSpecializationInfo *
+get_specialization_info(ShaderVariantKey *key, VkSpecializationInfo *info,
+                        VkSpecializationMapEntry *mapEntries)
+{
+    for (u32 i = 0; i < key->constantCount; i++)
+    {
+        mapEntries[i].constantID = i;
+        mapEntries[i].offset = (u32)(i * sizeof(u32));
+        mapEntries[i].size = sizeof(u32);
+    }
+    
+    info->mapEntryCount = key->constantCount;
+    info->pMapEntries = mapEntries;
+    info->dataSize = key->constantCount * sizeof(u32);
+    info->pData = key->constants;
+    
+    return key->constantCount > 0 ? info : NULL;
+}
+
+// Named after the variant, e.g. "Scene [1]"
+void
+name_pipeline_variant(VulkanContext *vk, VkPipeline pipeline, char *name,
+                      ShaderVariantKey *key)
+{
+    char constants[128] = {0};
+    u32 at = 0;
+    for (u32 i = 0; i < key->constantCount && at < sizeof(constants); i++)
+    {
+        at += sprintf_s(constants + at, sizeof(constants) - at,
+                        i ? " %u" : "%u", key->constants[i]);
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_PIPELINE, handle_to_u64(pipeline),
+                    "%s [%s]", name, constants);
+}
+
+// Viewport and scissor are dynamic, so the same pipeline works for any
+// swapchain extent and a rebuild doesn't need to know about the swapchain.
+// spirv is indexed by ShaderId.
+VkPipeline
+create_graphics_pipeline(VulkanContext *vk, VkPipelineCache pipelineCache,
+                         GraphicsPipelineDesc *desc, ShaderVariantKey *key,
+                         LoadedFile *spirv)
+{
+    VkPipeline result;
+    
+    /*
+    *  Define Specialization Info
+    */
+    
+    VkSpecializationMapEntry mapEntries[MAX_SPECIALIZATION_CONSTANTS];
+    VkSpecializationInfo specializationInfo;
+    VkSpecializationInfo *specialization =
+        get_specialization_info(key, &specializationInfo, mapEntries);
+    
+    /*
+    *  Define Shader Stage Create Info
+    */
+    
+    struct { VkShaderStageFlagBits stage; ShaderId shader; } stages[] =
+    {
+        { VK_SHADER_STAGE_TASK_BIT_EXT, desc->taskShader },
+        { VK_SHADER_STAGE_MESH_BIT_EXT, desc->meshShader },
+        { VK_SHADER_STAGE_VERTEX_BIT, desc->vertexShader },
+        { VK_SHADER_STAGE_FRAGMENT_BIT, desc->fragmentShader },
+    };
+    
+    VkPipelineShaderStageCreateInfo shaderStageInfo[array_count(stages)];
+    u32 stageCount = 0;
+    
+    for (u32 i = 0; i < array_count(stages); i++)
+    {
+        if (stages[i].shader != SHADER_NONE)
+        {
+            LoadedFile *code = &spirv[stages[i].shader];
+            
+            VkPipelineShaderStageCreateInfo stageInfo =
+            {
+                VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                NULL,
+                0,
+                stages[i].stage,
+                create_shader_module(vk, code->data, code->size),
+                "main", // entry point
+                specialization
+            };
+            
+            shaderStageInfo[stageCount++] = stageInfo;
+        }
+    }
+    
+    bool hasFragmentShader = desc->fragmentShader != SHADER_NONE;
+    bool meshShading = desc->meshShader != SHADER_NONE;
+    
+    /*
+    *  Define Vertex Input Create Info
+    */
+    
+    VertexLayout *vertexLayout = &vertexLayouts[desc->vertexFormat];
+    
+    VkVertexInputBindingDescription vertexBinding =
+    {
+        0, // binding
+        vertexLayout->stride,
+        vertexLayout->inputRate
+    };
+    
+    VkPipelineVertexInputStateCreateInfo vertexInputStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        NULL,
+        0,
+        vertexLayout->stride ? 1 : 0, // vertexBindingDescriptionCount
+        &vertexBinding,
+        vertexLayout->attributeCount,
+        vertexLayout->attributes
+    };
+    
+    VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+        NULL,
+        0,
+        desc->topology,
+        VK_FALSE // primitiveRestartEnable
+    };
+    
+    /*
+    *  Define Dynamic State Create Info
+    */
+    
+    VkDynamicState dynamicStates[] =
+    {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
+    
+    VkPipelineDynamicStateCreateInfo dynamicStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        NULL,
+        0,
+        array_count(dynamicStates),
+        dynamicStates
+    };
+    
+    /*
+    *  Define Viewport State Create Info
+    */
+    
+    VkPipelineViewportStateCreateInfo viewportStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        NULL,
+        0,
+        1, NULL, // (dynamic viewport)
+        1, NULL // (dynamic scissor)
+    };
+    
+    /*
+    *  Define Rasterization State Create Info
+    */
+    
+    VkPipelineRasterizationStateCreateInfo rasterizationStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_FALSE, // depthClampEnable
+        VK_FALSE, // rasterizerDiscardEnable
+        VK_POLYGON_MODE_FILL, // polygonMode (solid triangles)
+        desc->cullMode, // cullMode
+        VK_FRONT_FACE_COUNTER_CLOCKWISE, // frontFace
+        VK_FALSE, 0, 0, 0, // no depth bias
+        1.0f // lineWidth
+    };
+    
+    /*
+    *  Define Multisample State Create Info
+    */
+    
+    VkPipelineMultisampleStateCreateInfo multisampleStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        NULL,
+        0,
+        desc->samples, // rasterizationSamples
+        VK_FALSE, // sampleShadingEnable
+        0, // minSampleShading
+        NULL, // pSampleMask
+        VK_FALSE, // alphaToCoverageEnable
+        VK_FALSE, // alphaToOneEnable
+    };
+    
+    /*
+    *  Define Depth Stencil State Create Info
+    */
+    
+    VkPipelineDepthStencilStateCreateInfo depthStencilStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        NULL,
+        0,
+        desc->depthCompare != VK_COMPARE_OP_NEVER, // depthTestEnable
+        desc->depthWrite, // depthWriteEnable
+        desc->depthCompare,
+        VK_FALSE, // depthBoundsTestEnable
+        VK_FALSE, // stencilTestEnable
+        {0}, {0}, // (no stencil)
+        0, 1 // depth bounds
+    };
+    
+    /*
+    *  Define Color Blend State Create Info
+    */
+    
+    VkFlags colorWriteMask =
+        VK_COLOR_COMPONENT_R_BIT |
+        VK_COLOR_COMPONENT_G_BIT |
+        VK_COLOR_COMPONENT_B_BIT |
+        VK_COLOR_COMPONENT_A_BIT;
+    
+    VkPipelineColorBlendAttachmentState colorBlendAttachment =
+    {
+        VK_FALSE, // blendEnable
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_OP_ADD,
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_FACTOR_ZERO,
+        VK_BLEND_OP_ADD,
+        colorWriteMask,
+    };
+    
+    if (desc->alphaBlend)
+    {
+        colorBlendAttachment.blendEnable = VK_TRUE;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor =
+            VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        colorBlendAttachment.dstAlphaBlendFactor =
+            VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    }
+    
+    VkPipelineColorBlendAttachmentState
+        colorBlendAttachments[] = { colorBlendAttachment };
+    
+    VkPipelineColorBlendStateCreateInfo colorBlendStateInfo =
+    {
+        VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        NULL,
+        0,
+        VK_FALSE,
+        VK_LOGIC_OP_CLEAR,
+        hasFragmentShader ? array_count(colorBlendAttachments) : 0,
+        colorBlendAttachments,
+        {0, 0, 0, 0}
+    };
+    
+    /*
+    *  Create Graphics Pipeline
+    */
+    
+    VkGraphicsPipelineCreateInfo pipelineInfo =
+    {
+        VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        NULL,
+        0,
+        stageCount,
+        shaderStageInfo,
+        meshShading ? NULL : &vertexInputStateInfo,
+        meshShading ? NULL : &inputAssemblyStateInfo,
+        NULL, // pTessellationState
+        &viewportStateInfo,
+        &rasterizationStateInfo,
+        &multisampleStateInfo,
+        &depthStencilStateInfo,
+        &colorBlendStateInfo,
+        &dynamicStateInfo,
+        desc->layout,
+        desc->renderPass,
+        desc->subpass,
+        NULL, 0 // (no base pipeline)
+    };
+    
+    // Create the graphics pipeline
+    VkResult createResult =
+        vkCreateGraphicsPipelines(vk->device, pipelineCache, 1, &pipelineInfo,
+                                  NULL, &result);
+    
+    // The modules are baked into the pipeline and aren't needed anymore
+    for (u32 i = 0; i < stageCount; i++)
+    {
+        vkDestroyShaderModule(vk->device, shaderStageInfo[i].module, NULL);
+    }
+    
+    if (createResult != VK_SUCCESS)
+    {
+        result = VK_NULL_HANDLE;
+    }
+    
+    name_pipeline_variant(vk, result, desc->name, key);
+    
+    return result;
+}
+
+VkPipeline
+create_compute_pipeline(VulkanContext *vk, VkPipelineCache pipelineCache,
+                        ComputePipelineDesc *desc, ShaderVariantKey *key,
+                        LoadedFile *code)
+{
+    VkPipeline result;
+    
+    VkSpecializationMapEntry mapEntries[MAX_SPECIALIZATION_CONSTANTS];
+    VkSpecializationInfo specializationInfo;
+    VkSpecializationInfo *specialization =
+        get_specialization_info(key, &specializationInfo, mapEntries);
+    
+    VkShaderModule shaderModule =
+        create_shader_module(vk, code->data, code->size);
+    
+    VkComputePipelineCreateInfo pipelineInfo =
+    {
+        VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        NULL,
+        0,
+        {
+            VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            NULL,
+            0,
+            VK_SHADER_STAGE_COMPUTE_BIT,
+            shaderModule,
+            "main", // entry point
+            specialization
+        },
+        desc->layout,
+        NULL, 0 // (no base pipeline)
+    };
+    
+    VkResult createResult =
+        vkCreateComputePipelines(vk->device, pipelineCache, 1, &pipelineInfo,
+                                 NULL, &result);
+    
+    vkDestroyShaderModule(vk->device, shaderModule, NULL);
+    
+    if (createResult != VK_SUCCESS)
+    {
+        result = VK_NULL_HANDLE;
+    }
+    
+    name_pipeline_variant(vk, result, desc->name, key);
+    
+    return result;
+}
+
+/*
+*  Pipeline library
+*/
+
+typedef enum
+{
+    PipelineId_DepthPrepass,
+    PipelineId_Scene,
+    PipelineId_LightBinning,
+    PipelineId_MeshletCull,
+    PipelineId_MeshletPrepass,
+    PipelineId_Meshlets,
+    PipelineId_OcclusionDepth,
+    PipelineId_HiZDepth,
+    PipelineId_HiZDownsample,
+    PipelineId_OcclusionCull,
+    PipelineId_Sprites,
+    PipelineId_Text,
+    PipelineId_DebugLines,
+    
+    PipelineId_Count
+    
+} PipelineId;
+
+#define MAX_PIPELINE_VARIANTS 32
+
+typedef struct
+{
+    ShaderVariantKey key;
+    
+    // Only touched by the main thread, bound by the frame
+    VkPipeline pipeline;
+    
+    // Published by the reload thread, swapped in at the next frame boundary
+    void *volatile pending;
+    
+} PipelineVariant;
+
+typedef struct
+{
+    bool isCompute;
+    GraphicsPipelineDesc desc;
+    ComputePipelineDesc computeDesc;
+    
+    // Variants are only ever appended, so an index stays valid for the
+    // lifetime of the library
+    volatile LONG variantCount;
+    PipelineVariant variants[MAX_PIPELINE_VARIANTS];
+    
+    // Bumped with the library lock held exclusively whenever the SPIR-V of
+    // one of the slot's shaders is replaced, see get_pipeline_variant()
+    u32 shaderGeneration;
+    
+} PipelineSlot;
+
+typedef struct
+{
+    VulkanContext *vk;
+    VkPipelineCache cache;
+    PipelineSlot slots[PipelineId_Count];
+    
+    // SPIR-V of every shader, new variants are built from it. Replaced by the
+    // reload thread under an exclusive lock, the main thread holds it shared
+    // while it builds a variant and exclusively while it appends one.
+    SRWLOCK lock;
+    LoadedFile spirv[ShaderId_Count];
+    
+    // Startup's SPIR-V lives in the permanent arena, reloaded SPIR-V on the
+    // heap until it's replaced in turn
+    bool spirvOnHeap[ShaderId_Count];
+    
+    HANDLE watcherThread;
+    HANDLE stopWatcher; // event, set at shutdown
+    
+} PipelineLibrary;
+
+// The library keeps the SPIR-V, which has to live as long as it does
+void
+pipeline_library_init(PipelineLibrary *library, VulkanContext *vk,
+                      VkPipelineCache cache, LoadedFile *spirv)
+{
+    library->vk = vk;
+    library->cache = cache;
+    InitializeSRWLock(&library->lock);
+    
+    for (u32 i = 0; i < ShaderId_Count; i++)
+    {
+        library->spirv[i] = spirv[i];
+    }
+}
+
+bool
+variant_keys_match(ShaderVariantKey *a, ShaderVariantKey *b)
+{
+    return a->constantCount == b->constantCount &&
+        memcmp(a->constants, b->constants,
+               a->constantCount * sizeof(u32)) == 0;
+}
+
+char *
+get_slot_name(PipelineSlot *slot)
+{
+    return slot->isCompute ? slot->computeDesc.name : slot->desc.name;
+}
+
+bool
+slot_uses_shader(PipelineSlot *slot, ShaderId shader)
+{
+    if (slot->isCompute)
+    {
+        return slot->computeDesc.shader == shader;
+    }
+    
+    return slot->desc.vertexShader == shader ||
+        slot->desc.fragmentShader == shader ||
+        slot->desc.taskShader == shader ||
+        slot->desc.meshShader == shader;
+}
+
+// Builds one variant of the slot from the current SPIR-V, the caller holds the
+// library lock
+VkPipeline
+build_slot_variant(PipelineLibrary *library, PipelineSlot *slot,
+                   ShaderVariantKey *key)
+{
+    if (slot->isCompute)
+    {
+        ComputePipelineDesc *desc = &slot->computeDesc;
+        return create_compute_pipeline(library->vk, library->cache, desc, key,
+                                       &library->spirv[desc->shader]);
+    }
+    
+    return create_graphics_pipeline(library->vk, library->cache, &slot->desc,
+                                    key, library->spirv);
+}
+
+/* Returns the pipeline specialized for key, building it the first time the key
+   is seen. Building a pipeline takes milliseconds, so variants that are known
+   up front should be requested at load time rather than mid frame. Main thread
+   only. */
+VkPipeline
+get_pipeline_variant(PipelineLibrary *library, PipelineId id,
+                     ShaderVariantKey *key)
+{
+    PipelineSlot *slot = &library->slots[id];
+    assert(key->constantCount <= MAX_SPECIALIZATION_CONSTANTS);
+    
+    // The main thread is the only one appending variants, so it can search
+    // without taking the lock
+    u32 variantCount = (u32)slot->variantCount;
+    for (u32 i = 0; i < variantCount; i++)
+    {
+        if (variant_keys_match(&slot->variants[i].key, key))
+        {
+            return slot->variants[i].pipeline;
+        }
+    }
+    
+    assert(variantCount < MAX_PIPELINE_VARIANTS);
+    
+    u64 begin = get_ticks();
+    
+    // A reload may replace the SPIR-V between the build and the append, and
+    // its rebuild may already be past the variants it saw. A variant built
+    // from replaced SPIR-V is built again rather than appended stale.
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    for (;;)
+    {
+        AcquireSRWLockShared(&library->lock);
+        u32 generation = slot->shaderGeneration;
+        pipeline = build_slot_variant(library, slot, key);
+        ReleaseSRWLockShared(&library->lock);
+        
+        if (!pipeline)
+        {
+            assert(!"Failed to create pipeline!");
+        }
+        
+        AcquireSRWLockExclusive(&library->lock);
+        bool current = slot->shaderGeneration == generation;
+        if (current)
+        {
+            PipelineVariant *variant = &slot->variants[variantCount];
+            variant->key = *key;
+            variant->pipeline = pipeline;
+            variant->pending = NULL;
+            slot->variantCount = variantCount + 1;
+        }
+        ReleaseSRWLockExclusive(&library->lock);
+        
+        if (current)
+        {
+            break;
+        }
+        
+        // Never bound, nothing can be using it
+        vkDestroyPipeline(library->vk->device, pipeline, NULL);
+    }
+    
+    debug_printf("Pipeline %s: built variant %u in %.2f ms\n",
+                 get_slot_name(slot), variantCount,
+                 ticks_to_ms(get_ticks() - begin));
+    
+    return pipeline;
+}
+
+// Registers a pipeline and builds its unspecialized variant
+void
+pipeline_library_add(PipelineLibrary *library, PipelineId id,
+                     GraphicsPipelineDesc *desc)
+{
+    library->slots[id].desc = *desc;
+    
+    ShaderVariantKey defaultKey = {0};
+    get_pipeline_variant(library, id, &defaultKey);
+}
+
+void
+pipeline_library_add_compute(PipelineLibrary *library, PipelineId id,
+                             ComputePipelineDesc *desc)
+{
+    library->slots[id].isCompute = true;
+    library->slots[id].computeDesc = *desc;
+    
+    ShaderVariantKey defaultKey = {0};
+    get_pipeline_variant(library, id, &defaultKey);
+}
+
+// The pipeline with every specialization constant at its default value
+VkPipeline
+get_pipeline(PipelineLibrary *library, PipelineId id)
+{
+    return library->slots[id].variants[0].pipeline;
+}
+
+/* Called at the start of every frame, before any command is recorded.
+   Pipelines replaced by a reload are handed to the frame timeline, which
+   destroys them once every frame that could have bound them has completed, so
+   a reload never stalls the queue. */
+void
+pipeline_library_begin_frame(PipelineLibrary *library, FrameTimeline *frames)
+{
+    for (u32 i = 0; i < PipelineId_Count; i++)
+    {
+        PipelineSlot *slot = &library->slots[i];
+        
+        u32 variantCount = (u32)slot->variantCount;
+        for (u32 j = 0; j < variantCount; j++)
+        {
+            PipelineVariant *variant = &slot->variants[j];
+            
+            VkPipeline pending =
+                (VkPipeline)InterlockedExchangePointer(&variant->pending, NULL);
+            
+            if (pending)
+            {
+                defer_destroy(frames, DeferredDestroy_Pipeline,
+                              handle_to_u64(variant->pipeline),
+                              frames->frameNumber - 1);
+                
+                variant->pipeline = pending;
+            }
+        }
+    }
+}
+
+/*
+*  Shader hot reload
+*/
+
+bool
+shader_compiled(bool *compiled, ShaderId shader)
+{
+    return shader != SHADER_NONE && compiled[shader];
+}
+
+void
+rebuild_pipelines(PipelineLibrary *library, bool *shaderChanged)
+{
+    bool compiled[ShaderId_Count] = {0};
+    
+    for (u32 i = 0; i < ShaderId_Count; i++)
+    {
+        if (shaderChanged[i])
+        {
+            u64 begin = get_ticks();
+            LoadedFile spirv = recompile_shader((ShaderId)i);
+            compiled[i] = spirv.size > 0;
+            
+            debug_printf("Shader reload: %s %s in %.2f ms\n",
+                         shaderFiles[i].source,
+                         compiled[i] ? "compiled" : "failed to compile",
+                         ticks_to_ms(get_ticks() - begin));
+            
+            // Variants the main thread builds from now on use the new code,
+            // the ones it is building now are built again
+            if (compiled[i])
+            {
+                AcquireSRWLockExclusive(&library->lock);
+                LoadedFile old = library->spirv[i];
+                bool oldOnHeap = library->spirvOnHeap[i];
+                library->spirv[i] = spirv;
+                library->spirvOnHeap[i] = true;
+                for (u32 j = 0; j < PipelineId_Count; j++)
+                {
+                    if (slot_uses_shader(&library->slots[j], (ShaderId)i))
+                    {
+                        library->slots[j].shaderGeneration++;
+                    }
+                }
+                ReleaseSRWLockExclusive(&library->lock);
+                
+                if (oldOnHeap)
+                {
+                    heap_free(old.data);
+                }
+            }
+        }
+    }
+    
+    for (u32 i = 0; i < PipelineId_Count; i++)
+    {
+        PipelineSlot *slot = &library->slots[i];
+        
+        // A shader that failed to compile keeps its pipelines as they are
+        bool rebuild = slot->isCompute ?
+            compiled[slot->computeDesc.shader] :
+            shader_compiled(compiled, slot->desc.vertexShader) ||
+            shader_compiled(compiled, slot->desc.fragmentShader) ||
+            shader_compiled(compiled, slot->desc.taskShader) ||
+            shader_compiled(compiled, slot->desc.meshShader);
+        
+        // Slots of optional passes may never have been added
+        if (!rebuild || slot->variantCount == 0)
+        {
+            continue;
+        }
+        
+        AcquireSRWLockShared(&library->lock);
+        
+        u64 begin = get_ticks();
+        u32 variantCount = (u32)slot->variantCount;
+        for (u32 j = 0; j < variantCount; j++)
+        {
+            PipelineVariant *variant = &slot->variants[j];
+            
+            VkPipeline pipeline =
+                build_slot_variant(library, slot, &variant->key);
+            
+            if (pipeline)
+            {
+                // A pipeline that was published but never swapped in was
+                // never bound either, so it can go right away
+                VkPipeline unused = (VkPipeline)
+                    InterlockedExchangePointer(&variant->pending,
+                                               (void *)pipeline);
+                
+                if (unused)
+                {
+                    vkDestroyPipeline(library->vk->device, unused, NULL);
+                }
+            }
+        }
+        
+        ReleaseSRWLockShared(&library->lock);
+        
+        debug_printf("Shader reload: rebuilt %u variants of pipeline %s in "
+                     "%.2f ms\n", variantCount, get_slot_name(slot),
+                     ticks_to_ms(get_ticks() - begin));
+    }
+}
+
+DWORD WINAPI
+shader_watcher_thread(LPVOID param)
+{
+    PipelineLibrary *library = (PipelineLibrary *)param;
+    
+    HANDLE directory = CreateFile(SHADER_DIRECTORY, FILE_LIST_DIRECTORY,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                  FILE_SHARE_DELETE,
+                                  NULL, OPEN_EXISTING,
+                                  FILE_FLAG_BACKUP_SEMANTICS |
+                                  FILE_FLAG_OVERLAPPED, NULL);
+    
+    if (directory == INVALID_HANDLE_VALUE)
+    {
+        debug_printf("Shader reload: can't watch " SHADER_DIRECTORY "\n");
+        return 1;
+    }
+    
+    // DWORD aligned, as ReadDirectoryChangesW requires
+    DWORD changes[1024];
+    
+    // Overlapped, so the wait for changes also ends when the library stops
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    HANDLE events[] = { overlapped.hEvent, library->stopWatcher };
+    
+    for (;;)
+    {
+        DWORD bytesReturned = 0;
+        ResetEvent(overlapped.hEvent);
+        if (!ReadDirectoryChangesW(directory, changes, sizeof(changes), FALSE,
+                                   FILE_NOTIFY_CHANGE_LAST_WRITE |
+                                   FILE_NOTIFY_CHANGE_FILE_NAME,
+                                   NULL, &overlapped, NULL))
+        {
+            break;
+        }
+        
+        if (WaitForMultipleObjects(array_count(events), events, FALSE,
+                                   INFINITE) != WAIT_OBJECT_0)
+        {
+            CancelIo(directory);
+            GetOverlappedResult(directory, &overlapped, &bytesReturned, TRUE);
+            break;
+        }
+        
+        if (!GetOverlappedResult(directory, &overlapped, &bytesReturned,
+                                 FALSE))
+        {
+            break;
+        }
+        
+        // Editors tend to save in several steps, give them a moment so one
+        // save results in one rebuild
+        Sleep(100);
+        
+        bool shaderChanged[ShaderId_Count] = {0};
+        bool anyChanged = false;
+        
+        u8 *at = (u8 *)changes;
+        while (bytesReturned > 0)
+        {
+            FILE_NOTIFY_INFORMATION *info = (FILE_NOTIFY_INFORMATION *)at;
+            
+            char fileName[MAX_PATH] = {0};
+            WideCharToMultiByte(CP_UTF8, 0, info->FileName,
+                                (int)(info->FileNameLength / sizeof(WCHAR)),
+                                fileName, (int)sizeof(fileName) - 1,
+                                NULL, NULL);
+            
+            // Include files aren't tracked per shader, so a change to one
+            // reloads every shader. The compile cache makes that cheap for
+            // the shaders that don't include it.
+            char *extension = strrchr(fileName, '.');
+            bool isInclude = extension && _stricmp(extension, ".glsl") == 0;
+            
+            for (u32 i = 0; i < ShaderId_Count; i++)
+            {
+                if (isInclude ||
+                    _stricmp(fileName, shaderFiles[i].source) == 0)
+                {
+                    shaderChanged[i] = true;
+                    anyChanged = true;
+                }
+            }
+            
+            if (info->NextEntryOffset == 0)
+            {
+                break;
+            }
+            at += info->NextEntryOffset;
+        }
+        
+        if (anyChanged)
+        {
+            rebuild_pipelines(library, shaderChanged);
+        }
+    }
+    
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(directory);
+    return 0;
+}
+
+void
+start_shader_hot_reload(PipelineLibrary *library)
+{
+    library->stopWatcher = CreateEvent(NULL, TRUE, FALSE, NULL);
+    library->watcherThread = CreateThread(NULL, 0, shader_watcher_thread,
+                                          library, 0, NULL);
+    assert(library->stopWatcher && library->watcherThread);
+}
+
+// Lets a rebuild in progress finish, then ends the watcher thread
+void
+stop_shader_hot_reload(PipelineLibrary *library)
+{
+    if (!library->watcherThread)
+    {
+        return;
+    }
+    
+    SetEvent(library->stopWatcher);
+    WaitForSingleObject(library->watcherThread, INFINITE);
+    
+    CloseHandle(library->watcherThread);
+    CloseHandle(library->stopWatcher);
+    library->watcherThread = NULL;
+}
\ No newline at end of file
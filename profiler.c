@@ -0,0 +1,571 @@
+/*
+*  Profiler
+*/
+
+/* PROFILE_BEGIN(commandBuffer, name) and PROFILE_END(commandBuffer) mark a
+   scope three ways at once: a CPU zone timed with QueryPerformanceCounter, a
+   pair of GPU timestamps around the commands recorded in between, and a
+   debug-utils label with the same name, so a RenderDoc capture lines up with
+   our own numbers. Pass a NULL command buffer for CPU only zones.
+   
+   The timestamps of a frame are read back when its frame slot comes around
+   again, by then the timeline says the frame has completed, so reading the
+   results never waits on the GPU. Averages per scope are printed to the
+   debugger output every second. Main thread only.
+   
+   PROFILE_PASS_BEGIN/PROFILE_PASS_END also count what the pipeline did in
+   between with a pipeline statistics query, which shows why a pass is slow
+   (overdraw, poor vertex reuse) rather than only that it is. Passes can't
+   nest, Vulkan allows one active statistics query per command buffer. */
+
+#define PROFILER_MAX_SCOPES 64 // per frame
+#define PROFILER_MAX_DEPTH 16
+#define PROFILER_MAX_PASSES 16 // per frame
+
+// Results come back in the order of the bits
+#define PROFILER_STATISTICS \
+    (VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_CLIPPING_INVOCATIONS_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT | \
+     VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT)
+
+typedef enum
+{
+    PipelineStatistic_InputVertices,
+    PipelineStatistic_InputPrimitives,
+    PipelineStatistic_VertexInvocations,
+    PipelineStatistic_ClippingInvocations,
+    PipelineStatistic_ClippingPrimitives,
+    PipelineStatistic_FragmentInvocations,
+    PipelineStatistic_ComputeInvocations,
+    
+    PipelineStatistic_Count
+    
+} PipelineStatistic;
+
+typedef struct
+{
+    char *name;
+    u32 depth;
+    u64 cpuBegin;
+    u64 cpuEnd;
+    u32 query; // begin timestamp, end is the next one. UINT32_MAX if CPU only
+    u32 statisticsQuery; // UINT32_MAX unless the scope is a pass
+    
+} ProfileScope;
+
+typedef struct
+{
+    u64 frameNumber; // 0 until the slot records its first frame
+    VkQueryPool timestamps;
+    u32 queryCount;
+    VkQueryPool statistics;
+    u32 statisticsCount;
+    ProfileScope scopes[PROFILER_MAX_SCOPES];
+    u32 scopeCount;
+    
+} ProfileFrame;
+
+typedef struct
+{
+    char *name;
+    u32 depth;
+    u32 count;
+    u32 gpuCount;
+    f64 cpuMs;
+    f64 gpuMs;
+    u32 statisticsCount;
+    u64 statistics[PipelineStatistic_Count];
+    
+} ProfileTotal;
+
+typedef struct
+{
+    VulkanContext *vk;
+    bool hasTimestamps;
+    bool hasStatistics; // pipelineStatisticsQuery is enabled
+    f64 timestampPeriod; // nanoseconds per timestamp tick
+    u64 timestampMask; // timestamps only have timestampValidBits bits
+    
+    ProfileFrame frames[FRAMES_IN_FLIGHT];
+    ProfileFrame *current;
+    bool passActive;
+    
+    u32 stack[PROFILER_MAX_DEPTH];
+    u32 stackDepth;
+    
+    // Since the last report
+    ProfileTotal totals[PROFILER_MAX_SCOPES];
+    u32 totalCount;
+    u32 frameCount;
+    u64 lastReport;
+    
+    // The totals of the last report, for on-screen display
+    ProfileTotal reported[PROFILER_MAX_SCOPES];
+    u32 reportedCount;
+    u32 reportedFrameCount;
+    
+} Profiler;
+
+static Profiler globalProfiler;
+
+void
+profiler_init(Profiler *profiler, VulkanContext *vk)
+{
+    profiler->vk = vk;
+    profiler->timestampPeriod =
+        vk->physicalDeviceProperties.limits.timestampPeriod;
+    profiler->lastReport = get_ticks();
+    
+    u32 familyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->physicalDevice, &familyCount,
+                                             NULL);
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    VkQueueFamilyProperties *families =
+        push_array(scratch, VkQueueFamilyProperties, familyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(vk->physicalDevice, &familyCount,
+                                             families);
+    
+    u32 validBits =
+        families[vk->graphicsAndPresentQueueFamily].timestampValidBits;
+    arena_restore(scratch, scratchMark);
+    
+    profiler->hasTimestamps = validBits > 0;
+    profiler->timestampMask = validBits >= 64 ? UINT64_MAX :
+        ((u64)1 << validBits) - 1;
+    profiler->hasStatistics = vk->enabledFeatures.pipelineStatisticsQuery;
+    
+    if (!profiler->hasStatistics)
+    {
+        debug_printf("Profiler: no pipeline statistics queries\n");
+    }
+    
+    VkQueryPoolCreateInfo statisticsPoolInfo =
+    {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        NULL,
+        0,
+        VK_QUERY_TYPE_PIPELINE_STATISTICS,
+        PROFILER_MAX_PASSES, // queryCount
+        PROFILER_STATISTICS
+    };
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT && profiler->hasStatistics; i++)
+    {
+        ProfileFrame *frame = &profiler->frames[i];
+        
+        if (vkCreateQueryPool(vk->device, &statisticsPoolInfo, NULL,
+                              &frame->statistics) != VK_SUCCESS)
+        {
+            assert(!"Failed to create the profiler's statistics query pool");
+        }
+        
+        vkResetQueryPool(vk->device, frame->statistics, 0,
+                         statisticsPoolInfo.queryCount);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_QUERY_POOL,
+                        handle_to_u64(frame->statistics),
+                        "Profiler pipeline statistics %u", i);
+    }
+    
+    if (!profiler->hasTimestamps)
+    {
+        debug_printf("Profiler: no timestamp support, CPU times only\n");
+        return;
+    }
+    
+    VkQueryPoolCreateInfo queryPoolInfo =
+    {
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        NULL,
+        0,
+        VK_QUERY_TYPE_TIMESTAMP,
+        2 * PROFILER_MAX_SCOPES, // queryCount
+        0 // pipelineStatistics
+    };
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        ProfileFrame *frame = &profiler->frames[i];
+        
+        if (vkCreateQueryPool(vk->device, &queryPoolInfo, NULL,
+                              &frame->timestamps) != VK_SUCCESS)
+        {
+            assert(!"Failed to create the profiler's query pool");
+        }
+        
+        // Queries have to be reset before their first use
+        vkResetQueryPool(vk->device, frame->timestamps, 0,
+                         queryPoolInfo.queryCount);
+        
+        set_object_name(vk, VK_OBJECT_TYPE_QUERY_POOL,
+                        handle_to_u64(frame->timestamps),
+                        "Profiler timestamps %u", i);
+    }
+}
+
+// Scopes are matched by name and nesting depth across frames
+ProfileTotal *
+profiler_accumulate(Profiler *profiler, ProfileScope *scope, f64 cpuMs,
+                    f64 gpuMs, bool hasGpu)
+{
+    ProfileTotal *total = NULL;
+    for (u32 i = 0; i < profiler->totalCount; i++)
+    {
+        if (profiler->totals[i].depth == scope->depth &&
+            strcmp(profiler->totals[i].name, scope->name) == 0)
+        {
+            total = &profiler->totals[i];
+            break;
+        }
+    }
+    
+    if (!total)
+    {
+        if (profiler->totalCount == array_count(profiler->totals))
+        {
+            return NULL;
+        }
+        
+        total = &profiler->totals[profiler->totalCount++];
+        memset(total, 0, sizeof(*total));
+        total->name = scope->name;
+        total->depth = scope->depth;
+    }
+    
+    total->count++;
+    total->cpuMs += cpuMs;
+    
+    if (hasGpu)
+    {
+        total->gpuCount++;
+        total->gpuMs += gpuMs;
+    }
+    
+    return total;
+}
+
+void
+profiler_collect(Profiler *profiler, ProfileFrame *frame)
+{
+    u64 timestamps[2 * PROFILER_MAX_SCOPES];
+    bool hasGpu = false;
+    
+    if (frame->queryCount > 0)
+    {
+        // The frame has completed, so the results are available without
+        // VK_QUERY_RESULT_WAIT_BIT
+        VkResult result =
+            vkGetQueryPoolResults(profiler->vk->device, frame->timestamps, 0,
+                                  frame->queryCount, sizeof(timestamps),
+                                  timestamps, sizeof(u64),
+                                  VK_QUERY_RESULT_64_BIT);
+        hasGpu = result == VK_SUCCESS;
+    }
+    
+    u64 statistics[PROFILER_MAX_PASSES][PipelineStatistic_Count];
+    bool hasStatistics = false;
+    
+    if (frame->statisticsCount > 0)
+    {
+        VkResult result =
+            vkGetQueryPoolResults(profiler->vk->device, frame->statistics, 0,
+                                  frame->statisticsCount, sizeof(statistics),
+                                  statistics, sizeof(statistics[0]),
+                                  VK_QUERY_RESULT_64_BIT);
+        hasStatistics = result == VK_SUCCESS;
+    }
+    
+    for (u32 i = 0; i < frame->scopeCount; i++)
+    {
+        ProfileScope *scope = &frame->scopes[i];
+        f64 cpuMs = ticks_to_ms(scope->cpuEnd - scope->cpuBegin);
+        
+        f64 gpuMs = 0;
+        bool scopeHasGpu = hasGpu && scope->query != UINT32_MAX;
+        if (scopeHasGpu)
+        {
+            u64 ticks = (timestamps[scope->query + 1] -
+                         timestamps[scope->query]) & profiler->timestampMask;
+            gpuMs = (f64)ticks * profiler->timestampPeriod / 1000000.0;
+        }
+        
+        ProfileTotal *total =
+            profiler_accumulate(profiler, scope, cpuMs, gpuMs, scopeHasGpu);
+        
+        if (total && hasStatistics && scope->statisticsQuery != UINT32_MAX)
+        {
+            total->statisticsCount++;
+            for (u32 j = 0; j < PipelineStatistic_Count; j++)
+            {
+                total->statistics[j] += statistics[scope->statisticsQuery][j];
+            }
+        }
+    }
+    
+    profiler->frameCount++;
+}
+
+/* Per frame averages. Vertex shader invocations per input vertex show how
+   well the post-transform cache is used (1.0 means every index re-ran the
+   shader), fragment invocations per swapchain pixel are the overdraw. */
+void
+profiler_report_statistics(Profiler *profiler, ProfileTotal *total)
+{
+    f64 average[PipelineStatistic_Count];
+    for (u32 i = 0; i < PipelineStatistic_Count; i++)
+    {
+        average[i] = (f64)total->statistics[i] / (f64)total->statisticsCount;
+    }
+    
+    f64 inputVertices = average[PipelineStatistic_InputVertices];
+    f64 vertexReuse = inputVertices > 0 ?
+        average[PipelineStatistic_VertexInvocations] / inputVertices : 0;
+    
+    VkExtent2D extent = profiler->vk->swapchainExtents;
+    f64 pixels = (f64)extent.width * (f64)extent.height;
+    f64 overdraw = pixels > 0 ?
+        average[PipelineStatistic_FragmentInvocations] / pixels : 0;
+    
+    debug_printf("  %*s  ia %.0f verts %.0f prims, vs %.0f (%.2f per vert), "
+                 "clip %.0f in %.0f out, fs %.0f (%.2f per pixel), cs %.0f\n",
+                 (int)(2 * total->depth), "",
+                 average[PipelineStatistic_InputVertices],
+                 average[PipelineStatistic_InputPrimitives],
+                 average[PipelineStatistic_VertexInvocations], vertexReuse,
+                 average[PipelineStatistic_ClippingInvocations],
+                 average[PipelineStatistic_ClippingPrimitives],
+                 average[PipelineStatistic_FragmentInvocations], overdraw,
+                 average[PipelineStatistic_ComputeInvocations]);
+}
+
+void
+profiler_report(Profiler *profiler)
+{
+    debug_printf("Profile: average of %u frames\n", profiler->frameCount);
+    
+    for (u32 i = 0; i < profiler->totalCount; i++)
+    {
+        ProfileTotal *total = &profiler->totals[i];
+        
+        char gpu[32] = "";
+        if (total->gpuCount > 0)
+        {
+            sprintf_s(gpu, sizeof(gpu), "  gpu %7.3f ms",
+                      total->gpuMs / (f64)total->gpuCount);
+        }
+        
+        debug_printf("  %*s%-*s cpu %7.3f ms%s\n",
+                     (int)(2 * total->depth), "",
+                     (int)(32 - 2 * total->depth), total->name,
+                     total->cpuMs / (f64)total->count, gpu);
+        
+        if (total->statisticsCount > 0)
+        {
+            profiler_report_statistics(profiler, total);
+        }
+    }
+    
+    memcpy(profiler->reported, profiler->totals,
+           profiler->totalCount * sizeof(ProfileTotal));
+    profiler->reportedCount = profiler->totalCount;
+    profiler->reportedFrameCount = profiler->frameCount;
+    
+    profiler->totalCount = 0;
+    profiler->frameCount = 0;
+}
+
+/* Called after begin_frame(), before the first scope of the frame. Collects
+   what the slot recorded FRAMES_IN_FLIGHT frames ago and reuses its queries. */
+void
+profiler_begin_frame(Profiler *profiler, FrameTimeline *frames)
+{
+    ProfileFrame *frame =
+        &profiler->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+    
+    if (frame->frameNumber)
+    {
+        assert(is_frame_complete(frames, profiler->vk, frame->frameNumber));
+        profiler_collect(profiler, frame);
+        
+        if (frame->queryCount > 0)
+        {
+            vkResetQueryPool(profiler->vk->device, frame->timestamps, 0,
+                             frame->queryCount);
+        }
+        
+        if (frame->statisticsCount > 0)
+        {
+            vkResetQueryPool(profiler->vk->device, frame->statistics, 0,
+                             frame->statisticsCount);
+        }
+    }
+    
+    frame->frameNumber = frames->frameNumber;
+    frame->queryCount = 0;
+    frame->statisticsCount = 0;
+    frame->scopeCount = 0;
+    
+    profiler->current = frame;
+    profiler->stackDepth = 0;
+    profiler->passActive = false;
+    
+    u64 now = get_ticks();
+    if (ticks_to_ms(now - profiler->lastReport) >= 1000.0f &&
+        profiler->frameCount > 0)
+    {
+        profiler_report(profiler);
+        profiler->lastReport = now;
+    }
+}
+
+void
+profile_begin(Profiler *profiler, VkCommandBuffer commandBuffer, char *name)
+{
+    ProfileFrame *frame = profiler->current;
+    VulkanContext *vk = profiler->vk;
+    
+    if (commandBuffer && vk->vkCmdBeginDebugUtilsLabelEXT)
+    {
+        VkDebugUtilsLabelEXT label =
+        {
+            VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT,
+            NULL,
+            name,
+            {0, 0, 0, 0} // color (tool default)
+        };
+        
+        vk->vkCmdBeginDebugUtilsLabelEXT(commandBuffer, &label);
+    }
+    
+    // Scopes past the limits still get their labels, only timing is dropped
+    u32 index = UINT32_MAX;
+    if (frame && frame->scopeCount < PROFILER_MAX_SCOPES &&
+        profiler->stackDepth < PROFILER_MAX_DEPTH)
+    {
+        index = frame->scopeCount++;
+        
+        ProfileScope *scope = &frame->scopes[index];
+        scope->name = name;
+        scope->depth = profiler->stackDepth;
+        scope->query = UINT32_MAX;
+        scope->statisticsQuery = UINT32_MAX;
+        
+        if (commandBuffer && profiler->hasTimestamps)
+        {
+            scope->query = frame->queryCount;
+            frame->queryCount += 2;
+            
+            vkCmdWriteTimestamp(commandBuffer,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                frame->timestamps, scope->query);
+        }
+        
+        scope->cpuBegin = get_ticks();
+        scope->cpuEnd = scope->cpuBegin;
+    }
+    
+    if (profiler->stackDepth < PROFILER_MAX_DEPTH)
+    {
+        profiler->stack[profiler->stackDepth] = index;
+    }
+    profiler->stackDepth++;
+}
+
+void
+profile_end(Profiler *profiler, VkCommandBuffer commandBuffer)
+{
+    ProfileFrame *frame = profiler->current;
+    VulkanContext *vk = profiler->vk;
+    
+    assert(profiler->stackDepth > 0 && "PROFILE_END without PROFILE_BEGIN");
+    profiler->stackDepth--;
+    
+    u32 index = profiler->stackDepth < PROFILER_MAX_DEPTH ?
+        profiler->stack[profiler->stackDepth] : UINT32_MAX;
+    
+    if (frame && index != UINT32_MAX)
+    {
+        ProfileScope *scope = &frame->scopes[index];
+        scope->cpuEnd = get_ticks();
+        
+        if (scope->query != UINT32_MAX)
+        {
+            assert(commandBuffer && "GPU scope ended without command buffer");
+            vkCmdWriteTimestamp(commandBuffer,
+                                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                frame->timestamps, scope->query + 1);
+        }
+    }
+    
+    if (commandBuffer && vk->vkCmdEndDebugUtilsLabelEXT)
+    {
+        vk->vkCmdEndDebugUtilsLabelEXT(commandBuffer);
+    }
+}
+
+// A profile scope that also records pipeline statistics
+void
+profile_begin_pass(Profiler *profiler, VkCommandBuffer commandBuffer,
+                   char *name)
+{
+    assert(!profiler->passActive && "Profiler passes can't nest");
+    profile_begin(profiler, commandBuffer, name);
+    
+    ProfileFrame *frame = profiler->current;
+    u32 depth = profiler->stackDepth - 1;
+    u32 index = depth < PROFILER_MAX_DEPTH ? profiler->stack[depth] :
+        UINT32_MAX;
+    
+    if (frame && index != UINT32_MAX && profiler->hasStatistics &&
+        frame->statisticsCount < PROFILER_MAX_PASSES)
+    {
+        ProfileScope *scope = &frame->scopes[index];
+        scope->statisticsQuery = frame->statisticsCount++;
+        
+        vkCmdBeginQuery(commandBuffer, frame->statistics,
+                        scope->statisticsQuery, 0);
+        profiler->passActive = true;
+    }
+}
+
+void
+profile_end_pass(Profiler *profiler, VkCommandBuffer commandBuffer)
+{
+    ProfileFrame *frame = profiler->current;
+    u32 depth = profiler->stackDepth - 1;
+    u32 index = depth < PROFILER_MAX_DEPTH ? profiler->stack[depth] :
+        UINT32_MAX;
+    
+    if (frame && index != UINT32_MAX &&
+        frame->scopes[index].statisticsQuery != UINT32_MAX)
+    {
+        vkCmdEndQuery(commandBuffer, frame->statistics,
+                      frame->scopes[index].statisticsQuery);
+        profiler->passActive = false;
+    }
+    
+    profile_end(profiler, commandBuffer);
+}
+
+#if PROFILER
+#define PROFILE_BEGIN(commandBuffer, name) \
+    profile_begin(&globalProfiler, commandBuffer, name)
+#define PROFILE_END(commandBuffer) \
+    profile_end(&globalProfiler, commandBuffer)
+#define PROFILE_PASS_BEGIN(commandBuffer, name) \
+    profile_begin_pass(&globalProfiler, commandBuffer, name)
+#define PROFILE_PASS_END(commandBuffer) \
+    profile_end_pass(&globalProfiler, commandBuffer)
+#else
+#define PROFILE_BEGIN(commandBuffer, name)
+#define PROFILE_END(commandBuffer)
+#define PROFILE_PASS_BEGIN(commandBuffer, name)
+#define PROFILE_PASS_END(commandBuffer)
+#endif
\ No newline at end of file
@@ -0,0 +1,673 @@
+/*
+*  Meshes
+*/
+
+typedef struct
+{
+    f32 position[3];
+    f32 normal[3];
+    
+} MeshVertex;
+
+typedef enum
+{
+    MeshId_Plane,
+    MeshId_Cube,
+    MeshId_Sphere,
+    
+    MeshId_Count
+    
+} MeshId;
+
+// A range of the scene's shared vertex and index buffers
+typedef struct
+{
+    u32 firstIndex;
+    u32 indexCount;
+    s32 vertexOffset;
+    u32 vertexCount;
+    f32 radius; // bounding sphere around the origin
+    
+    // Quantized positions times scale plus offset are the mesh's positions,
+    // see quantize_vertices()
+    Vec3 positionOffset;
+    Vec3 positionScale;
+    
+} Mesh;
+
+typedef struct
+{
+    MeshVertex *vertices;
+    u32 vertexCount;
+    u32 vertexCapacity;
+    
+    u32 *indices;
+    u32 indexCount;
+    u32 indexCapacity;
+    
+} MeshBuilder;
+
+void
+mesh_builder_reserve(MeshBuilder *builder, u32 vertexCount, u32 indexCount)
+{
+    while (builder->vertexCount + vertexCount > builder->vertexCapacity)
+    {
+        builder->vertexCapacity = builder->vertexCapacity ?
+            builder->vertexCapacity * 2 : 1024;
+        builder->vertices = heap_realloc(builder->vertices,
+                                    builder->vertexCapacity *
+                                    sizeof(MeshVertex));
+        assert(builder->vertices);
+    }
+    
+    while (builder->indexCount + indexCount > builder->indexCapacity)
+    {
+        builder->indexCapacity = builder->indexCapacity ?
+            builder->indexCapacity * 2 : 4096;
+        builder->indices = heap_realloc(builder->indices,
+                                   builder->indexCapacity * sizeof(u32));
+        assert(builder->indices);
+    }
+}
+
+void
+add_vertex(MeshBuilder *builder, Vec3 position, Vec3 normal)
+{
+    MeshVertex *vertex = &builder->vertices[builder->vertexCount++];
+    vertex->position[0] = position.x;
+    vertex->position[1] = position.y;
+    vertex->position[2] = position.z;
+    vertex->normal[0] = normal.x;
+    vertex->normal[1] = normal.y;
+    vertex->normal[2] = normal.z;
+}
+
+// Quad with counter-clockwise corners a b c d seen from the front
+void
+add_quad(MeshBuilder *builder, u32 base, Vec3 a, Vec3 b, Vec3 c, Vec3 d)
+{
+    Vec3 normal = vec3_normalize(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+    u32 first = builder->vertexCount - base;
+    
+    add_vertex(builder, a, normal);
+    add_vertex(builder, b, normal);
+    add_vertex(builder, c, normal);
+    add_vertex(builder, d, normal);
+    
+    u32 quad[] = { 0, 1, 2, 0, 2, 3 };
+    for (u32 i = 0; i < array_count(quad); i++)
+    {
+        builder->indices[builder->indexCount++] = first + quad[i];
+    }
+}
+
+static char *meshNames[MeshId_Count] = { "Plane", "Cube", "Sphere" };
+
+/* Unit sized meshes centered on the origin (the plane lies in y = 0 and
+   faces up), optimized for the vertex cache, overdraw and vertex fetch.
+   Indices are relative to the mesh's first vertex. */
+Mesh
+build_mesh(MeshBuilder *builder, MeshId id)
+{
+    Mesh result = {0};
+    result.firstIndex = builder->indexCount;
+    result.vertexOffset = (s32)builder->vertexCount;
+    result.positionScale = vec3(1, 1, 1);
+    u32 base = builder->vertexCount;
+    
+    switch (id)
+    {
+        case MeshId_Plane:
+        {
+            mesh_builder_reserve(builder, 4, 6);
+            add_quad(builder, base,
+                     vec3(-0.5f, 0, 0.5f), vec3(0.5f, 0, 0.5f),
+                     vec3(0.5f, 0, -0.5f), vec3(-0.5f, 0, -0.5f));
+            result.radius = 0.7072f;
+        } break;
+        
+        case MeshId_Cube:
+        {
+            mesh_builder_reserve(builder, 24, 36);
+            
+            f32 h = 0.5f;
+            Vec3 p[8] =
+            {
+                {-h, -h, h}, {h, -h, h}, {h, h, h}, {-h, h, h},
+                {-h, -h, -h}, {h, -h, -h}, {h, h, -h}, {-h, h, -h},
+            };
+            
+            add_quad(builder, base, p[0], p[1], p[2], p[3]); // +z
+            add_quad(builder, base, p[5], p[4], p[7], p[6]); // -z
+            add_quad(builder, base, p[1], p[5], p[6], p[2]); // +x
+            add_quad(builder, base, p[4], p[0], p[3], p[7]); // -x
+            add_quad(builder, base, p[3], p[2], p[6], p[7]); // +y
+            add_quad(builder, base, p[4], p[5], p[1], p[0]); // -y
+            result.radius = 0.8661f;
+        } break;
+        
+        case MeshId_Sphere:
+        {
+            u32 rings = 16;
+            u32 segments = 32;
+            mesh_builder_reserve(builder, (rings + 1) * (segments + 1),
+                                 rings * segments * 6);
+            
+            for (u32 ring = 0; ring <= rings; ring++)
+            {
+                f32 theta = 3.14159265f * (f32)ring / (f32)rings;
+                for (u32 segment = 0; segment <= segments; segment++)
+                {
+                    f32 phi = 6.28318531f * (f32)segment / (f32)segments;
+                    Vec3 normal = vec3(sinf(theta) * cosf(phi), cosf(theta),
+                                       -sinf(theta) * sinf(phi));
+                    add_vertex(builder, vec3_scale(normal, 0.5f), normal);
+                }
+            }
+            
+            for (u32 ring = 0; ring < rings; ring++)
+            {
+                for (u32 segment = 0; segment < segments; segment++)
+                {
+                    u32 a = ring * (segments + 1) + segment;
+                    u32 b = a + segments + 1;
+                    u32 quad[] = { a, b, a + 1, a + 1, b, b + 1 };
+                    
+                    for (u32 i = 0; i < array_count(quad); i++)
+                    {
+                        builder->indices[builder->indexCount++] = quad[i];
+                    }
+                }
+            }
+            result.radius = 0.5f;
+        } break;
+        
+        default: break;
+    }
+    
+    result.indexCount = builder->indexCount - result.firstIndex;
+    
+    u32 *indices = builder->indices + result.firstIndex;
+    u32 vertexCount = builder->vertexCount - base;
+    VertexCacheStats before = analyze_vertex_cache(indices, result.indexCount,
+                                                   vertexCount,
+                                                   VERTEX_CACHE_SIZE);
+    
+    vertexCount = optimize_mesh(builder->vertices + base, vertexCount,
+                                sizeof(MeshVertex), indices,
+                                result.indexCount);
+    builder->vertexCount = base + vertexCount;
+    result.vertexCount = vertexCount;
+    
+    VertexCacheStats after = analyze_vertex_cache(indices, result.indexCount,
+                                                  vertexCount,
+                                                  VERTEX_CACHE_SIZE);
+    debug_printf("Mesh %s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+                 meshNames[id], before.acmr, after.acmr, before.atvr,
+                 after.atvr);
+    
+    return result;
+}
+
+/*
+*  Quantized vertices
+*/
+
+/* Positions are 16-bit fractions of the mesh's bounding box, which the
+   vertex shader scales and offsets back with the mesh's constants. Normals
+   are mapped onto an octahedron, whose lower half is folded over the upper
+   one, and the octahedron onto a square of two signed normalized values
+   (Cigolle et al., "A Survey of Efficient Representations for Independent
+   Unit Vectors"). 4x16 bits is the narrowest mandatory vertex format for
+   the position, its w overlaps the 8-bit normal or is padding. */
+typedef struct
+{
+    u16 position[3];
+    s8 normal[2];
+    
+} QuantizedVertex8;
+
+typedef struct
+{
+    u16 position[4];
+    s16 normal[2];
+    
+} QuantizedVertex16;
+
+// Unit vector to the square, both coordinates in [-1, 1]
+void
+octahedral_encode(Vec3 normal, f32 *u, f32 *v)
+{
+    f32 length = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+    f32 x = normal.x / length;
+    f32 y = normal.y / length;
+    
+    if (normal.z < 0)
+    {
+        f32 foldedX = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+        f32 foldedY = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    
+    *u = x;
+    *v = y;
+}
+
+// The same as octahedral_decode() in mesh.vert
+Vec3
+octahedral_decode(f32 u, f32 v)
+{
+    Vec3 result = vec3(u, v, 1.0f - fabsf(u) - fabsf(v));
+    f32 fold = result.z < 0 ? -result.z : 0;
+    result.x += result.x >= 0 ? -fold : fold;
+    result.y += result.y >= 0 ? -fold : fold;
+    
+    return vec3_normalize(result);
+}
+
+/* The octahedral normal in signed normalized integers up to maximum. Of
+   the four ways to round the two coordinates, the one that decodes closest
+   to the normal wins, which matters at 8 bits. */
+void
+quantize_normal(Vec3 normal, s32 maximum, s32 *result)
+{
+    f32 u;
+    f32 v;
+    octahedral_encode(normal, &u, &v);
+    
+    f32 scaledU = u * (f32)maximum;
+    f32 scaledV = v * (f32)maximum;
+    f32 bestDot = -2.0f;
+    
+    for (u32 i = 0; i < 4; i++)
+    {
+        s32 candidateU = (s32)((i & 1) ? ceilf(scaledU) : floorf(scaledU));
+        s32 candidateV = (s32)((i & 2) ? ceilf(scaledV) : floorf(scaledV));
+        Vec3 decoded = octahedral_decode((f32)candidateU / (f32)maximum,
+                                         (f32)candidateV / (f32)maximum);
+        
+        f32 dot = vec3_dot(decoded, normal);
+        if (dot > bestDot)
+        {
+            bestDot = dot;
+            result[0] = candidateU;
+            result[1] = candidateV;
+        }
+    }
+}
+
+/* The vertices of the meshes in the quantized format, pushed on arena, with
+   vertexSize set to the format's size. Sets every mesh's position scale and
+   offset to its bounding box. */
+void *
+quantize_vertices(Mesh *meshes, u32 meshCount, MeshVertex *vertices,
+                  u32 vertexCount, VertexQuantization quantization,
+                  Arena *arena, u32 *vertexSize)
+{
+    bool normal16 = quantization == VertexQuantization_Normal16;
+    *vertexSize = normal16 ? sizeof(QuantizedVertex16) :
+        sizeof(QuantizedVertex8);
+    u8 *result = (u8 *)arena_push_zero(arena,
+                                       (size_t)vertexCount * *vertexSize, 16);
+    
+    for (u32 i = 0; i < meshCount; i++)
+    {
+        Mesh *mesh = &meshes[i];
+        MeshVertex *first = vertices + mesh->vertexOffset;
+        
+        f32 low[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+        f32 high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (u32 j = 0; j < mesh->vertexCount; j++)
+        {
+            for (u32 k = 0; k < 3; k++)
+            {
+                low[k] = fminf(low[k], first[j].position[k]);
+                high[k] = fmaxf(high[k], first[j].position[k]);
+            }
+        }
+        
+        // Flat meshes have no extent along one axis, every vertex is 0
+        f32 scale[3];
+        for (u32 k = 0; k < 3; k++)
+        {
+            scale[k] = mesh->vertexCount ? high[k] - low[k] : 0;
+            low[k] = mesh->vertexCount ? low[k] : 0;
+        }
+        mesh->positionOffset = vec3(low[0], low[1], low[2]);
+        mesh->positionScale = vec3(scale[0], scale[1], scale[2]);
+        
+        for (u32 j = 0; j < mesh->vertexCount; j++)
+        {
+            MeshVertex *vertex = &first[j];
+            u16 position[3];
+            for (u32 k = 0; k < 3; k++)
+            {
+                f32 fraction = scale[k] > 0 ?
+                    (vertex->position[k] - low[k]) / scale[k] : 0;
+                position[k] = (u16)(fraction * 65535.0f + 0.5f);
+            }
+            
+            Vec3 normal = vec3(vertex->normal[0], vertex->normal[1],
+                               vertex->normal[2]);
+            s32 octahedral[2];
+            quantize_normal(normal, normal16 ? 32767 : 127, octahedral);
+            
+            u8 *out = result + (size_t)(mesh->vertexOffset + j) * *vertexSize;
+            if (normal16)
+            {
+                QuantizedVertex16 *quantized = (QuantizedVertex16 *)out;
+                memcpy(quantized->position, position, sizeof(position));
+                quantized->normal[0] = (s16)octahedral[0];
+                quantized->normal[1] = (s16)octahedral[1];
+            }
+            else
+            {
+                QuantizedVertex8 *quantized = (QuantizedVertex8 *)out;
+                memcpy(quantized->position, position, sizeof(position));
+                quantized->normal[0] = (s8)octahedral[0];
+                quantized->normal[1] = (s8)octahedral[1];
+            }
+        }
+    }
+    
+    return result;
+}
+
+/*
+*  Scene
+*/
+
+#define MAX_SCENE_OBJECTS 1024
+
+typedef struct
+{
+    MeshId mesh;
+    u32 node;
+    Mat4 transform; // the node's world matrix, see update_scene_transforms()
+    Vec4 color;
+    
+} SceneObject;
+
+// Push constants of the scene pipelines
+typedef struct
+{
+    Mat4 model;
+    Vec4 color;
+    
+    // The mesh's, w is unused. Quantized positions are dequantized with
+    // them, the other shader ignores them.
+    Vec4 positionOffset;
+    Vec4 positionScale;
+    
+} ObjectConstants;
+
+typedef struct
+{
+    Vec3 position;
+    Vec3 target;
+    f32 fovY;
+    f32 nearPlane;
+    f32 farPlane;
+    
+    Mat4 view;
+    Mat4 projection;
+    
+} Camera;
+
+typedef struct
+{
+    GpuBuffer vertices;
+    GpuBuffer indices;
+    Mesh meshes[MeshId_Count];
+    
+    SceneObject objects[MAX_SCENE_OBJECTS];
+    u32 objectCount;
+    
+    // The objects are children of one root node
+    TransformHierarchy transforms;
+    u32 root;
+    
+    f32 extent; // half the ground's side length
+    
+} Scene;
+
+void
+add_scene_object(Scene *scene, MeshId mesh, Vec3 position, Vec3 scale,
+                 Vec4 color)
+{
+    assert(scene->objectCount < MAX_SCENE_OBJECTS);
+    
+    SceneObject *object = &scene->objects[scene->objectCount++];
+    object->mesh = mesh;
+    object->node = add_transform_node(&scene->transforms, scene->root);
+    object->color = color;
+    
+    set_transform_position(&scene->transforms, object->node, position);
+    set_transform_scale(&scene->transforms, object->node, scale);
+}
+
+// A ground plane with a grid of boxes and spheres of varying sizes, enough
+// surface for thousands of lights to be spread over
+void
+scene_init(Scene *scene, VulkanContext *vk, VkCommandPool commandPool,
+           VertexQuantization quantization)
+{
+    MeshBuilder builder = {0};
+    for (u32 i = 0; i < MeshId_Count; i++)
+    {
+        scene->meshes[i] = build_mesh(&builder, (MeshId)i);
+    }
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    void *vertices = builder.vertices;
+    u32 vertexSize = sizeof(MeshVertex);
+    if (quantization != VertexQuantization_Off)
+    {
+        vertices = quantize_vertices(scene->meshes, MeshId_Count,
+                                     builder.vertices, builder.vertexCount,
+                                     quantization, scratchArena,
+                                     &vertexSize);
+    }
+    
+    debug_printf("Scene vertices: %u bytes, %u per vertex\n",
+                 builder.vertexCount * vertexSize, vertexSize);
+    
+    scene->vertices =
+        create_buffer_with_data(vk, commandPool,
+                                VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                vertices, builder.vertexCount * vertexSize,
+                                "Scene vertices");
+    arena_restore(scratchArena, scratchMark);
+    scene->indices =
+        create_buffer_with_data(vk, commandPool,
+                                VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                                builder.indices,
+                                builder.indexCount * sizeof(u32),
+                                "Scene indices");
+    
+    heap_free(builder.vertices);
+    heap_free(builder.indices);
+    
+    transform_hierarchy_init(&scene->transforms, MAX_SCENE_OBJECTS + 1);
+    scene->root = add_transform_node(&scene->transforms, TRANSFORM_NO_PARENT);
+    
+    scene->extent = 40.0f;
+    add_scene_object(scene, MeshId_Plane, vec3(0, 0, 0),
+                     vec3(2 * scene->extent, 1, 2 * scene->extent),
+                     vec4(0.6f, 0.6f, 0.6f, 1));
+    
+    // Pseudo random but the same every run
+    u32 random = 12345;
+    s32 gridSize = 12;
+    f32 spacing = 2 * scene->extent / (f32)gridSize;
+    
+    for (s32 z = 0; z < gridSize; z++)
+    {
+        for (s32 x = 0; x < gridSize; x++)
+        {
+            random = random * 1664525 + 1013904223;
+            f32 height = 1.0f + (f32)(random >> 24) / 255.0f * 6.0f;
+            f32 width = 1.5f + (f32)((random >> 16) & 0xff) / 255.0f * 2.0f;
+            
+            Vec3 center = vec3(((f32)x + 0.5f) * spacing - scene->extent, 0,
+                               ((f32)z + 0.5f) * spacing - scene->extent);
+            Vec4 color = vec4(0.4f + 0.5f * (f32)((random >> 8) & 0xff) / 255,
+                              0.4f + 0.5f * (f32)(random & 0xff) / 255,
+                              0.6f, 1);
+            
+            if ((x + z) & 1)
+            {
+                center.y = height * 0.5f;
+                add_scene_object(scene, MeshId_Cube, center,
+                                 vec3(width, height, width), color);
+            }
+            else
+            {
+                center.y = width * 0.5f;
+                add_scene_object(scene, MeshId_Sphere, center,
+                                 vec3(width, width, width), color);
+            }
+        }
+    }
+    
+    u32 newIndex[MAX_SCENE_OBJECTS + 1];
+    sort_transform_nodes(&scene->transforms, newIndex);
+    scene->root = newIndex[scene->root];
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        scene->objects[i].node = newIndex[scene->objects[i].node];
+    }
+}
+
+// Bobs the spheres up and down and refreshes the objects' world matrices.
+// The cubes and the ground stay clean and aren't recomputed.
+void
+update_scene_transforms(Scene *scene, f32 seconds)
+{
+    TransformHierarchy *transforms = &scene->transforms;
+    
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        SceneObject *object = &scene->objects[i];
+        if (object->mesh == MeshId_Sphere)
+        {
+            u32 node = object->node;
+            f32 bob = 0.5f + 0.5f * sinf(seconds * 1.5f + (f32)i);
+            set_transform_position(transforms, node,
+                                   vec3(transforms->positionX[node],
+                                        transforms->scaleY[node] * 0.5f + bob,
+                                        transforms->positionZ[node]));
+        }
+    }
+    
+    update_world_transforms(transforms);
+    
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        scene->objects[i].transform =
+            transforms->world[scene->objects[i].node];
+    }
+}
+
+// Slowly circles the scene
+void
+update_camera(Camera *camera, Scene *scene, f32 seconds, VkExtent2D extent)
+{
+    f32 angle = seconds * 0.1f;
+    f32 distance = scene->extent * 1.1f;
+    
+    camera->position = vec3(cosf(angle) * distance, scene->extent * 0.4f,
+                            sinf(angle) * distance);
+    camera->target = vec3(0, 0, 0);
+    camera->fovY = 1.0f; // radians
+    camera->nearPlane = 0.1f;
+    camera->farPlane = 4 * scene->extent;
+    
+    f32 aspect = extent.height ? (f32)extent.width / (f32)extent.height : 1;
+    
+    camera->view = mat4_look_at(camera->position, camera->target,
+                                vec3(0, 1, 0));
+    camera->projection = mat4_perspective(camera->fovY, aspect,
+                                          camera->nearPlane,
+                                          camera->farPlane);
+}
+
+/* Fills order with the object indices sorted by increasing distance from the
+   camera, which gets the most out of early depth testing. The ground is
+   behind everything else, so it goes last. The distances go on arena. */
+void
+sort_objects_front_to_back(Scene *scene, Camera *camera, u32 *order,
+                           Arena *arena)
+{
+    f32 *distances = push_array(arena, f32, scene->objectCount);
+    
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        Mat4 *transform = &scene->objects[i].transform;
+        Vec3 center = vec3(transform->m[12], transform->m[13],
+                           transform->m[14]);
+        Vec3 offset = vec3_sub(center, camera->position);
+        
+        distances[i] = scene->objects[i].mesh == MeshId_Plane ?
+            FLT_MAX : vec3_dot(offset, offset);
+        order[i] = i;
+    }
+    
+    // Insertion sort, plenty for a few hundred objects
+    for (u32 i = 1; i < scene->objectCount; i++)
+    {
+        u32 index = order[i];
+        u32 j = i;
+        while (j > 0 && distances[order[j - 1]] > distances[index])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = index;
+    }
+}
+
+// With the pipeline, descriptor set and the scene's vertex and index buffers
+// bound. With drawCommands each object's draw comes from its slot in the
+// buffer at drawOffset instead, filled in by the occlusion culling.
+void
+draw_scene_objects(Scene *scene, VkCommandBuffer commandBuffer,
+                   VkPipelineLayout layout, u32 *order,
+                   VkBuffer drawCommands, VkDeviceSize drawOffset)
+{
+    for (u32 i = 0; i < scene->objectCount; i++)
+    {
+        SceneObject *object = &scene->objects[order[i]];
+        Mesh *mesh = &scene->meshes[object->mesh];
+        
+        ObjectConstants constants =
+        {
+            object->transform,
+            object->color,
+            vec4(mesh->positionOffset.x, mesh->positionOffset.y,
+                 mesh->positionOffset.z, 0),
+            vec4(mesh->positionScale.x, mesh->positionScale.y,
+                 mesh->positionScale.z, 0),
+        };
+        vkCmdPushConstants(commandBuffer, layout,
+                           VK_SHADER_STAGE_VERTEX_BIT |
+                           VK_SHADER_STAGE_FRAGMENT_BIT,
+                           0, sizeof(constants), &constants);
+        
+        if (drawCommands != VK_NULL_HANDLE)
+        {
+            u32 stride = sizeof(VkDrawIndexedIndirectCommand);
+            vkCmdDrawIndexedIndirect(commandBuffer, drawCommands,
+                                     drawOffset + order[i] * stride, 1,
+                                     stride);
+        }
+        else
+        {
+            vkCmdDrawIndexed(commandBuffer, mesh->indexCount, 1,
+                             mesh->firstIndex, mesh->vertexOffset, 0);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,591 @@
+/*
+*  Shader table
+*/
+
+#define SHADER_DIRECTORY "../shaders/"
+
+// Content-hashed SPIR-V written by the runtime compiler
+#define SHADER_CACHE_DIRECTORY SHADER_DIRECTORY "cache/"
+
+// The first word of every SPIR-V module
+#define SPIRV_MAGIC 0x07230203
+
+typedef enum
+{
+    ShaderId_MeshVertex,
+    ShaderId_MeshVertexQuantized,
+    ShaderId_ClusteredFragment,
+    ShaderId_LightBinning,
+    ShaderId_MeshletVertex,
+    ShaderId_MeshletCull,
+    ShaderId_MeshletTask,
+    ShaderId_MeshletMesh,
+    ShaderId_HiZDepth,
+    ShaderId_HiZDepthMultisampled,
+    ShaderId_HiZDownsample,
+    ShaderId_OcclusionCull,
+    ShaderId_SpriteVertex,
+    ShaderId_SpriteFragment,
+    ShaderId_SpriteFragmentUniform, // without descriptor indexing
+    ShaderId_TextFragment,
+    ShaderId_DebugLineVertex,
+    ShaderId_DebugLineFragment,
+    
+    ShaderId_Count
+    
+} ShaderId;
+
+typedef struct
+{
+    char *source; // GLSL file in SHADER_DIRECTORY
+    char *binary; // SPIR-V file in SHADER_DIRECTORY, compiled with glslc
+    char *defines; // "NAME=VALUE NAME2" passed to the compiler, may be NULL
+    
+} ShaderFile;
+
+static ShaderFile shaderFiles[ShaderId_Count] =
+{
+    { "mesh.vert", "mesh_vert.spv", NULL },
+    { "mesh.vert", "mesh_quantized_vert.spv", "QUANTIZED_VERTICES" },
+    { "clustered.frag", "clustered_frag.spv", NULL },
+    { "light_binning.comp", "light_binning_comp.spv", NULL },
+    { "meshlet.vert", "meshlet_vert.spv", NULL },
+    { "meshlet_cull.comp", "meshlet_cull_comp.spv", NULL },
+    { "meshlet.task", "meshlet_task.spv", NULL },
+    { "meshlet.mesh", "meshlet_mesh.spv", NULL },
+    { "hiz_downsample.comp", "hiz_depth_comp.spv", "DEPTH_SOURCE" },
+    {
+        "hiz_downsample.comp", "hiz_depth_ms_comp.spv",
+        "DEPTH_SOURCE MULTISAMPLED"
+    },
+    { "hiz_downsample.comp", "hiz_downsample_comp.spv", NULL },
+    { "occlusion_cull.comp", "occlusion_cull_comp.spv", NULL },
+    { "sprite.vert", "sprite_vert.spv", NULL },
+    { "sprite.frag", "sprite_frag.spv", NULL },
+    { "sprite.frag", "sprite_uniform_frag.spv", "UNIFORM_TEXTURE_INDEX" },
+    { "text.frag", "text_frag.spv", NULL },
+    { "debug_line.vert", "debug_line_vert.spv", NULL },
+    { "debug_line.frag", "debug_line_frag.spv", NULL },
+};
+
+LoadedFile
+load_shader_binary(ShaderId shader, Arena *arena)
+{
+    char path[MAX_PATH];
+    sprintf_s(path, sizeof(path), SHADER_DIRECTORY "%s",
+              shaderFiles[shader].binary);
+    
+    return load_entire_file(path, arena);
+}
+
+/*
+*  Offline compilation with glslc
+*/
+
+bool
+compile_shader_with_glslc(ShaderId shader)
+{
+    // Prefer the glslc that ships with the SDK over whatever is on the PATH
+    char glslc[MAX_PATH] = "glslc";
+    char sdk[MAX_PATH];
+    DWORD sdkLength = GetEnvironmentVariable("VULKAN_SDK", sdk, sizeof(sdk));
+    if (sdkLength > 0 && sdkLength < sizeof(sdk))
+    {
+        sprintf_s(glslc, sizeof(glslc), "%s\\Bin\\glslc.exe", sdk);
+    }
+    
+    // Vulkan 1.2 is the minimum the app runs on, mesh shaders need at least
+    // its SPIR-V version
+    char commandLine[1024];
+    sprintf_s(commandLine, sizeof(commandLine),
+              "\"%s\" --target-env=vulkan1.2 \"" SHADER_DIRECTORY "%s\" "
+              "-o \"" SHADER_DIRECTORY "%s\"",
+              glslc, shaderFiles[shader].source, shaderFiles[shader].binary);
+    
+    // Same -D syntax as the runtime compiler's defines
+    char *defines = shaderFiles[shader].defines;
+    while (defines && *defines)
+    {
+        while (*defines == ' ')
+        {
+            defines++;
+        }
+        
+        u32 length = 0;
+        while (defines[length] && defines[length] != ' ')
+        {
+            length++;
+        }
+        
+        if (length > 0)
+        {
+            size_t used = strlen(commandLine);
+            sprintf_s(commandLine + used, sizeof(commandLine) - used,
+                      " -D%.*s", length, defines);
+        }
+        defines += length;
+    }
+    
+    // glslc's diagnostics go to the debugger output like everything else
+    SECURITY_ATTRIBUTES pipeAttributes =
+    {
+        sizeof(SECURITY_ATTRIBUTES),
+        NULL,
+        TRUE // bInheritHandle
+    };
+    
+    HANDLE readPipe;
+    HANDLE writePipe;
+    if (!CreatePipe(&readPipe, &writePipe, &pipeAttributes, 0))
+    {
+        return false;
+    }
+    SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+    
+    STARTUPINFO startupInfo = { sizeof(STARTUPINFO) };
+    startupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.hStdOutput = writePipe;
+    startupInfo.hStdError = writePipe;
+    
+    PROCESS_INFORMATION processInfo;
+    BOOL started = CreateProcess(NULL, commandLine, NULL, NULL, TRUE,
+                                 CREATE_NO_WINDOW, NULL, NULL, &startupInfo,
+                                 &processInfo);
+    CloseHandle(writePipe);
+    
+    if (!started)
+    {
+        CloseHandle(readPipe);
+        debug_printf("Shader compile: failed to run %s\n", glslc);
+        return false;
+    }
+    
+    char output[1024];
+    DWORD bytesRead = 0;
+    while (ReadFile(readPipe, output, sizeof(output) - 1, &bytesRead, NULL) &&
+           bytesRead > 0)
+    {
+        output[bytesRead] = 0;
+        OutputDebugString(output);
+    }
+    
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+    
+    DWORD exitCode = 1;
+    GetExitCodeProcess(processInfo.hProcess, &exitCode);
+    
+    CloseHandle(processInfo.hProcess);
+    CloseHandle(processInfo.hThread);
+    CloseHandle(readPipe);
+    
+    return exitCode == 0;
+}
+
+/*
+*  Runtime compilation with shaderc
+*/
+
+#ifdef RUNTIME_SHADER_COMPILE
+
+#include <shaderc/shaderc.h>
+
+// Bump when the compile options below change, so stale SPIR-V isn't reused
+#define SHADER_COMPILE_OPTIONS_VERSION 2
+
+// Whether a cache file can be SPIR-V at all, a file that was cut short or
+// is garbage is compiled again instead of reaching vkCreateShaderModule
+bool
+is_spirv_file(LoadedFile *file)
+{
+    return file->size > 0 && file->size % sizeof(u32) == 0 &&
+        *(u32 *)file->data == SPIRV_MAGIC;
+}
+
+static shaderc_compiler_t globalShaderCompiler;
+static INIT_ONCE globalShaderCompilerInit = INIT_ONCE_STATIC_INIT;
+
+// The include results shaderc holds on to while it compiles
+typedef struct
+{
+    shaderc_include_result result;
+    char path[MAX_PATH];
+    
+} ShaderInclude;
+
+static Pool globalShaderIncludes;
+
+// shaderc compilers can be used from several threads at once, so the startup
+// loader and the hot reload thread share a single one
+BOOL CALLBACK
+init_shader_compiler(PINIT_ONCE initOnce, PVOID param, PVOID *context)
+{
+    globalShaderCompiler = shaderc_compiler_initialize();
+    pool_init(&globalShaderIncludes, &globalPermanentArena,
+              sizeof(ShaderInclude));
+    return globalShaderCompiler != NULL;
+}
+
+shaderc_shader_kind
+get_shader_kind(char *source)
+{
+    static struct { char *extension; shaderc_shader_kind kind; } kinds[] =
+    {
+        { ".vert", shaderc_vertex_shader },
+        { ".frag", shaderc_fragment_shader },
+        { ".comp", shaderc_compute_shader },
+        { ".task", shaderc_task_shader },
+        { ".mesh", shaderc_mesh_shader },
+    };
+    
+    char *extension = strrchr(source, '.');
+    for (u32 i = 0; extension && i < array_count(kinds); i++)
+    {
+        if (strcmp(extension, kinds[i].extension) == 0)
+        {
+            return kinds[i].kind;
+        }
+    }
+    
+    return shaderc_glsl_infer_from_source;
+}
+
+/* Hashes a source file and, recursively, every file it #includes, so that
+   editing a shared header invalidates the cached SPIR-V of every shader that
+   uses it. Only quoted includes relative to SHADER_DIRECTORY are followed,
+   which is the only form the include resolver below supports. */
+u64
+hash_shader_source(u64 hash, char *fileName, u32 depth)
+{
+    char path[MAX_PATH];
+    sprintf_s(path, sizeof(path), SHADER_DIRECTORY "%s", fileName);
+    
+    hash = hash_string(hash, fileName);
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    LoadedFile file = load_entire_file(path, scratch);
+    if (!file.data)
+    {
+        return hash;
+    }
+    
+    hash = hash_bytes(hash, file.data, file.size);
+    
+    char *at = (char *)file.data;
+    char *end = at + file.size;
+    
+    while (at < end && depth < 8)
+    {
+        char *lineEnd = at;
+        while (lineEnd < end && *lineEnd != '\n')
+        {
+            lineEnd++;
+        }
+        
+        char *directive = at;
+        while (directive < lineEnd && (*directive == ' ' || *directive == '\t'))
+        {
+            directive++;
+        }
+        
+        size_t directiveLength = sizeof("#include \"") - 1;
+        if ((size_t)(lineEnd - directive) > directiveLength &&
+            strncmp(directive, "#include \"", directiveLength) == 0)
+        {
+            char *name = directive + directiveLength;
+            char *nameEnd = name;
+            while (nameEnd < lineEnd && *nameEnd != '"')
+            {
+                nameEnd++;
+            }
+            
+            char includeName[MAX_PATH];
+            sprintf_s(includeName, sizeof(includeName), "%.*s",
+                      (int)(nameEnd - name), name);
+            
+            hash = hash_shader_source(hash, includeName, depth + 1);
+        }
+        
+        at = lineEnd + 1;
+    }
+    
+    arena_restore(scratch, scratchMark);
+    
+    return hash;
+}
+
+shaderc_include_result *
+resolve_shader_include(void *userData, const char *requestedSource, int type,
+                       const char *requestingSource, size_t includeDepth)
+{
+    ShaderInclude *include = (ShaderInclude *)pool_alloc(&globalShaderIncludes);
+    memset(include, 0, sizeof(*include));
+    shaderc_include_result *result = &include->result;
+    char *path = include->path;
+    
+    // The content goes back to the heap when shaderc releases it
+    sprintf_s(path, MAX_PATH, SHADER_DIRECTORY "%s", requestedSource);
+    LoadedFile file = load_entire_file(path, NULL);
+    
+    if (file.data)
+    {
+        result->source_name = path;
+        result->source_name_length = strlen(path);
+        result->content = file.data;
+        result->content_length = file.size;
+    }
+    else
+    {
+        // An empty source name tells shaderc the include failed, the content
+        // is the error message
+        char *message = "Include file not found";
+        path[0] = 0;
+        result->source_name = path;
+        result->content = message;
+        result->content_length = strlen(message);
+    }
+    
+    return result;
+}
+
+void
+release_shader_include(void *userData, shaderc_include_result *result)
+{
+    if (result->source_name_length > 0)
+    {
+        heap_free((void *)result->content);
+    }
+    
+    // result is the first member
+    pool_free(&globalShaderIncludes, result);
+}
+
+/* Compiles the GLSL source of a shader, or returns the SPIR-V cached from an
+   earlier compile of the exact same input. The cache key covers the source,
+   every included file, the defines, the shader stage, the compile options and
+   the compiler's SPIR-V version, so an unchanged shader is never compiled
+   twice, across launches too. The SPIR-V goes on arena, or the heap when it
+   is NULL. */
+LoadedFile
+compile_shader_at_runtime(ShaderId shader, Arena *arena)
+{
+    LoadedFile result = {NULL};
+    ShaderFile *file = &shaderFiles[shader];
+    
+    char sourcePath[MAX_PATH];
+    sprintf_s(sourcePath, sizeof(sourcePath), SHADER_DIRECTORY "%s",
+              file->source);
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    LoadedFile source = load_entire_file(sourcePath, scratch);
+    if (!source.data)
+    {
+        return result;
+    }
+    
+    /*
+    *  Look up the content hash in the cache
+    */
+    
+    u32 spirvVersion = 0;
+    u32 spirvRevision = 0;
+    shaderc_get_spv_version(&spirvVersion, &spirvRevision);
+    
+    u32 compilerVersion[] =
+    {
+        SHADER_COMPILE_OPTIONS_VERSION,
+        VK_HEADER_VERSION_COMPLETE,
+        spirvVersion,
+        spirvRevision,
+        (u32)get_shader_kind(file->source)
+    };
+    
+    u64 hash = hash_bytes(HASH_SEED, compilerVersion, sizeof(compilerVersion));
+    hash = hash_string(hash, file->defines ? file->defines : "");
+    hash = hash_shader_source(hash, file->source, 0);
+    
+    char cachePath[MAX_PATH];
+    sprintf_s(cachePath, sizeof(cachePath),
+              SHADER_CACHE_DIRECTORY "%016llx.spv", hash);
+    
+    u64 arenaMark = arena ? arena_mark(arena) : 0;
+    result = load_entire_file(cachePath, arena);
+    if (result.data && is_spirv_file(&result))
+    {
+        arena_restore(scratch, scratchMark);
+        return result;
+    }
+    
+    if (result.data)
+    {
+        debug_printf("Shader compile: %s has a broken cache file\n",
+                     file->source);
+        if (arena)
+        {
+            arena_restore(arena, arenaMark);
+        }
+        else
+        {
+            heap_free(result.data);
+        }
+        
+        result.data = NULL;
+        result.size = 0;
+    }
+    
+    /*
+    *  Cache miss, compile the source
+    */
+    
+    u64 begin = get_ticks();
+    
+    InitOnceExecuteOnce(&globalShaderCompilerInit, init_shader_compiler,
+                        NULL, NULL);
+    assert(globalShaderCompiler);
+    
+    // The same target as the offline glslc build, SPIR-V 1.5 that every
+    // Vulkan 1.2 device the app accepts can load
+    shaderc_compile_options_t options = shaderc_compile_options_initialize();
+    shaderc_compile_options_set_target_env(options, shaderc_target_env_vulkan,
+                                           shaderc_env_version_vulkan_1_2);
+    shaderc_compile_options_set_optimization_level(
+        options, shaderc_optimization_level_performance);
+    shaderc_compile_options_set_include_callbacks(options,
+                                                  resolve_shader_include,
+                                                  release_shader_include,
+                                                  NULL);
+    
+    char *defines = file->defines;
+    while (defines && *defines)
+    {
+        while (*defines == ' ')
+        {
+            defines++;
+        }
+        
+        u32 length = 0;
+        u32 nameLength = 0;
+        while (defines[length] && defines[length] != ' ')
+        {
+            if (defines[length] == '=' && nameLength == 0)
+            {
+                nameLength = length;
+            }
+            length++;
+        }
+        
+        if (length > 0)
+        {
+            if (nameLength > 0)
+            {
+                shaderc_compile_options_add_macro_definition(
+                    options, defines, nameLength, defines + nameLength + 1,
+                    length - nameLength - 1);
+            }
+            else
+            {
+                shaderc_compile_options_add_macro_definition(
+                    options, defines, length, NULL, 0);
+            }
+        }
+        defines += length;
+    }
+    
+    shaderc_compilation_result_t compiled =
+        shaderc_compile_into_spv(globalShaderCompiler, source.data, source.size,
+                                 get_shader_kind(file->source), file->source,
+                                 "main", options);
+    
+    if (shaderc_result_get_compilation_status(compiled) ==
+        shaderc_compilation_status_success)
+    {
+        result.size = shaderc_result_get_length(compiled);
+        result.data = arena_push_or_heap(arena, result.size);
+        assert(result.data);
+        memcpy(result.data, shaderc_result_get_bytes(compiled), result.size);
+        
+        CreateDirectory(SHADER_CACHE_DIRECTORY, NULL);
+        if (!write_entire_file(cachePath, result.data, result.size))
+        {
+            debug_printf("Shader compile: couldn't cache %s\n",
+                         file->source);
+        }
+        
+        debug_printf("Shader compile: %s in %.2f ms\n", file->source,
+                     ticks_to_ms(get_ticks() - begin));
+    }
+    else
+    {
+        // The errors can be longer than debug_printf() takes, so they are
+        // printed on their own
+        debug_printf("Shader compile: %s failed:\n", file->source);
+        OutputDebugString(shaderc_result_get_error_message(compiled));
+    }
+    
+    shaderc_result_release(compiled);
+    shaderc_compile_options_release(options);
+    arena_restore(scratch, scratchMark);
+    
+    return result;
+}
+
+#endif
+
+/*
+*  SPIR-V access
+*/
+
+// The SPIR-V used at startup. With the runtime compiler built in this comes
+// from the GLSL source (through the cache). Without it, or when the source
+// isn't shipped, it's the glslc output from the asset pack and then from the
+// loose .spv files. Pushed on arena unless it's used in place from the pack,
+// see load_asset().
+LoadedFile
+get_shader_spirv(ShaderId shader, Arena *arena)
+{
+    LoadedFile result = {NULL};
+
+#ifdef RUNTIME_SHADER_COMPILE
+    result = compile_shader_at_runtime(shader, arena);
+#endif
+
+    if (!result.data)
+    {
+        result = load_asset(&globalAssetPack, shaderFiles[shader].binary,
+                            arena);
+    }
+    
+    if (!result.data)
+    {
+        result = load_shader_binary(shader, arena);
+    }
+    
+    if (!result.data)
+    {
+        debug_printf("Shader %s has no SPIR-V, compile it with glslc or build "
+                     "with RUNTIME_SHADER_COMPILE\n", shaderFiles[shader].source);
+    }
+    
+    return result;
+}
+
+// The SPIR-V of a shader whose source just changed, empty if it doesn't
+// compile. On the heap, the pipeline library frees it when it's replaced.
+LoadedFile
+recompile_shader(ShaderId shader)
+{
+#ifdef RUNTIME_SHADER_COMPILE
+    return compile_shader_at_runtime(shader, NULL);
+#else
+    LoadedFile result = {NULL};
+    if (compile_shader_with_glslc(shader))
+    {
+        result = load_shader_binary(shader, NULL);
+    }
+    
+    return result;
+#endif
+}
\ No newline at end of file
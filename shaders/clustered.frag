@@ -0,0 +1,82 @@
+#version 450
+
+#define CLUSTERS_ACCESS readonly
+#include "clustered_common.glsl"
+
+// Specialization constant, set per pipeline variant. 0 is the lit scene, 1
+// shows the number of lights per cluster, 2 the depth slices
+layout(constant_id = 0) const uint DEBUG_VIEW = 0;
+
+layout(location = 0) in vec3 worldPosition;
+layout(location = 1) in vec3 worldNormal;
+layout(location = 2) in float viewDepth;
+layout(location = 3) in vec4 albedoColor; // of the object or the instance
+
+layout(location = 0) out vec4 outColor;
+
+// Smooth inverse square falloff that reaches zero at the light's range
+float attenuation(float distance, float range)
+{
+    float ratio = distance / range;
+    float window = clamp(1.0 - ratio * ratio * ratio * ratio, 0.0, 1.0);
+    return window * window / (distance * distance + 1.0);
+}
+
+vec3 heatmap(float t)
+{
+    return clamp(vec3(t * 3.0, t * 3.0 - 1.0, t * 3.0 - 2.0), 0.0, 1.0);
+}
+
+void main()
+{
+    uint cluster = cluster_index(gl_FragCoord.xy, viewDepth);
+    uint lightCount = clusterLightCounts[cluster];
+
+    if (DEBUG_VIEW == 1)
+    {
+        outColor = vec4(heatmap(float(lightCount) / 32.0), 1.0);
+        return;
+    }
+
+    if (DEBUG_VIEW == 2)
+    {
+        uint slice = cluster_slice(viewDepth);
+        outColor = vec4(heatmap(float(slice) / float(CLUSTER_Z)), 1.0);
+        return;
+    }
+
+    vec3 n = normalize(worldNormal);
+    vec3 v = normalize(frame.cameraPosition.xyz - worldPosition);
+    vec3 albedo = albedoColor.rgb;
+
+    vec3 color = albedo * 0.03; // ambient
+
+    uint firstIndex = cluster * MAX_LIGHTS_PER_CLUSTER;
+    for (uint i = 0; i < lightCount; i++)
+    {
+        Light light = lights[clusterLightIndices[firstIndex + i]];
+
+        vec3 toLight = light.positionRange.xyz - worldPosition;
+        float distance = length(toLight);
+        vec3 l = toLight / distance;
+
+        float intensity = attenuation(distance, light.positionRange.w);
+
+        if (uint(light.color.w) == LIGHT_TYPE_SPOT)
+        {
+            float cosOuter = light.direction.w;
+            float cosAngle = dot(-l, light.direction.xyz);
+            intensity *= smoothstep(cosOuter, mix(cosOuter, 1.0, 0.2),
+                                    cosAngle);
+        }
+
+        // Lambert plus Blinn-Phong
+        vec3 h = normalize(l + v);
+        float diffuse = max(dot(n, l), 0.0);
+        float specular = pow(max(dot(n, h), 0.0), 32.0) * diffuse;
+
+        color += light.color.rgb * intensity * (albedo * diffuse + specular);
+    }
+
+    outColor = vec4(color, 1.0);
+}
\ No newline at end of file
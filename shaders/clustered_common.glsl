@@ -0,0 +1,82 @@
+// Shared by the light binning pass and the scene shaders. The constants and
+// structs have to match clustered.c
+
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+#define LIGHT_TYPE_POINT 0
+#define LIGHT_TYPE_SPOT 1
+
+struct Light
+{
+    vec4 positionRange; // xyz world position, w range
+    vec4 color; // rgb color times intensity, w light type
+    vec4 direction; // xyz spot direction, w cosine of the cone's half angle
+};
+
+layout(set = 0, binding = 0) uniform FrameUniforms
+{
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec4 cameraPosition; // w time in seconds
+    vec4 viewport; // width, height, 1 / width, 1 / height
+    vec4 clusterDepth; // near, far, slice scale, slice bias
+    vec4 ndcToView; // 1 / projection[0][0], 1 / projection[1][1]
+    uint lightCount;
+} frame;
+
+layout(std430, set = 0, binding = 1) readonly buffer Lights
+{
+    Light lights[];
+};
+
+// Written by the binning pass, read by the fragment shader
+layout(std430, set = 0, binding = 2) CLUSTERS_ACCESS buffer Clusters
+{
+    uint clusterLightCounts[CLUSTER_COUNT];
+    uint clusterLightIndices[]; // MAX_LIGHTS_PER_CLUSTER per cluster
+};
+
+// View depth is the positive distance along the view direction
+uint cluster_slice(float viewDepth)
+{
+    float slice = log(viewDepth) * frame.clusterDepth.z - frame.clusterDepth.w;
+    return uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+}
+
+uint cluster_index(vec2 fragCoord, float viewDepth)
+{
+    vec2 tileCount = vec2(CLUSTER_X, CLUSTER_Y);
+    uvec2 tile = uvec2(fragCoord * frame.viewport.zw * tileCount);
+    tile = min(tile, uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+
+    return tile.x + tile.y * CLUSTER_X +
+        cluster_slice(viewDepth) * CLUSTER_X * CLUSTER_Y;
+}
+
+// False if the world space sphere is entirely outside the view frustum. The
+// planes come straight from the view projection rows (Gribb and Hartmann).
+// With reversed-Z, depth 0 <= z <= w puts the far plane at row 2 and the
+// near plane at row 3 - row 2.
+bool sphere_in_frustum(vec3 center, float radius)
+{
+    mat4 m = transpose(frame.viewProjection);
+    vec4 planes[6] = vec4[6](m[3] + m[0], m[3] - m[0],
+                             m[3] + m[1], m[3] - m[1],
+                             m[2], m[3] - m[2]);
+
+    for (int i = 0; i < 6; i++)
+    {
+        vec4 plane = planes[i];
+        if (dot(plane.xyz, center) + plane.w < -radius * length(plane.xyz))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
\ No newline at end of file
@@ -1,8 +1,10 @@
 #version 450
 
+layout(location = 0) in vec4 lineColor;
+
 layout(location = 0) out vec4 outColor;
 
 void main()
 {
-    outColor = vec4(1.0, 0.0, 0.0, 1.0); // Red triangle
+    outColor = lineColor;
 }
\ No newline at end of file
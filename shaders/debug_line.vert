@@ -0,0 +1,18 @@
+#version 450
+
+layout(push_constant) uniform DebugConstants
+{
+    mat4 viewProjection;
+} constants;
+
+// DebugVertex, see debug_draw.c
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec4 color;
+
+layout(location = 0) out vec4 lineColor;
+
+void main()
+{
+    lineColor = color;
+    gl_Position = constants.viewProjection * vec4(position, 1.0);
+}
\ No newline at end of file
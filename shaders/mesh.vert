@@ -0,0 +1,63 @@
+#version 450
+
+#define CLUSTERS_ACCESS readonly
+#include "clustered_common.glsl"
+
+layout(push_constant) uniform ObjectConstants
+{
+    mat4 model;
+    vec4 color;
+
+    // Quantized positions times scale plus offset, w unused
+    vec4 positionOffset;
+    vec4 positionScale;
+} object;
+
+#ifdef QUANTIZED_VERTICES
+// QuantizedVertex8 or QuantizedVertex16, see scene.c. Fractions of the
+// mesh's bounds (w is unused) and octahedral normals.
+layout(location = 0) in vec4 quantizedPosition;
+layout(location = 1) in vec2 octahedralNormal;
+#else
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+#endif
+
+layout(location = 0) out vec3 worldPosition;
+layout(location = 1) out vec3 worldNormal;
+layout(location = 2) out float viewDepth;
+layout(location = 3) out vec4 color;
+
+// The depth prepass and the main pass must produce bit identical depth for
+// the main pass's EQUAL depth test
+invariant gl_Position;
+
+// Unfolds the lower half of the octahedron, the same as octahedral_decode()
+// in scene.c
+vec3 octahedral_decode(vec2 encoded)
+{
+    vec3 result = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+    float fold = max(-result.z, 0.0);
+    result.x += result.x >= 0.0 ? -fold : fold;
+    result.y += result.y >= 0.0 ? -fold : fold;
+
+    return normalize(result);
+}
+
+void main()
+{
+#ifdef QUANTIZED_VERTICES
+    vec3 position = quantizedPosition.xyz * object.positionScale.xyz +
+        object.positionOffset.xyz;
+    vec3 normal = octahedral_decode(octahedralNormal);
+#endif
+
+    vec4 world = object.model * vec4(position, 1.0);
+
+    worldPosition = world.xyz;
+    worldNormal = transpose(inverse(mat3(object.model))) * normal;
+    viewDepth = -(frame.view * world).z;
+    color = object.color;
+
+    gl_Position = frame.viewProjection * world;
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#version 450
+
+#define CLUSTERS_ACCESS readonly
+#include "clustered_common.glsl"
+#include "meshlet_common.glsl"
+
+layout(location = 0) out vec3 worldPosition;
+layout(location = 1) out vec3 worldNormal;
+layout(location = 2) out float viewDepth;
+layout(location = 3) out vec4 color;
+
+// Must match the depth prepass bit for bit, as in mesh.vert
+invariant gl_Position;
+
+void main()
+{
+    // See meshlet_cull.comp, vertexOffset is instance * vertexCount
+    uint instanceIndex = uint(gl_VertexIndex) / vertexCount;
+    uint vertex = uint(gl_VertexIndex) % vertexCount;
+    Instance instance = instances[instanceIndex];
+
+    vec4 world = instance.model * vec4(vertex_position(vertex), 1.0);
+
+    worldPosition = world.xyz;
+    worldNormal = mat3(instance.model) * vertex_normal(vertex);
+    viewDepth = -(frame.view * world).z;
+    color = instance.color;
+
+    gl_Position = frame.viewProjection * world;
+}
\ No newline at end of file
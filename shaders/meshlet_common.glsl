@@ -0,0 +1,90 @@
+// Shared by the meshlet culling, vertex, task and mesh shaders. The constants
+// and structs have to match meshlets.c
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+struct Meshlet
+{
+    vec4 sphere; // xyz center, w radius, in object space
+    vec4 cone; // xyz axis, w cutoff, a cutoff of 1 is never culled
+    uint vertexOffset; // into meshletVertices
+    uint triangleOffset; // into meshletTriangles, times 3 into the indices
+    uint vertexCount;
+    uint triangleCount;
+};
+
+struct Instance
+{
+    mat4 model; // rotation, translation and uniform scale
+    vec4 color;
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Meshlets
+{
+    Meshlet meshlets[];
+};
+
+// Mesh vertex index of each meshlet vertex
+layout(std430, set = 1, binding = 1) readonly buffer MeshletVertices
+{
+    uint meshletVertices[];
+};
+
+// Three 8-bit meshlet vertex indices per triangle
+layout(std430, set = 1, binding = 2) readonly buffer MeshletTriangles
+{
+    uint meshletTriangles[];
+};
+
+// Position and normal, 6 floats per vertex
+layout(std430, set = 1, binding = 3) readonly buffer VertexData
+{
+    float vertexData[];
+};
+
+layout(std430, set = 1, binding = 4) readonly buffer Instances
+{
+    uint meshletCount;
+    uint vertexCount;
+    uint instanceCount;
+    uint padding;
+    Instance instances[];
+};
+
+vec3 vertex_position(uint vertex)
+{
+    return vec3(vertexData[vertex * 6 + 0], vertexData[vertex * 6 + 1],
+                vertexData[vertex * 6 + 2]);
+}
+
+vec3 vertex_normal(uint vertex)
+{
+    return vec3(vertexData[vertex * 6 + 3], vertexData[vertex * 6 + 4],
+                vertexData[vertex * 6 + 5]);
+}
+
+// Needs clustered_common.glsl for the frustum. False if the meshlet is
+// outside the frustum or all of its triangles face away from the camera.
+bool meshlet_visible(Meshlet meshlet, mat4 model)
+{
+    vec3 center = (model * vec4(meshlet.sphere.xyz, 1.0)).xyz;
+    float scale = length(model[0].xyz);
+    float radius = meshlet.sphere.w * scale;
+
+    if (!sphere_in_frustum(center, radius))
+    {
+        return false;
+    }
+
+    // Every triangle's normal is within the cone around the axis. Viewed
+    // from inside the cone's backside every triangle faces away.
+    vec3 axis = normalize(mat3(model) * meshlet.cone.xyz);
+    vec3 offset = center - frame.cameraPosition.xyz;
+    if (dot(offset, axis) >= meshlet.cone.w * length(offset) + radius)
+    {
+        return false;
+    }
+
+    return true;
+}
\ No newline at end of file
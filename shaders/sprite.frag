@@ -0,0 +1,33 @@
+#version 450
+
+#ifndef UNIFORM_TEXTURE_INDEX
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
+
+layout(location = 0) in vec2 uv;
+layout(location = 1) in vec4 tint;
+layout(location = 2) flat in uint textureIndex;
+
+layout(location = 0) out vec4 outColor;
+
+#ifdef UNIFORM_TEXTURE_INDEX
+
+// Without descriptor indexing the batcher splits its draws where the texture
+// changes and binds that texture's set, the index is unused. An array of
+// samplers would need dynamic indexing, which isn't guaranteed either.
+layout(set = 0, binding = 0) uniform sampler2D spriteTexture;
+#define sprite_texture(index) spriteTexture
+
+#else
+
+// Every sprite texture, sized by the batcher and only partially bound. One
+// draw covers sprites of any number of textures.
+layout(set = 0, binding = 0) uniform sampler2D textures[];
+#define sprite_texture(index) textures[nonuniformEXT(index)]
+
+#endif
+
+void main()
+{
+    outColor = texture(sprite_texture(textureIndex), uv) * tint;
+}
\ No newline at end of file
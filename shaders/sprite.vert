@@ -0,0 +1,29 @@
+#version 450
+
+layout(push_constant) uniform SpriteConstants
+{
+    vec2 pixelToNdc; // 2 / width, 2 / height
+} constants;
+
+// One SpriteInstance per instance, see sprites.c
+layout(location = 0) in vec4 rect; // x0, y0, x1, y1 in pixels from the top left
+layout(location = 1) in vec4 uvRect; // u0, v0, u1, v1
+layout(location = 2) in vec4 color;
+layout(location = 3) in uint spriteTexture;
+
+layout(location = 0) out vec2 uv;
+layout(location = 1) out vec4 tint;
+layout(location = 2) flat out uint textureIndex;
+
+void main()
+{
+    // Triangle strip over the corners (0, 0) (1, 0) (0, 1) (1, 1)
+    vec2 corner = vec2(gl_VertexIndex & 1, gl_VertexIndex >> 1);
+
+    uv = mix(uvRect.xy, uvRect.zw, corner);
+    tint = color;
+    textureIndex = spriteTexture;
+
+    vec2 position = mix(rect.xy, rect.zw, corner);
+    gl_Position = vec4(position * constants.pixelToNdc - 1.0, 0.0, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#version 450
+
+// The sprite vertex shader's outputs, the texture index is unused
+layout(location = 0) in vec2 uv;
+layout(location = 1) in vec4 tint;
+
+layout(location = 0) out vec4 outColor;
+
+// Signed distance field, 0.5 on the glyph's edge, see text.c
+layout(set = 0, binding = 0) uniform sampler2D atlas;
+
+void main()
+{
+    float distance = texture(atlas, uv).r;
+
+    // The distance changes by about fwidth per pixel at the current scale, so
+    // the edge is antialiased over one pixel whatever the text size
+    float width = max(fwidth(distance), 1e-4) * 0.5;
+    float coverage = smoothstep(0.5 - width, 0.5 + width, distance);
+
+    outColor = vec4(tint.rgb, tint.a * coverage);
+}
\ No newline at end of file
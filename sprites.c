@@ -0,0 +1,614 @@
+/*
+*  Sprite batching
+*/
+
+/* Sprites are queued during the frame and drawn at the end of the main
+   subpass. Each sprite is one SpriteInstance, expanded to a 4 vertex
+   triangle strip by the vertex shader, so the stream written every frame is
+   40 bytes per sprite instead of 4 vertices and 6 indices. The stream is a
+   host visible buffer per frame slot that stays mapped for its lifetime.
+   
+   Before the stream is written the sprites are sorted by layer, then by
+   texture, with a stable radix sort, so sprites with the same key keep their
+   submission order. Layers draw in increasing order. With descriptor
+   indexing the texture is an index into one array of every sprite texture
+   and all the sprites are a single draw; without it every texture has a set
+   of its own and there is a draw per run of the same texture, so the shader
+   never indexes an array of samplers. */
+
+#define MAX_SPRITES 65536
+#define MAX_SPRITE_TEXTURES 1024 // with descriptor indexing
+#define SPRITE_FALLBACK_TEXTURES 16 // without it, a descriptor set each
+
+typedef u32 SpriteTextureId; // 0 is white, for untextured quads
+
+// VertexFormat_Sprite, 40 bytes
+typedef struct
+{
+    Vec4 rect; // x0, y0, x1, y1 in pixels from the top left
+    Vec4 uvRect; // u0, v0, u1, v1
+    u32 color; // RGBA8, red in the low byte
+    SpriteTextureId texture;
+    
+} SpriteInstance;
+
+typedef struct
+{
+    GpuBuffer stream; // SpriteInstance[MAX_SPRITES]
+    
+} SpriteFrame;
+
+typedef struct
+{
+    bool bindless; // descriptor indexing, see above
+    
+    // Textures are registered at load time, the set is shared by all frames
+    VkSampler sampler;
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSet descriptorSet; // bindless, every texture
+    VkDescriptorSet textureSets[SPRITE_FALLBACK_TEXTURES]; // otherwise
+    GpuImage white;
+    u32 textureCapacity;
+    u32 textureCount;
+    
+    SpriteFrame frames[FRAMES_IN_FLIGHT];
+    SpriteFrame *frame; // being recorded
+    
+    // Queued this frame, in submission order
+    SpriteInstance *sprites;
+    u64 *keys; // layer, texture, then the sprite's index
+    u64 *sortScratch;
+    u32 spriteCount;
+    u32 droppedCount; // past MAX_SPRITES
+    
+    u32 drawCount; // of the last flush
+    
+} SpriteBatcher;
+
+// 0xAABBGGRR, the byte order of VK_FORMAT_R8G8B8A8_UNORM
+u32
+pack_color(f32 r, f32 g, f32 b, f32 a)
+{
+    return (u32)(r * 255.0f + 0.5f) |
+        ((u32)(g * 255.0f + 0.5f) << 8) |
+        ((u32)(b * 255.0f + 0.5f) << 16) |
+        ((u32)(a * 255.0f + 0.5f) << 24);
+}
+
+void
+write_sprite_texture(SpriteBatcher *batcher, VulkanContext *vk, u32 slot,
+                     VkImageView view)
+{
+    VkDescriptorImageInfo imageInfo =
+    {
+        batcher->sampler,
+        view,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+    
+    VkWriteDescriptorSet write =
+    {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        NULL,
+        batcher->bindless ? batcher->descriptorSet :
+            batcher->textureSets[slot],
+        0, // dstBinding
+        batcher->bindless ? slot : 0, // dstArrayElement
+        1, // descriptorCount
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        &imageInfo,
+        NULL, // pBufferInfo
+        NULL // pTexelBufferView
+    };
+    
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, NULL);
+}
+
+/* Makes a sampled image available to sprites. Only at load time, the set
+   isn't update-after-bind, so it must not change while frames use it. */
+SpriteTextureId
+register_sprite_texture(SpriteBatcher *batcher, VulkanContext *vk,
+                        VkImageView view)
+{
+    if (batcher->textureCount >= batcher->textureCapacity)
+    {
+        debug_printf("Sprites: out of texture slots\n");
+        return 0;
+    }
+    
+    SpriteTextureId result = batcher->textureCount++;
+    write_sprite_texture(batcher, vk, result, view);
+    
+    return result;
+}
+
+void
+sprite_batcher_init(SpriteBatcher *batcher, VulkanContext *vk,
+                    VkCommandPool commandPool)
+{
+    VkPhysicalDeviceVulkan12Features *features = &vk->enabledFeatures12;
+    batcher->bindless = features->runtimeDescriptorArray &&
+        features->shaderSampledImageArrayNonUniformIndexing &&
+        features->descriptorBindingPartiallyBound;
+    
+    // Combined image samplers count against the sampler and the sampled
+    // image limits
+    VkPhysicalDeviceLimits *limits = &vk->physicalDeviceProperties.limits;
+    u32 deviceLimits[] =
+    {
+        limits->maxPerStageDescriptorSamplers,
+        limits->maxPerStageDescriptorSampledImages,
+        limits->maxDescriptorSetSamplers,
+        limits->maxDescriptorSetSampledImages,
+    };
+    
+    u32 capacity = MAX_SPRITE_TEXTURES;
+    for (u32 i = 0; i < array_count(deviceLimits); i++)
+    {
+        capacity = deviceLimits[i] < capacity ? deviceLimits[i] : capacity;
+    }
+    batcher->textureCapacity =
+        batcher->bindless ? capacity : SPRITE_FALLBACK_TEXTURES;
+    
+    VkSamplerCreateInfo samplerInfo =
+    {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        NULL,
+        0,
+        VK_FILTER_LINEAR, // magFilter
+        VK_FILTER_LINEAR, // minFilter
+        VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        0, // mipLodBias
+        VK_FALSE, 1, // (no anisotropy)
+        VK_FALSE, VK_COMPARE_OP_NEVER, // (no compare)
+        0, 0, // min and max lod
+        VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+        VK_FALSE // unnormalizedCoordinates
+    };
+    
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL,
+                        &batcher->sampler) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the sprite sampler");
+    }
+    
+    /*
+    *  Texture set
+    */
+    
+    VkDescriptorSetLayoutBinding binding =
+    {
+        0, // binding
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        batcher->bindless ? batcher->textureCapacity : 1, // descriptorCount
+        VK_SHADER_STAGE_FRAGMENT_BIT,
+        NULL // pImmutableSamplers
+    };
+    
+    // Slots past textureCount are never written
+    VkDescriptorBindingFlags bindingFlags =
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        NULL,
+        1, // bindingCount
+        &bindingFlags
+    };
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        batcher->bindless ? &bindingFlagsInfo : NULL,
+        0,
+        1, // bindingCount
+        &binding
+    };
+    
+    if (vkCreateDescriptorSetLayout(vk->device, &layoutInfo, NULL,
+                                    &batcher->setLayout) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the sprite set layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    handle_to_u64(batcher->setLayout), "Sprite set layout");
+    
+    VkDescriptorPoolSize poolSize =
+    {
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        batcher->textureCapacity
+    };
+    
+    VkDescriptorPoolCreateInfo poolInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        NULL,
+        0,
+        batcher->bindless ? 1 : batcher->textureCapacity, // maxSets
+        1, &poolSize
+    };
+    
+    if (vkCreateDescriptorPool(vk->device, &poolInfo, NULL,
+                               &batcher->descriptorPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the sprite descriptor pool");
+    }
+    
+    VkDescriptorSetLayout setLayouts[SPRITE_FALLBACK_TEXTURES];
+    for (u32 i = 0; i < array_count(setLayouts); i++)
+    {
+        setLayouts[i] = batcher->setLayout;
+    }
+    
+    VkDescriptorSetAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        NULL,
+        batcher->descriptorPool,
+        batcher->bindless ? 1 : batcher->textureCapacity, // descriptorSetCount
+        setLayouts
+    };
+    
+    if (batcher->bindless)
+    {
+        if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                     &batcher->descriptorSet) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate descriptor set");
+        }
+        set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                        handle_to_u64(batcher->descriptorSet), "Sprite set");
+    }
+    else
+    {
+        if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                     batcher->textureSets) != VK_SUCCESS)
+        {
+            assert(!"Failed to allocate descriptor sets");
+        }
+        for (u32 i = 0; i < batcher->textureCapacity; i++)
+        {
+            set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET,
+                            handle_to_u64(batcher->textureSets[i]),
+                            "Sprite texture set %u", i);
+        }
+    }
+    
+    // Texture 0. Without descriptor indexing every set is written, the
+    // unused ones show white too.
+    u32 whitePixel = 0xffffffff;
+    batcher->white = create_texture(vk, commandPool, 1, 1,
+                                    VK_FORMAT_R8G8B8A8_UNORM, 4, &whitePixel,
+                                    "White sprite texture");
+    
+    u32 initialSlots = batcher->bindless ? 1 : batcher->textureCapacity;
+    for (u32 i = 0; i < initialSlots; i++)
+    {
+        write_sprite_texture(batcher, vk, i, batcher->white.view);
+    }
+    batcher->textureCount = 1;
+    
+    /*
+    *  Streams and the CPU side queue
+    */
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        batcher->frames[i].stream =
+            create_host_buffer(vk, MAX_SPRITES * sizeof(SpriteInstance),
+                               VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                               "Sprite stream");
+    }
+    
+    batcher->sprites = push_array(&globalPermanentArena, SpriteInstance,
+                                  MAX_SPRITES);
+    batcher->keys = push_array(&globalPermanentArena, u64, MAX_SPRITES);
+    batcher->sortScratch = push_array(&globalPermanentArena, u64, MAX_SPRITES);
+    
+    debug_printf("Sprites: %s, %u texture slots\n",
+                 batcher->bindless ? "bindless" : "a draw per texture",
+                 batcher->textureCapacity);
+}
+
+// Starts the frame's queue, the frame slot's stream is free to overwrite
+void
+begin_sprites(SpriteBatcher *batcher, FrameTimeline *frames)
+{
+    batcher->frame = &batcher->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+    batcher->spriteCount = 0;
+    batcher->droppedCount = 0;
+}
+
+// Higher layers draw over lower ones, layer is 16 bits
+void
+draw_sprite_uv(SpriteBatcher *batcher, f32 x, f32 y, f32 width, f32 height,
+               Vec4 uvRect, SpriteTextureId texture, u32 layer, u32 color)
+{
+    if (batcher->spriteCount >= MAX_SPRITES)
+    {
+        batcher->droppedCount++;
+        return;
+    }
+    
+    u32 index = batcher->spriteCount++;
+    
+    SpriteInstance *sprite = &batcher->sprites[index];
+    sprite->rect = vec4(x, y, x + width, y + height);
+    sprite->uvRect = uvRect;
+    sprite->color = color;
+    sprite->texture = texture;
+    
+    batcher->keys[index] = ((u64)(layer & 0xffff) << 48) |
+        ((u64)(texture & 0xffff) << 32) | index;
+}
+
+void
+draw_sprite(SpriteBatcher *batcher, f32 x, f32 y, f32 width, f32 height,
+            SpriteTextureId texture, u32 layer, u32 color)
+{
+    draw_sprite_uv(batcher, x, y, width, height, vec4(0, 0, 1, 1), texture,
+                   layer, color);
+}
+
+/* LSD radix sort of the keys by their upper 32 bits, a byte per pass. The
+   lower 32 bits are the submission index, which the stable passes keep in
+   order. Passes where every key has the same byte are skipped, which with a
+   few layers and textures is most of them. */
+void
+sort_sprites(SpriteBatcher *batcher)
+{
+    u64 *keys = batcher->keys;
+    u64 *scratch = batcher->sortScratch;
+    u32 count = batcher->spriteCount;
+    
+    for (u32 shift = 32; shift < 64; shift += 8)
+    {
+        u32 offsets[256] = {0};
+        for (u32 i = 0; i < count; i++)
+        {
+            offsets[(keys[i] >> shift) & 0xff]++;
+        }
+        
+        if (count == 0 || offsets[(keys[0] >> shift) & 0xff] == count)
+        {
+            continue;
+        }
+        
+        u32 total = 0;
+        for (u32 bucket = 0; bucket < 256; bucket++)
+        {
+            u32 bucketCount = offsets[bucket];
+            offsets[bucket] = total;
+            total += bucketCount;
+        }
+        
+        for (u32 i = 0; i < count; i++)
+        {
+            scratch[offsets[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }
+        
+        u64 *swap = keys;
+        keys = scratch;
+        scratch = swap;
+    }
+    
+    batcher->keys = keys;
+    batcher->sortScratch = scratch;
+}
+
+/* Sorts the queue, writes it to the frame's stream and records the draws.
+   Expects to be inside the main subpass, binds its own pipeline, layout and
+   vertex buffer. */
+void
+flush_sprites(SpriteBatcher *batcher, VkCommandBuffer commandBuffer,
+              VkPipeline pipeline, VkPipelineLayout layout, VkExtent2D extent)
+{
+    batcher->drawCount = 0;
+    
+    u32 count = batcher->spriteCount;
+    if (count == 0)
+    {
+        return;
+    }
+    
+    sort_sprites(batcher);
+    
+    // Written front to back in one pass, the stream may be write combined
+    SpriteInstance *stream = (SpriteInstance *)batcher->frame->stream.mapped;
+    for (u32 i = 0; i < count; i++)
+    {
+        stream[i] = batcher->sprites[(u32)batcher->keys[i]];
+    }
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline);
+    
+    f32 pixelToNdc[2] =
+    {
+        2.0f / (f32)extent.width,
+        2.0f / (f32)extent.height
+    };
+    vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       sizeof(pixelToNdc), pixelToNdc);
+    
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+                           &batcher->frame->stream.buffer, &offset);
+    
+    if (batcher->bindless)
+    {
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1,
+                                &batcher->descriptorSet, 0, NULL);
+        vkCmdDraw(commandBuffer, 4, count, 0, 0);
+        batcher->drawCount = 1;
+        return;
+    }
+    
+    // A draw per run of the same texture with its set bound, read from the
+    // queue since the stream is slow to read back
+    u32 first = 0;
+    SpriteTextureId texture = batcher->sprites[(u32)batcher->keys[0]].texture;
+    for (u32 i = 1; i <= count; i++)
+    {
+        SpriteTextureId next = i < count ?
+            batcher->sprites[(u32)batcher->keys[i]].texture : texture;
+        
+        if (i == count || next != texture)
+        {
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS, layout,
+                                    0, 1, &batcher->textureSets[texture], 0,
+                                    NULL);
+            vkCmdDraw(commandBuffer, 4, i - first, 0, first);
+            batcher->drawCount++;
+            first = i;
+            texture = next;
+        }
+    }
+}
+
+/*
+*  Sprite demo
+*/
+
+/* Particles bouncing around the window over the scene, a mix of procedural
+   textures and layers to exercise the sorting and batching */
+
+#define SPRITE_DEMO_TEXTURES 4
+#define SPRITE_DEMO_TEXTURE_SIZE 64
+
+typedef struct
+{
+    Vec4 start; // x, y in 0..1, velocity x, y in windows per second
+    f32 size;
+    u32 color;
+    u32 layer;
+    SpriteTextureId texture;
+    
+} DemoSprite;
+
+typedef struct
+{
+    GpuImage textures[SPRITE_DEMO_TEXTURES];
+    SpriteTextureId textureIds[SPRITE_DEMO_TEXTURES];
+    DemoSprite *sprites;
+    u32 spriteCount;
+    
+} SpriteDemo;
+
+// Disc, ring, diamond and checker, white with alpha so the tint shows
+u32
+sprite_demo_texel(u32 shape, u32 x, u32 y)
+{
+    f32 u = ((f32)x + 0.5f) / SPRITE_DEMO_TEXTURE_SIZE * 2.0f - 1.0f;
+    f32 v = ((f32)y + 0.5f) / SPRITE_DEMO_TEXTURE_SIZE * 2.0f - 1.0f;
+    f32 radius = sqrtf(u * u + v * v);
+    
+    f32 alpha = 0;
+    switch (shape)
+    {
+        case 0:
+        {
+            alpha = 1.0f - radius;
+        } break;
+        
+        case 1:
+        {
+            alpha = 1.0f - fabsf(radius - 0.7f) * 8.0f;
+        } break;
+        
+        case 2:
+        {
+            alpha = (1.0f - fabsf(u) - fabsf(v)) * 4.0f;
+        } break;
+        
+        default:
+        {
+            alpha = ((x / 16 + y / 16) % 2) ? 1.0f : 0.25f;
+        } break;
+    }
+    
+    alpha = alpha < 0 ? 0 : alpha > 1 ? 1 : alpha;
+    return pack_color(1, 1, 1, alpha);
+}
+
+void
+sprite_demo_init(SpriteDemo *demo, SpriteBatcher *batcher, VulkanContext *vk,
+                 VkCommandPool commandPool, u32 spriteCount)
+{
+    u32 pixels[SPRITE_DEMO_TEXTURE_SIZE * SPRITE_DEMO_TEXTURE_SIZE];
+    
+    for (u32 i = 0; i < SPRITE_DEMO_TEXTURES; i++)
+    {
+        for (u32 y = 0; y < SPRITE_DEMO_TEXTURE_SIZE; y++)
+        {
+            for (u32 x = 0; x < SPRITE_DEMO_TEXTURE_SIZE; x++)
+            {
+                pixels[y * SPRITE_DEMO_TEXTURE_SIZE + x] =
+                    sprite_demo_texel(i, x, y);
+            }
+        }
+        
+        demo->textures[i] =
+            create_texture(vk, commandPool, SPRITE_DEMO_TEXTURE_SIZE,
+                           SPRITE_DEMO_TEXTURE_SIZE, VK_FORMAT_R8G8B8A8_UNORM,
+                           4, pixels, "Sprite demo texture");
+        demo->textureIds[i] = register_sprite_texture(batcher, vk,
+                                                      demo->textures[i].view);
+    }
+    
+    demo->spriteCount = spriteCount < MAX_SPRITES ? spriteCount : MAX_SPRITES;
+    demo->sprites = push_array(&globalPermanentArena, DemoSprite,
+                               demo->spriteCount);
+    
+    u32 random = 0x2545f491;
+    for (u32 i = 0; i < demo->spriteCount; i++)
+    {
+        DemoSprite *sprite = &demo->sprites[i];
+        sprite->start = vec4(random_unit(&random), random_unit(&random),
+                             (random_unit(&random) - 0.5f) * 0.2f,
+                             (random_unit(&random) - 0.5f) * 0.2f);
+        sprite->size = 6.0f + random_unit(&random) * 18.0f;
+        sprite->color = pack_color(0.3f + random_unit(&random) * 0.7f,
+                                   0.3f + random_unit(&random) * 0.7f,
+                                   0.3f + random_unit(&random) * 0.7f,
+                                   0.6f);
+        sprite->layer = (u32)(random_unit(&random) * 4.0f);
+        sprite->texture =
+            demo->textureIds[(u32)(random_unit(&random) *
+                                   SPRITE_DEMO_TEXTURES)];
+    }
+}
+
+// 0..1..0 as t goes from 0 to 2
+f32
+bounce(f32 t)
+{
+    f32 phase = t * 0.5f - floorf(t * 0.5f);
+    return 1.0f - fabsf(phase * 2.0f - 1.0f);
+}
+
+void
+sprite_demo_update(SpriteDemo *demo, SpriteBatcher *batcher,
+                   VkExtent2D extent, f32 seconds)
+{
+    for (u32 i = 0; i < demo->spriteCount; i++)
+    {
+        DemoSprite *sprite = &demo->sprites[i];
+        
+        f32 x = bounce(sprite->start.x + sprite->start.z * seconds);
+        f32 y = bounce(sprite->start.y + sprite->start.w * seconds);
+        
+        draw_sprite(batcher, x * ((f32)extent.width - sprite->size),
+                    y * ((f32)extent.height - sprite->size), sprite->size,
+                    sprite->size, sprite->texture, sprite->layer,
+                    sprite->color);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,580 @@
+/*
+*  Signed distance field font atlas
+*/
+
+/* The printable ASCII glyphs of a system font are rendered with GDI at
+   FONT_RENDER_SCALE times the atlas resolution, and each atlas texel stores
+   the distance to the nearest glyph edge instead of coverage: 0.5 on the
+   edge, more inside, less outside, FONT_SPREAD texels to either side
+   spanning the whole 0..1 range. Bilinear filtering of a distance is still a
+   good distance, so one atlas makes clean edges at any text size, where a
+   coverage atlas blurs when magnified and aliases when minified.
+   
+   Building the atlas takes a few milliseconds, so it runs in a startup
+   asset job, and the result is cached in FONT_ATLAS_CACHE. Every glyph
+   has a cell of the same size with the pen at the same spot, so a glyph's
+   quad only depends on its advance. */
+
+#define FONT_ATLAS_CACHE "font_atlas.bin"
+#define FONT_ATLAS_VERSION 1
+#define FONT_FACE "Consolas"
+
+#define FONT_FIRST_CHAR 32
+#define FONT_CHAR_COUNT 95 // up to '~'
+#define FONT_LINE_HEIGHT 32 // in atlas texels
+#define FONT_SPREAD 6 // in atlas texels
+#define FONT_CELL_SIZE (FONT_LINE_HEIGHT + 2 * FONT_SPREAD)
+#define FONT_ATLAS_COLUMNS 16
+#define FONT_ATLAS_ROWS 6
+#define FONT_ATLAS_WIDTH (FONT_ATLAS_COLUMNS * FONT_CELL_SIZE)
+#define FONT_ATLAS_HEIGHT (FONT_ATLAS_ROWS * FONT_CELL_SIZE)
+#define FONT_RENDER_SCALE 4
+
+// Also the header of FONT_ATLAS_CACHE, followed by the pixels
+typedef struct
+{
+    u32 version;
+    u32 width;
+    u32 height;
+    f32 advances[FONT_CHAR_COUNT]; // in atlas texels
+    
+} FontAtlasHeader;
+
+typedef struct
+{
+    FontAtlasHeader header;
+    u8 *pixels; // R8, FONT_ATLAS_WIDTH * FONT_ATLAS_HEIGHT
+    
+} FontAtlas;
+
+#define EDT_INFINITY 1e20f
+
+/* Squared distance transform of one row or column (Felzenszwalb and
+   Huttenlocher). f is 0 at feature samples and EDT_INFINITY elsewhere, d gets
+   the squared distance to the nearest feature. The lower envelope of the
+   parabolas rooted at the samples is built in v and z, so the whole
+   transform is linear in n. */
+void
+distance_transform_1d(f32 *f, f32 *d, u32 *v, f32 *z, u32 n)
+{
+    u32 k = 0;
+    v[0] = 0;
+    z[0] = -EDT_INFINITY;
+    z[1] = EDT_INFINITY;
+    
+    for (u32 q = 1; q < n; q++)
+    {
+        // Drop the parabolas the one of q hides, z[0] stops the loop
+        f32 s;
+        for (;;)
+        {
+            f32 p = (f32)v[k];
+            s = ((f[q] + (f32)q * (f32)q) - (f[v[k]] + p * p)) /
+                (2.0f * ((f32)q - p));
+            
+            if (s > z[k])
+            {
+                break;
+            }
+            k--;
+        }
+        
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = EDT_INFINITY;
+    }
+    
+    k = 0;
+    for (u32 q = 0; q < n; q++)
+    {
+        while (z[k + 1] < (f32)q)
+        {
+            k++;
+        }
+        
+        f32 offset = (f32)q - (f32)v[k];
+        d[q] = offset * offset + f[v[k]];
+    }
+}
+
+// In place on grid (size * size), columns then rows. scratch holds
+// 3 * size + 1 floats and size + 1 u32s.
+void
+distance_transform_2d(f32 *grid, u32 size, f32 *scratch, u32 *v)
+{
+    f32 *f = scratch;
+    f32 *d = scratch + size;
+    f32 *z = scratch + 2 * size;
+    
+    for (u32 x = 0; x < size; x++)
+    {
+        for (u32 y = 0; y < size; y++)
+        {
+            f[y] = grid[y * size + x];
+        }
+        
+        distance_transform_1d(f, d, v, z, size);
+        
+        for (u32 y = 0; y < size; y++)
+        {
+            grid[y * size + x] = d[y];
+        }
+    }
+    
+    for (u32 y = 0; y < size; y++)
+    {
+        memcpy(f, &grid[y * size], size * sizeof(f32));
+        distance_transform_1d(f, d, v, z, size);
+        memcpy(&grid[y * size], d, size * sizeof(f32));
+    }
+}
+
+void
+build_font_atlas(FontAtlas *atlas, Arena *arena)
+{
+    u32 size = FONT_CELL_SIZE * FONT_RENDER_SCALE;
+    
+    atlas->header.version = FONT_ATLAS_VERSION;
+    atlas->header.width = FONT_ATLAS_WIDTH;
+    atlas->header.height = FONT_ATLAS_HEIGHT;
+    atlas->pixels = push_array_zero(arena, u8,
+                                    FONT_ATLAS_WIDTH * FONT_ATLAS_HEIGHT);
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    // Distances to the nearest inside and outside sample
+    f32 *outside = push_array(scratchArena, f32, size * size);
+    f32 *inside = push_array(scratchArena, f32, size * size);
+    f32 *scratch = push_array(scratchArena, f32, 3 * size + 1);
+    u32 *v = push_array(scratchArena, u32, size + 1);
+    
+    // White on black into a top-down 32-bit DIB
+    HDC dc = CreateCompatibleDC(NULL);
+    
+    BITMAPINFO bitmapInfo = {0};
+    bitmapInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bitmapInfo.bmiHeader.biWidth = (LONG)size;
+    bitmapInfo.bmiHeader.biHeight = -(LONG)size;
+    bitmapInfo.bmiHeader.biPlanes = 1;
+    bitmapInfo.bmiHeader.biBitCount = 32;
+    bitmapInfo.bmiHeader.biCompression = BI_RGB;
+    
+    u32 *bits = NULL;
+    HBITMAP bitmap = CreateDIBSection(dc, &bitmapInfo, DIB_RGB_COLORS,
+                                      (void **)&bits, NULL, 0);
+    assert(bitmap && bits);
+    
+    // Aliased on purpose, the distance field does the antialiasing
+    HFONT font = CreateFontA(FONT_LINE_HEIGHT * FONT_RENDER_SCALE, 0, 0, 0,
+                             FW_NORMAL, FALSE, FALSE, FALSE, ANSI_CHARSET,
+                             OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS,
+                             NONANTIALIASED_QUALITY, FIXED_PITCH | FF_MODERN,
+                             FONT_FACE);
+    assert(font);
+    
+    HGDIOBJ oldBitmap = SelectObject(dc, bitmap);
+    HGDIOBJ oldFont = SelectObject(dc, font);
+    SetTextColor(dc, RGB(255, 255, 255));
+    SetBkMode(dc, TRANSPARENT);
+    
+    s32 pen = FONT_SPREAD * FONT_RENDER_SCALE;
+    
+    for (u32 glyph = 0; glyph < FONT_CHAR_COUNT; glyph++)
+    {
+        char c = (char)(FONT_FIRST_CHAR + glyph);
+        
+        memset(bits, 0, size * size * sizeof(u32));
+        TextOutA(dc, pen, pen, &c, 1);
+        GdiFlush();
+        
+        INT width = 0;
+        GetCharWidth32A(dc, (UINT)c, (UINT)c, &width);
+        atlas->header.advances[glyph] = (f32)width / FONT_RENDER_SCALE;
+        
+        for (u32 i = 0; i < size * size; i++)
+        {
+            bool isInside = (bits[i] & 0xff) > 127;
+            outside[i] = isInside ? 0 : EDT_INFINITY;
+            inside[i] = isInside ? EDT_INFINITY : 0;
+        }
+        
+        distance_transform_2d(outside, size, scratch, v);
+        distance_transform_2d(inside, size, scratch, v);
+        
+        // Point sample the center of each atlas texel's footprint
+        u32 cellX = (glyph % FONT_ATLAS_COLUMNS) * FONT_CELL_SIZE;
+        u32 cellY = (glyph / FONT_ATLAS_COLUMNS) * FONT_CELL_SIZE;
+        
+        for (u32 y = 0; y < FONT_CELL_SIZE; y++)
+        {
+            for (u32 x = 0; x < FONT_CELL_SIZE; x++)
+            {
+                u32 sample = (y * FONT_RENDER_SCALE + FONT_RENDER_SCALE / 2) *
+                    size + x * FONT_RENDER_SCALE + FONT_RENDER_SCALE / 2;
+                
+                // Positive outside, in atlas texels
+                f32 distance = (sqrtf(outside[sample]) -
+                                sqrtf(inside[sample])) / FONT_RENDER_SCALE;
+                f32 value = 0.5f - distance / (2.0f * FONT_SPREAD);
+                value = value < 0 ? 0 : value > 1 ? 1 : value;
+                
+                atlas->pixels[(cellY + y) * FONT_ATLAS_WIDTH + cellX + x] =
+                    (u8)(value * 255.0f + 0.5f);
+            }
+        }
+    }
+    
+    SelectObject(dc, oldFont);
+    SelectObject(dc, oldBitmap);
+    DeleteObject(font);
+    DeleteObject(bitmap);
+    DeleteDC(dc);
+    
+    arena_restore(scratchArena, scratchMark);
+}
+
+// From FONT_ATLAS_CACHE if it is there and current, otherwise built and
+// written to the cache. Runs as a startup asset job. The pixels are pushed on
+// arena.
+void
+load_font_atlas(FontAtlas *atlas, Arena *arena)
+{
+    size_t pixelsSize = FONT_ATLAS_WIDTH * FONT_ATLAS_HEIGHT;
+    
+    Arena *scratch = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratch);
+    
+    LoadedFile file = load_entire_file(FONT_ATLAS_CACHE, scratch);
+    FontAtlasHeader *header = (FontAtlasHeader *)file.data;
+    
+    if (file.size == sizeof(FontAtlasHeader) + pixelsSize &&
+        header->version == FONT_ATLAS_VERSION &&
+        header->width == FONT_ATLAS_WIDTH &&
+        header->height == FONT_ATLAS_HEIGHT)
+    {
+        atlas->header = *header;
+        atlas->pixels = push_array(arena, u8, pixelsSize);
+        memcpy(atlas->pixels, header + 1, pixelsSize);
+        
+        arena_restore(scratch, scratchMark);
+        return;
+    }
+    
+    arena_restore(scratch, scratchMark);
+    build_font_atlas(atlas, arena);
+    
+    u8 *cache = push_array(scratch, u8, sizeof(FontAtlasHeader) + pixelsSize);
+    memcpy(cache, &atlas->header, sizeof(FontAtlasHeader));
+    memcpy(cache + sizeof(FontAtlasHeader), atlas->pixels, pixelsSize);
+    
+    if (!write_entire_file(FONT_ATLAS_CACHE, cache,
+                           sizeof(FontAtlasHeader) + pixelsSize))
+    {
+        debug_printf("Font atlas: can't write " FONT_ATLAS_CACHE "\n");
+    }
+    arena_restore(scratch, scratchMark);
+}
+
+/*
+*  Text rendering
+*/
+
+/* Text is laid out on the CPU straight into a mapped per frame stream, one
+   SpriteInstance per glyph (the texture index is unused), and drawn with the
+   sprite vertex shader in one instanced draw at the end of the main
+   subpass. */
+
+#define MAX_TEXT_GLYPHS 16384
+
+typedef struct
+{
+    GpuBuffer stream; // SpriteInstance[MAX_TEXT_GLYPHS]
+    
+} TextFrame;
+
+typedef struct
+{
+    FontAtlasHeader font;
+    GpuImage atlas;
+    VkSampler sampler;
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSet descriptorSet;
+    
+    TextFrame frames[FRAMES_IN_FLIGHT];
+    TextFrame *frame; // being recorded
+    u32 glyphCount;
+    
+} TextRenderer;
+
+void
+text_renderer_init(TextRenderer *text, VulkanContext *vk,
+                   VkCommandPool commandPool, FontAtlas *font)
+{
+    text->font = font->header;
+    text->atlas = create_texture(vk, commandPool, font->header.width,
+                                 font->header.height, VK_FORMAT_R8_UNORM, 1,
+                                 font->pixels, "Font atlas");
+    
+    VkSamplerCreateInfo samplerInfo =
+    {
+        VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        NULL,
+        0,
+        VK_FILTER_LINEAR, // magFilter
+        VK_FILTER_LINEAR, // minFilter
+        VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        0, // mipLodBias
+        VK_FALSE, 1, // (no anisotropy)
+        VK_FALSE, VK_COMPARE_OP_NEVER, // (no compare)
+        0, 0, // min and max lod
+        VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+        VK_FALSE // unnormalizedCoordinates
+    };
+    
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL,
+                        &text->sampler) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the font sampler");
+    }
+    
+    VkDescriptorSetLayoutBinding binding =
+    {
+        0, // binding
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        1, // descriptorCount
+        VK_SHADER_STAGE_FRAGMENT_BIT,
+        &text->sampler
+    };
+    
+    VkDescriptorSetLayoutCreateInfo layoutInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        NULL,
+        0,
+        1, // bindingCount
+        &binding
+    };
+    
+    if (vkCreateDescriptorSetLayout(vk->device, &layoutInfo, NULL,
+                                    &text->setLayout) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the text set layout");
+    }
+    
+    set_object_name(vk, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT,
+                    handle_to_u64(text->setLayout), "Text set layout");
+    
+    VkDescriptorPoolSize poolSize =
+    {
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1
+    };
+    
+    VkDescriptorPoolCreateInfo poolInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        NULL,
+        0,
+        1, // maxSets
+        1, &poolSize
+    };
+    
+    if (vkCreateDescriptorPool(vk->device, &poolInfo, NULL,
+                               &text->descriptorPool) != VK_SUCCESS)
+    {
+        assert(!"Failed to create the text descriptor pool");
+    }
+    
+    VkDescriptorSetAllocateInfo allocInfo =
+    {
+        VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        NULL,
+        text->descriptorPool,
+        1, // descriptorSetCount
+        &text->setLayout
+    };
+    
+    if (vkAllocateDescriptorSets(vk->device, &allocInfo,
+                                 &text->descriptorSet) != VK_SUCCESS)
+    {
+        assert(!"Failed to allocate descriptor set");
+    }
+    
+    VkDescriptorImageInfo imageInfo =
+    {
+        VK_NULL_HANDLE, // (immutable sampler)
+        text->atlas.view,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+    
+    VkWriteDescriptorSet write =
+    {
+        VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        NULL,
+        text->descriptorSet,
+        0, // dstBinding
+        0, // dstArrayElement
+        1, // descriptorCount
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        &imageInfo,
+        NULL, // pBufferInfo
+        NULL // pTexelBufferView
+    };
+    
+    vkUpdateDescriptorSets(vk->device, 1, &write, 0, NULL);
+    
+    for (u32 i = 0; i < FRAMES_IN_FLIGHT; i++)
+    {
+        text->frames[i].stream =
+            create_host_buffer(vk, MAX_TEXT_GLYPHS * sizeof(SpriteInstance),
+                               VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                               "Text stream");
+    }
+}
+
+void
+begin_text(TextRenderer *text, FrameTimeline *frames)
+{
+    text->frame = &text->frames[frames->frameNumber % FRAMES_IN_FLIGHT];
+    text->glyphCount = 0;
+}
+
+/* Lays out string with its top left at x, y in pixels, lineHeight pixels
+   per line. Returns the x where the next character would go. */
+f32
+draw_text(TextRenderer *text, f32 x, f32 y, f32 lineHeight, u32 color,
+          char *string)
+{
+    f32 scale = lineHeight / FONT_LINE_HEIGHT;
+    f32 cellSize = FONT_CELL_SIZE * scale;
+    f32 spread = FONT_SPREAD * scale;
+    f32 texel = 1.0f / FONT_ATLAS_WIDTH;
+    f32 texelY = 1.0f / FONT_ATLAS_HEIGHT;
+    
+    SpriteInstance *stream = (SpriteInstance *)text->frame->stream.mapped;
+    
+    f32 penX = x;
+    for (char *at = string; *at; at++)
+    {
+        if (*at == '\n')
+        {
+            penX = x;
+            y += lineHeight;
+            continue;
+        }
+        
+        u32 glyph = (u32)(u8)*at - FONT_FIRST_CHAR;
+        if (glyph >= FONT_CHAR_COUNT)
+        {
+            glyph = '?' - FONT_FIRST_CHAR;
+        }
+        
+        // Spaces only advance
+        if (glyph != 0 && text->glyphCount < MAX_TEXT_GLYPHS)
+        {
+            f32 u = (f32)((glyph % FONT_ATLAS_COLUMNS) * FONT_CELL_SIZE);
+            f32 v = (f32)((glyph / FONT_ATLAS_COLUMNS) * FONT_CELL_SIZE);
+            
+            SpriteInstance *instance = &stream[text->glyphCount++];
+            instance->rect = vec4(penX - spread, y - spread,
+                                  penX - spread + cellSize,
+                                  y - spread + cellSize);
+            instance->uvRect = vec4(u * texel, v * texelY,
+                                    (u + FONT_CELL_SIZE) * texel,
+                                    (v + FONT_CELL_SIZE) * texelY);
+            instance->color = color;
+            instance->texture = 0;
+        }
+        
+        penX += text->font.advances[glyph] * scale;
+    }
+    
+    return penX;
+}
+
+f32
+draw_textf(TextRenderer *text, f32 x, f32 y, f32 lineHeight, u32 color,
+           char *format, ...)
+{
+    char buffer[1024];
+    
+    va_list args;
+    va_start(args, format);
+    vsprintf_s(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    
+    return draw_text(text, x, y, lineHeight, color, buffer);
+}
+
+// Records the frame's glyphs as a single draw, inside the main subpass
+void
+flush_text(TextRenderer *text, VkCommandBuffer commandBuffer,
+           VkPipeline pipeline, VkPipelineLayout layout, VkExtent2D extent)
+{
+    if (text->glyphCount == 0)
+    {
+        return;
+    }
+    
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            layout, 0, 1, &text->descriptorSet, 0, NULL);
+    
+    f32 pixelToNdc[2] =
+    {
+        2.0f / (f32)extent.width,
+        2.0f / (f32)extent.height
+    };
+    vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       sizeof(pixelToNdc), pixelToNdc);
+    
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &text->frame->stream.buffer,
+                           &offset);
+    
+    vkCmdDraw(commandBuffer, 4, text->glyphCount, 0, 0);
+}
+
+/*
+*  Diagnostics overlay
+*/
+
+// The profiler's last report, CPU and GPU milliseconds per scope, and the
+// frame's own counters. Returns the y below the last line.
+f32
+draw_diagnostics(TextRenderer *text, Profiler *profiler, f32 x, f32 y,
+                 f32 lineHeight)
+{
+    u32 white = pack_color(1, 1, 1, 1);
+    u32 grey = pack_color(0.7f, 0.7f, 0.7f, 1);
+    
+    draw_textf(text, x, y, lineHeight, white, "%-24s %8s %8s", "Scope",
+               "cpu ms", "gpu ms");
+    y += lineHeight;
+    
+    for (u32 i = 0; i < profiler->reportedCount; i++)
+    {
+        ProfileTotal *total = &profiler->reported[i];
+        
+        char gpu[16] = "";
+        if (total->gpuCount > 0)
+        {
+            sprintf_s(gpu, sizeof(gpu), "%8.3f",
+                      total->gpuMs / (f64)total->gpuCount);
+        }
+        
+        draw_textf(text, x, y, lineHeight, grey, "%*s%-*s %8.3f %8s",
+                   (int)(2 * total->depth), "",
+                   (int)(24 - 2 * total->depth), total->name,
+                   total->cpuMs / (f64)total->count, gpu);
+        y += lineHeight;
+    }
+    
+    return y;
+}
\ No newline at end of file
@@ -0,0 +1,568 @@
+/*
+*  Transform hierarchy
+*/
+
+/* Nodes keep their local translation, rotation and scale as structure of
+   arrays, one array per component, so the update loads one component of
+   four nodes with a single instruction and builds four local matrices at
+   once. A parent always has a lower index than its children, and
+   sort_transform_nodes() goes further and orders the nodes by depth: every
+   level then only depends on the level before it, and its nodes are split
+   over the cores with parallel_for().
+   
+   Changing a local transform marks the node dirty. The update carries the
+   flag down to the children and only recomputes the world matrices of dirty
+   subtrees, with SSE (FMA when built with -arch:AVX2) or NEON. */
+
+#define TRANSFORM_NO_PARENT 0xffffffff
+#define MAX_TRANSFORM_DEPTH 64
+
+// Nodes per job, a multiple of the SIMD width. Smaller levels are updated on
+// the calling thread.
+#define TRANSFORM_CHUNK_SIZE 4096
+
+typedef struct
+{
+    u32 count;
+    u32 capacity;
+    
+    // Local transform
+    f32 *positionX;
+    f32 *positionY;
+    f32 *positionZ;
+    f32 *rotationX; // unit quaternion
+    f32 *rotationY;
+    f32 *rotationZ;
+    f32 *rotationW;
+    f32 *scaleX;
+    f32 *scaleY;
+    f32 *scaleZ;
+    
+    u32 *parent; // TRANSFORM_NO_PARENT for roots
+    u8 *depth;
+    u8 *dirty; // local transform changed since the last update
+    
+    Mat4 *world; // parent's world times local
+    
+    // Set by sort_transform_nodes(), levelCount is 0 while the nodes aren't
+    // sorted by depth and the update falls back to one serial pass
+    u32 levelStart[MAX_TRANSFORM_DEPTH + 1];
+    u32 levelCount;
+    
+} TransformHierarchy;
+
+// Cache line aligned, so a Mat4 never straddles two lines
+void *
+transform_array(u32 capacity, size_t size)
+{
+    return arena_push_zero(&globalPermanentArena, capacity * size, 64);
+}
+
+void
+transform_hierarchy_init(TransformHierarchy *hierarchy, u32 capacity)
+{
+    hierarchy->capacity = capacity;
+    hierarchy->positionX = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->positionY = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->positionZ = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->rotationX = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->rotationY = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->rotationZ = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->rotationW = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->scaleX = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->scaleY = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->scaleZ = (f32 *)transform_array(capacity, sizeof(f32));
+    hierarchy->parent = (u32 *)transform_array(capacity, sizeof(u32));
+    hierarchy->depth = (u8 *)transform_array(capacity, sizeof(u8));
+    hierarchy->dirty = (u8 *)transform_array(capacity, sizeof(u8));
+    hierarchy->world = (Mat4 *)transform_array(capacity, sizeof(Mat4));
+}
+
+// Returns the new node, at identity and dirty. parent must already exist.
+u32
+add_transform_node(TransformHierarchy *hierarchy, u32 parent)
+{
+    assert(hierarchy->count < hierarchy->capacity);
+    assert(parent == TRANSFORM_NO_PARENT || parent < hierarchy->count);
+    
+    u32 node = hierarchy->count++;
+    hierarchy->positionX[node] = 0;
+    hierarchy->positionY[node] = 0;
+    hierarchy->positionZ[node] = 0;
+    hierarchy->rotationX[node] = 0;
+    hierarchy->rotationY[node] = 0;
+    hierarchy->rotationZ[node] = 0;
+    hierarchy->rotationW[node] = 1;
+    hierarchy->scaleX[node] = 1;
+    hierarchy->scaleY[node] = 1;
+    hierarchy->scaleZ[node] = 1;
+    hierarchy->parent[node] = parent;
+    hierarchy->dirty[node] = 1;
+    
+    u32 depth = parent == TRANSFORM_NO_PARENT ?
+        0 : hierarchy->depth[parent] + 1u;
+    assert(depth < MAX_TRANSFORM_DEPTH);
+    hierarchy->depth[node] = (u8)depth;
+    
+    hierarchy->levelCount = 0;
+    
+    return node;
+}
+
+void
+set_transform_position(TransformHierarchy *hierarchy, u32 node, Vec3 position)
+{
+    hierarchy->positionX[node] = position.x;
+    hierarchy->positionY[node] = position.y;
+    hierarchy->positionZ[node] = position.z;
+    hierarchy->dirty[node] = 1;
+}
+
+void
+set_transform_rotation(TransformHierarchy *hierarchy, u32 node, Vec4 rotation)
+{
+    hierarchy->rotationX[node] = rotation.x;
+    hierarchy->rotationY[node] = rotation.y;
+    hierarchy->rotationZ[node] = rotation.z;
+    hierarchy->rotationW[node] = rotation.w;
+    hierarchy->dirty[node] = 1;
+}
+
+void
+set_transform_scale(TransformHierarchy *hierarchy, u32 node, Vec3 scale)
+{
+    hierarchy->scaleX[node] = scale.x;
+    hierarchy->scaleY[node] = scale.y;
+    hierarchy->scaleZ[node] = scale.z;
+    hierarchy->dirty[node] = 1;
+}
+
+// Moves the elements of array to their new index, through scratch
+void
+permute_transform_array(void *array, void *scratch, size_t size, u32 count,
+                        u32 *newIndex)
+{
+    u8 *source = (u8 *)array;
+    u8 *destination = (u8 *)scratch;
+    
+    for (u32 i = 0; i < count; i++)
+    {
+        memcpy(destination + newIndex[i] * size, source + i * size, size);
+    }
+    
+    memcpy(array, scratch, count * size);
+}
+
+/* Orders the nodes breadth first, which sorts them by depth and keeps
+   siblings together, so a level reads its parents' world matrices front to
+   back instead of all over the previous level. Records where each level
+   starts. Owners of node indices remap them with newIndex, which gets count
+   entries when not NULL. */
+void
+sort_transform_nodes(TransformHierarchy *hierarchy, u32 *newIndex)
+{
+    u32 count = hierarchy->count;
+    
+    Arena *scratchArena = get_scratch_arena();
+    u64 scratchMark = arena_mark(scratchArena);
+    
+    u32 *remap = newIndex ? newIndex : push_array(scratchArena, u32, count);
+    
+    // The children of node i are children[firstChild[i]..firstChild[i + 1]]
+    u32 *firstChild = push_array_zero(scratchArena, u32, count + 1);
+    u32 *children = push_array(scratchArena, u32, count);
+    u32 *order = push_array(scratchArena, u32, count);
+    u32 orderCount = 0;
+    
+    for (u32 i = 0; i < count; i++)
+    {
+        if (hierarchy->parent[i] == TRANSFORM_NO_PARENT)
+        {
+            order[orderCount++] = i;
+        }
+        else
+        {
+            firstChild[hierarchy->parent[i] + 1]++;
+        }
+    }
+    
+    for (u32 i = 0; i < count; i++)
+    {
+        firstChild[i + 1] += firstChild[i];
+    }
+    
+    // remap is free until the end, it counts the children added so far
+    memset(remap, 0, count * sizeof(u32));
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 parent = hierarchy->parent[i];
+        if (parent != TRANSFORM_NO_PARENT)
+        {
+            children[firstChild[parent] + remap[parent]++] = i;
+        }
+    }
+    
+    // The order grows behind the loop, a level after the other
+    u32 levelStart[MAX_TRANSFORM_DEPTH + 1] = {0};
+    u32 levelCount = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 node = order[i];
+        u32 depth = hierarchy->depth[node];
+        if (depth + 1 > levelCount)
+        {
+            levelStart[depth] = i;
+            levelCount = depth + 1;
+        }
+        
+        for (u32 j = firstChild[node]; j < firstChild[node + 1]; j++)
+        {
+            order[orderCount++] = children[j];
+        }
+    }
+    levelStart[levelCount] = count;
+    
+    for (u32 i = 0; i < count; i++)
+    {
+        remap[order[i]] = i;
+    }
+    
+    // Mat4 is the largest element
+    void *scratch = push_array(scratchArena, Mat4, count);
+    
+    permute_transform_array(hierarchy->positionX, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->positionY, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->positionZ, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->rotationX, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->rotationY, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->rotationZ, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->rotationW, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->scaleX, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->scaleY, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->scaleZ, scratch, 4, count, remap);
+    permute_transform_array(hierarchy->depth, scratch, 1, count, remap);
+    permute_transform_array(hierarchy->dirty, scratch, 1, count, remap);
+    permute_transform_array(hierarchy->world, scratch, sizeof(Mat4), count,
+                            remap);
+    
+    // Parents stay ahead of their children, they are a level up
+    for (u32 i = 0; i < count; i++)
+    {
+        if (hierarchy->parent[i] != TRANSFORM_NO_PARENT)
+        {
+            hierarchy->parent[i] = remap[hierarchy->parent[i]];
+        }
+    }
+    permute_transform_array(hierarchy->parent, scratch, 4, count, remap);
+    
+    arena_restore(scratchArena, scratchMark);
+    
+    memcpy(hierarchy->levelStart, levelStart, sizeof(levelStart));
+    hierarchy->levelCount = levelCount;
+}
+
+/*
+*  World matrix kernels
+*/
+
+#if defined(_M_ARM64) || defined(__aarch64__)
+
+typedef float32x4_t f32x4;
+
+#define f32x4_load(p) vld1q_f32(p)
+#define f32x4_store(p, a) vst1q_f32(p, a)
+#define f32x4_set1(s) vdupq_n_f32(s)
+#define f32x4_add(a, b) vaddq_f32(a, b)
+#define f32x4_sub(a, b) vsubq_f32(a, b)
+#define f32x4_mul(a, b) vmulq_f32(a, b)
+#define f32x4_madd(a, b, c) vfmaq_f32(c, a, b) // a * b + c
+#define f32x4_lane(a, lane) vdupq_laneq_f32(a, lane)
+
+#else
+
+typedef __m128 f32x4;
+
+#define f32x4_load(p) _mm_loadu_ps(p)
+#define f32x4_store(p, a) _mm_storeu_ps(p, a)
+#define f32x4_set1(s) _mm_set1_ps(s)
+#define f32x4_add(a, b) _mm_add_ps(a, b)
+#define f32x4_sub(a, b) _mm_sub_ps(a, b)
+#define f32x4_mul(a, b) _mm_mul_ps(a, b)
+#ifdef __AVX2__
+#define f32x4_madd(a, b, c) _mm_fmadd_ps(a, b, c)
+#else
+#define f32x4_madd(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#endif
+#define f32x4_lane(a, lane) \
+    _mm_shuffle_ps(a, a, _MM_SHUFFLE(lane, lane, lane, lane))
+
+#endif
+
+static Mat4 transformIdentity =
+{{
+    1, 0, 0, 0,
+    0, 1, 0, 0,
+    0, 0, 1, 0,
+    0, 0, 0, 1,
+}};
+
+// One node at a time, for the ends of levels and unsorted hierarchies
+void
+update_world_transform(TransformHierarchy *hierarchy, u32 i)
+{
+    f32 x = hierarchy->rotationX[i];
+    f32 y = hierarchy->rotationY[i];
+    f32 z = hierarchy->rotationZ[i];
+    f32 w = hierarchy->rotationW[i];
+    f32 sx = hierarchy->scaleX[i];
+    f32 sy = hierarchy->scaleY[i];
+    f32 sz = hierarchy->scaleZ[i];
+    
+    Mat4 local =
+    {{
+        (1 - 2 * (y * y + z * z)) * sx, 2 * (x * y + w * z) * sx,
+        2 * (x * z - w * y) * sx, 0,
+        
+        2 * (x * y - w * z) * sy, (1 - 2 * (x * x + z * z)) * sy,
+        2 * (y * z + w * x) * sy, 0,
+        
+        2 * (x * z + w * y) * sz, 2 * (y * z - w * x) * sz,
+        (1 - 2 * (x * x + y * y)) * sz, 0,
+        
+        hierarchy->positionX[i], hierarchy->positionY[i],
+        hierarchy->positionZ[i], 1,
+    }};
+    
+    u32 parent = hierarchy->parent[i];
+    hierarchy->world[i] = parent == TRANSFORM_NO_PARENT ?
+        local : mat4_multiply(hierarchy->world[parent], local);
+}
+
+/* Node lane of the group: its world matrix is the parent's columns scaled by
+   the local matrix's elements, each broadcast from the group's vectors */
+#define UPDATE_GROUP_NODE(lane) \
+    if (dirty[lane]) \
+    { \
+        u32 parent = hierarchy->parent[first + lane]; \
+        f32 *p = parent == TRANSFORM_NO_PARENT ? \
+            transformIdentity.m : hierarchy->world[parent].m; \
+        f32x4 p0 = f32x4_load(p); \
+        f32x4 p1 = f32x4_load(p + 4); \
+        f32x4 p2 = f32x4_load(p + 8); \
+        f32x4 p3 = f32x4_load(p + 12); \
+        f32 *out = hierarchy->world[first + lane].m; \
+        f32x4_store(out, \
+                    f32x4_madd(p2, f32x4_lane(m02, lane), \
+                    f32x4_madd(p1, f32x4_lane(m01, lane), \
+                    f32x4_mul(p0, f32x4_lane(m00, lane))))); \
+        f32x4_store(out + 4, \
+                    f32x4_madd(p2, f32x4_lane(m12, lane), \
+                    f32x4_madd(p1, f32x4_lane(m11, lane), \
+                    f32x4_mul(p0, f32x4_lane(m10, lane))))); \
+        f32x4_store(out + 8, \
+                    f32x4_madd(p2, f32x4_lane(m22, lane), \
+                    f32x4_madd(p1, f32x4_lane(m21, lane), \
+                    f32x4_mul(p0, f32x4_lane(m20, lane))))); \
+        f32x4_store(out + 12, \
+                    f32x4_madd(p2, f32x4_lane(tz, lane), \
+                    f32x4_madd(p1, f32x4_lane(ty, lane), \
+                    f32x4_madd(p0, f32x4_lane(tx, lane), p3)))); \
+    }
+
+/* Nodes first to first + 4, all on the same level, with their dirty flags
+   already carried down from the parents. mCR is column C, row R of the four
+   local matrices. */
+void
+update_world_transform_group(TransformHierarchy *hierarchy, u32 first,
+                             u8 *dirty)
+{
+    f32x4 x = f32x4_load(hierarchy->rotationX + first);
+    f32x4 y = f32x4_load(hierarchy->rotationY + first);
+    f32x4 z = f32x4_load(hierarchy->rotationZ + first);
+    f32x4 w = f32x4_load(hierarchy->rotationW + first);
+    f32x4 sx = f32x4_load(hierarchy->scaleX + first);
+    f32x4 sy = f32x4_load(hierarchy->scaleY + first);
+    f32x4 sz = f32x4_load(hierarchy->scaleZ + first);
+    f32x4 tx = f32x4_load(hierarchy->positionX + first);
+    f32x4 ty = f32x4_load(hierarchy->positionY + first);
+    f32x4 tz = f32x4_load(hierarchy->positionZ + first);
+    
+    f32x4 one = f32x4_set1(1);
+    f32x4 two = f32x4_set1(2);
+    f32x4 x2 = f32x4_mul(x, two);
+    f32x4 y2 = f32x4_mul(y, two);
+    f32x4 z2 = f32x4_mul(z, two);
+    f32x4 xx = f32x4_mul(x, x2);
+    f32x4 yy = f32x4_mul(y, y2);
+    f32x4 zz = f32x4_mul(z, z2);
+    f32x4 xy = f32x4_mul(x, y2);
+    f32x4 xz = f32x4_mul(x, z2);
+    f32x4 yz = f32x4_mul(y, z2);
+    f32x4 wx = f32x4_mul(w, x2);
+    f32x4 wy = f32x4_mul(w, y2);
+    f32x4 wz = f32x4_mul(w, z2);
+    
+    f32x4 m00 = f32x4_mul(f32x4_sub(one, f32x4_add(yy, zz)), sx);
+    f32x4 m01 = f32x4_mul(f32x4_add(xy, wz), sx);
+    f32x4 m02 = f32x4_mul(f32x4_sub(xz, wy), sx);
+    f32x4 m10 = f32x4_mul(f32x4_sub(xy, wz), sy);
+    f32x4 m11 = f32x4_mul(f32x4_sub(one, f32x4_add(xx, zz)), sy);
+    f32x4 m12 = f32x4_mul(f32x4_add(yz, wx), sy);
+    f32x4 m20 = f32x4_mul(f32x4_add(xz, wy), sz);
+    f32x4 m21 = f32x4_mul(f32x4_sub(yz, wx), sz);
+    f32x4 m22 = f32x4_mul(f32x4_sub(one, f32x4_add(xx, yy)), sz);
+    
+    UPDATE_GROUP_NODE(0)
+    UPDATE_GROUP_NODE(1)
+    UPDATE_GROUP_NODE(2)
+    UPDATE_GROUP_NODE(3)
+}
+
+// Nodes first to end of one level, returns how many were dirty
+u32
+update_world_transform_range(TransformHierarchy *hierarchy, u32 first,
+                             u32 end)
+{
+    u8 *dirty = hierarchy->dirty;
+    u32 *parent = hierarchy->parent;
+    u32 updatedCount = 0;
+    
+    u32 i = first;
+    for (; i + 4 <= end; i += 4)
+    {
+        u32 groupDirty = 0;
+        for (u32 lane = 0; lane < 4; lane++)
+        {
+            u32 node = i + lane;
+            if (parent[node] != TRANSFORM_NO_PARENT && dirty[parent[node]])
+            {
+                dirty[node] = 1;
+            }
+            groupDirty += dirty[node];
+        }
+        
+        if (groupDirty)
+        {
+            update_world_transform_group(hierarchy, i, dirty + i);
+            updatedCount += groupDirty;
+        }
+    }
+    
+    for (; i < end; i++)
+    {
+        if (parent[i] != TRANSFORM_NO_PARENT && dirty[parent[i]])
+        {
+            dirty[i] = 1;
+        }
+        
+        if (dirty[i])
+        {
+            update_world_transform(hierarchy, i);
+            updatedCount++;
+        }
+    }
+    
+    return updatedCount;
+}
+
+// One level being updated by the job threads
+typedef struct
+{
+    TransformHierarchy *hierarchy;
+    u32 first;
+    volatile LONG updatedCount;
+    
+} TransformLevelJob;
+
+void
+transform_level_job(void *data, u32 first, u32 end)
+{
+    TransformLevelJob *job = (TransformLevelJob *)data;
+    u32 updatedCount = update_world_transform_range(job->hierarchy,
+                                                    job->first + first,
+                                                    job->first + end);
+    InterlockedExchangeAdd(&job->updatedCount, (LONG)updatedCount);
+}
+
+/* Brings the world matrices of the dirty subtrees up to date and clears the
+   dirty flags. Returns the number of nodes updated. */
+u32
+update_world_transforms(TransformHierarchy *hierarchy)
+{
+    u32 updatedCount = 0;
+    
+    if (hierarchy->levelCount == 0)
+    {
+        // Parents come first, but a group may hold a parent and its child
+        for (u32 i = 0; i < hierarchy->count; i++)
+        {
+            u32 parent = hierarchy->parent[i];
+            if (parent != TRANSFORM_NO_PARENT && hierarchy->dirty[parent])
+            {
+                hierarchy->dirty[i] = 1;
+            }
+            
+            if (hierarchy->dirty[i])
+            {
+                update_world_transform(hierarchy, i);
+                updatedCount++;
+            }
+        }
+    }
+    
+    for (u32 level = 0; level < hierarchy->levelCount; level++)
+    {
+        u32 first = hierarchy->levelStart[level];
+        u32 end = hierarchy->levelStart[level + 1];
+        
+        // Each level waits for the one before it
+        TransformLevelJob job = { hierarchy, first, 0 };
+        parallel_for(transform_level_job, &job, end - first,
+                     TRANSFORM_CHUNK_SIZE);
+        updatedCount += (u32)job.updatedCount;
+    }
+    
+    memset(hierarchy->dirty, 0, hierarchy->count);
+    
+    return updatedCount;
+}
+
+/*
+*  Stress test
+*/
+
+/* count nodes under one root, each a child of a random earlier node, which
+   makes a bushy tree about ln(count) levels deep. The root spins so every
+   frame updates all of them, the worst case. */
+void
+transform_stress_init(TransformHierarchy *hierarchy, u32 count)
+{
+    transform_hierarchy_init(hierarchy, count);
+    add_transform_node(hierarchy, TRANSFORM_NO_PARENT);
+    
+    u32 random = 12345;
+    for (u32 i = 1; i < count; i++)
+    {
+        random = random * 1664525 + 1013904223;
+        u32 node = add_transform_node(hierarchy, (random >> 8) % i);
+        
+        random = random * 1664525 + 1013904223;
+        f32 angle = (f32)(random >> 8) / (f32)(1 << 24) * 6.28318531f;
+        set_transform_position(hierarchy, node,
+                               vec3(cosf(angle), 0.1f, sinf(angle)));
+        set_transform_rotation(hierarchy, node,
+                               quat_axis_angle(vec3(0, 1, 0), angle));
+        set_transform_scale(hierarchy, node, vec3(0.9f, 0.9f, 0.9f));
+    }
+    
+    sort_transform_nodes(hierarchy, NULL);
+}
+
+u32
+transform_stress_update(TransformHierarchy *hierarchy, f32 seconds)
+{
+    set_transform_rotation(hierarchy, 0,
+                           quat_axis_angle(vec3(0, 1, 0), seconds));
+    
+    return update_world_transforms(hierarchy);
+}
\ No newline at end of file
@@ -0,0 +1,282 @@
+/*
+*  Validation message log
+*/
+
+/* The debug callback runs on whatever thread made the Vulkan call, often in
+   the middle of command recording, and the validation layer can report the
+   same problem thousands of times per second. The callback only copies the
+   message into a lock-free ring (multiple producers, single consumer), and a
+   logger thread drains it, printing each distinct message once followed by
+   periodic repeat counts. */
+
+#define VALIDATION_RING_SIZE 256 // power of two
+#define VALIDATION_MESSAGE_SIZE 1024
+#define VALIDATION_DEDUP_SIZE 1024 // power of two
+
+typedef struct
+{
+    // Equals the write position while the entry is free, position + 1 once
+    // it holds a message for the consumer
+    volatile LONG64 sequence;
+    
+    u64 key;
+    VkDebugUtilsMessageSeverityFlagBitsEXT severity;
+    char message[VALIDATION_MESSAGE_SIZE];
+    
+} ValidationLogEntry;
+
+typedef struct
+{
+    u64 key; // 0 marks an empty slot
+    u32 count;
+    u32 reportedCount;
+    
+} ValidationMessageCount;
+
+typedef struct
+{
+    ValidationLogEntry entries[VALIDATION_RING_SIZE];
+    volatile LONG64 writePosition;
+    LONG64 readPosition; // consumer only
+    volatile LONG64 droppedCount;
+    
+    // Logger thread state
+    HANDLE wakeEvent;
+    HANDLE thread;
+    volatile LONG stop;
+    u64 lastSummary;
+    ValidationMessageCount counts[VALIDATION_DEDUP_SIZE];
+    u32 distinctCount;
+    
+} ValidationLog;
+
+static ValidationLog globalValidationLog;
+
+char *
+severity_name(VkDebugUtilsMessageSeverityFlagBitsEXT severity)
+{
+    switch (severity)
+    {
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: return "error";
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT: return "warning";
+        case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: return "info";
+        default: return "verbose";
+    }
+}
+
+// Safe to call from any number of threads at once, never blocks
+void
+validation_log_push(ValidationLog *log,
+                    VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+                    s32 messageId, const char *message)
+{
+    // Messages without an id (loader and general messages) are deduplicated
+    // by their text
+    u64 key = messageId ? (u64)(u32)messageId : hash_string(HASH_SEED,
+                                                            (char *)message);
+    key = key ? key : 1;
+    
+    ValidationLogEntry *entry;
+    LONG64 position = log->writePosition;
+    
+    for (;;)
+    {
+        entry = &log->entries[position & (VALIDATION_RING_SIZE - 1)];
+        LONG64 difference = entry->sequence - position;
+        
+        if (difference == 0)
+        {
+            // Free, try to claim it
+            LONG64 previous =
+                InterlockedCompareExchange64(&log->writePosition,
+                                             position + 1, position);
+            if (previous == position)
+            {
+                break;
+            }
+            position = previous;
+        }
+        else if (difference < 0)
+        {
+            // Full, the logger is behind. Losing a message beats stalling the
+            // thread that is recording commands.
+            InterlockedIncrement64(&log->droppedCount);
+            return;
+        }
+        else
+        {
+            // Another producer claimed it first
+            position = log->writePosition;
+        }
+    }
+    
+    entry->key = key;
+    entry->severity = severity;
+    strncpy_s(entry->message, sizeof(entry->message), message, _TRUNCATE);
+    
+    // Publishes the message, the interlocked write is a full barrier
+    InterlockedExchange64(&entry->sequence, position + 1);
+    
+    // Errors show up right away, everything else waits for the next poll
+    if (severity >= VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+    {
+        SetEvent(log->wakeEvent);
+    }
+}
+
+ValidationMessageCount *
+find_message_count(ValidationLog *log, u64 key)
+{
+    u32 index = (u32)key & (VALIDATION_DEDUP_SIZE - 1);
+    
+    for (u32 probe = 0; probe < VALIDATION_DEDUP_SIZE; probe++)
+    {
+        ValidationMessageCount *count =
+            &log->counts[(index + probe) & (VALIDATION_DEDUP_SIZE - 1)];
+        
+        if (count->key == key)
+        {
+            return count;
+        }
+        
+        if (count->key == 0)
+        {
+            count->key = key;
+            log->distinctCount++;
+            return count;
+        }
+    }
+    
+    // Table full, the message is printed every time
+    return NULL;
+}
+
+void
+print_repeat_counts(ValidationLog *log)
+{
+    for (u32 i = 0; i < VALIDATION_DEDUP_SIZE; i++)
+    {
+        ValidationMessageCount *count = &log->counts[i];
+        if (count->key && count->count > count->reportedCount)
+        {
+            debug_printf("Vulkan Validation layer: message 0x%08llx repeated "
+                         "%u more times (%u total)\n", count->key,
+                         count->count - count->reportedCount, count->count);
+            count->reportedCount = count->count;
+        }
+    }
+    
+    LONG64 dropped = InterlockedExchange64(&log->droppedCount, 0);
+    if (dropped > 0)
+    {
+        debug_printf("Vulkan Validation layer: %lld messages dropped, the log "
+                     "ring was full\n", dropped);
+    }
+}
+
+void
+drain_validation_log(ValidationLog *log)
+{
+    for (;;)
+    {
+        ValidationLogEntry *entry =
+            &log->entries[log->readPosition & (VALIDATION_RING_SIZE - 1)];
+        
+        if (entry->sequence != log->readPosition + 1)
+        {
+            break;
+        }
+        
+        ValidationMessageCount *count = find_message_count(log, entry->key);
+        if (!count || count->count++ == 0)
+        {
+            // OutputDebugString truncates long strings, so the message is
+            // printed on its own
+            debug_printf("Vulkan Validation layer (%s, 0x%08llx):\n",
+                         severity_name(entry->severity), entry->key);
+            OutputDebugString(entry->message);
+            OutputDebugString("\n");
+            
+            if (count)
+            {
+                count->reportedCount = 1;
+            }
+        }
+        
+        // Hand the entry back to the producers, one lap ahead
+        InterlockedExchange64(&entry->sequence,
+                              log->readPosition + VALIDATION_RING_SIZE);
+        log->readPosition++;
+    }
+}
+
+DWORD WINAPI
+validation_log_thread(LPVOID param)
+{
+    ValidationLog *log = (ValidationLog *)param;
+    
+    while (!log->stop)
+    {
+        WaitForSingleObject(log->wakeEvent, 10);
+        drain_validation_log(log);
+        
+        u64 now = get_ticks();
+        if (ticks_to_ms(now - log->lastSummary) >= 2000.0f)
+        {
+            print_repeat_counts(log);
+            log->lastSummary = now;
+        }
+    }
+    
+    drain_validation_log(log);
+    print_repeat_counts(log);
+    
+    return 0;
+}
+
+void
+validation_log_init(ValidationLog *log)
+{
+    for (u32 i = 0; i < VALIDATION_RING_SIZE; i++)
+    {
+        log->entries[i].sequence = i;
+    }
+    
+    log->wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    log->lastSummary = get_ticks();
+    log->thread = CreateThread(NULL, 0, validation_log_thread, log, 0, NULL);
+    assert(log->wakeEvent && log->thread);
+}
+
+// Prints whatever is still queued and the final repeat counts
+void
+validation_log_shutdown(ValidationLog *log)
+{
+    if (log->thread)
+    {
+        log->stop = 1;
+        SetEvent(log->wakeEvent);
+        WaitForSingleObject(log->thread, INFINITE);
+        
+        CloseHandle(log->thread);
+        CloseHandle(log->wakeEvent);
+        log->thread = NULL;
+    }
+}
+
+/*
+*  Vulkan Validation layer's Debug Callback
+*/
+
+static VKAPI_ATTR VkBool32 VKAPI_CALL
+vulkan_debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
+                      VkDebugUtilsMessageTypeFlagsEXT messageType,
+                      const VkDebugUtilsMessengerCallbackDataEXT *callbackData,
+                      void *userData)
+{
+    validation_log_push((ValidationLog *)userData, messageSeverity,
+                        callbackData->messageIdNumber,
+                        callbackData->pMessage);
+    
+    return VK_FALSE;
+}
\ No newline at end of file
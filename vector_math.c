@@ -0,0 +1,216 @@
+/*
+*  Vector math
+*/
+
+/* Matrices are column major like GLSL's, m[column * 4 + row], so they are
+   copied into uniforms and push constants as they are. View space is right
+   handed, looking down -z. Projections target Vulkan's clip space: y points
+   down and depth goes from 1 at the near plane to 0 at the far plane. */
+
+typedef struct
+{
+    f32 x, y, z;
+    
+} Vec3;
+
+typedef struct
+{
+    f32 x, y, z, w;
+    
+} Vec4;
+
+typedef struct
+{
+    f32 m[16];
+    
+} Mat4;
+
+Vec3
+vec3(f32 x, f32 y, f32 z)
+{
+    Vec3 result = { x, y, z };
+    return result;
+}
+
+Vec4
+vec4(f32 x, f32 y, f32 z, f32 w)
+{
+    Vec4 result = { x, y, z, w };
+    return result;
+}
+
+Vec3
+vec3_add(Vec3 a, Vec3 b)
+{
+    return vec3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+Vec3
+vec3_sub(Vec3 a, Vec3 b)
+{
+    return vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+Vec3
+vec3_scale(Vec3 a, f32 s)
+{
+    return vec3(a.x * s, a.y * s, a.z * s);
+}
+
+f32
+vec3_dot(Vec3 a, Vec3 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Vec3
+vec3_cross(Vec3 a, Vec3 b)
+{
+    return vec3(a.y * b.z - a.z * b.y,
+                a.z * b.x - a.x * b.z,
+                a.x * b.y - a.y * b.x);
+}
+
+f32
+vec3_length(Vec3 a)
+{
+    return sqrtf(vec3_dot(a, a));
+}
+
+Vec3
+vec3_normalize(Vec3 a)
+{
+    f32 length = vec3_length(a);
+    return length > 0 ? vec3_scale(a, 1.0f / length) : a;
+}
+
+Mat4
+mat4_identity(void)
+{
+    Mat4 result = {0};
+    result.m[0] = 1;
+    result.m[5] = 1;
+    result.m[10] = 1;
+    result.m[15] = 1;
+    
+    return result;
+}
+
+// a * b, b is applied first
+Mat4
+mat4_multiply(Mat4 a, Mat4 b)
+{
+    Mat4 result;
+    for (u32 column = 0; column < 4; column++)
+    {
+        for (u32 row = 0; row < 4; row++)
+        {
+            f32 sum = 0;
+            for (u32 i = 0; i < 4; i++)
+            {
+                sum += a.m[i * 4 + row] * b.m[column * 4 + i];
+            }
+            result.m[column * 4 + row] = sum;
+        }
+    }
+    
+    return result;
+}
+
+Mat4
+mat4_translation(Vec3 t)
+{
+    Mat4 result = mat4_identity();
+    result.m[12] = t.x;
+    result.m[13] = t.y;
+    result.m[14] = t.z;
+    
+    return result;
+}
+
+Mat4
+mat4_scale(Vec3 s)
+{
+    Mat4 result = mat4_identity();
+    result.m[0] = s.x;
+    result.m[5] = s.y;
+    result.m[10] = s.z;
+    
+    return result;
+}
+
+Mat4
+mat4_rotation_y(f32 radians)
+{
+    f32 c = cosf(radians);
+    f32 s = sinf(radians);
+    
+    Mat4 result = mat4_identity();
+    result.m[0] = c;
+    result.m[2] = -s;
+    result.m[8] = s;
+    result.m[10] = c;
+    
+    return result;
+}
+
+// Quaternions are Vec4s, xyz the axis scaled by sin(angle / 2), w the cosine
+Vec4
+quat_axis_angle(Vec3 axis, f32 radians)
+{
+    Vec3 n = vec3_normalize(axis);
+    f32 s = sinf(radians * 0.5f);
+    
+    return vec4(n.x * s, n.y * s, n.z * s, cosf(radians * 0.5f));
+}
+
+Vec3
+mat4_transform_point(Mat4 a, Vec3 p)
+{
+    return vec3(a.m[0] * p.x + a.m[4] * p.y + a.m[8] * p.z + a.m[12],
+                a.m[1] * p.x + a.m[5] * p.y + a.m[9] * p.z + a.m[13],
+                a.m[2] * p.x + a.m[6] * p.y + a.m[10] * p.z + a.m[14]);
+}
+
+Mat4
+mat4_look_at(Vec3 eye, Vec3 target, Vec3 up)
+{
+    Vec3 f = vec3_normalize(vec3_sub(target, eye));
+    Vec3 s = vec3_normalize(vec3_cross(f, up));
+    Vec3 u = vec3_cross(s, f);
+    
+    Mat4 result = mat4_identity();
+    result.m[0] = s.x;
+    result.m[4] = s.y;
+    result.m[8] = s.z;
+    result.m[1] = u.x;
+    result.m[5] = u.y;
+    result.m[9] = u.z;
+    result.m[2] = -f.x;
+    result.m[6] = -f.y;
+    result.m[10] = -f.z;
+    result.m[12] = -vec3_dot(s, eye);
+    result.m[13] = -vec3_dot(u, eye);
+    result.m[14] = vec3_dot(f, eye);
+    
+    return result;
+}
+
+/* Reversed-Z, maps view depth nearPlane to 1 and farPlane to 0. Floating
+   point depth has the most precision near 0, which reversed-Z spends on the
+   distance where the 1 / z of the projection has the least, for close to
+   uniform precision over the whole depth range. */
+Mat4
+mat4_perspective(f32 fovY, f32 aspect, f32 nearPlane, f32 farPlane)
+{
+    f32 f = 1.0f / tanf(fovY * 0.5f);
+    
+    Mat4 result = {0};
+    result.m[0] = f / aspect;
+    result.m[5] = -f; // Vulkan's y points down
+    result.m[10] = nearPlane / (farPlane - nearPlane);
+    result.m[11] = -1;
+    result.m[14] = nearPlane * farPlane / (farPlane - nearPlane);
+    
+    return result;
+}
\ No newline at end of file